@@ -0,0 +1,180 @@
+//
+//  ADPCMCodec.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// IMA-ADPCM coder for blocks of interleaved 16 bit PCM. 4 bits per sample,
+/// i.e. 4:1, at next to no CPU cost. Meant for the iOS mic uplink and slow
+/// links where fidelity matters less than bandwidth.
+///
+/// The encoder carries its predictor state across packets, so quality does
+/// not suffer from small blocks. Every block starts with a snapshot of that
+/// state, so the decoder needs nothing from earlier packets and resyncs on
+/// the next packet after a loss.
+///
+/// A packet carries one or more blocks, back to back. Block layout:
+///     UInt16 frames, UInt8 channels, then per channel Int16 predictor and
+///     UInt8 step index, then one nibble per sample in interleaved order,
+///     two per byte, low nibble first.
+class ADPCMCodec {
+
+    static let kStepTable : [Int32] = [
+        7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37,
+        41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173,
+        190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658,
+        724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+        2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484,
+        7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818,
+        18500, 20350, 22385, 24623, 27086, 29794, 32767]
+
+    static let kIndexTable : [Int32] = [
+        -1, -1, -1, -1, 2, 4, 6, 8,
+        -1, -1, -1, -1, 2, 4, 6, 8]
+
+    /// Channels the coder keeps state for. AudioCodec.canEncode rejects
+    /// formats with more, so they go out as PCM.
+    static let kMaxChannels = 8
+
+    /// Most frames a block can carry. Longer input is split.
+    static let kMaxBlockFrames = Int(UInt16.max)
+
+    /// Encoder state per channel, carried from packet to packet.
+    var predictor = [Int32](repeating: 0, count: ADPCMCodec.kMaxChannels)
+    var stepIndex = [Int32](repeating: 0, count: ADPCMCodec.kMaxChannels)
+
+    /// Decoder state per channel. Reloaded from every block's snapshot.
+    var decPredictor = [Int32](repeating: 0, count: ADPCMCodec.kMaxChannels)
+    var decStepIndex = [Int32](repeating: 0, count: ADPCMCodec.kMaxChannels)
+
+    /// Forgets the encoder state, e.g. when a new session starts.
+    func reset() {
+        for ch in 0..<ADPCMCodec.kMaxChannels {
+            predictor[ch] = 0
+            stepIndex[ch] = 0
+        }
+    }
+
+    /// Appends the encoded blocks to out. channels must be at most
+    /// kMaxChannels.
+    func encode(_ pcm : UnsafePointer<Int16>, frames : Int, channels : Int, into out : inout Data) {
+        var done = 0
+        repeat {
+            let n = min(frames - done, ADPCMCodec.kMaxBlockFrames)
+            encodeBlock(pcm + done * channels, frames: n, channels: channels, into: &out)
+            done += n
+        } while done < frames
+    }
+
+    func encodeBlock(_ pcm : UnsafePointer<Int16>, frames : Int, channels : Int, into out : inout Data) {
+        var n16 = UInt16(frames)
+        out.append(Data(bytes: &n16, count: 2))
+        out.append(UInt8(channels))
+
+        // Snapshot of the state this block starts from.
+        for ch in 0..<channels {
+            var p = Int16(predictor[ch])
+            out.append(Data(bytes: &p, count: 2))
+            out.append(UInt8(stepIndex[ch]))
+        }
+
+        var byte : UInt8 = 0
+        var high = false
+        for i in 0..<frames {
+            for ch in 0..<channels {
+                let nibble = encodeSample(Int32(pcm[i * channels + ch]), ch)
+                if high {
+                    out.append(byte | nibble << 4)
+                } else {
+                    byte = nibble
+                }
+                high.toggle()
+            }
+        }
+        if high {
+            out.append(byte)
+        }
+    }
+
+    @inline(__always)
+    func encodeSample(_ sample : Int32, _ ch : Int) -> UInt8 {
+        var diff = sample - predictor[ch]
+        var nibble : Int32 = 0
+        if diff < 0 {
+            nibble = 8
+            diff = -diff
+        }
+        var step = ADPCMCodec.kStepTable[Int(stepIndex[ch])]
+        var delta = step >> 3
+        if diff >= step { nibble |= 4; diff -= step; delta += step }
+        step >>= 1
+        if diff >= step { nibble |= 2; diff -= step; delta += step }
+        step >>= 1
+        if diff >= step { nibble |= 1; delta += step }
+
+        // Track exactly what the decoder will reconstruct.
+        let p = predictor[ch] + ((nibble & 8) != 0 ? -delta : delta)
+        predictor[ch] = min(max(p, Int32(Int16.min)), Int32(Int16.max))
+        stepIndex[ch] = min(max(stepIndex[ch] + ADPCMCodec.kIndexTable[Int(nibble)], 0), 88)
+        return UInt8(nibble)
+    }
+
+    /// Decodes the blocks of a packet and appends the interleaved Int16 PCM
+    /// to out.
+    /// - Returns: false if a block is malformed.
+    func decode(_ src : UnsafeRawBufferPointer, into out : inout Data) -> Bool {
+        var pos = 0
+        repeat {
+            if !decodeBlock(src, &pos, into: &out) {
+                return false
+            }
+        } while pos < src.count
+        return true
+    }
+
+    func decodeBlock(_ src : UnsafeRawBufferPointer, _ pos : inout Int, into out : inout Data) -> Bool {
+        if src.count < pos + 3 { return false }
+        let frames = Int(src[pos]) | Int(src[pos + 1]) << 8
+        let channels = Int(src[pos + 2])
+        if channels == 0 || channels > ADPCMCodec.kMaxChannels { return false }
+        pos += 3
+        if src.count < pos + channels * 3 + (frames * channels + 1) / 2 { return false }
+
+        for ch in 0..<channels {
+            decPredictor[ch] = Int32(Int16(bitPattern: UInt16(src[pos]) | UInt16(src[pos + 1]) << 8))
+            decStepIndex[ch] = min(Int32(src[pos + 2]), 88)
+            pos += 3
+        }
+
+        let base = out.count
+        out.count += frames * channels * 2
+        out.withUnsafeMutableBytes { (o : UnsafeMutableRawBufferPointer) in
+            let dst = o.baseAddress!.advanced(by: base).assumingMemoryBound(to: Int16.self)
+            var n = 0
+            for i in 0..<frames {
+                for ch in 0..<channels {
+                    let byte = src[pos + n / 2]
+                    let nibble = (n & 1) == 0 ? byte & 0xF : byte >> 4
+                    dst[i * channels + ch] = decodeSample(Int32(nibble), ch)
+                    n += 1
+                }
+            }
+        }
+        pos += (frames * channels + 1) / 2
+        return true
+    }
+
+    @inline(__always)
+    func decodeSample(_ nibble : Int32, _ ch : Int) -> Int16 {
+        let step = ADPCMCodec.kStepTable[Int(decStepIndex[ch])]
+        var delta = step >> 3
+        if (nibble & 4) != 0 { delta += step }
+        if (nibble & 2) != 0 { delta += step >> 1 }
+        if (nibble & 1) != 0 { delta += step >> 2 }
+        let p = decPredictor[ch] + ((nibble & 8) != 0 ? -delta : delta)
+        decPredictor[ch] = min(max(p, Int32(Int16.min)), Int32(Int16.max))
+        decStepIndex[ch] = min(max(decStepIndex[ch] + ADPCMCodec.kIndexTable[Int(nibble)], 0), 88)
+        return Int16(decPredictor[ch])
+    }
+}
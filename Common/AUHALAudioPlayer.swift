@@ -6,81 +6,358 @@
 //
 
 import Foundation
+#if canImport(AVFoundation)
 import AVFoundation
 
 let kAudioSystemInputBus : UInt32 = 1;    // input bus element on AUHAL
 let kAudioSystemOutputBus : UInt32 = 0;   // output bus element on the AUHAL
+#endif
 
 /// Abstratction for playing audio data out of an AUHAL unit. Configure the unit,
 /// pass it in, feed raw mono-channeled LPCM data to this class, and it will take care
 /// playing it. Uses ringbuffer to copy and read data.
+/// Without the audio frameworks only the ringbuffer side exists, for
+/// backends that call render themselves.
 class AUHALAudioPlayer {
     
+    #if canImport(AVFoundation)
     /// The AU that has a speaker attached to it's output.
     var audioUnit : AudioComponentInstance!
+    #endif
     
     /// The Socket Ringbuffer to store incoming data and then read from
-    /// it to fill system io audio buffers.
-    var sRingbuffer : [UInt8]!
+    /// it to fill system io audio buffers. The enqueueing thread writes,
+    /// the render thread reads, and neither waits for the other.
+    var sRingbuffer : SPSCRing!
     
-    /// Size of ringbuffer in bytes. The longer this is, the more ringbuffer will
-    /// act like an infinitely sized buffer, probably less audio artifcats on
-    /// slower connections. Make big.
-    let kRingBufferSize = 8192 * 300
+    /// Audio (seconds) over the target above which render skips to the
+    /// target instead of catching up gradually.
+    let kResyncSeconds = 0.25
     
-    /// The index in the ringbuffer which we will write fresh data to.
-    var sRingbufferWO = 0
+    /// Seconds of audio the ringbuffer holds on top of the largest playout
+    /// target and the resync threshold, for arrivals and renders in
+    /// flight. The catch-up logic keeps it from filling beyond that, so
+    /// more would only cost memory and cache.
+    let kRingSlackSeconds = 0.1
     
-    /// The index in the ringbuffer from which we will start reading fresh data.
-    var sRingbufferRO = 0
+    /// Format of audio being fed into the AU.
+    var outAudioF: StreamFormat!
     
-    /// Mutex to prevent cross thread access to ringbuffer. 
-    let semaphore = DispatchSemaphore(value: 1)
+    /// Total frames enqueued since the session started. Format changes are
+    /// announced relative to this count.
+    var framesEnqueued : UInt64 = 0
     
-    /// Format of audio being fed into the AU.
-    var outAudioF: AudioStreamBasicDescription!
+    /// Format change announced by the peer that takes effect once
+    /// framesEnqueued reaches applyAt.
+    var pendingFormat : (applyAt: UInt64, format: StreamFormat)?
+    
+    /// Called on the enqueueing thread exactly at the frame a scheduled
+    /// format change applies. Expected to reconfigure the owning unit.
+    var onFormatSwitch : ((StreamFormat) -> Void)?
+    
+    /// Maps the peer's clock onto ours. Set by the owner once a transceiver
+    /// exists, nil while no peer is connected. Arrivals are timed on the
+    /// peer's clock once it has an estimate, see PlayoutTarget.
+    var clock : ClockSync?
+    var arrivalsOnPeerClock = false
+    
+    /// Our clock, which arrivals are timed on (see ClockSync.now). Tests
+    /// replay recorded arrival times through it.
+    var uptime : () -> UInt64 = ClockSync.now
+    
+    /// How much audio to keep buffered, from how jittery it arrives.
+    let playout = PlayoutTarget()
+    
+    /// playout's target in bytes of the current format. Written by the
+    /// enqueueing thread, read by the render thread.
+    var targetBytes = 0
+    
+    /// Speeds playback up or slows it down a little to follow the target.
+    /// nil for formats it can't handle.
+    var stretcher : TimeStretcher?
+    
+    /// Plays on (fading out) what was last played while the ringbuffer is
+    /// dry, instead of silence. nil for formats it can't handle.
+    var concealer : LossConcealer?
     
-    /// Debugging.
+    /// The same for audio lost on the way (see enqueueLoss), on the
+    /// enqueueing thread: fills in from what was enqueued before the gap.
+    var lossConcealer : LossConcealer?
+    
+    /// Concealment for enqueueLoss is built here. Enqueueing thread only.
+    var lossScratch = [Int16]()
+    
+    /// Audio is rendered here first when the unit wants a different channel
+    /// layout than the stream has, then mapped (see ChannelMapper). Fixed
+    /// size for any format, bigger renders are played silent.
+    static let kMapScratchBytes = 4096 * 16
+    let mapScratch = UnsafeMutableRawPointer.allocate(byteCount: AUHALAudioPlayer.kMapScratchBytes, alignment: 16)
+    
+    /// Whether rendering waits for the ringbuffer to fill up to the target
+    /// before playing, at the start and after every underrun. played tells
+    /// the first fill apart from later ones.
+    var priming = true
+    var played = false
+    
+    /// Statistics. Renders that found too little audio and concealed it,
+    /// bytes rendered, and the audio (bytes) buffered at the last render.
+    /// Also bytes dropped because the ringbuffer was full.
+    var underruns = 0
+    var bytesRendered : UInt64 = 0
+    var lastFreshBytes = 0
+    var overflowBytes = 0
+    var resyncs = 0
+    
+    /// Per render: time spent (ns), audio buffered at entry (us of audio)
+    /// and frames asked for. Recorded on the render thread, see Telemetry.
+    let callbackNs = Histogram()
+    let occupancyUs = Histogram()
+    let requestFrames = Histogram()
+    
+    /// Debugging. The render thread traces instead of logging.
     let TAG = "AUHALAudioPlayer"
+    let trace = TraceRing()
+    
+    deinit {
+        mapScratch.deallocate()
+        Trace.unregister(trace)
+    }
     
+    #if canImport(AVFoundation)
     /// Allocate ringbuffer, set up.
-    func initUnit(unit: AudioComponentInstance, outFormat: AudioStreamBasicDescription) {
-        sRingbuffer = Array.init(repeating: 0 as UInt8, count: kRingBufferSize)
+    func initUnit(unit: AudioComponentInstance, outFormat: StreamFormat) {
+        initRing(outFormat: outFormat)
         audioUnit = unit
+    }
+    #endif
+    
+    /// Allocate ringbuffer only, for backends that call render themselves
+    /// instead of an audio unit.
+    func initRing(outFormat: StreamFormat) {
+        sRingbuffer = SPSCRing(minimumCapacity: ringSize(outFormat))
         outAudioF = outFormat
+        makeStages(outFormat)
+    }
+    
+    /// Bytes the ringbuffer needs for format.
+    func ringSize(_ format : StreamFormat) -> Int {
+        let seconds = PlayoutTarget.kMaxTarget + kResyncSeconds + kRingSlackSeconds
+        let rate = format.mSampleRate > 0 ? format.mSampleRate : 48000
+        return Int(seconds * rate) * max(1, Int(format.mBytesPerFrame))
+    }
+    
+    /// Changes the format of the PCM data fed to the unit. Only call while
+    /// the unit is stopped. Data still in the ringbuffer is kept if the frame
+    /// size did not change, so the switch costs no more than a buffer.
+    func setFormat(_ format : StreamFormat) {
+        if format.mBytesPerFrame != outAudioF.mBytesPerFrame {
+            sRingbuffer.reset()
+            priming = true
+            played = false
+        }
+        let size = ringSize(format)
+        if size > sRingbuffer.capacity || size <= sRingbuffer.capacity / 2 {
+            let ring = SPSCRing(minimumCapacity: size)
+            sRingbuffer.drain(into: ring)
+            sRingbuffer = ring
+        }
+        outAudioF = format
+        makeStages(format)
+    }
+    
+    /// Sets up stretcher and concealer for format. They only handle
+    /// interleaved 16 bit integer PCM.
+    func makeStages(_ format : StreamFormat) {
+        if !format.isInterleavedInt16 {
+            stretcher = nil
+            concealer = nil
+            lossConcealer = nil
+            return
+        }
+        // Statistics carry over to the new stages.
+        let channels = Int(format.mChannelsPerFrame)
+        let ts = TimeStretcher(channels: channels, sampleRate: format.mSampleRate)
+        let lc = LossConcealer(channels: channels, sampleRate: format.mSampleRate)
+        let loss = LossConcealer(channels: channels, sampleRate: format.mSampleRate)
+        ts.accelerated = stretcher?.accelerated ?? 0
+        ts.expanded = stretcher?.expanded ?? 0
+        lc.gaps = concealer?.gaps ?? 0
+        loss.gaps = lossConcealer?.gaps ?? 0
+        stretcher = ts
+        concealer = lc
+        lossConcealer = loss
     }
     
-    /// Writes PCM data into the ringbuffer.
+    /// Schedules a switch to format once frame applyAt has been enqueued.
+    func scheduleFormat(_ format : StreamFormat, at applyAt : UInt64) {
+        pendingFormat = (applyAt, format)
+        if framesEnqueued >= applyAt {
+            switchFormat()
+        }
+    }
+    
+    /// Applies the pending format change.
+    func switchFormat() {
+        guard let pending = pendingFormat else { return }
+        pendingFormat = nil
+        Logger.log(.log, TAG, "Switching format at frame \(framesEnqueued) " +
+            "(announced for \(pending.applyAt)) to \(pending.format)")
+        onFormatSwitch?(pending.format)
+    }
+    
+    /// Writes PCM data into the ringbuffer. If a format change is pending,
+    /// splits the data at the exact frame the change applies.
     func enqueuePCM(_ pcm : UnsafeMutablePointer<Int8>, _ len : Int) {
-        // lock mutex.
-        semaphore.wait()
+        let bpf = Int(outAudioF.mBytesPerFrame)
+        if bpf > 0 {
+            let now = uptime()
+            let remote = clock?.toRemote(now)
+            if (remote != nil) != arrivalsOnPeerClock {
+                arrivalsOnPeerClock = remote != nil
+                playout.restart()
+            }
+            playout.arrived(frames: len / bpf, rate: outAudioF.mSampleRate, at: remote ?? now)
+            targetBytes = Int(playout.target * outAudioF.mSampleRate) * bpf
+            // Fades in after a lost frame, and keeps the history to conceal
+            // the next one from.
+            if let lc = lossConcealer, len % bpf == 0 {
+                lc.played(UnsafeMutableRawPointer(pcm).assumingMemoryBound(to: Int16.self),
+                          frames: len / bpf)
+            }
+        }
+        enqueueFrames(pcm, len)
+    }
+    
+    /// Fills in for len bytes of audio lost on the way (a datagram that
+    /// couldn't be repaired), in order with enqueuePCM: concealed from the
+    /// audio before the gap (see LossConcealer), silence for formats it
+    /// can't handle. The frame count, and with it format changes, stays in
+    /// step with the peer.
+    func enqueueLoss(_ len : Int) {
+        let bpf = Int(outAudioF.mBytesPerFrame)
+        if bpf <= 0 || len < bpf {
+            return
+        }
+        let frames = len / bpf
+        let samples = (frames * bpf + 1) / 2
+        if lossScratch.count < samples {
+            lossScratch = [Int16](repeating: 0, count: samples)
+        }
+        lossScratch.withUnsafeMutableBufferPointer { (b : inout UnsafeMutableBufferPointer<Int16>) in
+            if let lc = lossConcealer {
+                lc.conceal(b.baseAddress!, frames: frames)
+            } else {
+                b.baseAddress!.assign(repeating: 0, count: samples)
+            }
+            enqueueFrames(UnsafeMutableRawPointer(b.baseAddress!).assumingMemoryBound(to: Int8.self),
+                          frames * bpf)
+        }
+    }
+    
+    /// Counts frames enqueued and writes them to the ringbuffer. If a format
+    /// change is pending, splits the data at the exact frame it applies.
+    func enqueueFrames(_ pcm : UnsafeMutablePointer<Int8>, _ len : Int) {
+        var ptr = pcm
+        var remaining = len
+        if let pending = pendingFormat {
+            let bpf = Int(outAudioF.mBytesPerFrame)
+            let framesUntil = max(0, Int64(pending.applyAt) - Int64(framesEnqueued))
+            let head = min(remaining, Int(framesUntil) * bpf)
+            if head > 0 {
+                writeRing(ptr, head)
+                framesEnqueued += UInt64(head / bpf)
+                ptr = ptr.advanced(by: head)
+                remaining -= head
+            }
+            if framesEnqueued >= pending.applyAt {
+                switchFormat()
+            }
+        }
+        if remaining > 0 {
+            writeRing(ptr, remaining)
+            framesEnqueued += UInt64(remaining / Int(outAudioF.mBytesPerFrame))
+        }
+    }
+    
+    /// Copies PCM data into the ringbuffer. If the render thread fell so
+    /// far behind that it is full, the newest data is dropped.
+    func writeRing(_ pcm : UnsafeMutablePointer<Int8>, _ len : Int) {
+        let written = sRingbuffer.write(pcm, len)
+        if written < len {
+            overflowBytes += len - written
+        }
+    }
+    
+    /// Fills out with bufferSize bytes of audio from the ringbuffer, or
+    /// concealment if not enough arrived yet. Called on the render thread, by
+    /// the unit's callback or by a backend pulling audio itself. Never
+    /// blocks.
+    ///
+    /// Keeps the audio buffered after a render near the playout target:
+    /// after running dry it conceals the gap (see LossConcealer) until the
+    /// target is buffered again, and otherwise plays up to 2% faster or
+    /// slower (see TimeStretcher) the further it is off.
+    func render(_ out : UnsafeMutableRawPointer, _ bufferSize : Int) {
+        let start = DispatchTime.now().uptimeNanoseconds
+        let freshBytes = sRingbuffer.availableToRead
+        let target = targetBytes
+        let bpf = max(1, Int(outAudioF.mBytesPerFrame))
+        if outAudioF.mSampleRate > 0 {
+            occupancyUs.record(UInt64(Double(freshBytes / bpf) / outAudioF.mSampleRate * 1e6))
+        }
+        requestFrames.record(UInt64(bufferSize / bpf))
+        Trace.record(.verbose, trace, .playerRender, Int64(freshBytes), Int64(target), Int64(bufferSize))
+        lastFreshBytes = freshBytes
         
-        // Inclusive of current byte pointed to by WO.
-        let spaceUntilBufferEnd = sRingbuffer.count - sRingbufferWO
-        if len < spaceUntilBufferEnd {
-            // data fits in ringbuffer, so just copy it
-            sRingbuffer.withUnsafeMutableBytes({rbp in
-                memcpy(rbp.baseAddress?.advanced(by: sRingbufferWO), pcm, len)
-            })
-            sRingbufferWO += len
-        } else {
-            // data does not fit, so need to wrap around to start.
-            sRingbuffer.withUnsafeMutableBytes({rbp in
-                memcpy(rbp.baseAddress?.advanced(by: sRingbufferWO),
-                       pcm,
-                       spaceUntilBufferEnd)
-                memcpy(rbp.baseAddress,
-                       pcm.advanced(by: spaceUntilBufferEnd),
-                       len - spaceUntilBufferEnd)
-                sRingbufferWO = len - spaceUntilBufferEnd
-            })
-        }
-        sRingbufferWO %= sRingbuffer.count
+        if priming && freshBytes >= target + bufferSize {
+            priming = false
+        }
+        var excess = freshBytes - bufferSize - target
+        
+        // Way behind (e.g. a burst after a stall): stretching would take
+        // ages to catch up, so jump to the target once.
+        if !priming && excess > Int(outAudioF.mSampleRate * kResyncSeconds) * bpf {
+            sRingbuffer.skip(excess / bpf * bpf)
+            resyncs += 1
+            excess = 0
+        }
+        if !priming && freshBytes >= bufferSize {
+            if let ts = stretcher, bufferSize % bpf == 0 {
+                // Full speed change a target's worth (at least a buffer)
+                // off the target, none within a tenth of it.
+                let error = Double(excess) / Double(max(target, bufferSize))
+                ts.speed = abs(error) < 0.1 ? 1 : 1 + TimeStretcher.kMaxSpeedChange * min(max(error, -1), 1)
+                _ = ts.render(from: sRingbuffer, into: out.assumingMemoryBound(to: Int16.self),
+                              frames: bufferSize / bpf)
+            } else {
+                sRingbuffer.read(into: out, bufferSize)
+            }
+            if let lc = concealer, bufferSize % bpf == 0 {
+                lc.played(out.assumingMemoryBound(to: Int16.self), frames: bufferSize / bpf)
+            }
+            played = true
+        }
+        else  {
+            // Not enough buffer space. Conceal the gap (or play silence
+            // before anything played) and build the buffer back up to the
+            // target, so the next packet that is a little late doesn't run
+            // it dry again.
+            if played, let lc = concealer, bufferSize % bpf == 0 {
+                lc.conceal(out.assumingMemoryBound(to: Int16.self), frames: bufferSize / bpf)
+            } else {
+                memset(out, 0, bufferSize)
+            }
+            if played {
+                underruns += 1
+            }
+            priming = true
+        }
         
-        // releaes mutex.
-        semaphore.signal()
+        bytesRendered += UInt64(bufferSize)
+        callbackNs.record(DispatchTime.now().uptimeNanoseconds - start)
     }
     
+    #if canImport(AVFoundation)
     func addPlaybackCallback() {
         var callbackStruct = AURenderCallbackStruct()
         callbackStruct.inputProcRefCon = UnsafeMutableRawPointer(Unmanaged.passUnretained(self).toOpaque())
@@ -94,77 +371,32 @@ class AUHALAudioPlayer {
             
             let _self = Unmanaged<AUHALAudioPlayer>.fromOpaque(inRefCon).takeUnretainedValue()
             if ioData == nil {
-                Logger.log(.emergency, _self.TAG, "iOBuffer is NULL! Refusing to play audio.")
+                Trace.record(.emergency, _self.trace, .playerNoBuffer)
                 return .zero
             }
             
-            _self.semaphore.wait()
-            
             let abl = UnsafeMutableAudioBufferListPointer(ioData)!
-            var buffer = abl[0]
-            let bufferSize = Int(inNumberFrames * _self.outAudioF.mBytesPerFrame)
-            buffer.mDataByteSize = UInt32(bufferSize)
-            buffer.mNumberChannels = 1
+            let frames = Int(inNumberFrames)
+            let channels = Int(_self.outAudioF.mChannelsPerFrame)
+            let bufferSize = frames * Int(_self.outAudioF.mBytesPerFrame)
             
-            Logger.log(.verbose, _self.TAG, "Need to fill \(inNumberFrames) frames")
-
-            // write offet is ahead of read offset. this is good
-            if _self.sRingbufferWO >= _self.sRingbufferRO {
-                let freshBytes = Int(_self.sRingbufferWO - _self.sRingbufferRO)
-                Logger.log(.verbose, _self.TAG, "Distance between WO and RO is = \(freshBytes)")
-
-                if freshBytes >= bufferSize {
-                    _self.sRingbuffer.withUnsafeMutableBytes({rbp in
-                        memcpy(buffer.mData, rbp.baseAddress!.advanced(by: _self.sRingbufferRO), bufferSize)
-                    })
-                    _self.sRingbufferRO += bufferSize
-                }
-                else  {
-                    // Not enough buffer space. Skip packet. This will create
-                    // audio artifcat but hopefully stream will catch up next
-                    // packet, so we have enough data in the future. Set silence.
-                    memset(buffer.mData, 0, bufferSize)
-                }
-                
-                // If RO is lagging hard behind WO, we need to catch up to it
-                // to get low latency stream. Thus, artifically move RO forward.
-                if freshBytes >= Int(2 * Double(bufferSize))  {
-                    _self.sRingbufferRO += Int(round(0.25 * Double(bufferSize)))
+            if abl.count == 1 && Int(abl[0].mNumberChannels) == channels {
+                // The unit takes our format as is.
+                abl[0].mDataByteSize = UInt32(bufferSize)
+                _self.render(abl[0].mData!, bufferSize)
+            } else if bufferSize <= AUHALAudioPlayer.kMapScratchBytes &&
+                        _self.outAudioF.mBytesPerFrame == 2 * _self.outAudioF.mChannelsPerFrame {
+                // The unit wants other channels (e.g. stereo on headphones)
+                // or a buffer per channel.
+                _self.render(_self.mapScratch, bufferSize)
+                ChannelMapper.map(_self.mapScratch.assumingMemoryBound(to: Int16.self),
+                                  channels: channels, frames: frames, into: abl)
+            } else {
+                Trace.record(.emergency, _self.trace, .playerUnmappable, Int64(channels), Int64(abl.count))
+                for b in 0..<abl.count {
+                    memset(abl[b].mData, 0, Int(abl[b].mDataByteSize))
                 }
-                if freshBytes >= Int(4 * Double(bufferSize))  {
-                    _self.sRingbufferRO += Int(round(1 * Double(bufferSize)))
-                }
-            }
-            // read offet is ahead of write offset. this is bad
-            else {
-                let spaceUntilBufferEnd = _self.sRingbuffer.count - _self.sRingbufferRO
-                _self.sRingbuffer.withUnsafeMutableBytes({rbp in
-                    if spaceUntilBufferEnd >= bufferSize {
-                        memcpy(buffer.mData, rbp.baseAddress!.advanced(by: _self.sRingbufferRO), bufferSize)
-                        _self.sRingbufferRO += bufferSize
-                    }
-                    else {
-                        // copy tail end of ringbuffer into first half of active buffer
-                        memcpy(buffer.mData, rbp.baseAddress!.advanced(by: _self.sRingbufferRO), spaceUntilBufferEnd)
-                        // copy beginning of ring buffer into into second half of active buffer
-                        memcpy(buffer.mData?.advanced(by: spaceUntilBufferEnd), rbp.baseAddress, bufferSize - spaceUntilBufferEnd)
-                        _self.sRingbufferRO = bufferSize - spaceUntilBufferEnd
-                    }
-                })
             }
-            _self.sRingbufferRO %= _self.sRingbuffer.count
-       
-            // If system wants us to fill dual-channel audio (for example, if
-            // using headphones on iOS device, just point the second channel to
-            // the first to emulate stereo).
-            if abl.count == 2 {
-                var buffer2 = abl[1]
-                buffer2.mData = buffer.mData
-                buffer2.mDataByteSize = buffer.mDataByteSize
-                buffer2.mNumberChannels = buffer.mNumberChannels
-            }
-        
-            _self.semaphore.signal()
         
             return .zero
         }
@@ -177,4 +409,5 @@ class AUHALAudioPlayer {
                              &callbackStruct,
                              UInt32(MemoryLayout.size(ofValue: callbackStruct)))
     }
+    #endif
 }
@@ -7,15 +7,24 @@
 
 import Foundation
 import AVFoundation
+import Atomics
 
 /// Abstraction for recording audio from an AUHAL audio unit. Pre-configure the
 /// unit, pass it into the constructore. This class will take care of efficiently
 /// rendering and sending callbacks when new PCM audio data comes in from system.
+///
+/// The IO thread renders into a pool of slots allocated up front, each big
+/// enough for the unit's maximum frames per slice, and passes the slot's
+/// index through a wait-free ring to a sender thread. The sender calls
+/// micPacketReady and hands the slot back through a second ring. So the IO
+/// thread never allocates, copies, locks or waits on the socket; if the
+/// sender falls kSlots buffers behind, buffers are dropped (overruns).
 class AUHALAudioRecorder {
     var audioUnit : AudioComponentInstance!
     var inAudioF : AudioStreamBasicDescription!
     
-    /// Callback when new PCM Audio data packet has been rendered.
+    /// Callback when new PCM Audio data packet has been rendered. Called on
+    /// the sender thread.
     var micPacketReady: ((UnsafeMutableRawPointer, Int) -> Void)?
     
     /// Pre-Allocated AudioBufferList where PCM buffers get stored.
@@ -25,7 +34,47 @@ class AUHALAudioRecorder {
     /// we're using mono-channel audio.
     var audioBuffer : AudioBuffer!
     
+    /// Buffers in flight between the IO thread and the sender.
+    static let kSlots = 8
+    
+    /// Used if the unit won't say how many frames it renders at most.
+    static let kDefaultMaxFrames = 4096
+    
+    /// kSlots slots of slotBytes each, and the bytes rendered into each.
+    var pool : UnsafeMutableRawPointer!
+    var slotBytes = 0
+    let lengths = UnsafeMutablePointer<Int>.allocate(capacity: AUHALAudioRecorder.kSlots)
+    
+    /// Slot indices (Int32) rendered and waiting to be sent, and sent and
+    /// free to render into.
+    let filled = SPSCRing(minimumCapacity: AUHALAudioRecorder.kSlots * 4)
+    let free = SPSCRing(minimumCapacity: AUHALAudioRecorder.kSlots * 4)
+    
+    /// Signalled by the IO thread after queueing a slot.
+    let ready = DispatchSemaphore(value: 0)
+    var sender : Thread?
+    var running = false
+    
+    /// Set by flush() to have the sender signal idle once it sent all
+    /// there is.
+    let flushing = ManagedAtomic<Bool>(false)
+    let idle = DispatchSemaphore(value: 0)
+    
+    /// Statistics. Buffers dropped because no slot was free.
+    var overruns = 0
+    
+    /// Time spent in each callback (ns), see Telemetry.
+    let callbackNs = Histogram()
+    
+    /// Debugging. The render thread traces instead of logging.
     let TAG = "AUHALAudioRecorder"
+    let trace = TraceRing()
+    
+    deinit {
+        pool?.deallocate()
+        lengths.deallocate()
+        Trace.unregister(trace)
+    }
     
     func initUnit(unit: AudioComponentInstance, inFormat: AudioStreamBasicDescription, pcmPacketReady: ((_ ptr : UnsafeMutableRawPointer, _ len : Int) -> Void)?) {
         
@@ -41,6 +90,113 @@ class AUHALAudioRecorder {
         
         audioUnit = unit
         inAudioF = inFormat
+        allocatePool()
+        startSender()
+    }
+    
+    /// Switches to a new input format. Only while the unit is stopped:
+    /// waits for everything rendered in the old format to be sent first.
+    func setFormat(_ format : AudioStreamBasicDescription) {
+        flush()
+        inAudioF = format
+        allocatePool()
+    }
+    
+    /// Sizes the pool for the unit's largest slice in inAudioF. Only while
+    /// the IO thread isn't rendering and no slot is out.
+    func allocatePool() {
+        var maxFrames : UInt32 = 0
+        var size = UInt32(MemoryLayout.size(ofValue: maxFrames))
+        if AudioUnitGetProperty(audioUnit,
+                                kAudioUnitProperty_MaximumFramesPerSlice,
+                                kAudioUnitScope_Global,
+                                0,
+                                &maxFrames,
+                                &size) != noErr || maxFrames == 0 {
+            maxFrames = UInt32(AUHALAudioRecorder.kDefaultMaxFrames)
+        }
+        // Whole cache lines, so neighbouring slots never share one.
+        let bytes = (Int(maxFrames) * Int(inAudioF.mBytesPerFrame) + 63) & ~63
+        if bytes <= slotBytes {
+            return
+        }
+        Logger.log(.log, TAG, "Allocating \(AUHALAudioRecorder.kSlots) buffers for \(maxFrames) frames")
+        pool?.deallocate()
+        slotBytes = bytes
+        pool = UnsafeMutableRawPointer.allocate(byteCount: AUHALAudioRecorder.kSlots * slotBytes,
+                                                alignment: 64)
+        free.reset()
+        for i in 0..<AUHALAudioRecorder.kSlots {
+            AUHALAudioRecorder.push(free, Int32(i))
+        }
+    }
+    
+    static func push(_ ring : SPSCRing, _ slot : Int32) {
+        var s = slot
+        ring.write(&s, 4)
+    }
+    
+    static func pop(_ ring : SPSCRing) -> Int? {
+        var s : Int32 = 0
+        return ring.read(into: &s, 4) == 4 ? Int(s) : nil
+    }
+    
+    /// Starts the thread that sends rendered slots. It holds on to the
+    /// recorder until stop().
+    func startSender() {
+        if sender != nil {
+            return
+        }
+        running = true
+        let t = Thread {
+            while true {
+                self.ready.wait()
+                self.sendFilled()
+                // Everything queued before flush() set it is sent by the pass
+                // after taking it.
+                if self.flushing.exchange(false, ordering: .acquiringAndReleasing) {
+                    self.sendFilled()
+                    self.idle.signal()
+                }
+                if !self.running {
+                    break
+                }
+            }
+        }
+        t.name = TAG + ".sender"
+        t.qualityOfService = .userInteractive
+        sender = t
+        t.start()
+    }
+    
+    /// Sends every rendered slot and hands it back. Sender thread.
+    func sendFilled() {
+        while let slot = AUHALAudioRecorder.pop(filled) {
+            if lengths[slot] > 0 {
+                micPacketReady?(pool + slot * slotBytes, lengths[slot])
+            }
+            AUHALAudioRecorder.push(free, Int32(slot))
+        }
+    }
+    
+    /// Waits until everything queued so far has been sent. Only while the
+    /// unit is stopped, otherwise there may always be more.
+    func flush() {
+        if sender == nil {
+            return
+        }
+        flushing.store(true, ordering: .releasing)
+        ready.signal()
+        idle.wait()
+    }
+    
+    /// Sends what is left and ends the sender thread. Call once the unit is
+    /// stopped, before its owner goes away.
+    func stop() {
+        flush()
+        running = false
+        ready.signal()
+        sender = nil
     }
     
     func addRecordingCallback() {
@@ -55,12 +211,20 @@ class AUHALAudioRecorder {
               ioData         : UnsafeMutablePointer<AudioBufferList>?) -> OSStatus in
             
             let _self = Unmanaged<AUHALAudioRecorder>.fromOpaque(inRefCon).takeUnretainedValue()
+            let start = DispatchTime.now().uptimeNanoseconds
+            defer { _self.callbackNs.record(DispatchTime.now().uptimeNanoseconds - start) }
+            
+            // Render into a free slot. Note we only need one buffer since
+            // we're taking in mono-channel virtual device.
+            let bytes = Int(inNumberFrames * _self.inAudioF.mBytesPerFrame)
+            guard bytes <= _self.slotBytes, let slot = AUHALAudioRecorder.pop(_self.free) else {
+                _self.overruns += 1
+                Trace.record(.emergency, _self.trace, .recorderOverrun, Int64(inNumberFrames))
+                return .zero
+            }
+            _self.audioBufferList[0].mData = _self.pool + slot * _self.slotBytes
+            _self.audioBufferList[0].mDataByteSize = UInt32(bytes)
             
-            // Set audiobuffer to nil and compute buffer size. Note we only need
-            // one buffer since we're taking in mono-channel virtual device.
-            _self.audioBufferList[0].mData = nil
-            _self.audioBufferList[0].mDataByteSize = inNumberFrames * _self.inAudioF.mBytesPerFrame
- 
             // Request to fill audioBufferList.
             let res = AudioUnitRender(_self.audioUnit,
                                       ioActionFlags,
@@ -68,20 +232,20 @@ class AUHALAudioRecorder {
                                       inBusNumber,
                                       inNumberFrames,
                                       _self.audioBufferList.unsafeMutablePointer)
-            Logger.log(.verbose, _self.TAG, "Rendered with status \(res) "
-                    + "Got \(_self.audioBufferList.count) buffers "
-                    + "of size \(_self.audioBufferList[0].mDataByteSize) "
-                    + "and data \(_self.audioBufferList[0].mData) "
-                    + "with num channels \(_self.audioBufferList[0].mNumberChannels) "
-                    + "so recorded \(inNumberFrames) of data")
+            Trace.record(.verbose, _self.trace, .recorderRender, Int64(res),
+                         Int64(_self.audioBufferList[0].mDataByteSize), Int64(inNumberFrames))
             
-            // Ready to send buffers over to device.
-            if _self.audioBufferList[0].mData != nil {
-                _self.micPacketReady!(_self.audioBufferList[0].mData!, Int(_self.audioBufferList[0].mDataByteSize))
+            // Ready to send buffers over to device. A failed render still
+            // goes through the sender (empty), which owns returning slots.
+            if res == noErr {
+                _self.lengths[slot] = Int(_self.audioBufferList[0].mDataByteSize)
             }
             else {
-                Logger.log(.emergency, _self.TAG, "Failed to populate buffers!")
+                _self.lengths[slot] = 0
+                Trace.record(.emergency, _self.trace, .recorderNoBuffer)
             }
+            AUHALAudioRecorder.push(_self.filled, Int32(slot))
+            _self.ready.signal()
             return .zero
         }
         
@@ -0,0 +1,46 @@
+//
+//  AudioBackend.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Where ClientEngine's audio goes: the speaker stream is played from
+/// `player`, the mic stream (if any) comes out of micPacketReady.
+///
+/// On the device this is the RemoteIO unit (ClientAUHALInterface). Without
+/// one, PulledAudioBackend renders into nothing or WAVFileBackend into a
+/// file, which lets the whole receive pipeline run headless.
+protocol AudioBackend : AnyObject {
+
+    /// The speaker stream's ringbuffer. Exists once started.
+    var auhalPlayer : AUHALAudioPlayer! { get }
+
+    /// The format the speaker stream is played in.
+    var outAudioF : StreamFormat! { get }
+
+    /// Whether started and not stopped yet.
+    var initted : Bool { get }
+
+    /// Total mic frames handed out. Mic format changes are announced
+    /// relative to this count. Re-based when a session resumes.
+    var micFramesSent : UInt64 { get set }
+
+    /// Time spent in each mic callback, nil without a mic.
+    var recorderCallbackNs : Histogram? { get }
+
+    /// Starts playing outFormat. If inFormat is not nil, also records the
+    /// mic and hands its PCM to micPacketReady.
+    func initUnit(outFormat: StreamFormat,
+                  inFormat: StreamFormat?,
+                  _micPacketReady: ((_ ptr : UnsafeMutableRawPointer, _ len : Int) -> Void)?) throws
+
+    /// Switches to new formats without stopping the session. whileStopped
+    /// runs while no audio is rendered or recorded.
+    func reconfigure(outFormat: StreamFormat,
+                     inFormat: StreamFormat?,
+                     whileStopped: (() throws -> Void)?) throws
+
+    /// Stops playing (and recording).
+    func endSession()
+}
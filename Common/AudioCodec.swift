@@ -0,0 +1,47 @@
+//
+//  AudioCodec.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Encodings an audio stream can be sent in. The raw value is sent in the
+/// first payload byte of every coded frame and in the handshake.
+enum AudioCodec : UInt8, CaseIterable {
+    case pcm      = 0       // Raw PCM, the original wire format.
+    case lossless = 1       // Fixed order LPC + Rice, see LosslessCodec.
+    case adpcm    = 2       // IMA-ADPCM, 4:1 lossy, see ADPCMCodec.
+
+    /// Codecs this build can decode, as a bit mask of raw values.
+    static let supportedMask : UInt8 = (1 << AudioCodec.pcm.rawValue) |
+                                       (1 << AudioCodec.lossless.rawValue) |
+                                       (1 << AudioCodec.adpcm.rawValue)
+
+    /// The iPad appends its supported mask to its hello as "codecs=<mask>".
+    /// Older clients don't, so they only get PCM.
+    static func mask(fromHello hello : String) -> UInt8 {
+        guard let r = hello.range(of: "codecs=") else {
+            return 1 << AudioCodec.pcm.rawValue
+        }
+        return UInt8(hello[r.upperBound...].prefix(while: { $0.isNumber })) ?? 1
+    }
+
+    /// The codecs only handle interleaved signed 16 bit integer PCM, with
+    /// as many channels as ADPCMCodec keeps state for.
+    static func canEncode(_ f : StreamFormat) -> Bool {
+        return f.mFormatID == StreamFormat.kLinearPCM &&
+            f.mBitsPerChannel == 16 &&
+            f.mChannelsPerFrame >= 1 &&
+            f.mChannelsPerFrame <= UInt32(ADPCMCodec.kMaxChannels) &&
+            (f.mFormatFlags & StreamFormat.kFlagIsFloat) == 0 &&
+            (f.mFormatFlags & StreamFormat.kFlagIsNonInterleaved) == 0
+    }
+
+    /// Returns self if the peer can decode it, otherwise falls back to PCM.
+    func negotiated(peerMask : UInt8) -> AudioCodec {
+        if (peerMask & (1 << rawValue)) == 0 {
+            return .pcm
+        }
+        return self
+    }
+}
@@ -0,0 +1,146 @@
+//
+//  ChannelMapper.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+#if canImport(AVFoundation)
+import AVFoundation
+#endif
+
+/// Copies interleaved 16 bit PCM, as the player renders it, into the
+/// buffer list a render callback has to fill, whatever its layout: one
+/// interleaved buffer or one buffer per channel, with more, fewer or the
+/// same number of channels.
+///
+/// Mono is copied to every channel, stereo to mono is averaged, and other
+/// counts take channel i from source channel i (the last one if there are
+/// fewer). Mono to stereo, stereo to mono and stereo deinterleaving, the
+/// cases RemoteIO actually asks for, work eight frames at a time with SIMD
+/// vectors. Real time safe.
+enum ChannelMapper {
+
+    #if canImport(AVFoundation)
+    /// Maps frames frames of src (channels interleaved channels) into abl
+    /// and sets its byte sizes.
+    static func map(_ src : UnsafePointer<Int16>, channels : Int, frames : Int,
+                    into abl : UnsafeMutableAudioBufferListPointer) {
+        if abl.count == 1 {
+            let dstChannels = max(1, Int(abl[0].mNumberChannels))
+            let dst = abl[0].mData!.assumingMemoryBound(to: Int16.self)
+            abl[0].mDataByteSize = UInt32(frames * dstChannels * 2)
+            if dstChannels == channels {
+                dst.assign(from: src, count: frames * channels)
+            } else if channels == 1 && dstChannels == 2 {
+                upmixMono(src, dst, frames)
+            } else if channels == 2 && dstChannels == 1 {
+                downmixStereo(src, dst, frames)
+            } else {
+                for c in 0..<dstChannels {
+                    extract(src, channels, dstChannels == 1 ? 0 : min(c, channels - 1),
+                            dst + c, dstChannels, frames)
+                }
+            }
+            return
+        }
+
+        // Non-interleaved: a buffer per channel.
+        for b in 0..<abl.count {
+            abl[b].mDataByteSize = UInt32(frames * 2)
+        }
+        if channels == 2 && abl.count == 2 {
+            deinterleaveStereo(src, abl[0].mData!.assumingMemoryBound(to: Int16.self),
+                               abl[1].mData!.assumingMemoryBound(to: Int16.self), frames)
+            return
+        }
+        for b in 0..<abl.count {
+            let dst = abl[b].mData!.assumingMemoryBound(to: Int16.self)
+            if channels == 1 {
+                dst.assign(from: src, count: frames)
+            } else {
+                extract(src, channels, min(b, channels - 1), dst, 1, frames)
+            }
+        }
+    }
+    #endif
+
+    /// Unaligned vector loads and stores.
+    @inline(__always)
+    static func load8(_ p : UnsafePointer<Int16>) -> SIMD8<Int16> {
+        var v = SIMD8<Int16>()
+        memcpy(&v, p, 16)
+        return v
+    }
+
+    @inline(__always)
+    static func load16(_ p : UnsafePointer<Int16>) -> SIMD16<Int16> {
+        var v = SIMD16<Int16>()
+        memcpy(&v, p, 32)
+        return v
+    }
+
+    @inline(__always)
+    static func store<V : SIMD>(_ v : V, _ p : UnsafeMutablePointer<Int16>) {
+        var v = v
+        memcpy(p, &v, MemoryLayout<V>.size)
+    }
+
+    /// L R L R ... from a mono stream.
+    static func upmixMono(_ src : UnsafePointer<Int16>, _ dst : UnsafeMutablePointer<Int16>, _ frames : Int) {
+        var i = 0
+        while i + 8 <= frames {
+            let m = load8(src + i)
+            store(SIMD16<Int16>(m[0], m[0], m[1], m[1], m[2], m[2], m[3], m[3],
+                                m[4], m[4], m[5], m[5], m[6], m[6], m[7], m[7]), dst + 2 * i)
+            i += 8
+        }
+        while i < frames {
+            dst[2 * i] = src[i]
+            dst[2 * i + 1] = src[i]
+            i += 1
+        }
+    }
+
+    /// (L + R) / 2, rounded down, from an interleaved stereo stream. Halving
+    /// first can't overflow; adding back the bit both halves lost keeps the
+    /// vector and the scalar paths identical.
+    static func downmixStereo(_ src : UnsafePointer<Int16>, _ dst : UnsafeMutablePointer<Int16>, _ frames : Int) {
+        var i = 0
+        while i + 8 <= frames {
+            let s = load16(src + 2 * i)
+            let l = SIMD8<Int16>(s[0], s[2], s[4], s[6], s[8], s[10], s[12], s[14])
+            let r = SIMD8<Int16>(s[1], s[3], s[5], s[7], s[9], s[11], s[13], s[15])
+            store((l &>> 1) &+ (r &>> 1) &+ (l & r & 1), dst + i)
+            i += 8
+        }
+        while i < frames {
+            dst[i] = Int16((Int32(src[2 * i]) + Int32(src[2 * i + 1])) >> 1)
+            i += 1
+        }
+    }
+
+    /// Left and right buffers from an interleaved stereo stream.
+    static func deinterleaveStereo(_ src : UnsafePointer<Int16>, _ left : UnsafeMutablePointer<Int16>,
+                                   _ right : UnsafeMutablePointer<Int16>, _ frames : Int) {
+        var i = 0
+        while i + 8 <= frames {
+            let s = load16(src + 2 * i)
+            store(SIMD8<Int16>(s[0], s[2], s[4], s[6], s[8], s[10], s[12], s[14]), left + i)
+            store(SIMD8<Int16>(s[1], s[3], s[5], s[7], s[9], s[11], s[13], s[15]), right + i)
+            i += 8
+        }
+        while i < frames {
+            left[i] = src[2 * i]
+            right[i] = src[2 * i + 1]
+            i += 1
+        }
+    }
+
+    /// Copies source channel c into every stride-th sample of dst.
+    static func extract(_ src : UnsafePointer<Int16>, _ channels : Int, _ c : Int,
+                        _ dst : UnsafeMutablePointer<Int16>, _ stride : Int, _ frames : Int) {
+        for i in 0..<frames {
+            dst[i * stride] = src[i * channels + c]
+        }
+    }
+}
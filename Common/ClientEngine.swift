@@ -0,0 +1,455 @@
+//
+//  ClientEngine.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+import Socket
+
+/// The client side of a session, without any UI or audio hardware: listens
+/// for the server, exchanges hellos, receives and plays the speaker stream
+/// and sends the mic stream. Where the audio goes is up to the AudioBackend
+/// makeBackend creates, so the same pipeline runs in the iOS app (RemoteIO)
+/// and headless (PulledAudioBackend, WAVFileBackend) for soak tests.
+class ClientEngine {
+    
+    /// Creates the audio backend for a new session.
+    let makeBackend : () -> AudioBackend
+    
+    /// The backend packets get piped into.
+    var auhalIF : AudioBackend!
+    
+    /// The class that handles packet sending and receiving.
+    var trans : PCMTransceiver!
+    
+    /// The usbmux socket.
+    var sock : Socket!
+    
+    /// Socket accepting the server's connections, watched by the reactor.
+    var listener : Socket?
+    var listenSource : DispatchSourceRead?
+    
+    /// Whether a session is running. We serve one server at a time.
+    /// Guarded by semaphore.
+    var busy = false
+    let semaphore = DispatchSemaphore(value: 1)
+    
+    /// The server's ID for our session, and whether the session lost its
+    /// connection but may still be resumed (see SessionResume). The backend
+    /// keeps running meanwhile. suspendGen tells grace timers of earlier
+    /// suspensions apart. Guarded by semaphore.
+    var sessionId : UInt32?
+    var suspended = false
+    var suspendGen = 0
+    
+    /// Called with every mic buffer before it's sent, e.g. to visualize it.
+    /// Runs on the mic's send path, so it must not block or wait on the UI.
+    var onMicPCM : ((UnsafeBufferPointer<Int16>) -> Void)?
+    
+    /// Called when a session ended.
+    var onSessionEnded : (() -> Void)?
+    
+    /// Called every second of a session with the playback statistics.
+    var onStats : ((Stats) -> Void)?
+    
+    /// Playback health over the last second.
+    struct Stats {
+        /// Renders that found too little audio and concealed it.
+        var underruns = 0
+        /// Audio buffered at the last render, what the player aims for, and
+        /// the arrival jitter the aim is based on.
+        var bufferedMs = 0.0
+        var targetMs = 0.0
+        var jitterMs = 0.0
+        /// Process CPU time per second of audio played.
+        var cpuPerAudioSecond = 0.0
+        /// Seconds of audio played so far.
+        var audioSeconds = 0.0
+    }
+    
+    var statsTimer : DispatchSourceTimer?
+    var lastUnderruns = 0
+    var lastBytesRendered : UInt64 = 0
+    var lastCPU = 0.0
+    
+    /// Telemetry sent so far: counter totals and histogram counts by
+    /// histogram, to send deltas. Cleared when the backend goes away. Only
+    /// touched on the reactor, see startStats.
+    var lastTotals = Telemetry()
+    var lastCounts = [ObjectIdentifier : [UInt32]]()
+    
+    /// Logging.
+    let TAG = "ClientEngine"
+    
+    init(makeBackend : @escaping () -> AudioBackend) {
+        self.makeBackend = makeBackend
+    }
+
+    /// Opens the port the server connects to. Connections get accepted on
+    /// the reactor until stopListening. Returns right away.
+    /// - Parameter port: 0 picks a free one, see listener.listeningPort.
+    func startListening(port : Int = 7000) throws {
+        let sock = try Socket.create(family: .inet, type: .stream, proto: .tcp)
+        try sock.listen(on: port)
+        try sock.setBlocking(mode: false)
+        listener = sock
+        listenSource = Reactor.shared.watchRead(sock.socketfd) { [unowned self] in
+            self.acceptConnection()
+        }
+    }
+    
+    /// Stops accepting connections. A running session carries on.
+    func stopListening() {
+        guard let src = listenSource, let sock = listener else { return }
+        // The fd must stay open until the reactor is done with it.
+        src.setCancelHandler {
+            sock.close()
+        }
+        src.cancel()
+        listenSource = nil
+        listener = nil
+    }
+    
+    /// Called by the reactor when the server connects. Sets up audio
+    /// streaming off the reactor, unless a session is running already.
+    func acceptConnection() {
+        guard let listener = listener else { return }
+        var conn : Socket
+        do {
+            conn = try listener.acceptClientConnection()
+        } catch {
+            Logger.log(.verbose, TAG, "Nothing to accept")
+            return
+        }
+        semaphore.wait()
+        let refuse = busy
+        busy = true
+        semaphore.signal()
+        if refuse {
+            Logger.log(.log, TAG, "Refusing second connection")
+            conn.close()
+            return
+        }
+        DispatchQueue.global(qos: .userInitiated).async { [unowned self] in
+            do {
+                try self.startSession(conn)
+            } catch {
+                Logger.log(.emergency, self.TAG, "Failed to start session: \(error)")
+                conn.close()
+                self.endSession()
+            }
+        }
+    }
+    
+    func endSession() {
+        semaphore.wait()
+        busy = false
+        semaphore.signal()
+    }
+    
+    /// Stops the backend and tells the app the session is over.
+    func endBackend() {
+        stopStats()
+        Reactor.shared.queue.async {
+            self.lastTotals = Telemetry()
+            self.lastCounts.removeAll()
+        }
+        if auhalIF != nil && auhalIF.initted {
+            auhalIF.endSession()
+        }
+        onSessionEnded?()
+    }
+    
+    /// Called when the grace period of a suspended session is over.
+    func expireSession(_ gen : Int) {
+        semaphore.wait()
+        let expired = suspended && gen == suspendGen
+        if expired {
+            suspended = false
+            sessionId = nil
+        }
+        semaphore.signal()
+        if expired {
+            Logger.log(.log, TAG, "Session wasn't resumed in time")
+            endBackend()
+        }
+    }
+    
+    /// Exchanges hellos and starts a session with the server on the
+    /// reactor. Blocks only for the hellos.
+    func startSession(_ conn : Socket) throws {
+        sock = conn
+        try sock.setBlocking(mode: true)
+        try sock.setReadTimeout(value: 3)
+        try sock.setWriteTimeout(value: 3)
+        
+        // Take over a suspended session, so its grace timer leaves it alone.
+        semaphore.wait()
+        let resumable = suspended ? sessionId : nil
+        suspended = false
+        semaphore.signal()
+        
+        // We got a new connection. Say hello.
+        // The server picks codecs it knows we can decode.
+        var hello = "Hello from iPad codecs=\(AudioCodec.supportedMask)"
+        if resumable != nil {
+            hello += " resume=\(resumable!):\(auhalIF.auhalPlayer.framesEnqueued)"
+        }
+        // Over Wi-Fi, offer a port of our own for audio over UDP.
+        var link : UDPAudioLink?
+        if !UDPAudioLink.isLoopback(sock.remoteHostname) {
+            link = try? UDPAudioLink()
+            if link != nil {
+                hello += " udp=\(link!.localPort)"
+            }
+        }
+        var s : String?
+        var rest = Data()
+        do {
+            try sock.write(from: SessionResume.framed(hello))
+            let reply = try SessionResume.readHello(sock)
+            s = reply.hello
+            rest = reply.rest
+        } catch {
+            link?.close()
+            if resumable != nil {
+                endBackend()
+            }
+            throw error
+        }
+        Logger.log(.log, TAG, "Receifved: \(s)")
+        
+        // The server either resumes our session or starts a new one.
+        let resumedMic = resumable != nil ? SessionResume.resumed(fromHello: s ?? "") : nil
+        if resumable != nil && resumedMic == nil {
+            Logger.log(.log, TAG, "Server started a new session")
+            endBackend()
+        }
+        semaphore.wait()
+        sessionId = SessionResume.session(fromHello: s ?? "")
+        semaphore.signal()
+        
+        /// Called when server sends a handshake consisting of audio format desc.
+        func onHandshake(outAF : StreamFormat,
+                         inAF  : StreamFormat?) {
+            auhalIF = makeBackend()
+            do {
+                try auhalIF.initUnit(outFormat: outAF, inFormat: inAF, _micPacketReady: onSend)
+                auhalIF.auhalPlayer.clock = trans.clock
+                startStats()
+            } catch {
+                Logger.log(.emergency, TAG, "Failed to start audio: \(error)")
+            }
+        }
+        
+        /// Called when a new packet of microphone data becomes ready.
+        /// Hand it to onMicPCM and send it to the transceiver
+        func onSend(pcmPtr : UnsafeMutableRawPointer, pcmLen : Int) {
+            if onMicPCM != nil {
+                let ptr = pcmPtr.bindMemory(to: Int16.self, capacity: pcmLen)
+                onMicPCM!(UnsafeBufferPointer<Int16>.init(start: ptr, count: pcmLen / 2))
+            }
+            trans.packetReady(pcmPtr, pcmLen)
+        }
+        
+        /// Called when a new audio packet came in from the mac system.
+        /// Play it on our speaker.
+        func onReceived(bytes : UnsafeMutablePointer<Int8>, len : Int) {
+            Logger.log(.verbose, TAG, "about to enqueue packet")
+            auhalIF.auhalPlayer.enqueuePCM(bytes, len)
+        }
+        
+        /// Called for an audio packet lost on the way. The player conceals it.
+        func onLost(len : Int) {
+            auhalIF.auhalPlayer.enqueueLoss(len)
+        }
+        
+        /// Called when the server sends a control message.
+        func onControl(msg : ControlMessage) {
+            switch msg {
+            case .formatChange(let stream, let applyAt, let format):
+                if stream == .speaker {
+                    // Applied by the player once applyAt frames were enqueued.
+                    auhalIF.auhalPlayer.scheduleFormat(format, at: applyAt)
+                }
+                else {
+                    // We produce the mic stream, so we pick the exact frame
+                    // and tell the server while the unit is stopped.
+                    do {
+                        try auhalIF.reconfigure(outFormat: auhalIF.outAudioF, inFormat: format, whileStopped: {
+                            try self.trans.sendControlNow(.formatChange(
+                                stream: .mic, applyAt: self.auhalIF.micFramesSent, format: format))
+                        })
+                    } catch {
+                        Logger.log(.emergency, TAG, "Failed to switch mic format")
+                    }
+                }
+            default:
+                break
+            }
+        }
+        
+        /// Called when the socket breaks. Keeps playing (silence) for a
+        /// while if the session can be resumed.
+        func onTerminated() {
+            stopStats()
+            semaphore.wait()
+            let suspend = sessionId != nil && auhalIF != nil && auhalIF.initted
+            if suspend {
+                suspended = true
+                suspendGen += 1
+            }
+            let gen = suspendGen
+            busy = false
+            semaphore.signal()
+            
+            if suspend {
+                Logger.log(.log, TAG, "Connection lost, waiting for the server to resume")
+                Reactor.shared.after(SessionResume.kGraceSeconds) { [unowned self] in
+                    self.expireSession(gen)
+                }
+            } else {
+                endBackend()
+            }
+        }
+        
+        /// Set up callbacks and start listening for incoming packets
+        let previous = trans
+        trans = PCMTransceiver(sock, dataCallback:       onReceived,
+                                     handshakeCallback:  onHandshake,
+                                     terminatedCallback: onTerminated)
+        trans.audioChannel = .mic
+        trans.controlCallback = onControl
+        trans.lossCallback = onLost
+        // The handshake may have come in with the hello.
+        rest.withUnsafeBytes { (b : UnsafeRawBufferPointer) in
+            if b.count > 0 {
+                trans.parser.append(b.baseAddress!, b.count)
+            }
+        }
+        
+        // A resumed session has no handshake. Carry the negotiated mic
+        // codec over and count mic frames from what the server played.
+        if resumedMic != nil, let prev = previous {
+            trans.txCodec = prev.txCodec
+            trans.txEncodable = prev.txEncodable
+            trans.txChannels = prev.txChannels
+            trans.txBytesPerFrame = prev.txBytesPerFrame
+            auhalIF.micFramesSent = resumedMic!
+            auhalIF.auhalPlayer.clock = trans.clock
+            startStats()
+            Logger.log(.log, TAG, "Resumed session \(resumable!)")
+        }
+        
+        // The server answers our offer with its own port, or not at all.
+        if let link = link {
+            if let port = UDPAudioLink.port(fromHello: s ?? "") {
+                do {
+                    try link.connect(to: sock.remoteHostname, port: port)
+                    trans.udp = link
+                } catch {
+                    link.close()
+                    throw error
+                }
+            } else {
+                link.close()
+            }
+        }
+        try trans.start()
+    }
+    
+    /// Process CPU time (user and system) in seconds.
+    static func cpuTime() -> Double {
+        var ts = timespec()
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts)
+        return Double(ts.tv_sec) + Double(ts.tv_nsec) / 1e9
+    }
+    
+    /// Reports Stats every second while a session plays. A resumed session
+    /// keeps its player, so the counters and the CPU time start over from
+    /// where the player is now, together.
+    ///
+    /// The timer and everything reports keep (the last* counters and
+    /// telemetry totals) belong to the reactor, where reports run. Starting,
+    /// stopping and resetting them is queued there too, in call order.
+    func startStats() {
+        Reactor.shared.queue.async {
+            self.statsTimer?.cancel()
+            let player = self.auhalIF?.auhalPlayer
+            self.lastUnderruns = player?.underruns ?? 0
+            self.lastBytesRendered = player?.bytesRendered ?? 0
+            self.lastCPU = ClientEngine.cpuTime()
+            self.statsTimer = Reactor.shared.every(1) { [unowned self] in
+                self.reportStats()
+            }
+        }
+    }
+    
+    func stopStats() {
+        Reactor.shared.queue.async {
+            self.statsTimer?.cancel()
+            self.statsTimer = nil
+        }
+    }
+    
+    func reportStats() {
+        guard let backend = auhalIF, backend.initted, let player = backend.auhalPlayer else { return }
+        let format = backend.outAudioF!
+        let bytesPerSecond = format.mSampleRate * Double(format.mBytesPerFrame)
+        if bytesPerSecond <= 0 { return }
+        
+        let cpu = ClientEngine.cpuTime()
+        let rendered = player.bytesRendered
+        let audio = Double(rendered &- lastBytesRendered) / bytesPerSecond
+        var stats = Stats()
+        stats.underruns = player.underruns - lastUnderruns
+        stats.bufferedMs = Double(player.lastFreshBytes) / bytesPerSecond * 1000
+        stats.targetMs = player.playout.target * 1000
+        stats.jitterMs = player.playout.jitter * 1000
+        stats.cpuPerAudioSecond = audio > 0 ? (cpu - lastCPU) / audio : 0
+        stats.audioSeconds = Double(rendered) / bytesPerSecond
+        lastUnderruns = player.underruns
+        lastBytesRendered = rendered
+        lastCPU = cpu
+        
+        sendTelemetry(backend, player)
+        Logger.log(.verbose, TAG, "\(stats.underruns) underruns, \(Int(stats.bufferedMs)) ms buffered " +
+            "(target \(Int(stats.targetMs)) ms, jitter \(Int(stats.jitterMs)) ms), " +
+            "\(String(format: "%.3f", stats.cpuPerAudioSecond)) s CPU per s of audio")
+        onStats?(stats)
+    }
+    
+    /// Sends what the audio callbacks measured since the last report to
+    /// the server, see Telemetry.
+    func sendTelemetry(_ backend : AudioBackend, _ player : AUHALAudioPlayer) {
+        var totals = Telemetry()
+        totals.underruns = UInt32(truncatingIfNeeded: player.underruns)
+        totals.resyncs = UInt32(truncatingIfNeeded: player.resyncs)
+        totals.accelerated = UInt32(truncatingIfNeeded: player.stretcher?.accelerated ?? 0)
+        totals.expanded = UInt32(truncatingIfNeeded: player.stretcher?.expanded ?? 0)
+        totals.concealed = UInt32(truncatingIfNeeded: (player.concealer?.gaps ?? 0) +
+                                                      (player.lossConcealer?.gaps ?? 0))
+        
+        var t = Telemetry()
+        t.underruns = totals.underruns &- lastTotals.underruns
+        t.resyncs = totals.resyncs &- lastTotals.resyncs
+        t.accelerated = totals.accelerated &- lastTotals.accelerated
+        t.expanded = totals.expanded &- lastTotals.expanded
+        t.concealed = totals.concealed &- lastTotals.concealed
+        lastTotals = totals
+        
+        var histograms : [(Telemetry.Kind, Histogram)] = [
+            (.playerCallbackNs, player.callbackNs),
+            (.playerOccupancyUs, player.occupancyUs),
+            (.playerRequestFrames, player.requestFrames)]
+        if let rec = backend.recorderCallbackNs {
+            histograms.append((.recorderCallbackNs, rec))
+        }
+        for (kind, h) in histograms {
+            var last = lastCounts[ObjectIdentifier(h)] ?? [UInt32](repeating: 0, count: Histogram.kBuckets)
+            t.histograms[kind] = Telemetry.coarsen(h.delta(since: &last))
+            lastCounts[ObjectIdentifier(h)] = last
+        }
+        trans?.mux.send(t.encode(), on: .telemetry)
+    }
+}
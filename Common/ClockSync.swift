@@ -0,0 +1,162 @@
+//
+//  ClockSync.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Estimates the mapping between our uptime clock and the peer's from NTP
+/// style ping/pong exchanges on the control channel.
+///
+/// Every exchange yields the round trip delay and an offset sample. Samples
+/// that took noticeably longer than the fastest recent exchange were likely
+/// queued somewhere and are rejected. A least squares line through the rest
+/// gives offset and skew, so the mapping stays accurate between pings.
+class ClockSync {
+
+    /// One ping/pong exchange.
+    struct Sample {
+        var local  : Double     // Our uptime (ns) halfway through the exchange.
+        var offset : Double     // Peer clock minus ours (ns).
+        var delay  : Double     // Round trip minus peer processing time (ns).
+    }
+
+    /// Number of recent exchanges the estimate is based on.
+    static let kWindow = 32
+
+    /// Samples with a delay above the fastest one plus this much (ns) are
+    /// treated as outliers.
+    static let kDelayTolerance : Double = 500_000
+
+    /// Seconds between pings.
+    var interval : Double = 0.5
+
+    /// Sends a ping carrying our current uptime. Provided by PCMTransceiver.
+    var sendPing : ((UInt64) -> Void)?
+
+    /// Called after every exchange that updated the estimate.
+    var onUpdate : ((ClockSync) -> Void)?
+
+    /// Most recent exchanges, oldest first.
+    var samples = [Sample]()
+
+    /// Current estimate: peer = local + offset + skew * (local - refTime).
+    var refTime : Double = 0
+    var offset  : Double = 0
+    var skew    : Double = 0
+
+    /// Whether at least one exchange completed.
+    var valid = false
+
+    /// Exchanges accepted / rejected as outliers.
+    var accepted = 0
+    var rejected = 0
+
+    /// Mutex guarding the estimate, read from audio and socket threads.
+    let semaphore = DispatchSemaphore(value: 1)
+
+    var timer : DispatchSourceTimer?
+
+    /// Debugging.
+    let TAG = "ClockSync"
+
+    /// Our clock. Uptime in ns, monotonic.
+    static func now() -> UInt64 {
+        return DispatchTime.now().uptimeNanoseconds
+    }
+
+    /// Starts pinging the peer periodically.
+    func start() {
+        if timer != nil { return }
+        timer = Reactor.shared.every(interval) { [unowned self] in
+            self.sendPing?(ClockSync.now())
+        }
+    }
+
+    func stop() {
+        timer?.cancel()
+        timer = nil
+    }
+
+    /// Adds a completed exchange. t1/t4 are ours, t2/t3 the peer's.
+    func addExchange(t1 : UInt64, t2 : UInt64, t3 : UInt64, t4 : UInt64) {
+        let delay = Double(Int64(bitPattern: t4 &- t1)) - Double(Int64(bitPattern: t3 &- t2))
+        let offset = (Double(Int64(bitPattern: t2 &- t1)) + Double(Int64(bitPattern: t3 &- t4))) / 2
+        let local = Double(t1) + Double(t4 &- t1) / 2
+
+        semaphore.wait()
+        samples.append(Sample(local: local, offset: offset, delay: delay))
+        if samples.count > ClockSync.kWindow {
+            samples.removeFirst()
+        }
+        refit()
+        semaphore.signal()
+        onUpdate?(self)
+    }
+
+    /// Recomputes offset and skew from the samples. Called with mutex held.
+    func refit() {
+        let minDelay = samples.map({ $0.delay }).min()!
+        let good = samples.filter { $0.delay <= minDelay + ClockSync.kDelayTolerance }
+        if good.count < samples.count && samples.last!.delay > minDelay + ClockSync.kDelayTolerance {
+            rejected += 1
+        } else {
+            accepted += 1
+        }
+
+        // Least squares fit of offset over local time, relative to the
+        // newest good sample to keep the numbers small.
+        refTime = good.last!.local
+        if good.count < 2 {
+            offset = good[0].offset
+            skew = 0
+            valid = true
+            return
+        }
+        var sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0
+        for s in good {
+            let x = s.local - refTime
+            sx += x
+            sy += s.offset
+            sxx += x * x
+            sxy += x * s.offset
+        }
+        let n = Double(good.count)
+        let den = n * sxx - sx * sx
+        skew = den > 0 ? (n * sxy - sx * sy) / den : 0
+        offset = (sy - skew * sx) / n
+        valid = true
+    }
+
+    /// Maps one of our uptimes (ns) onto the peer's clock. nil until the
+    /// first exchange completed.
+    func toRemote(_ local : UInt64) -> UInt64? {
+        semaphore.wait()
+        defer { semaphore.signal() }
+        if !valid {
+            return nil
+        }
+        return ClockSync.clamped(Double(local) + offset + skew * (Double(local) - refTime))
+    }
+
+    /// Maps one of the peer's uptimes (ns) onto our clock. nil until the
+    /// first exchange completed.
+    func toLocal(_ remote : UInt64) -> UInt64? {
+        semaphore.wait()
+        defer { semaphore.signal() }
+        if !valid {
+            return nil
+        }
+        // Solve remote = local + offset + skew * (local - refTime) for local.
+        return ClockSync.clamped((Double(remote) - offset + skew * refTime) / (1 + skew))
+    }
+
+    /// A time in ns as UInt64. A bad early estimate may map before zero (or
+    /// make no sense at all), which clamps instead of trapping.
+    static func clamped(_ ns : Double) -> UInt64 {
+        if !(ns > 0) {
+            return 0
+        }
+        return ns < 1.8e19 ? UInt64(ns) : UInt64.max
+    }
+}
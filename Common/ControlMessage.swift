@@ -0,0 +1,117 @@
+//
+//  ControlMessage.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Opcodes of messages sent on MuxChannel.control. First byte of a message.
+enum ControlOp : UInt8 {
+    case formatChange = 1
+    case ping         = 2
+    case pong         = 3
+    case heartbeat    = 4
+}
+
+/// Messages exchanged on the control channel. Encoded as the opcode byte
+/// followed by the fields in host (little endian) byte order.
+enum ControlMessage {
+
+    /// Audio on `stream` switches to `format` starting with frame `applyAt`,
+    /// counted from the start of the session. Frames before it are still in
+    /// the old format.
+    case formatChange(stream: MuxChannel, applyAt: UInt64, format: StreamFormat)
+
+    /// Clock sync request. t1 is the sender's uptime (ns) when sent.
+    case ping(t1: UInt64)
+
+    /// Clock sync reply. Echoes t1, adds the replier's uptime (ns) when the
+    /// ping was received (t2) and when the pong was sent (t3).
+    case pong(t1: UInt64, t2: UInt64, t3: UInt64)
+
+    /// Sign of life, see Heartbeat.
+    case heartbeat
+
+    /// Serializes the message for StreamMux.
+    func encode() -> Data {
+        var d = Data(capacity: 64)
+        switch self {
+        case .formatChange(let stream, let applyAt, let format):
+            d.append(ControlOp.formatChange.rawValue)
+            d.append(stream.rawValue)
+            ControlMessage.append(&d, applyAt)
+            ControlMessage.append(&d, format)
+        case .ping(let t1):
+            d.append(ControlOp.ping.rawValue)
+            ControlMessage.append(&d, t1)
+        case .pong(let t1, let t2, let t3):
+            d.append(ControlOp.pong.rawValue)
+            ControlMessage.append(&d, t1)
+            ControlMessage.append(&d, t2)
+            ControlMessage.append(&d, t3)
+        case .heartbeat:
+            d.append(ControlOp.heartbeat.rawValue)
+        }
+        return d
+    }
+
+    /// Parses a message received on the control channel.
+    /// - Returns: nil if the message is unknown or truncated.
+    static func decode(_ d : Data) -> ControlMessage? {
+        var r = Reader(data: d)
+        guard let opByte : UInt8 = r.read(), let op = ControlOp(rawValue: opByte) else {
+            return nil
+        }
+        switch op {
+        case .formatChange:
+            guard let s : UInt8 = r.read(), let stream = MuxChannel(rawValue: s),
+                  let applyAt : UInt64 = r.read(),
+                  let format : StreamFormat = r.read() else {
+                return nil
+            }
+            return .formatChange(stream: stream, applyAt: applyAt, format: format)
+        case .ping:
+            guard let t1 : UInt64 = r.read() else { return nil }
+            return .ping(t1: t1)
+        case .pong:
+            guard let t1 : UInt64 = r.read(), let t2 : UInt64 = r.read(),
+                  let t3 : UInt64 = r.read() else {
+                return nil
+            }
+            return .pong(t1: t1, t2: t2, t3: t3)
+        case .heartbeat:
+            return .heartbeat
+        }
+    }
+
+    /// Appends the raw bytes of a trivial value.
+    static func append<T>(_ d : inout Data, _ v : T) {
+        withUnsafeBytes(of: v) { d.append(contentsOf: $0) }
+    }
+
+    /// Sequentially reads trivial values out of a message.
+    struct Reader {
+        let data : Data
+        var offset = 0
+
+        init(data : Data) {
+            self.data = data
+        }
+
+        mutating func read<T>() -> T? {
+            let size = MemoryLayout<T>.size
+            if offset + size > data.count {
+                return nil
+            }
+            let v = data.withUnsafeBytes { (p : UnsafeRawBufferPointer) -> T in
+                let tmp = UnsafeMutableRawPointer.allocate(byteCount: size,
+                                                           alignment: MemoryLayout<T>.alignment)
+                defer { tmp.deallocate() }
+                memcpy(tmp, p.baseAddress!.advanced(by: offset), size)
+                return tmp.load(as: T.self)
+            }
+            offset += size
+            return v
+        }
+    }
+}
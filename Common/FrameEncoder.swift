@@ -0,0 +1,63 @@
+//
+//  FrameEncoder.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Turns a batch of PCM into a complete audio frame (header included), coded
+/// with the given codec. Holds the encoder state, so one instance must only
+/// ever see one continuous stream. PCMTransceiver owns one for its own
+/// stream; the server's FanOut uses one per codec to encode the capture once
+/// for all devices.
+class FrameEncoder {
+
+    let kHeaderSig = Data([0x69, 0x4, 0x20, 0])  // Header PCM Data Signature
+    let kCodedSig  = Data([0x69, 0x4, 0x24, 0])  // Header Coded Audio Signature
+    let kHeaderSize = 8
+
+    let lossless = LosslessCodec()
+    let adpcm = ADPCMCodec()
+
+    /// Called when the stream changes format; coder state doesn't carry over.
+    func reset() {
+        adpcm.reset()
+    }
+
+    /// Replaces the contents of packet with the frame for pcm.
+    /// - Parameters:
+    ///   - pcm: Interleaved PCM. Only int16 can be coded, see AudioCodec.
+    ///   - codec: Codec to use.
+    ///   - channels: Interleaved channels in pcm.
+    ///   - channel: Logical channel, sent in byte 3 of the header.
+    func build(_ pcm : Data, codec : AudioCodec, channels : Int,
+               channel : MuxChannel, into packet : inout Data) {
+        packet.removeAll(keepingCapacity: true)
+        if codec == .pcm {
+            packet.append(kHeaderSig)
+            packet.append(contentsOf: [0, 0, 0, 0])
+            packet.append(pcm)
+        } else {
+            packet.append(kCodedSig)
+            packet.append(contentsOf: [0, 0, 0, 0])
+            packet.append(codec.rawValue)
+            let frames = pcm.count / (2 * channels)
+            pcm.withUnsafeBytes { (raw : UnsafeRawBufferPointer) in
+                let p = raw.baseAddress!.assumingMemoryBound(to: Int16.self)
+                switch codec {
+                case .lossless:
+                    lossless.encode(p, frames: frames, channels: channels, into: &packet)
+                case .adpcm:
+                    adpcm.encode(p, frames: frames, channels: channels, into: &packet)
+                case .pcm:
+                    break
+                }
+            }
+        }
+        packet[3] = channel.rawValue
+        let len = UInt32(packet.count - kHeaderSize)
+        packet.withUnsafeMutableBytes {
+            $0.storeBytes(of: len, toByteOffset: 4, as: UInt32.self)
+        }
+    }
+}
@@ -0,0 +1,87 @@
+//
+//  FrameParser.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Incremental parser for the transceiver's frame format. Bytes are fed in
+/// as they arrive, in chunks of any size, and complete frames come out.
+/// Garbage (misaligned communication) is skipped up to the next 0x69 0x4
+/// signature.
+class FrameParser {
+
+    let kHeaderSize = 8
+
+    /// Payloads bigger than this can only be garbage. Resync instead of
+    /// waiting forever for them.
+    let kMaxPayload = 1 << 20
+
+    /// Signature bytes (byte 2) of the frames we know.
+    let kKnownSigs : Set<UInt8> = [0x19, 0x20, 0x21, 0x22, 0x23, 0x24]
+
+    /// Received bytes not parsed yet start at pos.
+    var buf = Data(capacity: 65536)
+    var pos = 0
+
+    /// Statistics.
+    var resyncs = 0
+
+    /// Debugging.
+    let TAG = "FrameParser"
+
+    func append(_ bytes : UnsafeRawPointer, _ count : Int) {
+        // Compact before growing, so the buffer stays the size of a frame.
+        if pos > 0 && pos == buf.count {
+            buf.removeAll(keepingCapacity: true)
+            pos = 0
+        } else if pos > 32768 {
+            buf.removeSubrange(0..<pos)
+            pos = 0
+        }
+        buf.append(bytes.assumingMemoryBound(to: UInt8.self), count: count)
+    }
+
+    /// Calls handler with signature, byte 3 and payload of every complete
+    /// frame buffered. The payload is only valid during the call.
+    func drain(_ handler : (UInt8, UInt8, UnsafeMutableRawBufferPointer) -> Void) {
+        while buf.count - pos >= kHeaderSize {
+            let (valid, sig, byte3, len) = buf.withUnsafeBytes { (b : UnsafeRawBufferPointer) -> (Bool, UInt8, UInt8, Int) in
+                var len32 : UInt32 = 0
+                memcpy(&len32, b.baseAddress! + pos + 4, 4)
+                let len = Int(len32)
+                let valid = b[pos] == 0x69 && b[pos + 1] == 0x4 &&
+                    kKnownSigs.contains(b[pos + 2]) && len <= kMaxPayload
+                return (valid, b[pos + 2], b[pos + 3], len)
+            }
+            if !valid {
+                resync()
+                continue
+            }
+            if buf.count - pos < kHeaderSize + len {
+                return
+            }
+            let start = pos + kHeaderSize
+            pos = start + len
+            buf.withUnsafeMutableBytes { (b : UnsafeMutableRawBufferPointer) in
+                handler(sig, byte3, UnsafeMutableRawBufferPointer(rebasing: b[start..<start + len]))
+            }
+        }
+    }
+
+    /// Skips to the next possible signature.
+    func resync() {
+        if resyncs % 100 == 0 {
+            Logger.log(.emergency, TAG, "We've encountered misaligned communication. Attempting to "
+             + "autocorrect communication by skipping to next header")
+        }
+        resyncs += 1
+        pos += 1
+        while pos < buf.count {
+            if buf[pos] == 0x69 && (pos + 1 == buf.count || buf[pos + 1] == 0x4) {
+                return
+            }
+            pos += 1
+        }
+    }
+}
@@ -0,0 +1,65 @@
+//
+//  Heartbeat.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Detects a peer that silently went away (e.g. cable pulled) long before
+/// any socket timeout would. Sends a tiny heartbeat on the control channel
+/// every interval and declares the peer dead once nothing at all was heard
+/// from it for missCount intervals. Any received frame counts as a sign of
+/// life, so heartbeats only matter while the peer has nothing else to send.
+class Heartbeat {
+
+    /// Seconds between heartbeats.
+    var interval : Double = 0.1
+
+    /// Number of intervals without hearing from the peer before giving up.
+    var missCount = 5
+
+    /// Sends one heartbeat. Provided by PCMTransceiver.
+    var sendBeat : (() -> Void)?
+
+    /// Called once when the peer is considered dead.
+    var onPeerLost : (() -> Void)?
+
+    /// Uptime (ns) the peer was last heard from.
+    var lastHeard : UInt64 = 0
+
+    var timer : DispatchSourceTimer?
+
+    /// Debugging.
+    let TAG = "Heartbeat"
+
+    /// Starts sending and watching heartbeats.
+    func start() {
+        if timer != nil { return }
+        lastHeard = DispatchTime.now().uptimeNanoseconds
+        timer = Reactor.shared.every(interval) { [unowned self] in
+            self.tick()
+        }
+    }
+
+    func stop() {
+        timer?.cancel()
+        timer = nil
+    }
+
+    /// Called on the reactor whenever bytes arrive from the peer.
+    func heard() {
+        lastHeard = DispatchTime.now().uptimeNanoseconds
+    }
+
+    func tick() {
+        let now = DispatchTime.now().uptimeNanoseconds
+        let silence = Double(Int64(bitPattern: now &- lastHeard)) / 1e9
+        if silence > interval * Double(missCount) {
+            Logger.log(.emergency, TAG, "Peer lost after \(Int(silence * 1000)) ms of silence")
+            stop()
+            onPeerLost?()
+            return
+        }
+        sendBeat?()
+    }
+}
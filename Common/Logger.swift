@@ -20,13 +20,19 @@ class Logger {
 
     static let symLevel = Array(["V", "L", "E", " "])
     
-    /// The current debug level.
+    /// The current debug level. Build with -D IAUDIO_VERBOSE for verbose,
+    /// which Trace.level follows.
+    #if IAUDIO_VERBOSE
+    static let debugLevel : DebugLevel = .verbose
+    #else
     static let debugLevel : DebugLevel = .log
+    #endif
     
-    /// Print wrapper.
-    static func log(_ lvl : DebugLevel, _ tag : String, _ s : String) {
+    /// Print wrapper. The message is only built if it gets printed. Audio
+    /// threads use Trace instead.
+    static func log(_ lvl : DebugLevel, _ tag : String, _ s : @autoclosure () -> String) {
         if lvl.rawValue >= debugLevel.rawValue {
-            print("[\(symLevel[lvl.rawValue])][\(tag)]: " + s)
+            print("[\(symLevel[lvl.rawValue])][\(tag)]: " + s())
         }
     }
 }
@@ -0,0 +1,177 @@
+//
+//  LossConcealer.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Fills the player's output while the ringbuffer ran dry, after G.711
+/// Appendix I: instead of dropping to silence, keep playing the last pitch
+/// period of what was played, fading out after 10 ms and silent after 60
+/// ms. When audio arrives again it is cross-faded in over a few ms, so the
+/// gap has neither a click going in nor one coming out.
+///
+/// Remembers the last kHistory seconds played. Works on interleaved 16 bit
+/// integer PCM, allocates everything up front and is real time safe.
+final class LossConcealer {
+
+    /// Audio remembered (seconds). Enough to find periods up to kMaxPeriod.
+    static let kHistory = 0.04
+
+    /// Periods searched (seconds): 80 to 400 Hz.
+    static let kMinPeriod = 0.0025
+    static let kMaxPeriod = 0.0125
+
+    /// Concealment plays at full level for kHoldTime, then fades to silence
+    /// at kSilentAfter (seconds).
+    static let kHoldTime = 0.010
+    static let kSilentAfter = 0.060
+
+    /// Cross-fade from concealment back into real audio (seconds).
+    static let kFadeIn = 0.004
+
+    let channels : Int
+    let minPeriod : Int
+    let maxPeriod : Int
+    let holdFrames : Int
+    let silentFrames : Int
+    let fadeFrames : Int
+
+    /// Last frames played, oldest first, and its channels mixed down for
+    /// the period search.
+    let historyFrames : Int
+    let history : UnsafeMutablePointer<Int16>
+    let mono : UnsafeMutablePointer<Float>
+
+    /// Frames concealed so far in the current gap, 0 while not concealing.
+    var concealed = 0
+
+    /// Period being repeated, and where in it the next frame comes from.
+    var period = 0
+    var phase = 0
+
+    /// Statistics. Gaps concealed.
+    var gaps = 0
+
+    init(channels : Int, sampleRate : Double) {
+        self.channels = max(1, channels)
+        minPeriod = max(1, Int(LossConcealer.kMinPeriod * sampleRate))
+        maxPeriod = max(minPeriod, Int(LossConcealer.kMaxPeriod * sampleRate))
+        holdFrames = Int(LossConcealer.kHoldTime * sampleRate)
+        silentFrames = max(holdFrames + 1, Int(LossConcealer.kSilentAfter * sampleRate))
+        fadeFrames = max(1, Int(LossConcealer.kFadeIn * sampleRate))
+        historyFrames = max(Int(LossConcealer.kHistory * sampleRate), maxPeriod + 2 * minPeriod)
+        history = UnsafeMutablePointer<Int16>.allocate(capacity: historyFrames * self.channels)
+        history.initialize(repeating: 0, count: historyFrames * self.channels)
+        mono = UnsafeMutablePointer<Float>.allocate(capacity: historyFrames)
+    }
+
+    deinit {
+        history.deallocate()
+        mono.deallocate()
+    }
+
+    /// Called with every buffer of real audio about to be played. Fades it
+    /// in if a gap was being concealed, then remembers it.
+    func played(_ out : UnsafeMutablePointer<Int16>, frames : Int) {
+        let n = channels
+        if concealed > 0 {
+            let fade = min(fadeFrames, frames)
+            for i in 0..<fade {
+                let w = Float(i) / Float(fade)
+                let g = gain()
+                for c in 0..<n {
+                    let a = g * Float(history[(historyFrames - period + phase) * n + c])
+                    let b = Float(out[i * n + c])
+                    out[i * n + c] = Int16(clamping: Int(a + (b - a) * w))
+                }
+                advance()
+            }
+            concealed = 0
+        }
+        remember(out, frames)
+    }
+
+    /// Fills out with frames frames of concealment.
+    func conceal(_ out : UnsafeMutablePointer<Int16>, frames : Int) {
+        let n = channels
+        if concealed == 0 {
+            period = findPeriod()
+            phase = 0
+            gaps += 1
+        }
+        for i in 0..<frames {
+            let g = gain()
+            for c in 0..<n {
+                let v = g * Float(history[(historyFrames - period + phase) * n + c])
+                out[i * n + c] = Int16(clamping: Int(v))
+            }
+            advance()
+        }
+    }
+
+    /// Level of the next concealed frame.
+    func gain() -> Float {
+        if concealed <= holdFrames {
+            return 1
+        }
+        if concealed >= silentFrames {
+            return 0
+        }
+        return 1 - Float(concealed - holdFrames) / Float(silentFrames - holdFrames)
+    }
+
+    func advance() {
+        concealed += 1
+        phase += 1
+        if phase == period {
+            phase = 0
+        }
+    }
+
+    /// Appends frames to the history, dropping the oldest.
+    func remember(_ pcm : UnsafePointer<Int16>, _ frames : Int) {
+        let n = channels
+        if frames >= historyFrames {
+            history.assign(from: pcm + (frames - historyFrames) * n, count: historyFrames * n)
+        } else {
+            history.assign(from: history + frames * n, count: (historyFrames - frames) * n)
+            (history + (historyFrames - frames) * n).assign(from: pcm, count: frames * n)
+        }
+    }
+
+    /// The lag at which the end of the history is most like the audio
+    /// before it, so repeating the last that many frames loops seamlessly.
+    func findPeriod() -> Int {
+        for i in 0..<historyFrames {
+            var sum : Float = 0
+            for c in 0..<channels {
+                sum += Float(history[i * channels + c])
+            }
+            mono[i] = sum
+        }
+        let window = 2 * minPeriod
+        let end = historyFrames - window
+        var e0 : Float = 0
+        for i in 0..<window {
+            e0 += mono[end + i] * mono[end + i]
+        }
+        var best = maxPeriod
+        var bestScore = -Float.greatestFiniteMagnitude
+        for lag in minPeriod...maxPeriod {
+            var xy : Float = 0
+            var e1 : Float = 0
+            for i in 0..<window {
+                let v = mono[end - lag + i]
+                xy += mono[end + i] * v
+                e1 += v * v
+            }
+            let score = xy / max(1, sqrtf(e0 * e1))
+            if score > bestScore {
+                bestScore = score
+                best = lag
+            }
+        }
+        return best
+    }
+}
@@ -0,0 +1,357 @@
+//
+//  LosslessCodec.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Low latency lossless coder for blocks of interleaved 16 bit PCM, in the
+/// style of FLAC: every channel of a block is predicted with the best of the
+/// fixed polynomial predictors of order 0-4 and the residual is Rice coded.
+/// Works on whatever block size a packet carries (typically 128-512 frames),
+/// so it adds no latency. Channels that don't compress are sent verbatim.
+///
+/// A packet carries one or more blocks, back to back. Block layout:
+///     UInt16 frames, UInt8 channels, then per channel:
+///     UInt8 order (0xFF = verbatim), UInt8 rice parameter,
+///     order x Int16 warm-up samples, Rice coded residuals padded to a byte.
+class LosslessCodec {
+
+    static let kMaxOrder = 4
+
+    /// Order byte of a channel sent as raw Int16 samples.
+    static let kVerbatim : UInt8 = 0xFF
+
+    /// Quotients this long or longer are escaped and sent as 32 raw bits, so
+    /// a spike after silence can't blow up the block.
+    static let kEscapeQuotient = 24
+
+    /// Most frames a block can carry. Longer input is split.
+    static let kMaxBlockFrames = Int(UInt16.max)
+
+    /// Scratch space holding one channel widened to Int32. Grown on demand,
+    /// normally allocated once for the session.
+    var samples = [Int32]()
+
+    /// Scratch space for the residual cost of every predictor order.
+    var costs = [Int64](repeating: 0, count: LosslessCodec.kMaxOrder + 1)
+
+    // MARK: Encoding
+
+    /// Appends the encoded blocks to out. channels must fit a UInt8, see
+    /// AudioCodec.canEncode.
+    func encode(_ pcm : UnsafePointer<Int16>, frames : Int, channels : Int, into out : inout Data) {
+        var done = 0
+        repeat {
+            let n = min(frames - done, LosslessCodec.kMaxBlockFrames)
+            encodeBlock(pcm + done * channels, frames: n, channels: channels, into: &out)
+            done += n
+        } while done < frames
+    }
+
+    func encodeBlock(_ pcm : UnsafePointer<Int16>, frames : Int, channels : Int, into out : inout Data) {
+        var n16 = UInt16(frames)
+        out.append(Data(bytes: &n16, count: 2))
+        out.append(UInt8(channels))
+        if samples.count < frames + 8 {
+            samples = [Int32](repeating: 0, count: frames + 8)
+        }
+        for ch in 0..<channels {
+            samples.withUnsafeMutableBufferPointer { buf in
+                let x = buf.baseAddress!
+                for i in 0..<frames {
+                    x[i] = Int32(pcm[i * channels + ch])
+                }
+                encodeChannel(x, frames, &out)
+            }
+        }
+    }
+
+    /// Loads 8 consecutive samples, no alignment required.
+    @inline(__always)
+    func load8(_ p : UnsafePointer<Int32>) -> SIMD8<Int32> {
+        var v = SIMD8<Int32>()
+        withUnsafeMutableBytes(of: &v) { memcpy($0.baseAddress!, p, 32) }
+        return v
+    }
+
+    @inline(__always)
+    func abs8(_ v : SIMD8<Int32>) -> SIMD8<Int32> {
+        return v.replacing(with: 0 &- v, where: v .< 0)
+    }
+
+    /// Sums of absolute residuals of every fixed predictor over the block,
+    /// eight samples at a time, into costs.
+    func residualCosts(_ x : UnsafePointer<Int32>, _ n : Int) {
+        let k = LosslessCodec.kMaxOrder
+        var acc0 = SIMD8<Int32>(), acc1 = SIMD8<Int32>(), acc2 = SIMD8<Int32>()
+        var acc3 = SIMD8<Int32>(), acc4 = SIMD8<Int32>()
+        for o in 0...k {
+            costs[o] = 0
+        }
+        var i = k
+        // Accumulators are flushed every 64 vectors so Int32 can't overflow.
+        var vecs = 0
+        while i + 8 <= n {
+            let x0 = load8(x + i), x1 = load8(x + i - 1), x2 = load8(x + i - 2)
+            let x3 = load8(x + i - 3), x4 = load8(x + i - 4)
+            let d1 = x0 &- x1, d1b = x1 &- x2, d1c = x2 &- x3, d1d = x3 &- x4
+            let d2 = d1 &- d1b, d2b = d1b &- d1c, d2c = d1c &- d1d
+            let d3 = d2 &- d2b, d3b = d2b &- d2c
+            let d4 = d3 &- d3b
+            acc0 &+= abs8(x0)
+            acc1 &+= abs8(d1)
+            acc2 &+= abs8(d2)
+            acc3 &+= abs8(d3)
+            acc4 &+= abs8(d4)
+            i += 8
+            vecs += 1
+            if vecs == 64 || i + 8 > n {
+                costs[0] += Int64(acc0.wrappedSum())
+                costs[1] += Int64(acc1.wrappedSum())
+                costs[2] += Int64(acc2.wrappedSum())
+                costs[3] += Int64(acc3.wrappedSum())
+                costs[4] += Int64(acc4.wrappedSum())
+                acc0 = .zero; acc1 = .zero; acc2 = .zero; acc3 = .zero; acc4 = .zero
+                vecs = 0
+            }
+        }
+        while i < n {
+            for o in 0...k {
+                costs[o] += Int64(abs(residual(x, i, o)))
+            }
+            i += 1
+        }
+    }
+
+    /// Residual of sample i under the fixed predictor of the given order.
+    @inline(__always)
+    func residual(_ x : UnsafePointer<Int32>, _ i : Int, _ order : Int) -> Int32 {
+        switch order {
+        case 0:  return x[i]
+        case 1:  return x[i] - x[i-1]
+        case 2:  return x[i] - 2*x[i-1] + x[i-2]
+        case 3:  return x[i] - 3*x[i-1] + 3*x[i-2] - x[i-3]
+        default: return x[i] - 4*x[i-1] + 6*x[i-2] - 4*x[i-3] + x[i-4]
+        }
+    }
+
+    func encodeChannel(_ x : UnsafePointer<Int32>, _ n : Int, _ out : inout Data) {
+        let start = out.count
+        if n <= LosslessCodec.kMaxOrder {
+            appendVerbatim(x, n, &out)
+            return
+        }
+        residualCosts(x, n)
+        var order = 0
+        for o in 1...LosslessCodec.kMaxOrder where costs[o] < costs[order] {
+            order = o
+        }
+
+        // Rice parameter such that 2^k is about the mean residual magnitude.
+        let count = Int64(n - LosslessCodec.kMaxOrder)
+        var k = 0
+        while k < 15 && (count << (k + 1)) < costs[order] {
+            k += 1
+        }
+
+        out.append(UInt8(order))
+        out.append(UInt8(k))
+        for i in 0..<order {
+            var s = Int16(x[i])
+            out.append(Data(bytes: &s, count: 2))
+        }
+        var w = BitWriter()
+        for i in order..<n {
+            let r = residual(x, i, order)
+            let u = UInt32(bitPattern: (r << 1) ^ (r >> 31))    // zigzag
+            let q = Int(u >> UInt32(k))
+            if q >= LosslessCodec.kEscapeQuotient {
+                w.put((1 << UInt32(LosslessCodec.kEscapeQuotient)) - 1,
+                      LosslessCodec.kEscapeQuotient, &out)
+                w.put(u, 32, &out)
+            } else {
+                // q ones, a terminating zero, then the low k bits.
+                w.put(((1 << UInt32(q)) - 1) << 1, q + 1, &out)
+                if k > 0 {
+                    w.put(u & ((1 << UInt32(k)) - 1), k, &out)
+                }
+            }
+        }
+        w.flush(&out)
+
+        // Didn't pay off (e.g. white noise). Send it raw instead.
+        if out.count - start > 2 + n * 2 {
+            out.removeSubrange(start..<out.count)
+            appendVerbatim(x, n, &out)
+        }
+    }
+
+    func appendVerbatim(_ x : UnsafePointer<Int32>, _ n : Int, _ out : inout Data) {
+        out.append(LosslessCodec.kVerbatim)
+        out.append(0)
+        for i in 0..<n {
+            var s = Int16(truncatingIfNeeded: x[i])
+            out.append(Data(bytes: &s, count: 2))
+        }
+    }
+
+    // MARK: Decoding
+
+    /// Decodes the blocks of a packet and appends the interleaved Int16 PCM
+    /// to out.
+    /// - Returns: false if a block is malformed.
+    func decode(_ src : UnsafeRawBufferPointer, into out : inout Data) -> Bool {
+        var pos = 0
+        repeat {
+            if !decodeBlock(src, &pos, into: &out) {
+                return false
+            }
+        } while pos < src.count
+        return true
+    }
+
+    func decodeBlock(_ src : UnsafeRawBufferPointer, _ pos : inout Int, into out : inout Data) -> Bool {
+        if pos + 3 > src.count { return false }
+        let frames = Int(src[pos]) | Int(src[pos + 1]) << 8
+        let channels = Int(src[pos + 2])
+        if channels == 0 { return false }
+        // Every residual takes at least a bit, so a header claiming more
+        // than the packet can hold is corrupt. Don't allocate for it.
+        if channels * (max(frames - LosslessCodec.kMaxOrder, 0) / 8 + 2) > src.count - pos - 3 {
+            return false
+        }
+        let base = out.count
+        out.count += frames * channels * 2
+        pos += 3
+        if samples.count < frames + 8 {
+            samples = [Int32](repeating: 0, count: frames + 8)
+        }
+        for ch in 0..<channels {
+            let ok = samples.withUnsafeMutableBufferPointer { buf -> Bool in
+                let x = buf.baseAddress!
+                guard decodeChannel(src, &pos, x, frames) else { return false }
+                out.withUnsafeMutableBytes { (o : UnsafeMutableRawBufferPointer) in
+                    let dst = o.baseAddress!.advanced(by: base)
+                        .assumingMemoryBound(to: Int16.self)
+                    for i in 0..<frames {
+                        dst[i * channels + ch] = Int16(truncatingIfNeeded: x[i])
+                    }
+                }
+                return true
+            }
+            if !ok { return false }
+        }
+        return true
+    }
+
+    func decodeChannel(_ src : UnsafeRawBufferPointer, _ pos : inout Int,
+                       _ x : UnsafeMutablePointer<Int32>, _ n : Int) -> Bool {
+        if pos + 2 > src.count { return false }
+        let order = src[pos]
+        let k = Int(src[pos + 1])
+        pos += 2
+
+        if order == LosslessCodec.kVerbatim {
+            if pos + n * 2 > src.count { return false }
+            for i in 0..<n {
+                x[i] = Int32(Int16(bitPattern: UInt16(src[pos]) | UInt16(src[pos + 1]) << 8))
+                pos += 2
+            }
+            return true
+        }
+        let o = Int(order)
+        if o > LosslessCodec.kMaxOrder || o > n || k > 15 || pos + o * 2 > src.count { return false }
+        for i in 0..<o {
+            x[i] = Int32(Int16(bitPattern: UInt16(src[pos]) | UInt16(src[pos + 1]) << 8))
+            pos += 2
+        }
+
+        var r = BitReader(src: src, pos: pos)
+        for i in o..<n {
+            var q = 0
+            while q < LosslessCodec.kEscapeQuotient {
+                guard let b = r.get(1) else { return false }
+                if b == 0 { break }
+                q += 1
+            }
+            var u : UInt32
+            if q == LosslessCodec.kEscapeQuotient {
+                guard let raw = r.get(32) else { return false }
+                u = raw
+            } else {
+                u = UInt32(q) << UInt32(k)
+                if k > 0 {
+                    guard let low = r.get(k) else { return false }
+                    u |= low
+                }
+            }
+            let e = Int32(bitPattern: u >> 1) ^ (0 &- Int32(bitPattern: u & 1))    // un-zigzag
+            // Wrapping, so a corrupt residual can't trap. Real samples are
+            // Int16, anything else means the block is corrupt.
+            var v : Int32
+            switch o {
+            case 0:  v = e
+            case 1:  v = e &+ x[i-1]
+            case 2:  v = e &+ 2 &* x[i-1] &- x[i-2]
+            case 3:  v = e &+ 3 &* x[i-1] &- 3 &* x[i-2] &+ x[i-3]
+            default: v = e &+ 4 &* x[i-1] &- 6 &* x[i-2] &+ 4 &* x[i-3] &- x[i-4]
+            }
+            if v < Int32(Int16.min) || v > Int32(Int16.max) { return false }
+            x[i] = v
+        }
+        pos = r.pos
+        return true
+    }
+}
+
+/// MSB first bit packer appending to a Data.
+struct BitWriter {
+    var acc : UInt64 = 0
+    var bits = 0
+
+    /// Appends the low count bits of v (count <= 32).
+    mutating func put(_ v : UInt32, _ count : Int, _ out : inout Data) {
+        acc = (acc << UInt64(count)) | UInt64(v)
+        bits += count
+        while bits >= 8 {
+            bits -= 8
+            out.append(UInt8(truncatingIfNeeded: acc >> UInt64(bits)))
+        }
+    }
+
+    /// Pads the last byte with zeros.
+    mutating func flush(_ out : inout Data) {
+        if bits > 0 {
+            out.append(UInt8(truncatingIfNeeded: acc << UInt64(8 - bits)))
+        }
+        acc = 0
+        bits = 0
+    }
+}
+
+/// MSB first bit reader. pos is the next unread byte; leftover bits of a
+/// partially read byte are dropped when decoding moves on.
+struct BitReader {
+    let src : UnsafeRawBufferPointer
+    var pos : Int
+    var acc : UInt64 = 0
+    var bits = 0
+
+    init(src : UnsafeRawBufferPointer, pos : Int) {
+        self.src = src
+        self.pos = pos
+    }
+
+    /// Reads count bits (count <= 32). nil if the input ran out.
+    mutating func get(_ count : Int) -> UInt32? {
+        while bits < count {
+            if pos >= src.count { return nil }
+            acc = (acc << 8) | UInt64(src[pos])
+            pos += 1
+            bits += 8
+        }
+        bits -= count
+        return UInt32(truncatingIfNeeded: (acc >> UInt64(bits)) & ((1 << UInt64(count)) - 1))
+    }
+}
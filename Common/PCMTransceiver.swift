@@ -7,10 +7,10 @@
 
 import Foundation
 import Socket
-import AVFoundation
 
 /// Abstraction for socket based communication of audio data. Handles basic
 /// error correction, parses packet headers, calls appropriate callbacks. 
+/// Control and telemetry messages share the socket through `mux`.
 class PCMTransceiver {
     
     /// Called when a new PCM Audio packet comes in.
@@ -19,7 +19,15 @@ class PCMTransceiver {
     /// Called when a new connection start handshake comes in. First arg is
     /// The speaker output audio format requested by macOS, second arg is the
     /// microphone audio output format requested by macOS.
-    var handshakeCallback: ((AudioStreamBasicDescription, AudioStreamBasicDescription?) -> Void)?
+    var handshakeCallback: ((StreamFormat, StreamFormat?) -> Void)?
+    
+    /// Called when a control message comes in that the transceiver does not
+    /// handle itself (e.g. format changes).
+    var controlCallback: ((ControlMessage) -> Void)?
+    
+    /// Called in order with dataCallback with the bytes of PCM an audio
+    /// frame lost over UDP would have played, so the player can conceal it.
+    var lossCallback: ((Int) -> Void)?
     
     /// Called when socket dies.
     var terminatedCallback: (() -> Void)!
@@ -31,178 +39,649 @@ class PCMTransceiver {
     let kHeaderSig    = Data([0x69, 0x4, 0x20, 0])  // Header PCM Data Signature
     let kHandshakeSig = Data([0x69, 0x4, 0x19, 0])  // Header Handshak Signature
     let kHandMicSig   = Data([0x69, 0x4, 0x21, 0])  // Header Handshak With Mic Signature
-    var packet        = Data(capacity: 2048)        // Preallocate Packet Buffer
+    let kMessageSig   = Data([0x69, 0x4, 0x22, 0])  // Header Channel Message Signature
+    let kCreditSig    = Data([0x69, 0x4, 0x23, 0])  // Header Channel Credit Signature
+    let kCodedSig     = Data([0x69, 0x4, 0x24, 0])  // Header Coded Audio Signature
+    let kHeaderSize   = 8                           // Signature + UInt32 length
+    var packet        = Data(capacity: 8192)        // Preallocate Packet Buffer
+    
+    /// Batches consecutive PCM buffers into one frame. Set
+    /// coalescer.deadline to trade latency for less per-frame overhead.
+    let coalescer = PacketCoalescer()
+    
+    /// Raw PCM held back by the coalescer until the frame gets flushed.
+    var pcmBatch      = Data(capacity: 8192)
+    
+    /// Guards pcmBatch, the coalescer and the encoder: the coalescer's
+    /// deadline flushes on the reactor, packetReady on the audio thread.
+    let batchLock = DispatchSemaphore(value: 1)
+    
+    /// Codec negotiated for our outgoing audio. Negotiated in the handshake:
+    /// macOS picks both, iOS learns its mic codec from the handshake. Kept
+    /// for the whole session, see sendCodec.
+    var txCodec = AudioCodec.pcm
+    
+    /// Whether the current format of our outgoing audio can be coded at
+    /// all. Recomputed on every format change.
+    var txEncodable = true
+    
+    /// Codec frames actually go out with: txCodec while the format allows,
+    /// PCM otherwise.
+    var sendCodec : AudioCodec {
+        return txEncodable ? txCodec : .pcm
+    }
+    
+    /// Codec the peer should encode its audio with (the mic on macOS).
+    /// Only meaningful on the side sending the handshake. The peer falls
+    /// back to PCM itself while its format can't be coded.
+    var peerCodec = AudioCodec.pcm
+    
+    /// Interleaved channels of our outgoing audio. The codecs need it.
+    var txChannels = 1
+    var txBytesPerFrame = 2
+    
+    /// Frames of our audio handed to packetReady but dropped instead of
+    /// sent. Under batchLock.
+    var droppedAudioFrames : UInt64 = 0
+    
+    /// Builds our outgoing frames and holds the encoder state.
+    let encoder = FrameEncoder()
+    
+    /// Decoder state and the buffer coded frames get decoded into.
+    let lossless = LosslessCodec()
+    let adpcm = ADPCMCodec()
+    var decoded = Data(capacity: 8192)
+    
+    /// Logical channel our outgoing PCM frames belong to. Speaker on macOS,
+    /// mic on iOS. Sent in byte 3 of the header.
+    var audioChannel = MuxChannel.speaker
+    
+    /// Carries control and telemetry messages next to the audio stream.
+    var mux : StreamMux!
+    
+    /// Serializes socket writes from the audio thread and the reactor, and
+    /// guards the outbox.
+    let writeLock = DispatchSemaphore(value: 1)
+    
+    /// Bytes accepted for writing the socket didn't take yet, written by
+    /// the reactor once it drains. Guarded by writeLock.
+    var outbox = Data(capacity: 65536)
+    
+    /// Audio frames are dropped rather than queued once the outbox holds
+    /// this much, i.e. the peer fell more than a few hundred ms behind.
+    static let kMaxOutbox = 65536
+    var droppedFrames = 0
+    
+    /// Reactor sources watching the socket. The write source only runs
+    /// (writeArmed) while the outbox is not empty.
+    var readSource : DispatchSourceRead?
+    var writeSource : DispatchSourceWrite?
+    var writeArmed = false
+    
+    /// Assembles frames from whatever the socket hands us.
+    let parser = FrameParser()
+    var readBuf = [UInt8](repeating: 0, count: 65536)
+    
+    /// Shared notion of time with the peer, kept up to date by ping/pong
+    /// exchanges on the control channel.
+    let clock = ClockSync()
+    
+    /// Notices a silently vanished peer. See Heartbeat.
+    let heartbeat = Heartbeat()
+    
+    /// Set once the session ended, so teardown runs exactly once no matter
+    /// which thread notices first. Written under both terminateLock and
+    /// writeLock, so either is enough to read it.
+    var terminated = false
+    let terminateLock = DispatchSemaphore(value: 1)
+    
+    var isTerminated : Bool {
+        terminateLock.wait()
+        defer { terminateLock.signal() }
+        return terminated
+    }
+    
+    /// Carries the audio frames instead of the socket if set, for sessions
+    /// over Wi-Fi. Set before start.
+    var udp : UDPAudioLink?
+    
+    /// Bytes of PCM the last audio frame played. A frame lost over UDP is
+    /// taken to be as long.
+    var lastPCMBytes = 0
     
     /// Debugging.
     let TAG = "PCMTransceiver"
     
+    /// Traces of the receive path (the reactor queue) and of the send path
+    /// (packetReady's caller, an audio thread or a peer's serial queue).
+    let rxTrace = TraceRing()
+    let txTrace = TraceRing()
+    
     init(_ _sock : Socket,
          dataCallback: @escaping (UnsafeMutablePointer<Int8>, Int) -> Void,
-         handshakeCallback: ((AudioStreamBasicDescription, AudioStreamBasicDescription?) -> Void)?,
+         handshakeCallback: ((StreamFormat, StreamFormat?) -> Void)?,
          terminatedCallback: @escaping () -> Void) {
         self.dataCallback = dataCallback
         self.handshakeCallback = handshakeCallback
         self.terminatedCallback = terminatedCallback
         sock = _sock
+        mux = StreamMux(self)
+        mux.setHandler(.control) { [unowned self] data in
+            self.onControl(data)
+        }
+        // Pings bypass the queue so queueing delay doesn't skew the estimate.
+        clock.sendPing = { [unowned self] t1 in
+            try? self.mux.sendNow(ControlMessage.ping(t1: t1).encode(), on: .control)
+        }
+        heartbeat.sendBeat = { [unowned self] in
+            self.mux.send(ControlMessage.heartbeat.encode(), on: .control)
+        }
+        heartbeat.onPeerLost = { [unowned self] in
+            self.terminate()
+        }
+        coalescer.onDeadline = { [weak self] in
+            self?.flushExpired()
+        }
+    }
+    
+    deinit {
+        Trace.unregister(rxTrace)
+        Trace.unregister(txTrace)
     }
     
-    func dataToASBD(data : NSData) -> AudioStreamBasicDescription {
-        var restored = AudioStreamBasicDescription()
-        let size = MemoryLayout.size(ofValue: restored)
-        withUnsafeMutableBytes(of: &restored) {
-            let d : UnsafeMutableRawPointer = $0.baseAddress!
-            memcpy(d, data.bytes, size)
+    /// Ends the session: stops timers and reactor sources, closes the socket
+    /// and calls terminatedCallback. Safe to call from any thread, any
+    /// number of times.
+    func terminate() {
+        terminateLock.wait()
+        if terminated {
+            terminateLock.signal()
+            return
+        }
+        writeLock.wait()
+        terminated = true
+        writeLock.signal()
+        terminateLock.signal()
+        
+        heartbeat.stop()
+        clock.stop()
+        mux.stop()
+        batchLock.wait()
+        coalescer.reset()
+        batchLock.signal()
+        udp?.close()
+        shutdown(sock.socketfd, Int32(SHUT_RDWR))
+        writeLock.wait()
+        // A suspended source can't be cancelled.
+        if !writeArmed {
+            writeSource?.resume()
+        }
+        writeSource?.cancel()
+        writeArmed = true
+        outbox.removeAll()
+        writeLock.signal()
+        if readSource != nil {
+            // The fd must stay open until the reactor is done with it.
+            let sock = self.sock
+            readSource!.setCancelHandler {
+                sock.close()
+            }
+            readSource!.cancel()
+        } else {
+            sock.close()
+        }
+        Logger.log(.log, TAG, "Session ended. Dropped \(droppedFrames) audio frames, " +
+            "\(parser.resyncs) resyncs")
+        
+        // Off the reactor, the callbacks stop audio units.
+        DispatchQueue.global(qos: .userInitiated).async {
+            self.terminatedCallback()
+        }
+    }
+    
+    /// Dispatches a message received on the control channel.
+    func onControl(_ data : Data) {
+        let receivedAt = ClockSync.now()
+        guard let msg = ControlMessage.decode(data) else {
+            Logger.log(.emergency, TAG, "Dropping malformed control message")
+            return
+        }
+        switch msg {
+        case .ping(let t1):
+            let pong = ControlMessage.pong(t1: t1, t2: receivedAt, t3: ClockSync.now())
+            try? mux.sendNow(pong.encode(), on: .control)
+        case .pong(let t1, let t2, let t3):
+            clock.addExchange(t1: t1, t2: t2, t3: t3, t4: receivedAt)
+        case .heartbeat:
+            // Receiving it already counted as a sign of life.
+            break
+        default:
+            Logger.log(.log, TAG, "Received control message \(msg)")
+            controlCallback?(msg)
         }
-        return restored
+    }
+    
+    /// Queues a control message. Does not block on the socket.
+    func sendControl(_ msg : ControlMessage) {
+        mux.send(msg.encode(), on: .control)
+    }
+    
+    /// Sends a control message in order with the audio stream: any PCM held
+    /// back by the coalescer goes out first. Only call while the audio unit
+    /// feeding us is stopped, so no audio of the old format follows.
+    /// A format change of our own audio counts the frames handed to
+    /// packetReady; the ones dropped here never reach the peer and come off.
+    func sendControlNow(_ msg : ControlMessage) throws {
+        batchLock.wait()
+        defer { batchLock.signal() }
+        if coalescer.batchedBytes > 0 {
+            flushPacket()
+        }
+        var m = msg
+        // Our own audio changes format: the codecs need the new layout.
+        if case .formatChange(let stream, let applyAt, let format) = msg, stream == audioChannel {
+            txChannels = Int(format.mChannelsPerFrame)
+            txBytesPerFrame = Int(format.mBytesPerFrame)
+            txEncodable = AudioCodec.canEncode(format)
+            encoder.reset()
+            m = .formatChange(stream: stream,
+                              applyAt: applyAt - min(applyAt, droppedAudioFrames),
+                              format: format)
+        }
+        try mux.sendNow(m.encode(), on: .control)
     }
     
     /// Called when audioStreamer queries current audio configuration and
-    /// reports back the AudioStreamBasicDescription of the current stream.
+    /// reports back the StreamFormat of the current stream.
     /// i.e. the format of future PCM Audio buffers, sample rate, etc.
-    /// - Parameter absd: Serialized ASBD.
+    /// - Parameter absd: Serialized StreamFormat (or ASBD, the same bytes).
     /// - Throws: If connection to socket fails.
     func handshakePacketReady(absd : Data, useMic : Bool) throws {
         var len : UInt32 = UInt32(absd.count)
         packet.removeAll(keepingCapacity: true)
         if useMic { packet.append(kHandMicSig)   }
         else      { packet.append(kHandshakeSig) }  // append command sig
+        
+        // Low nibble of byte 3 is our codec, high nibble the peer's. Formats
+        // the codecs can't handle go out as PCM, but the negotiated codecs
+        // stay for later formats.
+        let txAF = StreamFormat(data: absd) ?? StreamFormat()
+        txChannels = Int(txAF.mChannelsPerFrame)
+        txBytesPerFrame = Int(txAF.mBytesPerFrame)
+        txEncodable = AudioCodec.canEncode(txAF)
+        packet[3] = sendCodec.rawValue | peerCodec.rawValue << 4
         packet.append(Data(bytes: &len, count: 4))  // append payload length
         packet.append(absd)                         // append payload
         Logger.log(.log, TAG, "Sending handshake \(packet[0]) \(packet[1]) \(packet[2])" +
             " \(packet[3]) \(packet[4]) \(packet[5])")
         Logger.log(.log, TAG, "Handshake size: \(packet.count). Embedded payload size: \(len)")
-        try sock.write(from: packet)
+        if !enqueueWrite(packet) {
+            throw NSError(domain: "Error_Domain", code: 101,
+                          userInfo: [NSLocalizedDescriptionKey : "Connection closed"])
+        }
     }
     
     /// Called when the AUHAL audio unit rendered a new buffer of PCM
-    /// Audio data from Virtual USBAudioDriver (i.e. system output audio)
+    /// Audio data from Virtual USBAudioDriver (i.e. system output audio).
+    /// Consecutive buffers may be batched into one frame by the coalescer.
     /// - Parameters:
     ///   - pcmPtr: Pointer to the PCM Audio buffer.
     ///   - pcmLen: Length of the PCM Audio buffer
     func packetReady(_ pcmPtr : UnsafeMutableRawPointer, _ pcmLen : Int) {
-        var len : UInt32 = UInt32(pcmLen)
+        batchLock.wait()
+        defer { batchLock.signal() }
+        if coalescer.batchedBytes == 0 {
+            pcmBatch.removeAll(keepingCapacity: true)
+        }
+        pcmBatch.append(pcmPtr.assumingMemoryBound(to: UInt8.self), count: pcmLen)
         
-        packet.removeAll(keepingCapacity: true)
-        packet.append(kHeaderSig)
-        packet.append(Data(bytes: &len, count: 4))
-        packet.append(Data(bytesNoCopy: pcmPtr, count: pcmLen,
-                           deallocator: Data.Deallocator.none))
-        Logger.log(.verbose, TAG, "Sending packet with data \(packet[0]) \(packet[1]) \(packet[2])" +
-            " \(packet[3]) \(packet[4]) \(packet[5])")
-        do {
-            try sock.write(from: packet)
-        } catch {
-            Logger.log(.emergency, TAG, "Failed to send packet")
-            sock.close()
-            terminatedCallback()
-       }
+        if coalescer.add(pcmLen) {
+            flushPacket()
+        }
+    }
+    
+    /// Called on the reactor when the batch's deadline passed before the
+    /// next buffer came.
+    func flushExpired() {
+        batchLock.wait()
+        defer { batchLock.signal() }
+        if coalescer.expired() {
+            flushPacket()
+        }
+    }
+    
+    /// Encodes and sends the currently batched PCM as one frame. Under
+    /// batchLock.
+    /// - Returns: false if the frame was dropped, see droppedAudioFrames.
+    @discardableResult
+    func flushPacket() -> Bool {
+        encoder.build(pcmBatch, codec: sendCodec, channels: txChannels,
+                      channel: audioChannel, into: &packet)
+        Trace.record(.verbose, txTrace, .frameSent, Int64(packet[2]), Int64(packet[3]), Int64(packet.count))
+        coalescer.didFlush()
+        if sendFrame(packet) {
+            return true
+        }
+        droppedAudioFrames += UInt64(pcmBatch.count / max(txBytesPerFrame, 1))
+        return false
+    }
+    
+    /// Writes a complete audio frame, over UDP if the session uses it. Never
+    /// blocks: if the peer can't keep up the frame is dropped. A failed
+    /// write ends the session.
+    /// - Returns: false if the frame won't reach the peer. A datagram that
+    ///   fails or gets lost still counts as sent: the peer conceals it with
+    ///   a frame of the same length.
+    @discardableResult
+    func sendFrame(_ frame : Data) -> Bool {
+        if udp != nil {
+            // A lost datagram is not fatal. The TCP session and the heartbeat
+            // decide whether the peer is gone.
+            do {
+                try udp!.send(frame)
+            } catch {
+                Logger.log(.verbose, TAG, "Failed to send datagram")
+            }
+            return true
+        }
+        return enqueueWrite(frame, droppable: true)
+    }
+    
+    /// Decodes the payload of a coded frame into `decoded`.
+    /// - Returns: false if the codec is unknown or the payload is malformed.
+    func decodeFrame(_ payload : UnsafeRawBufferPointer) -> Bool {
+        decoded.removeAll(keepingCapacity: true)
+        guard payload.count > 0, let codec = AudioCodec(rawValue: payload[0]) else {
+            return false
+        }
+        let body = UnsafeRawBufferPointer(rebasing: payload[1...])
+        switch codec {
+        case .lossless:
+            return lossless.decode(body, into: &decoded)
+        case .adpcm:
+            return adpcm.decode(body, into: &decoded)
+        case .pcm:
+            decoded.append(contentsOf: body)
+            return true
+        }
+    }
+    
+    /// Plays the payload of an audio frame (PCM or coded).
+    func playFrame(_ sig : Int8, _ ptr : UnsafeMutableRawBufferPointer) {
+        if sig != 0x24 {
+            playPCM(ptr)
+            return
+        }
+        if !decodeFrame(UnsafeRawBufferPointer(ptr)) {
+            Logger.log(.emergency, TAG, "Dropping undecodable audio packet")
+            return
+        }
+        if decoded.count > 0 {
+            decoded.withUnsafeMutableBytes { playPCM($0) }
+        }
+    }
+    
+    func playPCM(_ pcm : UnsafeMutableRawBufferPointer) {
+        lastPCMBytes = pcm.count
+        dataCallback(pcm.baseAddress!.assumingMemoryBound(to: Int8.self), pcm.count)
+    }
+    
+    /// Plays an audio frame that came in over UDP, header included.
+    func playDatagramFrame(_ frame : Data) {
+        var f = frame
+        if f.count < kHeaderSize || f[0] != 0x69 || f[1] != 0x4 ||
+            (f[2] != 0x20 && f[2] != 0x24) {
+            return
+        }
+        let sig = Int8(bitPattern: f[2])
+        f.withUnsafeMutableBytes { (ptr : UnsafeMutableRawBufferPointer) in
+            playFrame(sig, UnsafeMutableRawBufferPointer(rebasing: ptr[kHeaderSize...]))
+        }
+    }
+    
+    /// A frame lost over UDP couldn't be repaired. The player fills in for
+    /// it, see lossCallback.
+    func concealLoss() {
+        if lastPCMBytes > 0 {
+            lossCallback?(lastPCMBytes)
+        }
+    }
+    
+    /// Writes a single non audio frame (message, credit grant) on a channel.
+    /// - Throws: If the connection failed.
+    func writeFrame(_ sig : Data, _ ch : MuxChannel, _ payload : Data) throws {
+        var len : UInt32 = UInt32(payload.count)
+        var frame = Data(capacity: kHeaderSize + payload.count)
+        frame.append(sig)
+        frame[3] = ch.rawValue
+        frame.append(Data(bytes: &len, count: 4))
+        frame.append(payload)
+        if !enqueueWrite(frame) {
+            throw NSError(domain: "Error_Domain", code: 101,
+                          userInfo: [NSLocalizedDescriptionKey : "Connection closed"])
+        }
+    }
+    
+    /// True while the outbox has room, i.e. the peer keeps up. The mux only
+    /// writes queued messages while this holds.
+    func canWrite() -> Bool {
+        writeLock.wait()
+        defer { writeLock.signal() }
+        return outbox.count < PCMTransceiver.kMaxOutbox / 2
     }
     
-    /// Reads *exactly* n bytes from current sock into buffer.
+    /// Writes bytes without ever blocking. Whatever the socket doesn't take
+    /// right away waits in the outbox and is written by the reactor once the
+    /// socket drains. Frames are written whole or, if droppable, not at all.
     /// - Parameters:
-    ///   - buffer: Destination buffer.
-    ///   - count: Will ensure that this many bytes get read
-    func readBytes(buffer : UnsafeMutablePointer<CChar>, count : Int) throws {
-        var bytesRead = 0
-        while bytesRead != count {
-            bytesRead += try sock.read(into:
-                            buffer.advanced(by: bytesRead),
-                            bufSize: count - bytesRead,
-                            truncate: true)
-        }
-    }
-    
-    /// Error correcting recieve loop. Calls appropritae callbacks on certain
-    /// packets recevied (like audio packets, handshakes, etc).
-    func receiveLoop() throws {
-        var header: [Int8] = [Int8](repeating: 0, count: 8)
-        var pcmBuf = Data(capacity: 2048)
-        var errorCorrectedFlag = false
-        while (true) {
-            if (sock.remoteConnectionClosed) {
-                terminatedCallback()
-                return
+    ///   - data: A complete frame.
+    ///   - droppable: Audio. Dropped instead of queued once the outbox is full.
+    /// - Returns: false if the frame was dropped or the connection failed.
+    @discardableResult
+    func enqueueWrite(_ data : Data, droppable : Bool = false) -> Bool {
+        writeLock.wait()
+        if terminated {
+            writeLock.signal()
+            return false
+        }
+        if droppable && outbox.count >= PCMTransceiver.kMaxOutbox {
+            droppedFrames += 1
+            writeLock.signal()
+            return false
+        }
+        var failed = false
+        if outbox.isEmpty {
+            data.withUnsafeBytes { (b : UnsafeRawBufferPointer) in
+                let n = Reactor.write(sock.socketfd, b.baseAddress!, b.count)
+                if n < 0 && !Reactor.wouldBlock() {
+                    failed = true
+                } else if n < b.count {
+                    let w = max(n, 0)
+                    outbox.append(b.baseAddress!.assumingMemoryBound(to: UInt8.self) + w,
+                                  count: b.count - w)
+                }
             }
-            if !errorCorrectedFlag {
-                try readBytes(buffer: &header, count: 8)
+        } else {
+            outbox.append(data)
+        }
+        if !outbox.isEmpty && !writeArmed {
+            writeArmed = true
+            writeSource?.resume()
+        }
+        writeLock.signal()
+        
+        // Tear down off the audio thread, the teardown stops audio units.
+        if failed {
+            Logger.log(.emergency, TAG, "Failed to write to socket")
+            DispatchQueue.global(qos: .userInitiated).async {
+                self.terminate()
             }
-            else {
-                errorCorrectedFlag = false
-                try readBytes(buffer: &header + 2, count: 6)
+        }
+        return !failed
+    }
+    
+    /// Called by the reactor when the socket can take more of the outbox.
+    func flushOutbox() {
+        writeLock.wait()
+        // terminate() cancelled the source, it must not be suspended again.
+        if terminated {
+            writeLock.signal()
+            return
+        }
+        var failed = false
+        if !outbox.isEmpty {
+            let n = outbox.withUnsafeBytes { (b : UnsafeRawBufferPointer) in
+                Reactor.write(sock.socketfd, b.baseAddress!, b.count)
             }
-            
-            Logger.log(.verbose, TAG, "Received header \(header[0]) \(header[1]) \(header[2]) \(header[3])" +
-                " \(header[4]) \(header[5])")
-
-            let payloadSize = Int(header.withUnsafeBytes {
-                $0.load(fromByteOffset: 4, as: UInt32.self)
-            })
-            
-            Logger.log(.verbose, TAG, "Payload size \(payloadSize)")
-            
-            // we received a valid handshake packet
-            if header[0] == 0x69 &&
-                header[1] == 0x4 &&
-                (header[2] == 0x19 || header[2] == 0x21) {
-                
-                var outAF : AudioStreamBasicDescription?
-                var inAF: AudioStreamBasicDescription?
-                
-                if header[2] == 0x19 {
-                    // handshake with mic disabled
-                    var asbdBuf = Data.init(count: Int(payloadSize))
-                    try asbdBuf.withUnsafeMutableBytes({
-                        try readBytes(buffer: $0, count: payloadSize)
-                    })
-                    outAF = dataToASBD(data: asbdBuf as NSData)
-                    inAF = nil
-                }
-                else {
-                    var outAsbd = Data.init(count: Int(payloadSize / 2))
-                    var inAsbd = Data.init(count: Int(payloadSize / 2))
-                    try outAsbd.withUnsafeMutableBytes({
-                        try readBytes(buffer: $0, count: payloadSize / 2)
-                    })
-                    try inAsbd.withUnsafeMutableBytes({
-                        try readBytes(buffer: $0, count: payloadSize / 2)
-                    })
-                    outAF = dataToASBD(data: outAsbd as NSData)
-                    inAF = dataToASBD(data: inAsbd as NSData)
+            if n > 0 {
+                outbox.removeSubrange(0..<n)
+            } else if n < 0 && !Reactor.wouldBlock() {
+                failed = true
+            }
+        }
+        if outbox.isEmpty && writeArmed {
+            writeArmed = false
+            writeSource?.suspend()
+        }
+        let drained = outbox.count < PCMTransceiver.kMaxOutbox / 2
+        writeLock.signal()
+        
+        if failed {
+            terminate()
+        } else if drained {
+            mux.pump()
+        }
+    }
+    
+    /// Starts the session on the reactor and returns right away. Frames get
+    /// dispatched to the callbacks as they arrive; terminatedCallback tells
+    /// when the session ended.
+    /// - Throws: If the socket can't be made non-blocking.
+    func start() throws {
+        try sock.setBlocking(mode: false)
+        let fd = sock.socketfd
+        writeLock.wait()
+        if terminated {
+            writeLock.signal()
+            return
+        }
+        writeSource = Reactor.shared.watchWrite(fd) { [weak self] in
+            self?.flushOutbox()
+        }
+        // Whatever the handshake left in the outbox.
+        if writeArmed {
+            writeSource!.resume()
+        }
+        writeLock.signal()
+        readSource = Reactor.shared.watchRead(fd) { [weak self] in
+            self?.onReadable()
+        }
+        // Frames that came in with the hello won't make the socket readable.
+        Reactor.shared.queue.async { [weak self] in
+            guard let self = self, !self.isTerminated else { return }
+            self.parser.drain { sig, byte3, payload in
+                self.handleFrame(sig, byte3, payload)
+            }
+        }
+        mux.start()
+        clock.start()
+        heartbeat.start()
+        if let link = udp {
+            link.deliver = { [unowned self] frame in
+                self.playDatagramFrame(frame)
+            }
+            link.conceal = { [unowned self] in
+                self.concealLoss()
+            }
+            try link.start()
+        }
+    }
+    
+    /// Called by the reactor when the socket has bytes (or hit EOF). Reads
+    /// everything available and dispatches every complete frame.
+    func onReadable() {
+        while !isTerminated {
+            let n = readBuf.withUnsafeMutableBytes { (b : UnsafeMutableRawBufferPointer) -> Int in
+                let n = Reactor.read(sock.socketfd, b.baseAddress!, b.count)
+                if n > 0 {
+                    parser.append(b.baseAddress!, n)
                 }
-                Logger.log(.log, TAG, "Received handshake with audio format \(outAF) and \(inAF)")
-                Logger.log(.log, TAG, "payload size was \(payloadSize)")
-                if handshakeCallback != nil {
-                    handshakeCallback!(outAF!, inAF)
+                return n
+            }
+            if n > 0 {
+                heartbeat.heard()
+                parser.drain { sig, byte3, payload in
+                    handleFrame(sig, byte3, payload)
                 }
+                continue
+            }
+            if n < 0 && Reactor.wouldBlock() {
+                return
+            }
+            if n < 0 {
+                Logger.log(.emergency, TAG, "Receiving failed: \(errno)")
+            }
+            terminate()
+            return
+        }
+    }
+    
+    /// Handles one complete frame from the peer.
+    func handleFrame(_ sig : UInt8, _ byte3 : UInt8, _ payload : UnsafeMutableRawBufferPointer) {
+        let payloadSize = payload.count
+        Trace.record(.verbose, rxTrace, .frameReceived, Int64(sig), Int64(byte3), Int64(payloadSize))
+        
+        switch sig {
+        // we received a valid handshake packet
+        case 0x19, 0x21:
+            let size = StreamFormat.kSize
+            let body = Data(payload)
+            guard let outAF = StreamFormat(data: body),
+                  sig == 0x19 || payloadSize >= 2 * size else {
+                Logger.log(.emergency, TAG, "Dropping short handshake")
+                return
+            }
+            var inAF : StreamFormat?
+            if sig == 0x21 {
+                // handshake with mic enabled
+                inAF = StreamFormat(data: body.subdata(in: size..<2 * size))
+            }
+            Logger.log(.log, TAG, "Received handshake with audio format \(outAF) and \(inAF)")
+            Logger.log(.log, TAG, "payload size was \(payloadSize)")
+            
+            // High nibble of byte 3 is the codec macOS wants our audio in.
+            txCodec = AudioCodec(rawValue: byte3 >> 4) ?? .pcm
+            if inAF != nil {
+                txChannels = Int(inAF!.mChannelsPerFrame)
+                txBytesPerFrame = Int(inAF!.mBytesPerFrame)
+                txEncodable = AudioCodec.canEncode(inAF!)
+            }
+            Logger.log(.log, TAG, "Speaker codec \(byte3 & 0xF), sending with \(sendCodec)")
+            if handshakeCallback != nil {
+                handshakeCallback!(outAF, inAF)
+            } else {
                 Logger.log(.emergency, TAG, "ERROR HANDSHAKE CALLBACK NIL")
-           }
-            // we received a valid PCM packet signature
-            else if header[0] == 0x69 && header[1] == 0x4 && header[2] == 0x20 {
-                Logger.log(.verbose, TAG, "About to play PCM packety of size \(payloadSize)")
-                pcmBuf.removeAll(keepingCapacity: true)
-                pcmBuf.resetBytes(in: 0..<payloadSize)
-                try pcmBuf.withUnsafeMutableBytes({(ptr : UnsafeMutableRawBufferPointer) in
-                    let p = ptr.baseAddress!.assumingMemoryBound(to: Int8.self)
-                    try readBytes(buffer: p, count: payloadSize)
-                    dataCallback(p, payloadSize)
-                })
-             
-            }
-            // Error correction of wrong packet signature was detected.
-            else {
-                Logger.log(.emergency, TAG, "We've encountered misaligned communication. Attempting to "
-                 + "autocorrect communication by stalling until next header")
-                while true {
-                    try readBytes(buffer: &header, count: 1)
-                    if header[0] == 0x69 {
-                        try readBytes(buffer: &header + 1, count: 1)
-                        if header[1] == 0x4 {
-                            break
-                        }
-                    }
-                }
-                errorCorrectedFlag = true
             }
+        // we received a PCM or coded audio packet. Play it.
+        case 0x20, 0x24:
+            playFrame(Int8(bitPattern: sig), payload)
+        // we received a message on one of the multiplexed channels
+        case 0x22:
+            if let ch = MuxChannel(rawValue: byte3), !ch.isAudio,
+               payloadSize <= StreamMux.kMaxMessageSize {
+                mux.deliver(ch, Data(payload))
+            } else {
+                Logger.log(.emergency, TAG, "Dropping message on unknown channel \(byte3)")
+            }
+        // the peer granted us more credit on a channel
+        case 0x23:
+            if let ch = MuxChannel(rawValue: byte3), !ch.isAudio, payloadSize == 4 {
+                var grant : UInt32 = 0
+                memcpy(&grant, payload.baseAddress!, 4)
+                mux.addCredit(ch, Int(grant))
+            }
+        default:
+            break
         }
     }
 }
@@ -0,0 +1,118 @@
+//
+//  PacketCoalescer.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Decides when consecutive PCM buffers handed to PCMTransceiver get flushed
+/// as a single frame. Every frame costs an 8 byte header plus usbmuxd framing,
+/// so batching saves overhead at the cost of latency. A batch is flushed once
+/// the next buffer would overflow the byte budget or would make the oldest
+/// buffer in the batch wait longer than the deadline. If the next buffer
+/// doesn't come (the capture stalled or stopped), a reactor timer flushes
+/// the batch once the deadline passed.
+class PacketCoalescer {
+
+    /// Longest time (in seconds) the first buffer of a batch may be held back.
+    /// 0 disables coalescing, i.e. every buffer is sent as its own frame.
+    /// Can be changed at runtime.
+    var deadline : Double = 0
+
+    /// Largest payload (in bytes) a coalesced frame may carry.
+    var byteBudget = 4096
+
+    /// Smoothed interval between incoming buffers in ns. Used to predict
+    /// whether the next buffer would still arrive before the deadline.
+    var avgInterval : Double = 0
+
+    /// Uptime in ns of the last buffer and of the first buffer in this batch.
+    var lastArrival : UInt64 = 0
+    var batchStart  : UInt64 = 0
+
+    /// Bytes currently held in the batch.
+    var batchedBytes = 0
+
+    /// Statistics. How many buffers went out in how many frames.
+    var buffersSent = 0
+    var framesSent = 0
+
+    /// Called on the reactor once a batch is deadline old without having
+    /// been flushed. The owner takes the lock it calls add() under and
+    /// flushes if expired() still holds.
+    var onDeadline : (() -> Void)?
+    var timer : DispatchSourceTimer?
+
+    deinit {
+        timer?.cancel()
+    }
+
+    /// Records a buffer of len bytes that was just appended to the batch.
+    /// - Returns: true if the batch (including this buffer) must be flushed now.
+    func add(_ len : Int) -> Bool {
+        let now = DispatchTime.now().uptimeNanoseconds
+        if lastArrival != 0 {
+            let dt = Double(now - lastArrival)
+            avgInterval = avgInterval == 0 ? dt : avgInterval + 0.1 * (dt - avgInterval)
+        }
+        lastArrival = now
+        let first = batchedBytes == 0
+        if first {
+            batchStart = now
+        }
+        batchedBytes += len
+        buffersSent += 1
+
+        if deadline <= 0 {
+            return true
+        }
+
+        // Assume the next buffer is as big as this one and arrives after the
+        // average interval. If it would not fit, flush now rather than later.
+        if batchedBytes + len > byteBudget {
+            return true
+        }
+        let waited = Double(now - batchStart)
+        if waited + avgInterval > deadline * 1e9 {
+            return true
+        }
+        if first {
+            armTimer()
+        }
+        return false
+    }
+
+    /// Schedules onDeadline for when the batch that just started is due.
+    func armTimer() {
+        if timer == nil {
+            let t = DispatchSource.makeTimerSource(queue: Reactor.shared.queue)
+            t.setEventHandler { [weak self] in
+                self?.onDeadline?()
+            }
+            t.schedule(deadline: .now() + deadline)
+            t.resume()
+            timer = t
+        } else {
+            timer!.schedule(deadline: .now() + deadline)
+        }
+    }
+
+    /// Whether a batch is held back and its deadline passed.
+    func expired() -> Bool {
+        return batchedBytes > 0 &&
+            Double(DispatchTime.now().uptimeNanoseconds - batchStart) >= deadline * 1e9
+    }
+
+    /// Forgets the batch and stops the timer, e.g. when the stream ends.
+    func reset() {
+        batchedBytes = 0
+        timer?.cancel()
+        timer = nil
+    }
+
+    /// Called after the batch went out over the socket.
+    func didFlush() {
+        batchedBytes = 0
+        framesSent += 1
+    }
+}
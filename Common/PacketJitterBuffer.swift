@@ -0,0 +1,98 @@
+//
+//  PacketJitterBuffer.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Puts audio frames arriving over an unreliable transport back into
+/// sequence order. Frames in order are passed on right away, so it only adds
+/// latency while there is a gap. A gap is held open until depth later frames
+/// arrived (time for a reordered frame or an FEC repair to show up) and is
+/// then given up on and concealed.
+///
+/// The stream starts at the lowest sequence number among the first depth + 1
+/// frames, not at the first one to arrive: that one may well have overtaken
+/// the real first frame, which would then count as late.
+class PacketJitterBuffer {
+
+    /// Frames that may queue up behind a gap before it is declared lost.
+    var depth : Int
+
+    /// Called with every frame, in sequence order.
+    var deliver : ((Data) -> Void)?
+
+    /// Called once for every frame that was lost for good.
+    var conceal : (() -> Void)?
+
+    /// Frames waiting for a gap before them to close, by sequence number.
+    var frames = [UInt32 : Data]()
+
+    /// Sequence number of the next frame to deliver. Set once the first
+    /// reorder window arrived.
+    var next : UInt32 = 0
+    var started = false
+
+    /// Gaps larger than this are skipped instead of concealed.
+    static let kMaxGap : UInt32 = 256
+
+    /// Statistics.
+    var delivered = 0
+    var lost = 0
+    var late = 0
+
+    /// Debugging.
+    let TAG = "PacketJitterBuffer"
+
+    init(depth : Int) {
+        self.depth = depth
+    }
+
+    /// Adds a received (or repaired) frame.
+    func insert(_ seq : UInt32, _ frame : Data) {
+        if !started {
+            frames[seq] = frame
+            if frames.count <= depth {
+                return
+            }
+            // Wrap-safe: lowest relative to any one of them.
+            next = frames.keys.min { Int32(bitPattern: $0 &- seq) < Int32(bitPattern: $1 &- seq) }!
+            started = true
+            drain()
+            return
+        }
+        // Wrap-safe: anything before next was already delivered or concealed.
+        if Int32(bitPattern: seq &- next) < 0 {
+            late += 1
+            return
+        }
+        // Way ahead, e.g. the sender restarted. Don't conceal the whole gap.
+        if seq &- next > PacketJitterBuffer.kMaxGap {
+            Logger.log(.log, TAG, "Sequence jumped from \(next) to \(seq), resyncing")
+            frames.removeAll()
+            next = seq
+        }
+        frames[seq] = frame
+        drain()
+    }
+
+    /// True if seq still can be used, i.e. was neither delivered nor given up.
+    func isPending(_ seq : UInt32) -> Bool {
+        return !started || Int32(bitPattern: seq &- next) >= 0
+    }
+
+    func drain() {
+        while true {
+            if let f = frames.removeValue(forKey: next) {
+                delivered += 1
+                deliver?(f)
+            } else if frames.count > depth {
+                lost += 1
+                conceal?()
+            } else {
+                return
+            }
+            next = next &+ 1
+        }
+    }
+}
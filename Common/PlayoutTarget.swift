@@ -0,0 +1,105 @@
+//
+//  PlayoutTarget.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Decides how much audio the player keeps buffered, from how unevenly it
+/// arrives.
+///
+/// Every arrival yields a delay sample: arrival time minus the media time
+/// of the audio in it. The fastest recent sample is as early as audio gets.
+/// Anything later is jitter the buffer has to absorb, so the target is the
+/// 95th percentile of how much later samples are, plus a margin. Targets
+/// rise right away and decay slowly, so one calm second doesn't shrink the
+/// buffer just before the next burst.
+///
+/// Arrivals are best timed on the sender's clock (see ClockSync), so that
+/// the two clocks drifting apart doesn't look like growing jitter.
+class PlayoutTarget {
+
+    /// Number of recent arrivals the estimate is based on.
+    static let kWindow = 256
+
+    /// Share of arrivals the buffer is sized to absorb.
+    static let kPercentile = 0.95
+
+    /// Added to the jitter estimate, and bounds for the target (seconds).
+    static let kMargin = 0.005
+    static let kMinTarget = 0.010
+    static let kMaxTarget = 0.500
+
+    /// Fraction of the way down to a lower estimate the target moves per
+    /// update. Updates happen every kUpdateEvery arrivals.
+    static let kRelease = 0.05
+    static let kUpdateEvery = 16
+
+    /// Arrivals further apart than this (seconds of delay change) mean the
+    /// stream paused, e.g. across a session resume. Starts over.
+    static let kGap = 1.0
+
+    /// Most recent delay samples (seconds), a ring, and a copy to sort.
+    var delays = [Double](repeating: 0, count: PlayoutTarget.kWindow)
+    var sorted = [Double](repeating: 0, count: PlayoutTarget.kWindow)
+    var count = 0
+    var next = 0
+    var arrivals = 0
+
+    /// Seconds of audio that arrived so far.
+    var mediaTime = 0.0
+    var lastDelay : Double?
+
+    /// Current estimates (seconds). Written by the enqueueing thread, read
+    /// anywhere.
+    var jitter = 0.0
+    var target = PlayoutTarget.kMinTarget
+
+    /// Records that frames at rate arrived at uptime now (ns), on whichever
+    /// clock all arrivals are timed on.
+    func arrived(frames : Int, rate : Double, at now : UInt64) {
+        if rate <= 0 || frames <= 0 {
+            return
+        }
+        let delay = Double(now) / 1e9 - mediaTime
+        mediaTime += Double(frames) / rate
+        if let last = lastDelay, abs(delay - last) > PlayoutTarget.kGap {
+            restart()
+        }
+        lastDelay = delay
+
+        delays[next] = delay
+        next = (next + 1) % PlayoutTarget.kWindow
+        count = min(count + 1, PlayoutTarget.kWindow)
+        arrivals += 1
+        if arrivals % PlayoutTarget.kUpdateEvery == 0 {
+            update()
+        }
+    }
+
+    /// Forgets the delay samples, e.g. because arrivals are timed on
+    /// another clock from now on. The target decays from where it is.
+    func restart() {
+        count = 0
+        next = 0
+        lastDelay = nil
+    }
+
+    /// Recomputes jitter and moves the target towards it.
+    func update() {
+        for i in 0..<count {
+            sorted[i] = delays[i]
+        }
+        sorted[0..<count].sort()
+        let p = sorted[min(count - 1, Int(Double(count) * PlayoutTarget.kPercentile))]
+        jitter = p - sorted[0]
+
+        let wanted = min(max(jitter + PlayoutTarget.kMargin, PlayoutTarget.kMinTarget),
+                         PlayoutTarget.kMaxTarget)
+        if wanted > target {
+            target = wanted
+        } else {
+            target += (wanted - target) * PlayoutTarget.kRelease
+        }
+    }
+}
@@ -0,0 +1,110 @@
+//
+//  PulledAudioBackend.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Audio backend without audio hardware. A thread of its own pulls the
+/// speaker stream from the player in real time, a render quantum at a time,
+/// the way an audio unit would, and hands it to `sink` (or drops it). Has
+/// no mic. Used to run ClientEngine headless, e.g. to soak test streaming.
+class PulledAudioBackend : AudioBackend {
+
+    var auhalPlayer : AUHALAudioPlayer!
+    var outAudioF : StreamFormat!
+    var initted = false
+    var micFramesSent : UInt64 = 0
+    var recorderCallbackNs : Histogram? { return nil }
+
+    /// Frames rendered per pull. 480 is 10 ms at 48 kHz, about what
+    /// RemoteIO asks for with our preferred IO buffer duration.
+    var framesPerPull = 480
+
+    /// Gets every rendered buffer. Runs on the render thread.
+    var sink : ((UnsafeRawPointer, Int) -> Void)?
+
+    /// Guards the format against reconfigure while rendering.
+    let renderLock = DispatchSemaphore(value: 1)
+
+    /// Debugging.
+    var TAG : String { return "PulledAudioBackend" }
+
+    func initUnit(outFormat: StreamFormat,
+                  inFormat: StreamFormat?,
+                  _micPacketReady: ((_ ptr : UnsafeMutableRawPointer, _ len : Int) -> Void)?) throws {
+        if initted {
+            try reconfigure(outFormat: outFormat, inFormat: inFormat, whileStopped: nil)
+            return
+        }
+        if inFormat != nil {
+            Logger.log(.log, TAG, "No mic here, the peer won't get any mic audio")
+        }
+        outAudioF = outFormat
+        auhalPlayer = AUHALAudioPlayer()
+        auhalPlayer.initRing(outFormat: outFormat)
+        auhalPlayer.onFormatSwitch = { [unowned self] format in
+            do {
+                try self.reconfigure(outFormat: format, inFormat: nil, whileStopped: nil)
+            } catch {
+                Logger.log(.emergency, self.TAG, "Failed to switch speaker format")
+            }
+        }
+        initted = true
+        let thread = Thread { [unowned self] in
+            self.renderLoop()
+        }
+        thread.qualityOfService = .userInteractive
+        thread.start()
+    }
+
+    func reconfigure(outFormat: StreamFormat,
+                     inFormat: StreamFormat?,
+                     whileStopped: (() throws -> Void)?) throws {
+        renderLock.wait()
+        defer { renderLock.signal() }
+        outAudioF = outFormat
+        auhalPlayer.setFormat(outFormat)
+        try whileStopped?()
+    }
+
+    func endSession() {
+        renderLock.wait()
+        initted = false
+        renderLock.signal()
+    }
+
+    /// Renders framesPerPull frames every framesPerPull / sample rate
+    /// seconds until the session ends. Deadlines are absolute, so the pace
+    /// doesn't drift with the time rendering takes.
+    func renderLoop() {
+        var buf = [UInt8](repeating: 0, count: 65536)
+        var deadline = DispatchTime.now().uptimeNanoseconds
+        while true {
+            renderLock.wait()
+            if !initted {
+                renderLock.signal()
+                break
+            }
+            let rate = outAudioF.mSampleRate > 0 ? outAudioF.mSampleRate : 48000
+            let bytes = min(framesPerPull * Int(outAudioF.mBytesPerFrame), buf.count)
+            buf.withUnsafeMutableBytes { (b : UnsafeMutableRawBufferPointer) in
+                auhalPlayer.render(b.baseAddress!, bytes)
+                sink?(b.baseAddress!, bytes)
+            }
+            renderLock.signal()
+
+            deadline += UInt64(Double(framesPerPull) / rate * 1e9)
+            let now = DispatchTime.now().uptimeNanoseconds
+            if deadline > now {
+                usleep(UInt32((deadline - now) / 1000))
+            } else {
+                // Fell behind (e.g. the machine was suspended). Don't try
+                // to catch up in a burst.
+                deadline = now
+            }
+        }
+        Logger.log(.log, TAG, "Rendered \(auhalPlayer.bytesRendered) bytes, " +
+            "\(auhalPlayer.underruns) underruns")
+    }
+}
@@ -0,0 +1,90 @@
+//
+//  Reactor.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// The event loop sockets and timers run on. Dispatch sources are backed by
+/// kqueue (epoll on Linux), so one serial queue can wait on the usbmuxd
+/// socket, every device socket and every timer at once, instead of a
+/// blocking thread per socket and sleep based polling.
+///
+/// Handlers run on `queue` and must never block. Sockets watched here have
+/// to be non-blocking (Socket.setBlocking(mode: false)).
+class Reactor {
+
+    static let shared = Reactor()
+
+    let queue = DispatchQueue(label: "Reactor", qos: .userInitiated)
+
+    /// Calls handler whenever fd has bytes to read, or hit EOF.
+    /// Cancel the returned source to stop watching.
+    func watchRead(_ fd : Int32, _ handler : @escaping () -> Void) -> DispatchSourceRead {
+        let src = DispatchSource.makeReadSource(fileDescriptor: fd, queue: queue)
+        src.setEventHandler(handler: handler)
+        src.resume()
+        return src
+    }
+
+    /// Calls handler whenever fd can take more bytes. Returned suspended,
+    /// resume it while there is something to write.
+    func watchWrite(_ fd : Int32, _ handler : @escaping () -> Void) -> DispatchSourceWrite {
+        let src = DispatchSource.makeWriteSource(fileDescriptor: fd, queue: queue)
+        src.setEventHandler(handler: handler)
+        return src
+    }
+
+    /// Calls handler every interval seconds, the first time right away.
+    func every(_ interval : Double, _ handler : @escaping () -> Void) -> DispatchSourceTimer {
+        let timer = DispatchSource.makeTimerSource(queue: queue)
+        timer.schedule(deadline: .now(), repeating: interval)
+        timer.setEventHandler(handler: handler)
+        timer.resume()
+        return timer
+    }
+
+    /// Calls handler once after the given number of seconds.
+    func after(_ seconds : Double, _ handler : @escaping () -> Void) {
+        queue.asyncAfter(deadline: .now() + seconds, execute: handler)
+    }
+
+    /// read(2) on a non-blocking fd. Returns 0 on EOF, -1 with errno set on
+    /// errors, see wouldBlock.
+    static func read(_ fd : Int32, _ buf : UnsafeMutableRawPointer, _ count : Int) -> Int {
+        while true {
+            #if canImport(Darwin)
+            let n = Darwin.read(fd, buf, count)
+            #else
+            let n = Glibc.read(fd, buf, count)
+            #endif
+            if n >= 0 || errno != EINTR {
+                return n
+            }
+        }
+    }
+
+    /// write(2) on a non-blocking socket. Returns the bytes written, -1
+    /// with errno set on errors, see wouldBlock. A peer that reset the
+    /// connection fails the write with EPIPE instead of killing us with
+    /// SIGPIPE: BlueSocket sets SO_NOSIGPIPE on its sockets on Darwin,
+    /// Linux only has the per call MSG_NOSIGNAL.
+    static func write(_ fd : Int32, _ buf : UnsafeRawPointer, _ count : Int) -> Int {
+        while true {
+            #if canImport(Darwin)
+            let n = Darwin.write(fd, buf, count)
+            #else
+            let n = Glibc.send(fd, buf, count, Int32(MSG_NOSIGNAL))
+            #endif
+            if n >= 0 || errno != EINTR {
+                return n
+            }
+        }
+    }
+
+    /// True if the last read or write failed only because the fd had
+    /// nothing to give (or no room) right now.
+    static func wouldBlock() -> Bool {
+        return errno == EAGAIN || errno == EWOULDBLOCK
+    }
+}
@@ -0,0 +1,246 @@
+//
+//  SPSCRing.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+import Atomics
+
+/// Wait-free byte ring for exactly one producer thread and one consumer
+/// thread, e.g. the socket thread enqueueing audio and the render thread
+/// playing it. Neither side ever blocks or takes a lock, so the render
+/// thread can't wait on a thread of lower priority.
+///
+/// Capacity is a power of two. The cursors count bytes ever written and
+/// read, and are masked to index storage, so full and empty are never
+/// ambiguous. Only the producer stores the write cursor and only the
+/// consumer stores the read cursor. Each side publishes its cursor with a
+/// releasing store and loads the other side's with an acquiring load, so
+/// the bytes between them are always complete. Its own cursor a side loads
+/// relaxed.
+///
+/// Storage is mapped twice, back to back (vm_remap on Apple platforms, a
+/// shared memory file mapped twice on Linux), so the bytes from any offset
+/// on are contiguous for a whole capacity: copies in and out never wrap,
+/// and the consumer can read in place (readPointer). If the mapping can't
+/// be set up it falls back to a plain allocation and wrapping copies.
+final class SPSCRing {
+
+    /// Bytes the ring holds. A power of two and a multiple of the page size.
+    let capacity : Int
+    let mask : Int
+
+    let storage : UnsafeMutableRawPointer
+
+    /// Whether storage + capacity maps the same memory as storage.
+    let mirrored : Bool
+
+    /// Write cursor at index 0, read cursor a cache line further, so the
+    /// two threads don't bounce one line between them.
+    let cursors : UnsafeMutablePointer<UnsafeAtomic<Int>.Storage>
+    static let kReadCursor = 16
+    let writeCursor : UnsafeAtomic<Int>
+    let readCursor : UnsafeAtomic<Int>
+
+    /// Rounds minimumCapacity up to a power of two of at least a page.
+    init(minimumCapacity : Int) {
+        #if canImport(Darwin)
+        var cap = Int(vm_page_size)
+        #else
+        var cap = Int(getpagesize())
+        #endif
+        while cap < minimumCapacity {
+            cap <<= 1
+        }
+        capacity = cap
+        mask = cap - 1
+        if let mirror = SPSCRing.mapMirrored(cap) {
+            storage = mirror
+            mirrored = true
+        } else {
+            storage = UnsafeMutableRawPointer.allocate(byteCount: cap, alignment: 64)
+            storage.initializeMemory(as: UInt8.self, repeating: 0, count: cap)
+            mirrored = false
+        }
+        cursors = UnsafeMutablePointer<UnsafeAtomic<Int>.Storage>.allocate(capacity: SPSCRing.kReadCursor + 1)
+        cursors.initialize(to: UnsafeAtomic<Int>.Storage(0))
+        (cursors + SPSCRing.kReadCursor).initialize(to: UnsafeAtomic<Int>.Storage(0))
+        writeCursor = UnsafeAtomic(at: cursors)
+        readCursor = UnsafeAtomic(at: cursors + SPSCRing.kReadCursor)
+    }
+
+    deinit {
+        if mirrored {
+            #if canImport(Darwin)
+            vm_deallocate(mach_task_self_, vm_address_t(UInt(bitPattern: storage)), vm_size_t(2 * capacity))
+            #else
+            munmap(storage, 2 * capacity)
+            #endif
+        } else {
+            storage.deallocate()
+        }
+        cursors.deallocate()
+    }
+
+    #if canImport(Darwin)
+    /// Reserves 2 * size bytes and maps the second half onto the first.
+    /// Another thread may grab the second half between freeing and
+    /// remapping it, so that is retried a few times.
+    static func mapMirrored(_ size : Int) -> UnsafeMutableRawPointer? {
+        let task = mach_task_self_
+        for _ in 0..<3 {
+            var base : vm_address_t = 0
+            if vm_allocate(task, &base, vm_size_t(2 * size), VM_FLAGS_ANYWHERE) != KERN_SUCCESS {
+                return nil
+            }
+            if vm_deallocate(task, base + vm_address_t(size), vm_size_t(size)) != KERN_SUCCESS {
+                vm_deallocate(task, base, vm_size_t(2 * size))
+                return nil
+            }
+            // Flags 0 is VM_FLAGS_FIXED, inheritance 1 VM_INHERIT_COPY (the
+            // default), neither of which Swift imports.
+            var mirror = base + vm_address_t(size)
+            var cur : vm_prot_t = 0
+            var max : vm_prot_t = 0
+            let kr = vm_remap(task, &mirror, vm_size_t(size), 0, 0, task, base, 0,
+                              &cur, &max, 1)
+            if kr == KERN_SUCCESS && mirror == base + vm_address_t(size) {
+                return UnsafeMutableRawPointer(bitPattern: UInt(base))
+            }
+            if kr == KERN_SUCCESS {
+                vm_deallocate(task, mirror, vm_size_t(size))
+            }
+            vm_deallocate(task, base, vm_size_t(size))
+        }
+        return nil
+    }
+    #else
+    /// Reserves 2 * size bytes and maps an unlinked shared memory file into
+    /// both halves. Reserving first means nothing else can land in between.
+    static func mapMirrored(_ size : Int) -> UnsafeMutableRawPointer? {
+        var path = Array("/dev/shm/SPSCRing-XXXXXX".utf8CString)
+        let fd = path.withUnsafeMutableBufferPointer { mkstemp($0.baseAddress!) }
+        if fd < 0 {
+            return nil
+        }
+        unlink(path)
+        // The mappings keep the memory alive.
+        defer { close(fd) }
+        if ftruncate(fd, off_t(size)) != 0 {
+            return nil
+        }
+        let failed = UnsafeMutableRawPointer(bitPattern: -1)
+        guard let base = mmap(nil, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0),
+              base != failed else {
+            return nil
+        }
+        for half in [base, base + size] {
+            if mmap(half, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != half {
+                munmap(base, 2 * size)
+                return nil
+            }
+        }
+        return base
+    }
+    #endif
+
+    /// Where the next byte to read is. Valid for availableToRead bytes if
+    /// mirrored, else up to the end of storage. Consumer side.
+    var readPointer : UnsafeRawPointer {
+        return UnsafeRawPointer(storage.advanced(by: readCursor.load(ordering: .relaxed) & mask))
+    }
+
+    /// Bytes ready to read. Consumer side.
+    var availableToRead : Int {
+        return writeCursor.load(ordering: .acquiring) - readCursor.load(ordering: .relaxed)
+    }
+
+    /// Bytes that fit. Producer side.
+    var availableToWrite : Int {
+        let r = readCursor.load(ordering: .acquiring)
+        return capacity - (writeCursor.load(ordering: .relaxed) - r)
+    }
+
+    /// Copies up to len bytes in. Returns how many fit. Producer side.
+    @discardableResult
+    func write(_ src : UnsafeRawPointer, _ len : Int) -> Int {
+        let w = writeCursor.load(ordering: .relaxed)
+        let n = min(len, availableToWrite)
+        if n <= 0 {
+            return 0
+        }
+        let at = w & mask
+        let first = mirrored ? n : min(n, capacity - at)
+        memcpy(storage.advanced(by: at), src, first)
+        if n > first {
+            memcpy(storage, src.advanced(by: first), n - first)
+        }
+        writeCursor.store(w + n, ordering: .releasing)
+        return n
+    }
+
+    /// Copies up to len bytes out. Returns how many were there. Consumer
+    /// side.
+    @discardableResult
+    func read(into dst : UnsafeMutableRawPointer, _ len : Int) -> Int {
+        let n = peek(into: dst, len)
+        if n <= 0 {
+            return 0
+        }
+        advanceRead(n)
+        return n
+    }
+
+    /// Copies up to len bytes out but leaves them in the ring. Consumer
+    /// side.
+    @discardableResult
+    func peek(into dst : UnsafeMutableRawPointer, _ len : Int) -> Int {
+        let n = min(len, availableToRead)
+        if n <= 0 {
+            return 0
+        }
+        let at = readCursor.load(ordering: .relaxed) & mask
+        let first = mirrored ? n : min(n, capacity - at)
+        memcpy(dst, storage.advanced(by: at), first)
+        if n > first {
+            memcpy(dst.advanced(by: first), storage, n - first)
+        }
+        return n
+    }
+
+    /// Drops up to len bytes without reading them. Consumer side.
+    @discardableResult
+    func skip(_ len : Int) -> Int {
+        let n = min(len, availableToRead)
+        if n <= 0 {
+            return 0
+        }
+        advanceRead(n)
+        return n
+    }
+
+    /// Hands n bytes back to the producer, once they were copied out.
+    func advanceRead(_ n : Int) {
+        readCursor.store(readCursor.load(ordering: .relaxed) + n, ordering: .releasing)
+    }
+
+    /// Moves everything buffered into ring, as much as fits. Consumer side
+    /// of this ring, producer side of ring.
+    func drain(into ring : SPSCRing) {
+        while availableToRead > 0 {
+            let at = readCursor.load(ordering: .relaxed) & mask
+            let chunk = mirrored ? availableToRead : min(availableToRead, capacity - at)
+            let n = ring.write(readPointer, chunk)
+            skip(n)
+            if n < chunk {
+                break
+            }
+        }
+    }
+
+    /// Drops everything buffered. Consumer side, or while the consumer
+    /// isn't running.
+    func reset() {
+        skip(availableToRead)
+    }
+}
@@ -0,0 +1,92 @@
+//
+//  SessionResume.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+import Socket
+
+/// Lets a session survive a short disconnect (cable wiggle, Wi-Fi hiccup)
+/// without a new handshake. When the socket dies both sides keep their
+/// audio units and rings for kGraceSeconds. If the device reconnects in
+/// time, it asks to resume in its hello and both sides carry on with a new
+/// socket from the next frame.
+///
+/// Each side also tells the other how many frames of its stream it played
+/// so far. Frames in flight when the socket died are lost, and format
+/// changes are announced in frame counts, so the sender re-bases its count
+/// on what actually arrived.
+///
+/// Hellos:
+///     server: "Hello from computer session=<id>"          new session
+///             "Hello from computer session=<id> resumed=<mic frames>"
+///     device: "Hello from iPad codecs=<mask> resume=<id>:<speaker frames>"
+/// Over Wi-Fi both also append " udp=<port>", see UDPAudioLink.
+/// Each hello ends in a newline: the server writes the handshake right
+/// behind its hello, so one read may return both.
+enum SessionResume {
+
+    /// Seconds a dead session can be resumed.
+    static let kGraceSeconds = 5.0
+
+    /// A new, random session ID. Never 0.
+    static func newId() -> UInt32 {
+        return UInt32.random(in: 1...UInt32.max)
+    }
+
+    /// A hello longer than this is garbage.
+    static let kMaxHello = 1024
+
+    /// Terminates a hello for the wire.
+    static func framed(_ hello : String) -> Data {
+        return (hello + "\n").data(using: .utf8)!
+    }
+
+    /// Reads one hello off a blocking socket.
+    /// - Returns: The hello without its newline, and the bytes that came
+    ///   in behind it (the start of the first frames).
+    /// - Throws: On a read error, timeout, EOF or an overlong hello.
+    static func readHello(_ sock : Socket) throws -> (hello : String, rest : Data) {
+        var data = Data()
+        while true {
+            if let end = data.firstIndex(of: 0x0a) {
+                return (String(decoding: data[..<end], as: UTF8.self),
+                        Data(data[(end + 1)...]))
+            }
+            if data.count > kMaxHello {
+                throw NSError(domain: "Error_Domain", code: 103,
+                              userInfo: [NSLocalizedDescriptionKey : "Hello from peer too long"])
+            }
+            if try sock.read(into: &data) == 0 {
+                throw NSError(domain: "Error_Domain", code: 103,
+                              userInfo: [NSLocalizedDescriptionKey : "No hello from peer"])
+            }
+        }
+    }
+
+    /// Value of "key=" in a hello, up to the next space.
+    static func value(_ key : String, in hello : String) -> Substring? {
+        guard let r = hello.range(of: " \(key)=") else { return nil }
+        return hello[r.upperBound...].prefix(while: { $0 != " " })
+    }
+
+    /// The device's resume request: session ID and speaker frames played.
+    static func request(fromHello hello : String) -> (id : UInt32, frames : UInt64)? {
+        guard let v = value("resume", in: hello) else { return nil }
+        let parts = v.split(separator: ":")
+        guard parts.count == 2, let id = UInt32(parts[0]), let frames = UInt64(parts[1]) else {
+            return nil
+        }
+        return (id, frames)
+    }
+
+    /// The session ID the server assigned.
+    static func session(fromHello hello : String) -> UInt32? {
+        return value("session", in: hello).flatMap { UInt32($0) }
+    }
+
+    /// Mic frames the server played, if it resumed our session.
+    static func resumed(fromHello hello : String) -> UInt64? {
+        return value("resumed", in: hello).flatMap { UInt64($0) }
+    }
+}
@@ -0,0 +1,111 @@
+//
+//  StreamFormat.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+#if canImport(AVFoundation)
+import AVFoundation
+#endif
+
+/// Format of an audio stream, as the streaming code sees it. Fields, layout
+/// and constants are those of CoreAudio's AudioStreamBasicDescription, so
+/// it goes over the wire as the same 40 bytes and converts to and from one
+/// for free at the audio unit. Only the audio unit code (and everything
+/// that doesn't build without the audio frameworks) deals in ASBDs.
+struct StreamFormat : Equatable {
+    var mSampleRate : Double = 0
+    var mFormatID : UInt32 = 0
+    var mFormatFlags : UInt32 = 0
+    var mBytesPerPacket : UInt32 = 0
+    var mFramesPerPacket : UInt32 = 0
+    var mBytesPerFrame : UInt32 = 0
+    var mChannelsPerFrame : UInt32 = 0
+    var mBitsPerChannel : UInt32 = 0
+    var mReserved : UInt32 = 0
+
+    /// kAudioFormatLinearPCM.
+    static let kLinearPCM : UInt32 = 0x6C70636D    // 'lpcm'
+
+    /// kAudioFormatFlag* values used by the streaming code.
+    static let kFlagIsFloat : UInt32 = 1 << 0
+    static let kFlagIsSignedInteger : UInt32 = 1 << 2
+    static let kFlagIsPacked : UInt32 = 1 << 3
+    static let kFlagIsNonInterleaved : UInt32 = 1 << 5
+
+    /// Size on the wire, the same as an ASBD's.
+    static let kSize = 40
+
+    init() {}
+
+    /// Interleaved, packed, signed 16 bit integer PCM, the format the
+    /// server's virtual devices run in.
+    static func pcm16(sampleRate : Double, channels : Int) -> StreamFormat {
+        var f = StreamFormat()
+        f.mSampleRate = sampleRate
+        f.mFormatID = kLinearPCM
+        f.mFormatFlags = kFlagIsSignedInteger | kFlagIsPacked
+        f.mBytesPerFrame = UInt32(2 * channels)
+        f.mBytesPerPacket = f.mBytesPerFrame
+        f.mFramesPerPacket = 1
+        f.mChannelsPerFrame = UInt32(channels)
+        f.mBitsPerChannel = 16
+        return f
+    }
+
+    /// Reads the format at the start of data, as sent in a handshake or a
+    /// control message.
+    /// - Returns: nil if data is too short.
+    init?(data : Data) {
+        if data.count < StreamFormat.kSize {
+            return nil
+        }
+        var r = ControlMessage.Reader(data: data)
+        guard let f : StreamFormat = r.read() else { return nil }
+        self = f
+    }
+
+    /// The wire representation.
+    var data : Data {
+        var d = Data(capacity: StreamFormat.kSize)
+        ControlMessage.append(&d, self)
+        return d
+    }
+
+    /// Whether the stream is interleaved signed 16 bit integer PCM, the only
+    /// kind the stretcher, concealer and channel mapper handle.
+    var isInterleavedInt16 : Bool {
+        return mFormatID == StreamFormat.kLinearPCM &&
+            mFormatFlags & StreamFormat.kFlagIsSignedInteger != 0 &&
+            mFormatFlags & StreamFormat.kFlagIsNonInterleaved == 0 &&
+            mBitsPerChannel == 16 &&
+            mBytesPerFrame == 2 * mChannelsPerFrame
+    }
+
+    #if canImport(AVFoundation)
+    init(_ asbd : AudioStreamBasicDescription) {
+        mSampleRate = asbd.mSampleRate
+        mFormatID = asbd.mFormatID
+        mFormatFlags = asbd.mFormatFlags
+        mBytesPerPacket = asbd.mBytesPerPacket
+        mFramesPerPacket = asbd.mFramesPerPacket
+        mBytesPerFrame = asbd.mBytesPerFrame
+        mChannelsPerFrame = asbd.mChannelsPerFrame
+        mBitsPerChannel = asbd.mBitsPerChannel
+        mReserved = asbd.mReserved
+    }
+
+    /// The format for audio unit properties.
+    var asbd : AudioStreamBasicDescription {
+        return AudioStreamBasicDescription(mSampleRate: mSampleRate,
+                                           mFormatID: mFormatID,
+                                           mFormatFlags: mFormatFlags,
+                                           mBytesPerPacket: mBytesPerPacket,
+                                           mFramesPerPacket: mFramesPerPacket,
+                                           mBytesPerFrame: mBytesPerFrame,
+                                           mChannelsPerFrame: mChannelsPerFrame,
+                                           mBitsPerChannel: mBitsPerChannel,
+                                           mReserved: mReserved)
+    }
+    #endif
+}
@@ -0,0 +1,198 @@
+//
+//  StreamMux.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Logical streams carried over the single usbmuxd socket. The raw value is
+/// sent in byte 3 of every frame header.
+enum MuxChannel : UInt8, CaseIterable {
+    case speaker   = 0      // PCM audio, macOS -> iOS.
+    case mic       = 1      // PCM audio, iOS -> macOS.
+    case control   = 2      // Session control messages.
+    case telemetry = 3      // Statistics, best effort.
+
+    /// Lower is more urgent. Audio channels never wait in a queue at all.
+    var priority : Int {
+        switch self {
+        case .speaker, .mic: return 0
+        case .control:       return 1
+        case .telemetry:     return 2
+        }
+    }
+
+    var isAudio : Bool { return priority == 0 }
+}
+
+/// Multiplexes message based logical channels (control, telemetry) over the
+/// transceiver's socket, next to the audio stream.
+///
+/// Audio is written straight from the audio thread by PCMTransceiver and is
+/// never queued here. Messages on the other channels are queued per channel and
+/// pumped into the transceiver's outbox on the reactor, one message at a time
+/// and in priority order, and only while the outbox has room, so messages never
+/// pile up in front of audio. Each channel is flow controlled by credits: the
+/// sender may only have as many bytes in flight as the receiver granted, and the
+/// receiver hands out new credit as its handlers consume messages.
+class StreamMux {
+
+    /// Largest payload a single message may carry.
+    static let kMaxMessageSize = 1024
+
+    /// Credit (bytes) both sides grant each other per channel up front.
+    static let kInitialCredit = 16384
+
+    /// Bytes the telemetry queue may hold before the oldest messages are
+    /// dropped. Control messages are never dropped.
+    static let kMaxQueuedBytes = 65536
+
+    /// The transceiver owning the socket. Does the actual framing and writing.
+    unowned let trans : PCMTransceiver
+
+    /// Per channel send queues and their size in bytes.
+    var queues = [MuxChannel : [Data]]()
+    var queuedBytes = [MuxChannel : Int]()
+
+    /// Bytes we may still send per channel before the peer grants more.
+    var credits = [MuxChannel : Int]()
+
+    /// Bytes consumed per channel since we last granted credit to the peer.
+    var consumed = [MuxChannel : Int]()
+
+    /// Called on the reactor when a message arrives on a channel.
+    var handlers = [MuxChannel : (Data) -> Void]()
+
+    /// Mutex guarding queues and credits.
+    let semaphore = DispatchSemaphore(value: 1)
+
+    /// Whether queued messages get written.
+    var running = false
+
+    /// Debugging.
+    let TAG = "StreamMux"
+
+    init(_ trans : PCMTransceiver) {
+        self.trans = trans
+        for ch in MuxChannel.allCases where !ch.isAudio {
+            queues[ch] = []
+            queuedBytes[ch] = 0
+            credits[ch] = StreamMux.kInitialCredit
+            consumed[ch] = 0
+        }
+    }
+
+    /// Registers the callback for messages arriving on a channel.
+    func setHandler(_ ch : MuxChannel, _ handler : @escaping (Data) -> Void) {
+        handlers[ch] = handler
+    }
+
+    /// Starts writing queued messages. Called when the transceiver starts.
+    func start() {
+        if running { return }
+        running = true
+        pumpSoon()
+    }
+
+    /// Stops writing. Queued messages are discarded.
+    func stop() {
+        running = false
+    }
+
+    /// Queues a message on a non-audio channel. Thread safe, never blocks
+    /// on the socket.
+    /// - Returns: false if the message was rejected.
+    @discardableResult
+    func send(_ msg : Data, on ch : MuxChannel) -> Bool {
+        if ch.isAudio || msg.count > StreamMux.kMaxMessageSize {
+            Logger.log(.emergency, TAG, "Refusing message of size \(msg.count) on \(ch)")
+            return false
+        }
+        semaphore.wait()
+        queues[ch]!.append(msg)
+        queuedBytes[ch]! += msg.count
+
+        // Telemetry is best effort. Drop the oldest if the peer can't keep up.
+        if ch == .telemetry {
+            while queuedBytes[ch]! > StreamMux.kMaxQueuedBytes {
+                queuedBytes[ch]! -= queues[ch]!.removeFirst().count
+            }
+        }
+        semaphore.signal()
+        pumpSoon()
+        return true
+    }
+
+    /// Writes a message right away instead of queueing it, so it is ordered
+    /// with respect to audio frames written before and after it. Only meant
+    /// for rare messages like format changes. May overdraw the peer's credit.
+    /// - Throws: If writing to the socket fails.
+    func sendNow(_ msg : Data, on ch : MuxChannel) throws {
+        semaphore.wait()
+        credits[ch]! -= msg.count
+        semaphore.signal()
+        try trans.writeFrame(trans.kMessageSig, ch, msg)
+    }
+
+    /// Pops the most urgent message the peer has credit for.
+    func nextMessage() -> (MuxChannel, Data)? {
+        semaphore.wait()
+        defer { semaphore.signal() }
+        for ch in MuxChannel.allCases.sorted(by: { $0.priority < $1.priority })
+            where !ch.isAudio {
+            if let msg = queues[ch]!.first, credits[ch]! >= msg.count {
+                queues[ch]!.removeFirst()
+                queuedBytes[ch]! -= msg.count
+                credits[ch]! -= msg.count
+                return (ch, msg)
+            }
+        }
+        return nil
+    }
+
+    /// Schedules a pump on the reactor.
+    func pumpSoon() {
+        Reactor.shared.queue.async { [weak self] in
+            self?.pump()
+        }
+    }
+
+    /// Moves queued messages into the transceiver's outbox while it has room.
+    /// Runs on the reactor; called again once the outbox drains or credit
+    /// arrives.
+    func pump() {
+        while running && trans.canWrite(), let (ch, msg) = nextMessage() {
+            do {
+                try trans.writeFrame(trans.kMessageSig, ch, msg)
+            } catch {
+                Logger.log(.emergency, TAG, "Failed to send message on \(ch)")
+                running = false
+            }
+        }
+    }
+
+    /// Called on the reactor for every message frame.
+    func deliver(_ ch : MuxChannel, _ msg : Data) {
+        handlers[ch]?(msg)
+
+        // Hand back credit once half the window has been consumed.
+        consumed[ch]! += msg.count
+        if consumed[ch]! >= StreamMux.kInitialCredit / 2 {
+            var grant = UInt32(consumed[ch]!)
+            consumed[ch] = 0
+            do {
+                try trans.writeFrame(trans.kCreditSig, ch, Data(bytes: &grant, count: 4))
+            } catch {
+                Logger.log(.emergency, TAG, "Failed to grant credit on \(ch)")
+            }
+        }
+    }
+
+    /// Called on the reactor when the peer grants credit on a channel.
+    func addCredit(_ ch : MuxChannel, _ bytes : Int) {
+        semaphore.wait()
+        credits[ch]! += bytes
+        semaphore.signal()
+        pump()
+    }
+}
@@ -0,0 +1,195 @@
+//
+//  Telemetry.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Histogram with logarithmic buckets, HDR style: values below 32 get a
+/// bucket each, above that every power of two is split into 16 buckets, so
+/// any value is known to within about 6%. Covers 0 to 2^40.
+///
+/// Recording is a couple of instructions and a store into preallocated
+/// counts, so audio threads can record. There is one writer; readers take
+/// deltas against their own copy of the counts, so nothing is ever reset.
+final class Histogram {
+
+    static let kSubBits = 5
+    static let kSubCount = 1 << kSubBits
+    static let kHalf = kSubCount / 2
+    static let kMaxShift = 40 - kSubBits
+    static let kBuckets = kSubCount + kMaxShift * kHalf
+
+    let counts : UnsafeMutablePointer<UInt32>
+
+    init() {
+        counts = UnsafeMutablePointer<UInt32>.allocate(capacity: Histogram.kBuckets)
+        counts.initialize(repeating: 0, count: Histogram.kBuckets)
+    }
+
+    deinit {
+        counts.deallocate()
+    }
+
+    @inline(__always)
+    static func bucket(_ v : UInt64) -> Int {
+        if v < UInt64(kSubCount) {
+            return Int(v)
+        }
+        let shift = min(63 - v.leadingZeroBitCount - (kSubBits - 1), kMaxShift)
+        let sub = min(Int(truncatingIfNeeded: v >> UInt64(shift)), kSubCount - 1)
+        return kSubCount + (shift - 1) * kHalf + (sub - kHalf)
+    }
+
+    /// Smallest value that falls into bucket i.
+    static func lowerBound(_ i : Int) -> UInt64 {
+        if i < kSubCount {
+            return UInt64(i)
+        }
+        let shift = (i - kSubCount) / kHalf + 1
+        let sub = (i - kSubCount) % kHalf + kHalf
+        return UInt64(sub) << UInt64(shift)
+    }
+
+    @inline(__always)
+    func record(_ v : UInt64) {
+        counts[Histogram.bucket(v)] &+= 1
+    }
+
+    /// Buckets that changed since last, as (bucket, count) pairs. Updates
+    /// last, which must hold kBuckets counts.
+    func delta(since last : inout [UInt32]) -> [(UInt16, UInt32)] {
+        var d = [(UInt16, UInt32)]()
+        for i in 0..<Histogram.kBuckets {
+            let c = counts[i]
+            if c != last[i] {
+                d.append((UInt16(i), c &- last[i]))
+                last[i] = c
+            }
+        }
+        return d
+    }
+
+    /// Value at percentile p (0...1) of sparse buckets, or 0 if empty.
+    static func percentile(_ buckets : [(UInt16, UInt32)], _ p : Double) -> UInt64 {
+        let total = buckets.reduce(0) { $0 + UInt64($1.1) }
+        if total == 0 {
+            return 0
+        }
+        let rank = UInt64((Double(total) * p).rounded(.up))
+        var seen : UInt64 = 0
+        for (i, c) in buckets.sorted(by: { $0.0 < $1.0 }) {
+            seen += UInt64(c)
+            if seen >= max(rank, 1) {
+                return lowerBound(Int(i))
+            }
+        }
+        return lowerBound(Int(buckets.map { $0.0 }.max()!))
+    }
+}
+
+/// What the device's audio callbacks measured over the last report period,
+/// sent on MuxChannel.telemetry every second.
+struct Telemetry {
+
+    /// Histograms, by what they measure.
+    enum Kind : UInt8 {
+        case playerCallbackNs   = 1     // Time spent in the player's render.
+        case playerOccupancyUs  = 2     // Audio buffered when render started.
+        case playerRequestFrames = 3    // Frames the unit asked for.
+        case recorderCallbackNs = 4     // Time spent in the recorder's callback.
+    }
+
+    /// Renders that ran dry, jumps to the target, periods dropped and
+    /// repeated by the stretcher, and gaps concealed.
+    var underruns : UInt32 = 0
+    var resyncs : UInt32 = 0
+    var accelerated : UInt32 = 0
+    var expanded : UInt32 = 0
+    var concealed : UInt32 = 0
+
+    var histograms = [Kind : [(UInt16, UInt32)]]()
+
+    /// Most buckets sent per histogram, so a report fits a mux message.
+    static let kMaxBuckets = 36
+
+    /// Merges buckets until at most kMaxBuckets are left: buckets whose
+    /// indices only differ in the low k bits, for the smallest k that does
+    /// it, are counted as the highest of them. So counts never move to a
+    /// lower value and percentiles only err high, by at most 2^k buckets,
+    /// however sparse the buckets are.
+    static func coarsen(_ buckets : [(UInt16, UInt32)]) -> [(UInt16, UInt32)] {
+        let sorted = buckets.sorted(by: { $0.0 < $1.0 })
+        var shift : UInt16 = 0
+        while true {
+            var merged = [(UInt16, UInt32)]()
+            for (i, c) in sorted {
+                if let last = merged.last, last.0 >> shift == i >> shift {
+                    merged[merged.count - 1] = (i, last.1 &+ c)
+                } else {
+                    merged.append((i, c))
+                }
+            }
+            if merged.count <= kMaxBuckets {
+                return merged
+            }
+            shift += 1
+        }
+    }
+
+    func encode() -> Data {
+        var d = Data(capacity: 512)
+        for v in [underruns, resyncs, accelerated, expanded, concealed] {
+            ControlMessage.append(&d, v)
+        }
+        d.append(UInt8(histograms.count))
+        for (kind, buckets) in histograms {
+            d.append(kind.rawValue)
+            ControlMessage.append(&d, UInt16(buckets.count))
+            for (i, c) in buckets {
+                ControlMessage.append(&d, i)
+                ControlMessage.append(&d, c)
+            }
+        }
+        return d
+    }
+
+    /// - Returns: nil if the message is truncated.
+    static func decode(_ d : Data) -> Telemetry? {
+        var r = ControlMessage.Reader(data: d)
+        var t = Telemetry()
+        guard let u : UInt32 = r.read(), let rs : UInt32 = r.read(), let a : UInt32 = r.read(),
+              let e : UInt32 = r.read(), let c : UInt32 = r.read(), let n : UInt8 = r.read() else {
+            return nil
+        }
+        (t.underruns, t.resyncs, t.accelerated, t.expanded, t.concealed) = (u, rs, a, e, c)
+        for _ in 0..<n {
+            guard let k : UInt8 = r.read(), let count : UInt16 = r.read() else { return nil }
+            var buckets = [(UInt16, UInt32)]()
+            for _ in 0..<count {
+                guard let i : UInt16 = r.read(), let c : UInt32 = r.read(),
+                      Int(i) < Histogram.kBuckets else { return nil }
+                buckets.append((i, c))
+            }
+            if let kind = Kind(rawValue: k) {
+                t.histograms[kind] = buckets
+            }
+        }
+        return t
+    }
+
+    /// One line for the server's window.
+    var summary : String {
+        func ms(_ k : Kind, _ p : Double) -> Double {
+            return Double(Histogram.percentile(histograms[k] ?? [], p)) / 1e6
+        }
+        func buffered(_ p : Double) -> Double {
+            return Double(Histogram.percentile(histograms[.playerOccupancyUs] ?? [], p)) / 1e3
+        }
+        return String(format: "Device render p50 %.2f / p99 %.2f ms, buffered p1 %.0f / p50 %.0f ms, " +
+                        "%u underruns, %u concealed, %u stretched",
+                      ms(.playerCallbackNs, 0.5), ms(.playerCallbackNs, 0.99),
+                      buffered(0.01), buffered(0.5),
+                      underruns, concealed, accelerated + expanded)
+    }
+}
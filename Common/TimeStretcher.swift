@@ -0,0 +1,183 @@
+//
+//  TimeStretcher.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Plays the player's ringbuffer slightly faster or slower than real time
+/// without changing pitch, so its latency can drift towards the playout
+/// target without cutting the waveform.
+///
+/// Overlap-add in the time domain, one pitch period at a time: to speed up,
+/// a render reads one period more than it plays and cross-fades the audio
+/// into itself a period later; to slow down, it reads one period less and
+/// cross-fades a period back, repeating it. The period is the lag at which
+/// the audio is most similar to itself (normalized cross-correlation), so
+/// the seam falls on matching points of the waveform. Whole frames only.
+///
+/// Works on interleaved 16 bit integer PCM, which is what the server sends.
+/// All buffers are allocated up front, so render is real time safe.
+final class TimeStretcher {
+
+    /// Most the rate may differ from real time.
+    static let kMaxSpeedChange = 0.02
+
+    /// Periods searched (seconds): 80 to 400 Hz.
+    static let kMinPeriod = 0.0025
+    static let kMaxPeriod = 0.0125
+
+    /// Largest render handled, in frames. Larger ones play unstretched.
+    static let kMaxFrames = 4096
+
+    let channels : Int
+    let minPeriod : Int
+    let maxPeriod : Int
+
+    /// Audio peeked from the ringbuffer, and its channels mixed down for
+    /// the period search.
+    let input : UnsafeMutablePointer<Int16>
+    let mono : UnsafeMutablePointer<Float>
+
+    /// Playback speed wanted, 1 +- kMaxSpeedChange. Set by the player.
+    var speed = 1.0
+
+    /// Frames owed: positive means we should have consumed that many more
+    /// than we played. Paid off a period at a time.
+    var budget = 0.0
+
+    /// Statistics. Periods dropped and repeated.
+    var accelerated = 0
+    var expanded = 0
+
+    init(channels : Int, sampleRate : Double) {
+        self.channels = max(1, channels)
+        minPeriod = max(1, Int(TimeStretcher.kMinPeriod * sampleRate))
+        maxPeriod = max(minPeriod, Int(TimeStretcher.kMaxPeriod * sampleRate))
+        let frames = TimeStretcher.kMaxFrames + maxPeriod
+        input = UnsafeMutablePointer<Int16>.allocate(capacity: frames * self.channels)
+        mono = UnsafeMutablePointer<Float>.allocate(capacity: frames)
+    }
+
+    deinit {
+        input.deallocate()
+        mono.deallocate()
+    }
+
+    /// Fills out with frames frames from ring, consuming a period more or
+    /// less now and then to follow speed. Returns false, leaving out and
+    /// ring alone, if fewer than frames are buffered.
+    func render(from ring : SPSCRing, into out : UnsafeMutablePointer<Int16>, frames : Int) -> Bool {
+        let bpf = channels * 2
+        let available = ring.availableToRead / bpf
+        if available < frames {
+            return false
+        }
+        let speed = min(max(self.speed, 1 - TimeStretcher.kMaxSpeedChange), 1 + TimeStretcher.kMaxSpeedChange)
+        budget += Double(frames) * (speed - 1)
+        budget = min(max(budget, -Double(2 * maxPeriod)), Double(2 * maxPeriod))
+
+        // A period is never longer than the budget, so paying it off can't
+        // overshoot into the other direction.
+        if frames <= TimeStretcher.kMaxFrames {
+            if speed > 1 && budget >= Double(minPeriod) && available >= frames + minPeriod {
+                let have = min(available, frames + maxPeriod)
+                let p = peekAndSearch(ring, have, maxLag: min(have - frames, frames, Int(budget)))
+                if p > 0 {
+                    accelerate(out, frames, p)
+                    ring.skip((frames + p) * bpf)
+                    budget -= Double(p)
+                    accelerated += 1
+                    return true
+                }
+            }
+            else if speed < 1 && budget <= -Double(minPeriod) && frames >= 3 * minPeriod {
+                let p = peekAndSearch(ring, frames, maxLag: min(frames / 3, Int(-budget)))
+                if p > 0 {
+                    expand(out, frames, p)
+                    ring.skip((frames - p) * bpf)
+                    budget += Double(p)
+                    expanded += 1
+                    return true
+                }
+            }
+        }
+        ring.read(into: out, frames * bpf)
+        return true
+    }
+
+    /// Copies have frames from ring into input without consuming them and
+    /// returns the period to use, at most maxLag, or 0 if none fits.
+    func peekAndSearch(_ ring : SPSCRing, _ have : Int, maxLag : Int) -> Int {
+        let hi = min(maxPeriod, maxLag)
+        if hi < minPeriod {
+            return 0
+        }
+        ring.peek(into: input, have * channels * 2)
+        for i in 0..<have {
+            var sum : Float = 0
+            for c in 0..<channels {
+                sum += Float(input[i * channels + c])
+            }
+            mono[i] = sum
+        }
+
+        // Compare a window at the start with the same window lag later.
+        let window = min(2 * minPeriod, have - hi)
+        if window <= 0 {
+            return 0
+        }
+        var e0 : Float = 0
+        for i in 0..<window {
+            e0 += mono[i] * mono[i]
+        }
+        var best = hi
+        var bestScore = -Float.greatestFiniteMagnitude
+        for lag in minPeriod...hi {
+            var xy : Float = 0
+            var e1 : Float = 0
+            for i in 0..<window {
+                xy += mono[i] * mono[i + lag]
+                e1 += mono[i + lag] * mono[i + lag]
+            }
+            let score = xy / max(1, sqrtf(e0 * e1))
+            if score > bestScore {
+                bestScore = score
+                best = lag
+            }
+        }
+        return best
+    }
+
+    /// Plays input[0..<frames + p] in frames frames: fades from the audio
+    /// into the audio p frames later over the first p frames.
+    func accelerate(_ out : UnsafeMutablePointer<Int16>, _ frames : Int, _ p : Int) {
+        let n = channels
+        for i in 0..<p {
+            let w = Float(i) / Float(p)
+            for c in 0..<n {
+                let a = Float(input[i * n + c])
+                let b = Float(input[(i + p) * n + c])
+                out[i * n + c] = Int16(clamping: Int(a + (b - a) * w))
+            }
+        }
+        (out + p * n).assign(from: input + 2 * p * n, count: (frames - p) * n)
+    }
+
+    /// Plays input[0..<frames - p] in frames frames: after the first p
+    /// frames, fades into the audio p frames earlier and plays that
+    /// period again.
+    func expand(_ out : UnsafeMutablePointer<Int16>, _ frames : Int, _ p : Int) {
+        let n = channels
+        out.assign(from: input, count: p * n)
+        for i in p..<2 * p {
+            let w = Float(i - p) / Float(p)
+            for c in 0..<n {
+                let a = Float(input[i * n + c])
+                let b = Float(input[(i - p) * n + c])
+                out[i * n + c] = Int16(clamping: Int(a + (b - a) * w))
+            }
+        }
+        (out + 2 * p * n).assign(from: input + p * n, count: (frames - 2 * p) * n)
+    }
+}
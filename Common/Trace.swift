@@ -0,0 +1,170 @@
+//
+//  Trace.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+import Atomics
+
+/// Things worth logging from audio threads. Each takes up to three integer
+/// arguments, named in describe().
+enum TraceEvent : UInt16 {
+    case playerRender           // fresh bytes, target bytes, bytes wanted
+    case playerNoBuffer
+    case playerUnmappable       // channels, buffers
+    case recorderRender         // status, bytes, frames
+    case recorderNoBuffer
+    case recorderOverrun        // frames
+    case frameReceived          // signature, byte3, size
+    case frameSent              // signature, byte3, size
+
+    var tag : String {
+        switch self {
+        case .playerRender, .playerNoBuffer, .playerUnmappable: return "AUHALAudioPlayer"
+        case .recorderRender, .recorderNoBuffer, .recorderOverrun: return "AUHALAudioRecorder"
+        case .frameReceived, .frameSent: return "PCMTransceiver"
+        }
+    }
+
+    func describe(_ a : Int64, _ b : Int64, _ c : Int64) -> String {
+        switch self {
+        case .playerRender: return "Distance between WO and RO is = \(a), target \(b), need \(c)"
+        case .playerNoBuffer: return "iOBuffer is NULL! Refusing to play audio."
+        case .playerUnmappable: return "Can't map \(a) channels to \(b) buffers"
+        case .recorderRender: return "Rendered with status \(a), got \(b) bytes, recorded \(c) frames"
+        case .recorderNoBuffer: return "Failed to populate buffers!"
+        case .recorderOverrun: return "No free buffer, dropped \(a) frames"
+        case .frameReceived: return "Received frame \(a) \(b) of size \(c)"
+        case .frameSent: return "Sent frame \(a) \(b) of size \(c)"
+        }
+    }
+}
+
+/// One traced event. Fixed size, no references.
+struct TraceRecord {
+    var time : UInt64 = 0
+    var event : UInt16 = 0
+    var level : UInt8 = 0
+    var a : Int64 = 0
+    var b : Int64 = 0
+    var c : Int64 = 0
+}
+
+/// Where one thread (or serial queue) traces to. Recording copies a record
+/// into a wait-free ring, so it is real time safe; Trace prints the
+/// records later on a background thread. Full rings drop records.
+///
+/// Trace keeps every ring alive until its owner calls Trace.unregister, so
+/// the drain thread never reads a ring that is going away. Owners do that
+/// in their deinit.
+final class TraceRing {
+
+    /// Records the ring holds. About a second of render callbacks.
+    static let kRecords = 512
+
+    let ring = SPSCRing(minimumCapacity: TraceRing.kRecords * MemoryLayout<TraceRecord>.stride)
+
+    /// Records dropped, counted by the recording thread and read by the
+    /// drain thread, and how many of them Trace reported.
+    let dropped = ManagedAtomic<Int>(0)
+    var reported = 0
+
+    init() {
+        Trace.register(self)
+    }
+
+    /// Records go in whole or not at all: the capacity isn't a multiple of
+    /// the record size, and a partial one would misalign all after it.
+    func record(_ r : TraceRecord) {
+        var r = r
+        if ring.availableToWrite < MemoryLayout<TraceRecord>.stride {
+            dropped.wrappingIncrement(ordering: .relaxed)
+            return
+        }
+        ring.write(&r, MemoryLayout<TraceRecord>.stride)
+    }
+}
+
+/// Logging for audio threads, where Logger's string building would allocate
+/// and lock. Call sites record binary TraceRecords into their TraceRing;
+/// every kDrainInterval seconds a utility thread formats them and passes
+/// them to Logger.
+///
+/// Trace.level is a literal and record() is inlined, so sites below it
+/// compile to nothing.
+enum Trace {
+
+    /// Events below this level are not recorded. Follows Logger.debugLevel,
+    /// but as a computed literal: a static let is lazily initialized and
+    /// not folded.
+    #if IAUDIO_VERBOSE
+    @inline(__always) static var level : DebugLevel { return .verbose }
+    #else
+    @inline(__always) static var level : DebugLevel { return .log }
+    #endif
+
+    static let kDrainInterval = 0.2
+
+    /// Rings to drain, retained until unregistered. Guarded by semaphore
+    /// (never taken by audio threads).
+    static var rings = [ObjectIdentifier : TraceRing]()
+    static let semaphore = DispatchSemaphore(value: 1)
+    static var timer : DispatchSourceTimer?
+
+    @inline(__always)
+    static func record(_ lvl : DebugLevel, _ ring : TraceRing, _ event : TraceEvent,
+                       _ a : Int64 = 0, _ b : Int64 = 0, _ c : Int64 = 0) {
+        if lvl.rawValue >= level.rawValue {
+            ring.record(TraceRecord(time: DispatchTime.now().uptimeNanoseconds, event: event.rawValue,
+                                    level: UInt8(lvl.rawValue), a: a, b: b, c: c))
+        }
+    }
+
+    static func register(_ ring : TraceRing) {
+        semaphore.wait()
+        rings[ObjectIdentifier(ring)] = ring
+        if timer == nil {
+            let t = DispatchSource.makeTimerSource(queue: DispatchQueue.global(qos: .utility))
+            t.schedule(deadline: .now() + kDrainInterval, repeating: kDrainInterval)
+            t.setEventHandler {
+                drain()
+            }
+            t.resume()
+            timer = t
+        }
+        semaphore.signal()
+    }
+
+    /// Prints what is left, then forgets ring. Call once nothing records
+    /// into it anymore.
+    static func unregister(_ ring : TraceRing) {
+        semaphore.wait()
+        flush(ring)
+        rings.removeValue(forKey: ObjectIdentifier(ring))
+        semaphore.signal()
+    }
+
+    /// Prints everything recorded so far.
+    static func drain() {
+        semaphore.wait()
+        for r in rings.values {
+            flush(r)
+        }
+        semaphore.signal()
+    }
+
+    static func flush(_ ring : TraceRing) {
+        var r = TraceRecord()
+        while ring.ring.availableToRead >= MemoryLayout<TraceRecord>.stride {
+            ring.ring.read(into: &r, MemoryLayout<TraceRecord>.stride)
+            guard let event = TraceEvent(rawValue: r.event),
+                  let lvl = DebugLevel(rawValue: Int(r.level)) else { continue }
+            Logger.log(lvl, event.tag, "@\(r.time / 1_000_000) ms " + event.describe(r.a, r.b, r.c))
+        }
+        let dropped = ring.dropped.load(ordering: .relaxed)
+        if dropped != ring.reported {
+            Logger.log(.log, "Trace", "Dropped \(dropped - ring.reported) records")
+            ring.reported = dropped
+        }
+    }
+}
@@ -0,0 +1,303 @@
+//
+//  UDPAudioLink.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+import Socket
+
+/// Carries audio frames over UDP for sessions over Wi-Fi, where a late TCP
+/// retransmit hurts more than a lost packet. The session itself (handshake,
+/// control, heartbeats) stays on the TCP socket; only the frames PCMTransceiver
+/// would otherwise write there go through here.
+///
+/// Every kGroupSize data datagrams are followed by an XOR parity datagram,
+/// so any single loss within a group is repaired without a retransmit.
+/// Received frames go through a PacketJitterBuffer to undo reordering.
+///
+/// Every link binds its own ephemeral port, so any number of devices can
+/// stream at once. Both sides name their port in their hello ("udp=<port>")
+/// and connect the socket to the other's, so the kernel drops datagrams
+/// from anyone else: streams don't mix and nobody on the LAN can inject
+/// audio.
+///
+/// Datagram layout:
+///     [0x69, 0x5, kind, count] UInt32 sequence number, then
+///     kind 0: one audio frame, header included, as written to the socket.
+///     kind 1: parity of the group starting at seq. UInt16 XOR of the frame
+///             lengths, then the XOR of the frames zero padded to the longest.
+class UDPAudioLink {
+
+    /// Data datagrams covered by one parity datagram.
+    static let kGroupSize = 4
+
+    static let kDataKind   : UInt8 = 0
+    static let kParityKind : UInt8 = 1
+    let kDatagramHeaderSize = 8
+    let kMaxDatagram = 65507
+
+    let sock : Socket
+
+    /// Port we receive on, for the hello.
+    let localPort : Int
+
+    /// Called with every frame, in order, on the reactor.
+    var deliver : ((Data) -> Void)? {
+        get { return jitter.deliver }
+        set { jitter.deliver = newValue }
+    }
+
+    /// Called for every frame that was lost for good.
+    var conceal : (() -> Void)? {
+        get { return jitter.conceal }
+        set { jitter.conceal = newValue }
+    }
+
+    /// Send side. Only touched by the (single) sending thread.
+    var txSeq : UInt32 = 0
+    var datagram = Data(capacity: 8192)
+    var parity = Data(capacity: 8192)
+    var parityLen : UInt16 = 0
+
+    /// Receive side. Only touched on the reactor.
+    var readSource : DispatchSourceRead?
+    lazy var buf = [UInt8](repeating: 0, count: kMaxDatagram)
+    let jitter = PacketJitterBuffer(depth: UDPAudioLink.kGroupSize)
+    var groups = [UInt32 : FECGroup]()
+    var recovered = 0
+
+    /// What arrived of one FEC group so far.
+    struct FECGroup {
+        var frames = [UInt32 : Data]()
+        var parity : Data?
+    }
+
+    /// Debugging.
+    let TAG = "UDPAudioLink"
+
+    /// Binds an ephemeral local port. connect() before sending.
+    /// - Throws: If the socket can't be created or bound.
+    init() throws {
+        let s = try Socket.create(family: .inet, type: .datagram, proto: .udp)
+        try s.listen(on: 0)
+        var addr = sockaddr_in()
+        var len = socklen_t(MemoryLayout<sockaddr_in>.size)
+        let ok = withUnsafeMutablePointer(to: &addr) {
+            $0.withMemoryRebound(to: sockaddr.self, capacity: 1) {
+                getsockname(s.socketfd, $0, &len) == 0
+            }
+        }
+        if !ok {
+            s.close()
+            throw NSError(domain: "Error_Domain", code: 102,
+                          userInfo: [NSLocalizedDescriptionKey : "Can't bind a UDP port"])
+        }
+        sock = s
+        localPort = Int(UInt16(bigEndian: addr.sin_port))
+    }
+
+    /// Sends to and only receives from peerHost:peerPort from now on.
+    /// - Throws: If the host can't be resolved or connected to.
+    func connect(to peerHost : String, port peerPort : Int) throws {
+        guard let addr = Socket.createAddress(for: peerHost, on: Int32(peerPort)),
+              UDPAudioLink.connect(sock.socketfd, addr) else {
+            throw NSError(domain: "Error_Domain", code: 102,
+                          userInfo: [NSLocalizedDescriptionKey : "Can't connect to \(peerHost):\(peerPort)"])
+        }
+        Logger.log(.log, TAG, "Sending audio to \(peerHost):\(peerPort) over UDP from port \(localPort)")
+    }
+
+    static func connect(_ fd : Int32, _ addr : Socket.Address) -> Bool {
+        func connect<T>(_ sa : T) -> Bool {
+            var sa = sa
+            return withUnsafePointer(to: &sa) {
+                $0.withMemoryRebound(to: sockaddr.self, capacity: 1) {
+                    #if canImport(Darwin)
+                    return Darwin.connect(fd, $0, socklen_t(MemoryLayout<T>.size)) == 0
+                    #else
+                    return Glibc.connect(fd, $0, socklen_t(MemoryLayout<T>.size)) == 0
+                    #endif
+                }
+            }
+        }
+        switch addr {
+        case .ipv4(let sa):
+            return connect(sa)
+        case .ipv6(let sa):
+            return connect(sa)
+        default:
+            return false
+        }
+    }
+
+    /// Both sides name their UDP port in the hello as "udp=<port>".
+    static func port(fromHello hello : String) -> Int? {
+        guard let r = hello.range(of: "udp=") else { return nil }
+        return Int(hello[r.upperBound...].prefix(while: { $0.isNumber }))
+    }
+
+    /// usbmuxd hands USB connections to the device over loopback; anything
+    /// else came over the network.
+    static func isLoopback(_ host : String) -> Bool {
+        return host == "::1" || host == "localhost" || host.hasSuffix("127.0.0.1")
+    }
+
+    func close() {
+        if readSource != nil {
+            // The fd must stay open until the reactor is done with it.
+            let sock = self.sock
+            readSource!.setCancelHandler {
+                sock.close()
+            }
+            readSource!.cancel()
+            readSource = nil
+        } else {
+            sock.close()
+        }
+        Logger.log(.log, TAG, "Received \(jitter.delivered) frames, repaired \(recovered), " +
+            "concealed \(jitter.lost), \(jitter.late) late")
+    }
+
+    // MARK: Sending
+
+    /// Sends one audio frame, plus the group's parity after every kGroupSize.
+    /// A frame that fails to send still uses up its sequence number, so the
+    /// peer repairs or conceals it like one lost on the way.
+    func send(_ frame : Data) throws {
+        let slot = Int(txSeq % UInt32(UDPAudioLink.kGroupSize))
+        if slot == 0 {
+            parity.removeAll(keepingCapacity: true)
+            parityLen = 0
+        }
+        var failure : Error?
+        do {
+            try sendDatagram(UDPAudioLink.kDataKind, 0, txSeq, frame)
+        } catch {
+            failure = error
+        }
+
+        // Fold the frame into the running parity.
+        parityLen ^= UInt16(frame.count)
+        if parity.count < frame.count {
+            parity.append(contentsOf: repeatElement(0, count: frame.count - parity.count))
+        }
+        parity.withUnsafeMutableBytes { (p : UnsafeMutableRawBufferPointer) in
+            frame.withUnsafeBytes { (f : UnsafeRawBufferPointer) in
+                for i in 0..<f.count {
+                    p[i] ^= f[i]
+                }
+            }
+        }
+
+        txSeq = txSeq &+ 1
+        if slot == UDPAudioLink.kGroupSize - 1 {
+            var len = parityLen
+            let first = txSeq &- UInt32(UDPAudioLink.kGroupSize)
+            try sendDatagram(UDPAudioLink.kParityKind, UInt8(UDPAudioLink.kGroupSize), first,
+                             Data(bytes: &len, count: 2) + parity)
+        }
+        if let e = failure {
+            throw e
+        }
+    }
+
+    func sendDatagram(_ kind : UInt8, _ count : UInt8, _ seq : UInt32, _ body : Data) throws {
+        var s = seq
+        datagram.removeAll(keepingCapacity: true)
+        datagram.append(contentsOf: [0x69, 0x5, kind, count])
+        datagram.append(Data(bytes: &s, count: 4))
+        datagram.append(body)
+        // The socket is connected, so a plain write goes to the peer.
+        let n = datagram.withUnsafeBytes { Reactor.write(sock.socketfd, $0.baseAddress!, $0.count) }
+        if n < 0 && !Reactor.wouldBlock() {
+            throw NSError(domain: "Error_Domain", code: 101,
+                          userInfo: [NSLocalizedDescriptionKey : "Failed to send datagram"])
+        }
+    }
+
+    // MARK: Receiving
+
+    /// Starts receiving datagrams on the reactor.
+    /// - Throws: If the socket can't be made non-blocking.
+    func start() throws {
+        try sock.setBlocking(mode: false)
+        readSource = Reactor.shared.watchRead(sock.socketfd) { [weak self] in
+            self?.onReadable()
+        }
+    }
+
+    /// Reads every datagram queued on the socket.
+    func onReadable() {
+        while true {
+            let n = buf.withUnsafeMutableBytes {
+                Reactor.read(sock.socketfd, $0.baseAddress!, $0.count)
+            }
+            // Errors include ECONNREFUSED after the peer's port closed.
+            if n < 0 {
+                return
+            }
+            if n < kDatagramHeaderSize { continue }
+            let d = buf.withUnsafeBytes { Data($0.prefix(n)) }
+            received(d)
+        }
+    }
+
+    func received(_ d : Data) {
+        if d[0] != 0x69 || d[1] != 0x5 { return }
+        let kind = d[2]
+        let seq = d.withUnsafeBytes { $0.load(fromByteOffset: 4, as: UInt32.self) }
+        let body = d.subdata(in: kDatagramHeaderSize..<d.count)
+        let first = seq &- seq % UInt32(UDPAudioLink.kGroupSize)
+
+        if kind == UDPAudioLink.kDataKind {
+            jitter.insert(seq, body)
+            // Keep it for repairing the rest of its group, if that still matters.
+            if jitter.isPending(first &+ UInt32(UDPAudioLink.kGroupSize - 1)) {
+                groups[first, default: FECGroup()].frames[seq] = body
+            }
+        } else if kind == UDPAudioLink.kParityKind && body.count >= 2 {
+            groups[first, default: FECGroup()].parity = body
+        } else {
+            return
+        }
+        repair(first)
+        prune()
+    }
+
+    /// Rebuilds the one missing frame of a group from the others and parity.
+    func repair(_ first : UInt32) {
+        guard let g = groups[first], let p = g.parity,
+              g.frames.count == UDPAudioLink.kGroupSize - 1 else { return }
+        var missing = first
+        while g.frames[missing] != nil {
+            missing = missing &+ 1
+        }
+        groups.removeValue(forKey: first)
+        if !jitter.isPending(missing) { return }
+
+        var len = p.withUnsafeBytes { $0.load(as: UInt16.self) }
+        var frame = p.subdata(in: 2..<p.count)
+        frame.withUnsafeMutableBytes { (o : UnsafeMutableRawBufferPointer) in
+            for (_, f) in g.frames {
+                len ^= UInt16(f.count)
+                f.withUnsafeBytes { (b : UnsafeRawBufferPointer) in
+                    for i in 0..<min(b.count, o.count) {
+                        o[i] ^= b[i]
+                    }
+                }
+            }
+        }
+        if Int(len) > frame.count { return }
+        recovered += 1
+        jitter.insert(missing, frame.prefix(Int(len)))
+    }
+
+    /// Forgets groups the jitter buffer moved past.
+    func prune() {
+        if groups.count <= 4 { return }
+        for first in groups.keys where
+            !jitter.isPending(first &+ UInt32(UDPAudioLink.kGroupSize - 1)) {
+            groups.removeValue(forKey: first)
+        }
+    }
+}
@@ -0,0 +1,101 @@
+//
+//  WAVFileBackend.swift
+//  iAudio CommonTools
+//
+
+import Foundation
+
+/// Headless audio backend that writes the speaker stream to a WAV file
+/// instead of playing it, in real time. Integer PCM only, which is what
+/// the server sends. A format change starts a new file.
+class WAVFileBackend : PulledAudioBackend {
+
+    /// Files are named <path>.wav, then <path>-1.wav after a format
+    /// change and so on.
+    let path : String
+
+    var file : FileHandle?
+    var dataBytes = 0
+    var files = 0
+
+    override var TAG : String { return "WAVFileBackend" }
+
+    init(path : String) {
+        self.path = path
+        super.init()
+        sink = { [unowned self] ptr, len in
+            self.file?.write(Data(bytes: ptr, count: len))
+            self.dataBytes += len
+        }
+    }
+
+    override func initUnit(outFormat: StreamFormat,
+                           inFormat: StreamFormat?,
+                           _micPacketReady: ((_ ptr : UnsafeMutableRawPointer, _ len : Int) -> Void)?) throws {
+        if !initted {
+            try openFile(outFormat)
+        }
+        try super.initUnit(outFormat: outFormat, inFormat: inFormat, _micPacketReady: _micPacketReady)
+    }
+
+    override func reconfigure(outFormat: StreamFormat,
+                              inFormat: StreamFormat?,
+                              whileStopped: (() throws -> Void)?) throws {
+        try super.reconfigure(outFormat: outFormat, inFormat: inFormat) {
+            self.closeFile()
+            try self.openFile(outFormat)
+            try whileStopped?()
+        }
+    }
+
+    override func endSession() {
+        super.endSession()
+        renderLock.wait()
+        closeFile()
+        renderLock.signal()
+    }
+
+    /// Creates the next file and writes a header for format. The sizes in
+    /// the header get patched by closeFile.
+    func openFile(_ format : StreamFormat) throws {
+        let name = files == 0 ? "\(path).wav" : "\(path)-\(files).wav"
+        files += 1
+        if !FileManager.default.createFile(atPath: name, contents: nil) {
+            throw NSError(domain: "Error_Domain", code: 120,
+                          userInfo: [NSLocalizedDescriptionKey : "Can't create \(name)"])
+        }
+        file = FileHandle(forWritingAtPath: name)
+        dataBytes = 0
+
+        var h = Data()
+        func put32(_ v : UInt32) { var x = v.littleEndian; h.append(Data(bytes: &x, count: 4)) }
+        func put16(_ v : UInt16) { var x = v.littleEndian; h.append(Data(bytes: &x, count: 2)) }
+        h.append("RIFF".data(using: .ascii)!)
+        put32(0)
+        h.append("WAVEfmt ".data(using: .ascii)!)
+        put32(16)
+        put16(format.mFormatFlags & StreamFormat.kFlagIsFloat != 0 ? 3 : 1)
+        put16(UInt16(format.mChannelsPerFrame))
+        put32(UInt32(format.mSampleRate))
+        put32(UInt32(format.mSampleRate) * format.mBytesPerFrame)
+        put16(UInt16(format.mBytesPerFrame))
+        put16(UInt16(format.mBitsPerChannel))
+        h.append("data".data(using: .ascii)!)
+        put32(0)
+        file?.write(h)
+        Logger.log(.log, TAG, "Writing \(format) to \(name)")
+    }
+
+    /// Patches the RIFF and data sizes and closes the file.
+    func closeFile() {
+        guard let f = file else { return }
+        var riff = UInt32(36 + dataBytes).littleEndian
+        var data = UInt32(dataBytes).littleEndian
+        f.seek(toFileOffset: 4)
+        f.write(Data(bytes: &riff, count: 4))
+        f.seek(toFileOffset: 40)
+        f.write(Data(bytes: &data, count: 4))
+        f.closeFile()
+        file = nil
+    }
+}
@@ -0,0 +1,48 @@
+// swift-tools-version:5.3
+//
+//  Package.swift
+//  iAudioProject
+//
+//  The apps build with Xcode. This package only builds the parts of Common
+//  (and of the server) that don't need the audio frameworks, so they can be
+//  unit tested with `swift test`, on macOS or Linux. That includes the whole
+//  client pipeline, ClientEngine, run headless through PulledAudioBackend.
+//
+
+import PackageDescription
+
+let package = Package(
+    name: "iAudioCommon",
+    dependencies: [
+        .package(name: "Socket", url: "https://github.com/Kitura/BlueSocket.git", from: "1.0.200"),
+        .package(url: "https://github.com/apple/swift-atomics.git", from: "1.0.0"),
+    ],
+    targets: [
+        .target(
+            name: "iAudioCommon",
+            dependencies: [
+                .product(name: "Socket", package: "Socket"),
+                .product(name: "Atomics", package: "swift-atomics"),
+            ],
+            path: "Common",
+            // The recorder is nothing but an audio unit callback. The rest
+            // compiles its audio unit parts out without AVFoundation.
+            exclude: [
+                "AUHALAudioRecorder.swift",
+            ]),
+        .target(
+            name: "iAudioServerCore",
+            path: "iAudioServer",
+            sources: [
+                "BinaryPlist.swift",
+            ]),
+        .testTarget(
+            name: "iAudioCommonTests",
+            dependencies: [
+                "iAudioCommon",
+                "iAudioServerCore",
+                .product(name: "Atomics", package: "swift-atomics"),
+            ],
+            path: "Tests/iAudioCommonTests"),
+    ]
+)
@@ -0,0 +1,131 @@
+//
+//  ADPCMCodecTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+@testable import iAudioCommon
+
+final class ADPCMCodecTests : XCTestCase {
+
+    func encode(_ coder : ADPCMCodec, _ pcm : [Int16], channels : Int) -> Data {
+        var coded = Data()
+        pcm.withUnsafeBufferPointer {
+            coder.encode($0.baseAddress!, frames: pcm.count / channels, channels: channels, into: &coded)
+        }
+        return coded
+    }
+
+    /// The decoded samples, nil if the decoder rejected the packet.
+    func decode(_ coded : Data) -> [Int16]? {
+        var out = Data()
+        let ok = coded.withUnsafeBytes { ADPCMCodec().decode($0, into: &out) }
+        if !ok {
+            return nil
+        }
+        var pcm = [Int16](repeating: 0, count: out.count / 2)
+        _ = pcm.withUnsafeMutableBytes { out.copyBytes(to: $0) }
+        return pcm
+    }
+
+    /// Two tones, interleaved.
+    func tones(_ frames : Int) -> [Int16] {
+        var pcm = [Int16]()
+        for i in 0..<frames {
+            pcm.append(Int16(10000 * sin(Double(i) * 2 * .pi * 440 / 48000)))
+            pcm.append(Int16(5000 * sin(Double(i) * 2 * .pi * 1000 / 48000)))
+        }
+        return pcm
+    }
+
+    /// Signal to noise ratio (dB) of channel ch, once the step size settled.
+    func snr(_ a : [Int16], _ b : [Int16], channel ch : Int, channels : Int) -> Double {
+        var signal = 0.0, noise = 0.0
+        var i = 200 * channels + ch
+        while i < a.count {
+            signal += Double(a[i]) * Double(a[i])
+            noise += (Double(a[i]) - Double(b[i])) * (Double(a[i]) - Double(b[i]))
+            i += channels
+        }
+        return 10 * log10(signal / max(noise, 1))
+    }
+
+    func testStereoRoundTrip() {
+        let pcm = tones(4800)
+        guard let out = decode(encode(ADPCMCodec(), pcm, channels: 2)) else {
+            return XCTFail("Rejected own packet")
+        }
+        XCTAssertEqual(out.count, pcm.count)
+        XCTAssertGreaterThan(snr(pcm, out, channel: 0, channels: 2), 25)
+        XCTAssertGreaterThan(snr(pcm, out, channel: 1, channels: 2), 25)
+    }
+
+    /// The encoder predicts exactly what the decoder reconstructs.
+    func testEncoderTracksDecoder() {
+        let coder = ADPCMCodec()
+        let pcm = tones(1000)
+        guard let out = decode(encode(coder, pcm, channels: 2)) else {
+            return XCTFail("Rejected own packet")
+        }
+        XCTAssertEqual(Int32(out[out.count - 2]), coder.predictor[0])
+        XCTAssertEqual(Int32(out[out.count - 1]), coder.predictor[1])
+    }
+
+    /// State carries over between packets, but every packet decodes on its
+    /// own, e.g. after the one before it was lost.
+    func testPacketsDecodeIndependently() {
+        let coder = ADPCMCodec()
+        let pcm = tones(960)
+        let first = encode(coder, Array(pcm[..<960]), channels: 2)
+        let second = encode(coder, Array(pcm[960...]), channels: 2)
+        guard let both = decode(first + second), let alone = decode(second) else {
+            return XCTFail("Rejected own packet")
+        }
+        XCTAssertEqual(Array(both[960...]), alone)
+    }
+
+    /// More frames than a block header can count are split into blocks.
+    func testSplitsLongInput() {
+        let frames = ADPCMCodec.kMaxBlockFrames + 1000
+        let pcm = (0..<frames).map { Int16(8000 * sin(Double($0) * 2 * .pi * 300 / 48000)) }
+        XCTAssertEqual(decode(encode(ADPCMCodec(), pcm, channels: 1))?.count, frames)
+    }
+
+    func testRejectsMalformedPacket() {
+        let coded = encode(ADPCMCodec(), tones(100), channels: 2)
+        XCTAssertNil(decode(coded.prefix(coded.count - 1)))
+        XCTAssertNil(decode(coded.prefix(2)))
+        // No channels, and more channels than the decoder keeps state for.
+        XCTAssertNil(decode(Data([0x01, 0x00, 0x00, 0x00])))
+        var nine = Data([0x01, 0x00, 0x09])
+        nine.append(Data(repeating: 0, count: 9 * 3 + 5))
+        XCTAssertNil(decode(nine))
+    }
+
+    /// 100 s of stereo in 10 ms packets.
+    func testEncodeBenchmark() {
+        let pcm = tones(480)
+        let coder = ADPCMCodec()
+        var coded = Data(capacity: 1024)
+        measure {
+            for _ in 0..<10_000 {
+                coded.removeAll(keepingCapacity: true)
+                pcm.withUnsafeBufferPointer {
+                    coder.encode($0.baseAddress!, frames: 480, channels: 2, into: &coded)
+                }
+            }
+        }
+    }
+
+    func testDecodeBenchmark() {
+        let coded = encode(ADPCMCodec(), tones(480), channels: 2)
+        let decoder = ADPCMCodec()
+        var out = Data(capacity: 4096)
+        measure {
+            for _ in 0..<10_000 {
+                out.removeAll(keepingCapacity: true)
+                _ = coded.withUnsafeBytes { decoder.decode($0, into: &out) }
+            }
+        }
+    }
+}
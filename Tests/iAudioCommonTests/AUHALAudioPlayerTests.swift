@@ -0,0 +1,131 @@
+//
+//  AUHALAudioPlayerTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+@testable import iAudioCommon
+
+/// The player's enqueueing side, without an audio unit: what ends up in the
+/// ringbuffer, and in which format.
+final class AUHALAudioPlayerTests : XCTestCase {
+
+    let mono = StreamFormat.pcm16(sampleRate: 48000, channels: 1)
+
+    /// A 220 Hz tone, from frame start on.
+    func tone(_ frames : Int, from start : Int = 0, channels : Int = 1) -> [Int16] {
+        return (start..<start + frames).flatMap { i -> [Int16] in
+            let v = Int16(8000 * sin(2 * Double.pi * 220 * Double(i) / 48000))
+            return [Int16](repeating: v, count: channels)
+        }
+    }
+
+    func enqueue(_ player : AUHALAudioPlayer, _ pcm : [Int16]) {
+        var p = pcm
+        p.withUnsafeMutableBytes {
+            player.enqueuePCM($0.baseAddress!.assumingMemoryBound(to: Int8.self), $0.count)
+        }
+    }
+
+    /// Reads everything the ringbuffer holds.
+    func drain(_ player : AUHALAudioPlayer) -> [Int16] {
+        let n = player.sRingbuffer.availableToRead
+        var out = [Int16](repeating: 0, count: n / 2)
+        out.withUnsafeMutableBytes {
+            _ = player.sRingbuffer.read(into: $0.baseAddress!, n)
+        }
+        return out
+    }
+
+    /// A frame lost on the way is filled in from the tone before it, not
+    /// with silence, and counts towards the frames enqueued.
+    func testConcealsLostFrame() {
+        let player = AUHALAudioPlayer()
+        player.initRing(outFormat: mono)
+        enqueue(player, tone(960))
+        player.enqueueLoss(480 * 2)
+        enqueue(player, tone(960, from: 1440))
+        XCTAssertEqual(player.framesEnqueued, 2400)
+        XCTAssertEqual(player.lossConcealer?.gaps, 1)
+
+        let out = drain(player)
+        XCTAssertEqual(out.count, 2400)
+        XCTAssertEqual(Array(out[..<960]), tone(960))
+        // The first 10 ms of a gap play at full level.
+        XCTAssertGreaterThan(out[960..<1440].map { abs(Int($0)) }.max()!, 6000)
+        XCTAssertEqual(Array(out[1700...]), Array(tone(960, from: 1440)[260...]))
+    }
+
+    /// Stands in for a backend: reconfigures the player when it switches
+    /// and remembers at which frame that was.
+    func switching(_ player : AUHALAudioPlayer) -> () -> [UInt64] {
+        var at = [UInt64]()
+        player.onFormatSwitch = { [unowned player] format in
+            at.append(player.framesEnqueued)
+            player.setFormat(format)
+        }
+        return { at }
+    }
+
+    /// The switch lands on the announced frame in the middle of a buffer.
+    /// The frame size stays, so nothing buffered is lost.
+    func testSwitchesRateAtExactFrame() {
+        let player = AUHALAudioPlayer()
+        player.initRing(outFormat: mono)
+        let switches = switching(player)
+        let slower = StreamFormat.pcm16(sampleRate: 44100, channels: 1)
+        player.scheduleFormat(slower, at: 1000)
+        for i in 0..<3 {
+            enqueue(player, tone(480, from: 480 * i))
+        }
+        XCTAssertEqual(switches(), [1000])
+        XCTAssertEqual(player.outAudioF, slower)
+        XCTAssertNil(player.pendingFormat)
+        XCTAssertEqual(player.framesEnqueued, 1440)
+        XCTAssertEqual(drain(player), tone(1440))
+    }
+
+    /// Frames after the switch are counted in the new frame size.
+    func testSwitchesChannelsAtExactFrame() {
+        let player = AUHALAudioPlayer()
+        player.initRing(outFormat: mono)
+        let switches = switching(player)
+        let stereo = StreamFormat.pcm16(sampleRate: 48000, channels: 2)
+        player.scheduleFormat(stereo, at: 1000)
+        enqueue(player, tone(480))
+        enqueue(player, tone(480, from: 480))
+        // 40 mono frames, then 100 stereo frames, in one buffer.
+        enqueue(player, tone(40, from: 960) + tone(100, from: 1000, channels: 2))
+        XCTAssertEqual(switches(), [1000])
+        XCTAssertEqual(player.outAudioF, stereo)
+        XCTAssertEqual(player.framesEnqueued, 1100)
+        // A new frame size starts the ringbuffer over.
+        XCTAssertEqual(drain(player), tone(100, from: 1000, channels: 2))
+    }
+
+    /// A change announced for a frame already enqueued applies right away.
+    func testSwitchesLateAnnouncementRightAway() {
+        let player = AUHALAudioPlayer()
+        player.initRing(outFormat: mono)
+        let switches = switching(player)
+        enqueue(player, tone(480))
+        player.scheduleFormat(StreamFormat.pcm16(sampleRate: 44100, channels: 1), at: 400)
+        XCTAssertEqual(switches(), [480])
+        enqueue(player, tone(480, from: 480))
+        XCTAssertEqual(switches(), [480])
+    }
+
+    /// Concealing a 512 frame render of stereo, right after real audio each
+    /// time, so every gap starts with a period search.
+    func testConcealBenchmark() {
+        let lc = LossConcealer(channels: 2, sampleRate: 48000)
+        var pcm = tone(512, channels: 2)
+        var out = [Int16](repeating: 0, count: 1024)
+        measure {
+            for _ in 0..<5_000 {
+                pcm.withUnsafeMutableBufferPointer { lc.played($0.baseAddress!, frames: 512) }
+                out.withUnsafeMutableBufferPointer { lc.conceal($0.baseAddress!, frames: 512) }
+            }
+        }
+    }
+}
@@ -0,0 +1,141 @@
+//
+//  BinaryPlistTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+@testable import iAudioServerCore
+
+final class BinaryPlistTests : XCTestCase {
+
+    /// Integers and reals come back as NSNumber.
+    func int(_ o : Any?) -> Int? {
+        return (o as? NSNumber)?.intValue
+    }
+
+    func testRoundTripsMessage() throws {
+        let message : [String : Any] = [
+            "MessageType"         : "Connect",
+            "ClientVersionString" : "libusbmuxd 2.0.2",
+            "DeviceID"            : 3,
+            "PortNumber"          : 7000,
+            "Big"                 : 70_000,
+            "Huge"                : 5_000_000_000,
+            "Negative"            : -42,
+            "Attached"            : true,
+            "Detached"            : false,
+            "Ratio"               : 0.25,
+            "Blob"                : Data([0, 1, 2, 0xFF]),
+            "Name"                : "Travis’s iPad",
+            "Properties"          : ["SerialNumber" : "abc", "Codecs" : [1, 2, 4]] as [String : Any],
+        ]
+        let plist = try BinaryPlist.decode(try BinaryPlist.encode(message))
+        guard let d = plist as? [String : Any] else {
+            return XCTFail("Not a dictionary")
+        }
+        XCTAssertEqual(d.count, message.count)
+        XCTAssertEqual(d["MessageType"] as? String, "Connect")
+        XCTAssertEqual(d["ClientVersionString"] as? String, "libusbmuxd 2.0.2")
+        XCTAssertEqual(int(d["DeviceID"]), 3)
+        XCTAssertEqual(int(d["PortNumber"]), 7000)
+        XCTAssertEqual(int(d["Big"]), 70_000)
+        XCTAssertEqual(int(d["Huge"]), 5_000_000_000)
+        XCTAssertEqual(int(d["Negative"]), -42)
+        XCTAssertEqual(d["Attached"] as? Bool, true)
+        XCTAssertEqual(d["Detached"] as? Bool, false)
+        XCTAssertEqual((d["Ratio"] as? NSNumber)?.doubleValue, 0.25)
+        XCTAssertEqual(d["Blob"] as? Data, Data([0, 1, 2, 0xFF]))
+        XCTAssertEqual(d["Name"] as? String, "Travis’s iPad")
+
+        let props = d["Properties"] as? [String : Any]
+        XCTAssertEqual(props?["SerialNumber"] as? String, "abc")
+        XCTAssertEqual((props?["Codecs"] as? [Any])?.compactMap { int($0) }, [1, 2, 4])
+    }
+
+    /// Enough objects and bytes for two byte references and offsets.
+    func testRoundTripsLargePlist() throws {
+        let numbers = Array(0..<300)
+        let blob = Data((0..<1000).map { UInt8(truncatingIfNeeded: $0) })
+        let plist = try BinaryPlist.decode(try BinaryPlist.encode(["Numbers" : numbers, "Blob" : blob]))
+        let d = plist as? [String : Any]
+        XCTAssertEqual((d?["Numbers"] as? [Any])?.compactMap { int($0) }, numbers)
+        XCTAssertEqual(d?["Blob"] as? Data, blob)
+    }
+
+    /// Plists from Foundation (what usbmuxd sends is written the same way)
+    /// decode, and ours are readable by Foundation.
+    func testInteroperatesWithFoundation() throws {
+        let event : [String : Any] = [
+            "MessageType" : "Attached",
+            "DeviceID"    : 7,
+            "Properties"  : ["ConnectionType" : "USB", "LocationID" : 337641472] as [String : Any],
+        ]
+        let theirs = try PropertyListSerialization.data(fromPropertyList: event, format: .binary, options: 0)
+        let d = try BinaryPlist.decode(theirs) as? [String : Any]
+        XCTAssertEqual(d?["MessageType"] as? String, "Attached")
+        XCTAssertEqual(int(d?["DeviceID"]), 7)
+        XCTAssertEqual(int((d?["Properties"] as? [String : Any])?["LocationID"]), 337641472)
+
+        let ours = try BinaryPlist.encode(event)
+        var fmt = PropertyListSerialization.PropertyListFormat.xml
+        let back = try PropertyListSerialization.propertyList(from: ours, format: &fmt) as? [String : Any]
+        XCTAssertEqual(fmt, .binary)
+        XCTAssertEqual(back?["MessageType"] as? String, "Attached")
+        XCTAssertEqual(int(back?["DeviceID"]), 7)
+    }
+
+    func testRejectsUnsupportedTypes() {
+        XCTAssertThrowsError(try BinaryPlist.encode(["When" : Date()]))
+        XCTAssertThrowsError(try BinaryPlist.encode([NSNull()]))
+    }
+
+    func testRejectsMalformedPlist() throws {
+        let good = try BinaryPlist.encode(["MessageType" : "Result", "Number" : 0])
+        XCTAssertThrowsError(try BinaryPlist.decode(good.prefix(good.count - 1)))
+        XCTAssertThrowsError(try BinaryPlist.decode(Data("bplist00".utf8)))
+        XCTAssertThrowsError(try BinaryPlist.decode(Data("<?xml version=\"1.0\"?>".utf8)))
+
+        // An array containing itself.
+        var cycle = Data("bplist00".utf8)
+        cycle.append(contentsOf: [0xA1, 0x00, 0x08])
+        cycle.append(contentsOf: [0, 0, 0, 0, 0, 0, 1, 1])
+        cycle.append(contentsOf: [0, 0, 0, 0, 0, 0, 0, 1])
+        cycle.append(contentsOf: [0, 0, 0, 0, 0, 0, 0, 0])
+        cycle.append(contentsOf: [0, 0, 0, 0, 0, 0, 0, 10])
+        XCTAssertThrowsError(try BinaryPlist.decode(cycle))
+
+        // Random bytes behind a valid header must not trap.
+        var seed : UInt32 = 11
+        for _ in 0..<200 {
+            var garbage = Data("bplist00".utf8)
+            garbage.append(Data((0..<64).map { _ -> UInt8 in
+                seed = seed &* 1664525 &+ 1013904223
+                return UInt8(truncatingIfNeeded: seed >> 24)
+            }))
+            _ = try? BinaryPlist.decode(garbage)
+        }
+    }
+
+    /// 10k usbmuxd requests and device events, each encoded and decoded.
+    func testMessagesBenchmark() {
+        let connect : [String : Any] = [
+            "MessageType"         : "Connect",
+            "ClientVersionString" : "libusbmuxd 2.0.2",
+            "ProgName"            : "iAudioServer",
+            "DeviceID"            : 3,
+            "PortNumber"          : 0x581B,
+        ]
+        let attached : [String : Any] = [
+            "MessageType" : "Attached",
+            "DeviceID"    : 3,
+            "Properties"  : ["ConnectionType" : "USB", "DeviceID" : 3, "LocationID" : 337641472,
+                             "ProductID" : 0x12AB, "SerialNumber" : "00008030001A2B3C4D5E6F70"] as [String : Any],
+        ]
+        measure {
+            for i in 0..<10_000 {
+                let d = try? BinaryPlist.decode(try BinaryPlist.encode(i % 2 == 0 ? connect : attached))
+                XCTAssertNotNil(d)
+            }
+        }
+    }
+}
@@ -0,0 +1,143 @@
+//
+//  ChannelMapperTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+#if canImport(AVFoundation)
+import AVFoundation
+#endif
+@testable import iAudioCommon
+
+/// Every kernel is checked against a plain loop over an odd frame count, so
+/// both the vector body and the scalar tail run.
+final class ChannelMapperTests : XCTestCase {
+
+    let frames = 19
+
+    /// Deterministic samples, with both extremes thrown in.
+    func samples(_ count : Int) -> [Int16] {
+        var seed : UInt32 = 3
+        var pcm = (0..<count).map { _ -> Int16 in
+            seed = seed &* 1664525 &+ 1013904223
+            return Int16(truncatingIfNeeded: seed >> 16)
+        }
+        pcm[0] = Int16.max
+        pcm[1] = Int16.max
+        pcm[2] = Int16.min
+        pcm[3] = Int16.min
+        pcm[count - 1] = Int16.min
+        return pcm
+    }
+
+    func testUpmixesMono() {
+        let src = samples(frames)
+        var dst = [Int16](repeating: 0, count: 2 * frames)
+        ChannelMapper.upmixMono(src, &dst, frames)
+        XCTAssertEqual(dst, src.flatMap { [$0, $0] })
+    }
+
+    func testDownmixesStereo() {
+        let src = samples(2 * frames)
+        var dst = [Int16](repeating: 0, count: frames)
+        ChannelMapper.downmixStereo(src, &dst, frames)
+        let expected = (0..<frames).map {
+            Int16((Int32(src[2 * $0]) + Int32(src[2 * $0 + 1])) >> 1)
+        }
+        XCTAssertEqual(dst, expected)
+    }
+
+    /// Odd sums of either sign round the same way in both paths.
+    func testDownmixRoundsConsistently() {
+        let pairs : [Int16] = [1, 2, -1, -2, 3, 0, -3, 0, Int16.max, Int16.min, -1, 0, 1, 0, 7, -8]
+        // Two vectors, then seven frames for the scalar tail.
+        let src = pairs + pairs + pairs
+        let n = 23
+        var dst = [Int16](repeating: 0, count: n)
+        ChannelMapper.downmixStereo(src, &dst, n)
+        XCTAssertEqual(Array(dst[0..<8]), [1, -2, 1, -2, -1, -1, 0, -1])
+        XCTAssertEqual(Array(dst[8..<16]), Array(dst[0..<8]))
+        XCTAssertEqual(Array(dst[16..<23]), Array(dst[0..<7]))
+    }
+
+    func testDeinterleavesStereo() {
+        let src = samples(2 * frames)
+        var left = [Int16](repeating: 0, count: frames)
+        var right = [Int16](repeating: 0, count: frames)
+        ChannelMapper.deinterleaveStereo(src, &left, &right, frames)
+        XCTAssertEqual(left, (0..<frames).map { src[2 * $0] })
+        XCTAssertEqual(right, (0..<frames).map { src[2 * $0 + 1] })
+    }
+
+    func testExtractsChannel() {
+        let src = samples(3 * frames)
+        var dst = [Int16](repeating: 0, count: 2 * frames)
+        dst.withUnsafeMutableBufferPointer {
+            ChannelMapper.extract(src, 3, 2, $0.baseAddress! + 1, 2, frames)
+        }
+        XCTAssertEqual((0..<frames).map { dst[2 * $0 + 1] }, (0..<frames).map { src[3 * $0 + 2] })
+        XCTAssertEqual((0..<frames).map { dst[2 * $0] }, [Int16](repeating: 0, count: frames))
+    }
+
+    #if canImport(AVFoundation)
+    /// Buffers of channels channels each, frames long.
+    func bufferList(_ buffers : Int, channels : Int) -> UnsafeMutableAudioBufferListPointer {
+        let abl = AudioBufferList.allocate(maximumBuffers: buffers)
+        for b in 0..<buffers {
+            let size = frames * channels * 2
+            abl[b] = AudioBuffer(mNumberChannels: UInt32(channels), mDataByteSize: UInt32(size),
+                                 mData: UnsafeMutableRawPointer.allocate(byteCount: size, alignment: 16))
+        }
+        return abl
+    }
+
+    func release(_ abl : UnsafeMutableAudioBufferListPointer) {
+        for b in abl {
+            b.mData?.deallocate()
+        }
+        abl.unsafeMutablePointer.deallocate()
+    }
+
+    func contents(_ b : AudioBuffer) -> [Int16] {
+        let p = b.mData!.assumingMemoryBound(to: Int16.self)
+        return Array(UnsafeBufferPointer(start: p, count: Int(b.mDataByteSize) / 2))
+    }
+
+    /// Three channels into an interleaved stereo buffer keeps the first two.
+    func testMapsToFewerInterleavedChannels() {
+        let src = samples(3 * frames)
+        let abl = bufferList(1, channels: 2)
+        defer { release(abl) }
+        ChannelMapper.map(src, channels: 3, frames: frames, into: abl)
+        XCTAssertEqual(contents(abl[0]), (0..<frames).flatMap { [src[3 * $0], src[3 * $0 + 1]] })
+    }
+
+    /// Mono into a buffer per channel copies it to both.
+    func testMapsMonoToChannelBuffers() {
+        let src = samples(frames)
+        let abl = bufferList(2, channels: 1)
+        defer { release(abl) }
+        ChannelMapper.map(src, channels: 1, frames: frames, into: abl)
+        XCTAssertEqual(contents(abl[0]), src)
+        XCTAssertEqual(contents(abl[1]), src)
+    }
+    #endif
+
+    /// The three vector kernels on a 512 frame render each, the way
+    /// RemoteIO asks for stereo, mono and a buffer per channel.
+    func testKernelsBenchmark() {
+        let n = 512
+        let mono = samples(n)
+        let stereo = samples(2 * n)
+        var wide = [Int16](repeating: 0, count: 2 * n)
+        var narrow = [Int16](repeating: 0, count: n)
+        var right = [Int16](repeating: 0, count: n)
+        measure {
+            for _ in 0..<20_000 {
+                ChannelMapper.upmixMono(mono, &wide, n)
+                ChannelMapper.downmixStereo(stereo, &narrow, n)
+                ChannelMapper.deinterleaveStereo(stereo, &narrow, &right, n)
+            }
+        }
+    }
+}
@@ -0,0 +1,108 @@
+//
+//  ClientEngineSoakTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+import Socket
+@testable import iAudioCommon
+
+/// Runs ClientEngine headless (PulledAudioBackend) against a fake server on
+/// loopback. The server side streams 48 kHz stereo from a Reactor timer,
+/// paced by the clock the way the capture unit is. IAUDIO_SOAK_SECONDS sets
+/// the length, 5 s by default; run it for an hour to catch slow leaks and
+/// drift.
+final class ClientEngineSoakTests : XCTestCase {
+
+    let format = StreamFormat.pcm16(sampleRate: 48000, channels: 2)
+    let framesPerPacket = 480
+
+    var seconds : Double {
+        return Double(ProcessInfo.processInfo.environment["IAUDIO_SOAK_SECONDS"] ?? "") ?? 5
+    }
+
+    /// A frame as the server sends it: signature, length, payload.
+    func frame(_ sig : UInt8, _ payload : Data) -> Data {
+        var len = UInt32(payload.count)
+        var f = Data([0x69, 0x4, sig, 0])
+        f.append(Data(bytes: &len, count: 4))
+        f.append(payload)
+        return f
+    }
+
+    func testStreamsWithoutUnderruns() throws {
+        var backend : PulledAudioBackend?
+        let engine = ClientEngine {
+            let b = PulledAudioBackend()
+            backend = b
+            return b
+        }
+        var reports = 0
+        engine.onStats = { _ in reports += 1 }
+        let ended = expectation(description: "session ended")
+        engine.onSessionEnded = { ended.fulfill() }
+        try engine.startListening(port: 0)
+        defer { engine.stopListening() }
+
+        // Trade hellos like the server. Without a session ID the session
+        // ends as soon as the socket closes instead of waiting for a resume.
+        let server = try Socket.create(family: .inet, type: .stream, proto: .tcp)
+        try server.connect(to: "127.0.0.1", port: engine.listener!.listeningPort)
+        try server.setReadTimeout(value: 3000)
+        let hello = try SessionResume.readHello(server)
+        XCTAssertTrue(hello.hello.hasPrefix("Hello from iPad"))
+        var start = SessionResume.framed("Hello from computer")
+        start.append(frame(0x19, format.data))
+        _ = try server.write(from: start)
+        try server.setBlocking(mode: false)
+
+        let packet = frame(0x20, Data((0..<framesPerPacket * 4).map { UInt8(truncatingIfNeeded: $0) }))
+        let fd = server.socketfd
+        let began = DispatchTime.now().uptimeNanoseconds
+        var sent = 0
+        var shortWrites = 0
+        var underruns = -1
+        var timer : DispatchSourceTimer?
+        let streamed = expectation(description: "streamed")
+
+        // What the client sends back (clock pings, heartbeats, telemetry)
+        // is read and dropped, so its outbox never fills.
+        let drain = Reactor.shared.watchRead(fd) {
+            var buf = [UInt8](repeating: 0, count: 4096)
+            while buf.withUnsafeMutableBytes({ Reactor.read(fd, $0.baseAddress!, $0.count) }) > 0 {}
+        }
+        // Sends whatever is due by the clock, so late ticks don't slow the
+        // stream down.
+        timer = Reactor.shared.every(0.005) { [unowned self] in
+            let elapsed = Double(DispatchTime.now().uptimeNanoseconds - began) / 1e9
+            while Double(sent) < elapsed * self.format.mSampleRate {
+                let n = packet.withUnsafeBytes { Reactor.write(fd, $0.baseAddress!, $0.count) }
+                if n != packet.count {
+                    shortWrites += 1
+                }
+                sent += self.framesPerPacket
+            }
+            if elapsed >= self.seconds {
+                // Before the stream stops and the player runs dry.
+                underruns = backend?.auhalPlayer?.underruns ?? -1
+                timer?.cancel()
+                drain.cancel()
+                streamed.fulfill()
+            }
+        }
+        wait(for: [streamed], timeout: seconds + 10)
+
+        let player = try XCTUnwrap(backend?.auhalPlayer)
+        let played = Double(player.bytesRendered) / Double(format.mBytesPerFrame) / format.mSampleRate
+        XCTAssertEqual(shortWrites, 0)
+        XCTAssertEqual(played, seconds, accuracy: 0.05 * seconds + 0.2)
+        XCTAssertGreaterThanOrEqual(underruns, 0)
+        XCTAssertLessThanOrEqual(underruns, Int(seconds / 10) + 1)
+        XCTAssertEqual(player.overflowBytes, 0)
+        XCTAssertGreaterThanOrEqual(reports, Int(seconds) - 1)
+
+        server.close()
+        wait(for: [ended], timeout: 3)
+        XCTAssertEqual(backend?.initted, false)
+    }
+}
@@ -0,0 +1,90 @@
+//
+//  ClockSyncTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+@testable import iAudioCommon
+
+final class ClockSyncTests : XCTestCase {
+
+    /// A peer whose clock is offset ns ahead of ours and runs skew fast.
+    struct PeerClock {
+        let offset : Double
+        let skew : Double
+
+        func remote(_ local : Double) -> Double {
+            return local + offset + skew * local
+        }
+
+        func local(_ remote : Double) -> Double {
+            return (remote - offset) / (1 + skew)
+        }
+    }
+
+    /// Deterministic noise in [0, 1), so failures reproduce.
+    struct Noise {
+        var state : UInt64
+
+        mutating func next() -> Double {
+            state = state &* 6364136223846793005 &+ 1442695040888963407
+            return Double(state >> 11) / Double(UInt64(1) << 53)
+        }
+    }
+
+    /// One ping/pong that took up ns to the peer and down ns back.
+    func exchange(_ sync : ClockSync, _ peer : PeerClock, at t1 : Double, up : Double, down : Double) {
+        let t2 = peer.remote(t1 + up)
+        let t3 = t2 + 20_000
+        let t4 = peer.local(t3) + down
+        sync.addExchange(t1: UInt64(t1), t2: UInt64(t2), t3: UInt64(t3), t4: UInt64(t4))
+    }
+
+    func testConvergesOnSkewedClock() {
+        let peer = PeerClock(offset: 3.7e9, skew: 80e-6)
+        let sync = ClockSync()
+        var noise = Noise(state: 29)
+        var t = 1e12
+        for i in 0..<64 {
+            var up = 300_000 + 50_000 * noise.next()
+            let down = 300_000 + 50_000 * noise.next()
+            // Every fifth ping got stuck in a queue on the way.
+            if i % 5 == 4 {
+                up += 5_000_000
+            }
+            exchange(sync, peer, at: t, up: up, down: down)
+            t += sync.interval * 1e9
+        }
+
+        XCTAssertTrue(sync.valid)
+        XCTAssertGreaterThan(sync.rejected, 0)
+        XCTAssertEqual(sync.skew, peer.skew, accuracy: 2e-6)
+
+        // A second past the last exchange the mapping still holds.
+        let local = t + 1e9
+        guard let remote = sync.toRemote(UInt64(local)) else {
+            return XCTFail("No estimate")
+        }
+        XCTAssertEqual(Double(remote), peer.remote(local), accuracy: 100_000)
+        XCTAssertEqual(Double(sync.toLocal(remote) ?? 0), local, accuracy: 1_000)
+    }
+
+    func testMapsNothingBeforeFirstExchange() {
+        let sync = ClockSync()
+        XCTAssertNil(sync.toRemote(1_000_000))
+        XCTAssertNil(sync.toLocal(1_000_000))
+    }
+
+    func testClampsOutOfRangeTimes() {
+        XCTAssertEqual(ClockSync.clamped(-5e9), 0)
+        XCTAssertEqual(ClockSync.clamped(.nan), 0)
+        XCTAssertEqual(ClockSync.clamped(2e19), UInt64.max)
+        XCTAssertEqual(ClockSync.clamped(1234), 1234)
+
+        // Peer far behind: our early times map before its zero.
+        let sync = ClockSync()
+        let peer = PeerClock(offset: -5e9, skew: 0)
+        exchange(sync, peer, at: 6e9, up: 100_000, down: 100_000)
+        XCTAssertEqual(sync.toRemote(1_000_000), 0)
+    }
+}
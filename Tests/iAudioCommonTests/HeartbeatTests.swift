@@ -0,0 +1,90 @@
+//
+//  HeartbeatTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+import Socket
+@testable import iAudioCommon
+
+final class HeartbeatTests : XCTestCase {
+
+    func seconds(since start : UInt64) -> Double {
+        return Double(DispatchTime.now().uptimeNanoseconds - start) / 1e9
+    }
+
+    /// missCount intervals of silence, 500 ms by default, and the peer is
+    /// gone. Heartbeats go out meanwhile.
+    func testDeclaresSilentPeerDead() {
+        let hb = Heartbeat()
+        var beats = 0
+        hb.sendBeat = { beats += 1 }
+        let lost = expectation(description: "peer lost")
+        let start = DispatchTime.now().uptimeNanoseconds
+        var latency = 0.0
+        hb.onPeerLost = {
+            latency = self.seconds(since: start)
+            lost.fulfill()
+        }
+        hb.start()
+        wait(for: [lost], timeout: 2)
+        XCTAssertGreaterThan(latency, 0.5)
+        XCTAssertLessThan(latency, 0.7)
+        XCTAssertGreaterThanOrEqual(beats, 4)
+        XCTAssertNil(hb.timer)
+    }
+
+    /// A peer that keeps sending is never declared dead.
+    func testKeepsPeerThatIsHeard() {
+        let hb = Heartbeat()
+        hb.onPeerLost = { XCTFail("Peer declared dead") }
+        hb.start()
+        for _ in 0..<10 {
+            usleep(100_000)
+            Reactor.shared.queue.sync { hb.heard() }
+        }
+        hb.stop()
+        Reactor.shared.queue.sync {}
+    }
+
+    /// A transceiver whose peer went silent ends the session in about
+    /// 500 ms, and only once, however many more times it is terminated.
+    func testTransceiverTerminatesOnce() throws {
+        let listener = try Socket.create()
+        defer { listener.close() }
+        try listener.listen(on: 0, node: "127.0.0.1")
+        let sock = try Socket.create()
+        try sock.connect(to: "127.0.0.1", port: listener.listeningPort)
+        let peer = try listener.acceptClientConnection()
+        defer { peer.close() }
+
+        let lock = DispatchSemaphore(value: 1)
+        var terminations = 0
+        let ended = expectation(description: "session ended")
+        let start = DispatchTime.now().uptimeNanoseconds
+        var latency = 0.0
+        let trans = PCMTransceiver(sock, dataCallback: { _, _ in }, handshakeCallback: nil,
+                                   terminatedCallback: {
+            lock.wait()
+            terminations += 1
+            if terminations == 1 {
+                latency = self.seconds(since: start)
+                ended.fulfill()
+            }
+            lock.signal()
+        })
+        try trans.start()
+        wait(for: [ended], timeout: 2)
+        XCTAssertGreaterThan(latency, 0.5)
+        XCTAssertLessThan(latency, 0.8)
+
+        DispatchQueue.concurrentPerform(iterations: 8) { _ in
+            trans.terminate()
+        }
+        usleep(200_000)
+        lock.wait()
+        XCTAssertEqual(terminations, 1)
+        lock.signal()
+        XCTAssertTrue(trans.isTerminated)
+    }
+}
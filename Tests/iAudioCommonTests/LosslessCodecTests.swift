@@ -0,0 +1,95 @@
+//
+//  LosslessCodecTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+@testable import iAudioCommon
+
+final class LosslessCodecTests : XCTestCase {
+
+    func encode(_ pcm : [Int16], channels : Int) -> Data {
+        var coded = Data()
+        pcm.withUnsafeBufferPointer {
+            LosslessCodec().encode($0.baseAddress!, frames: pcm.count / channels,
+                                   channels: channels, into: &coded)
+        }
+        return coded
+    }
+
+    /// The decoded samples, nil if the decoder rejected the packet.
+    func decode(_ coded : Data) -> [Int16]? {
+        var out = Data()
+        let ok = coded.withUnsafeBytes { LosslessCodec().decode($0, into: &out) }
+        if !ok {
+            return nil
+        }
+        var pcm = [Int16](repeating: 0, count: out.count / 2)
+        _ = pcm.withUnsafeMutableBytes { out.copyBytes(to: $0) }
+        return pcm
+    }
+
+    /// Stereo with a sine on the left and noise on the right, then silence,
+    /// then full scale swings, the worst case for the predictors.
+    func testStereoRoundTrip() {
+        var pcm = [Int16]()
+        var seed : UInt32 = 31
+        for i in 0..<1500 {
+            seed = seed &* 1664525 &+ 1013904223
+            if i < 500 {
+                pcm.append(Int16(12000 * sin(Double(i) * 2 * .pi * 440 / 48000)))
+                pcm.append(Int16(truncatingIfNeeded: seed >> 16))
+            } else if i < 1000 {
+                pcm.append(0)
+                pcm.append(0)
+            } else {
+                pcm.append(i % 2 == 0 ? Int16.min : Int16.max)
+                pcm.append(i % 3 == 0 ? Int16.max : Int16.min)
+            }
+        }
+        let coded = encode(pcm, channels: 2)
+        XCTAssertEqual(decode(coded), pcm)
+    }
+
+    func testCompressesTonalAudio() {
+        let pcm = (0..<960).map { Int16(8000 * sin(Double($0) * 2 * .pi * 440 / 48000)) }
+        let coded = encode(pcm, channels: 1)
+        // Less than half the PCM bytes.
+        XCTAssertLessThan(coded.count, pcm.count)
+        XCTAssertEqual(decode(coded), pcm)
+    }
+
+    /// More frames than a block header can count are split into blocks.
+    func testSplitsLongInput() {
+        let frames = LosslessCodec.kMaxBlockFrames + 1000
+        let pcm = (0..<frames).map { Int16(truncatingIfNeeded: $0 &* 37) }
+        XCTAssertEqual(decode(encode(pcm, channels: 1)), pcm)
+    }
+
+    func testRejectsTruncatedPacket() {
+        var seed : UInt32 = 7
+        let pcm = (0..<512).map { _ -> Int16 in
+            seed = seed &* 1664525 &+ 1013904223
+            return Int16(truncatingIfNeeded: seed >> 20)
+        }
+        let coded = encode(pcm, channels: 2)
+        XCTAssertNil(decode(coded.prefix(coded.count - 3)))
+        XCTAssertNil(decode(coded.prefix(2)))
+    }
+
+    /// A header claiming a full block in a few bytes, and random bytes, are
+    /// rejected without trapping or allocating for the claim.
+    func testRejectsCorruptPacket() {
+        XCTAssertNil(decode(Data([0xFF, 0xFF, 0x08, 0x04, 0x00, 0x00])))
+        XCTAssertNil(decode(Data([0x10, 0x00, 0x00])))
+
+        var seed : UInt32 = 5
+        for _ in 0..<200 {
+            let garbage = Data((0..<64).map { _ -> UInt8 in
+                seed = seed &* 1664525 &+ 1013904223
+                return UInt8(truncatingIfNeeded: seed >> 24)
+            })
+            _ = decode(garbage)
+        }
+    }
+}
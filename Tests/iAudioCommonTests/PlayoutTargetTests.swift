@@ -0,0 +1,155 @@
+//
+//  PlayoutTargetTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+@testable import iAudioCommon
+
+/// Replays arrival traces through the player's render path and through the
+/// fixed thresholds it used before PlayoutTarget, on a virtual clock.
+final class PlayoutTargetTests : XCTestCase {
+
+    static let kRate = 48000.0
+
+    /// Deterministic noise in [0, 1), so failures reproduce.
+    struct Noise {
+        var state : UInt64
+
+        mutating func next() -> Double {
+            state = state &* 6364136223846793005 &+ 1442695040888963407
+            return Double(state >> 11) / Double(UInt64(1) << 53)
+        }
+    }
+
+    /// Arrival times (seconds) of packets of frames each, sent back to back
+    /// and delayed 2 ms plus up to spread seconds on the way. Packets stay
+    /// in order, so one held up holds up the ones behind it, as on a TCP
+    /// connection through usbmuxd.
+    func trace(seconds : Double, frames : Int, spread : Double, seed : UInt64) -> [Double] {
+        var noise = Noise(state: seed)
+        var arrivals = [Double]()
+        var last = 0.0
+        let count = Int(seconds * PlayoutTargetTests.kRate) / frames
+        for i in 0..<count {
+            let sent = Double(i * frames) / PlayoutTargetTests.kRate
+            last = max(last, sent + 0.002 + spread * noise.next())
+            arrivals.append(last)
+        }
+        return arrivals
+    }
+
+    /// Renders that found too little audio, mean seconds from sending to
+    /// playing out over the renders that played audio, and the playout
+    /// target at the end.
+    struct Result {
+        var underruns = 0
+        var latency = 0.0
+        var target = 0.0
+    }
+
+    /// The player, rendering quantum frames whenever a quantum's worth of
+    /// time passed.
+    func replay(_ arrivals : [Double], frames : Int, quantum : Int) -> Result {
+        let player = AUHALAudioPlayer()
+        var now : UInt64 = 0
+        player.uptime = { now }
+        player.initRing(outFormat: StreamFormat.pcm16(sampleRate: PlayoutTargetTests.kRate, channels: 1))
+
+        var pcm = [Int16](repeating: 0, count: frames)
+        var out = [Int16](repeating: 0, count: quantum)
+        var sent = 0
+        var next = 0
+        var plays = 0
+        var latency = 0.0
+        var t = 0.0
+        while next < arrivals.count {
+            while next < arrivals.count && arrivals[next] <= t {
+                now = UInt64(arrivals[next] * 1e9)
+                for i in 0..<frames {
+                    pcm[i] = Int16(8000 * sin(2 * Double.pi * 220 * Double(sent + i) / PlayoutTargetTests.kRate))
+                }
+                sent += frames
+                pcm.withUnsafeMutableBytes {
+                    player.enqueuePCM($0.baseAddress!.assumingMemoryBound(to: Int8.self), $0.count)
+                }
+                next += 1
+            }
+            out.withUnsafeMutableBytes {
+                player.render($0.baseAddress!, $0.count)
+            }
+            if !player.priming {
+                // The render played the quantum before everything not yet
+                // consumed.
+                let consumed = Int(player.framesEnqueued) - player.sRingbuffer.availableToRead / 2
+                latency += t - Double(consumed - quantum) / PlayoutTargetTests.kRate
+                plays += 1
+            }
+            t += Double(quantum) / PlayoutTargetTests.kRate
+        }
+        return Result(underruns: player.underruns, latency: latency / Double(max(plays, 1)),
+                      target: player.playout.target)
+    }
+
+    /// The same, with the render policy before PlayoutTarget: play whenever
+    /// a quantum is buffered, silence otherwise, and skip a quarter quantum
+    /// once two were buffered and another full one at four.
+    func replayFixedThresholds(_ arrivals : [Double], frames : Int, quantum : Int) -> Result {
+        var buffered = 0
+        var consumed = 0
+        var played = false
+        var result = Result()
+        var plays = 0
+        var next = 0
+        var t = 0.0
+        while next < arrivals.count {
+            while next < arrivals.count && arrivals[next] <= t {
+                buffered += frames
+                next += 1
+            }
+            let fresh = buffered
+            if fresh >= quantum {
+                result.latency += t - Double(consumed) / PlayoutTargetTests.kRate
+                plays += 1
+                buffered -= quantum
+                consumed += quantum
+                played = true
+            } else if played {
+                result.underruns += 1
+            }
+            for (threshold, skip) in [(2 * quantum, quantum / 4), (4 * quantum, quantum)] where fresh >= threshold {
+                let n = min(buffered, skip)
+                buffered -= n
+                consumed += n
+            }
+            t += Double(quantum) / PlayoutTargetTests.kRate
+        }
+        result.latency /= Double(max(plays, 1))
+        return result
+    }
+
+    /// Delays of 2 to 17 ms against a 512 frame render quantum. The fixed
+    /// thresholds kept about a quantum buffered and ran dry on every late
+    /// packet. The player buffers its target instead and doesn't, and that
+    /// costs it less latency than the target.
+    func testFewerUnderrunsOnJitteryTrace() {
+        let arrivals = trace(seconds: 20, frames: 128, spread: 0.015, seed: 42)
+        let fixed = replayFixedThresholds(arrivals, frames: 128, quantum: 512)
+        let adaptive = replay(arrivals, frames: 128, quantum: 512)
+        XCTAssertGreaterThan(fixed.underruns, 40)
+        XCTAssertLessThan(adaptive.underruns, fixed.underruns / 10)
+        XCTAssertLessThan(adaptive.latency, fixed.latency + adaptive.target)
+    }
+
+    /// Delays of 2 to 4 ms against a 1024 frame render quantum. The fixed
+    /// thresholds only started skipping at two quanta, so they sat between
+    /// one and two whatever the jitter. The player keeps its 10 ms minimum
+    /// target on top of one.
+    func testLowerLatencyOnSteadyTrace() {
+        let arrivals = trace(seconds: 20, frames: 128, spread: 0.002, seed: 7)
+        let fixed = replayFixedThresholds(arrivals, frames: 128, quantum: 1024)
+        let adaptive = replay(arrivals, frames: 128, quantum: 1024)
+        XCTAssertLessThanOrEqual(adaptive.underruns, fixed.underruns)
+        XCTAssertLessThan(adaptive.latency, fixed.latency - 0.002)
+    }
+}
@@ -0,0 +1,108 @@
+//
+//  ReactorTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+import Socket
+@testable import iAudioCommon
+
+final class ReactorTests : XCTestCase {
+
+    /// Writing to a peer that hung up fails instead of raising SIGPIPE,
+    /// which would kill the test run.
+    func testWriteToClosedPeerFails() throws {
+        let listener = try Socket.create(family: .inet, type: .stream, proto: .tcp)
+        defer { listener.close() }
+        try listener.listen(on: 0, node: "127.0.0.1")
+        let a = try Socket.create(family: .inet, type: .stream, proto: .tcp)
+        defer { a.close() }
+        try a.connect(to: "127.0.0.1", port: listener.listeningPort)
+        let b = try listener.acceptClientConnection()
+        try a.setBlocking(mode: false)
+        b.close()
+
+        // The first write may still go out and draw the reset.
+        let bytes = [UInt8](repeating: 7, count: 1024)
+        var n = 0
+        var err : Int32 = 0
+        for _ in 0..<100 {
+            n = bytes.withUnsafeBytes { Reactor.write(a.socketfd, $0.baseAddress!, $0.count) }
+            if n < 0 && !Reactor.wouldBlock() {
+                err = errno
+                break
+            }
+            usleep(1000)
+        }
+        XCTAssertEqual(n, -1)
+        XCTAssertTrue(err == EPIPE || err == ECONNRESET)
+    }
+
+    /// 48 connections each bouncing a message back and forth 100 times, all
+    /// at once on the reactor, the way it serves every device's socket.
+    func testManyPeersBenchmark() throws {
+        let listener = try Socket.create(family: .inet, type: .stream, proto: .tcp)
+        defer { listener.close() }
+        try listener.listen(on: 0, node: "127.0.0.1")
+        var pairs = [(Socket, Socket)]()
+        defer {
+            for (a, b) in pairs {
+                a.close()
+                b.close()
+            }
+        }
+        for _ in 0..<48 {
+            let a = try Socket.create(family: .inet, type: .stream, proto: .tcp)
+            try a.connect(to: "127.0.0.1", port: listener.listeningPort)
+            let b = try listener.acceptClientConnection()
+            try a.setBlocking(mode: false)
+            try b.setBlocking(mode: false)
+            pairs.append((a, b))
+        }
+
+        // Handlers all run on the reactor queue, one at a time.
+        let buf = UnsafeMutableRawPointer.allocate(byteCount: 256, alignment: 8)
+        defer { buf.deallocate() }
+        let rounds = 100
+        measure {
+            let done = DispatchSemaphore(value: 0)
+            var sources = [DispatchSourceRead]()
+            for (a, b) in pairs {
+                let fa = a.socketfd
+                let fb = b.socketfd
+                var left = rounds
+                sources.append(Reactor.shared.watchRead(fb) {
+                    let n = Reactor.read(fb, buf, 256)
+                    if n > 0 {
+                        _ = Reactor.write(fb, buf, n)
+                    }
+                })
+                sources.append(Reactor.shared.watchRead(fa) {
+                    let n = Reactor.read(fa, buf, 256)
+                    if n <= 0 || left == 0 {
+                        return
+                    }
+                    left -= 1
+                    if left == 0 {
+                        done.signal()
+                    } else {
+                        _ = Reactor.write(fa, buf, n)
+                    }
+                })
+            }
+            memset(buf, 7, 64)
+            Reactor.shared.queue.sync {
+                for (a, _) in pairs {
+                    _ = Reactor.write(a.socketfd, buf, 64)
+                }
+            }
+            for _ in pairs {
+                XCTAssertEqual(done.wait(timeout: .now() + 10), .success)
+            }
+            for s in sources {
+                s.cancel()
+            }
+            Reactor.shared.queue.sync {}
+        }
+    }
+}
@@ -0,0 +1,107 @@
+//
+//  SPSCRingTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+@testable import iAudioCommon
+
+final class SPSCRingTests : XCTestCase {
+
+    func testWrapsAround() {
+        let ring = SPSCRing(minimumCapacity: 1000)
+        XCTAssertEqual(ring.capacity & ring.mask, 0)
+        XCTAssertGreaterThanOrEqual(ring.capacity, 1000)
+
+        // Walk the cursors most of the way round first.
+        var junk = [UInt8](repeating: 0, count: ring.capacity - 10)
+        XCTAssertEqual(ring.write(junk, junk.count), junk.count)
+        XCTAssertEqual(ring.read(into: &junk, junk.count), junk.count)
+
+        let bytes = (0..<100).map { UInt8($0) }
+        XCTAssertEqual(ring.write(bytes, bytes.count), 100)
+        var peeked = [UInt8](repeating: 0, count: 100)
+        XCTAssertEqual(ring.peek(into: &peeked, 100), 100)
+        XCTAssertEqual(peeked, bytes)
+        if ring.mirrored {
+            // Contiguous across the end of storage.
+            XCTAssertEqual(Array(UnsafeRawBufferPointer(start: ring.readPointer, count: 100)), bytes)
+        }
+        var out = [UInt8](repeating: 0, count: 100)
+        XCTAssertEqual(ring.read(into: &out, 200), 100)
+        XCTAssertEqual(out, bytes)
+        XCTAssertEqual(ring.availableToRead, 0)
+    }
+
+    func testStopsWhenFull() {
+        let ring = SPSCRing(minimumCapacity: 1)
+        let bytes = [UInt8](repeating: 7, count: ring.capacity + 5)
+        XCTAssertEqual(ring.write(bytes, bytes.count), ring.capacity)
+        XCTAssertEqual(ring.availableToWrite, 0)
+        XCTAssertEqual(ring.write(bytes, 1), 0)
+        XCTAssertEqual(ring.skip(5), 5)
+        XCTAssertEqual(ring.availableToWrite, 5)
+    }
+
+    /// Streams count UInt32s from one thread to another in uneven chunks,
+    /// so the cursors race on every size. Returns how many arrived in order.
+    func stream(_ ring : SPSCRing, count : Int) -> Int {
+        let done = DispatchSemaphore(value: 0)
+        Thread.detachNewThread {
+            var next : UInt32 = 0
+            var chunk = [UInt32](repeating: 0, count: 37)
+            while next < UInt32(count) {
+                let n = min(chunk.count, count - Int(next))
+                for i in 0..<n {
+                    chunk[i] = next + UInt32(i)
+                }
+                let bytes = n * 4
+                var sent = 0
+                while sent < bytes {
+                    sent += chunk.withUnsafeBytes { ring.write($0.baseAddress! + sent, bytes - sent) }
+                }
+                next += UInt32(n)
+            }
+            done.signal()
+        }
+        var expected : UInt32 = 0
+        var inOrder = 0
+        var chunk = [UInt32](repeating: 0, count: 53)
+        var partial = 0
+        while expected < UInt32(count) {
+            // Whole values only; a value split across reads is finished first.
+            let got = chunk.withUnsafeMutableBytes {
+                ring.read(into: $0.baseAddress! + partial, $0.count - partial)
+            }
+            partial += got
+            for i in 0..<partial / 4 {
+                if chunk[i] == expected {
+                    inOrder += 1
+                }
+                expected += 1
+            }
+            let whole = partial / 4 * 4
+            if whole > 0 && whole < partial {
+                chunk.withUnsafeMutableBytes {
+                    $0.baseAddress!.copyMemory(from: $0.baseAddress! + whole, byteCount: partial - whole)
+                }
+            }
+            partial -= whole
+        }
+        done.wait()
+        return inOrder
+    }
+
+    func testStreamsAcrossThreads() {
+        let ring = SPSCRing(minimumCapacity: 4096)
+        XCTAssertEqual(stream(ring, count: 1_000_000), 1_000_000)
+    }
+
+    /// Producer and consumer hammering one small ring.
+    func testContentionBenchmark() {
+        let ring = SPSCRing(minimumCapacity: 4096)
+        measure {
+            _ = stream(ring, count: 1_000_000)
+        }
+    }
+}
@@ -0,0 +1,58 @@
+//
+//  SessionResumeTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+import Socket
+@testable import iAudioCommon
+
+final class SessionResumeTests : XCTestCase {
+
+    /// A connected pair of blocking loopback sockets.
+    func socketPair() throws -> (Socket, Socket) {
+        let listener = try Socket.create()
+        defer { listener.close() }
+        try listener.listen(on: 0, node: "127.0.0.1")
+        let client = try Socket.create()
+        try client.connect(to: "127.0.0.1", port: listener.listeningPort)
+        return (client, try listener.acceptClientConnection())
+    }
+
+    /// The server writes the handshake right behind its hello.
+    func testKeepsBytesBehindHello() throws {
+        let (a, b) = try socketPair()
+        defer { a.close(); b.close() }
+        _ = try a.write(from: SessionResume.framed("Hello from computer session=7 udp=5000") + Data([1, 2, 3]))
+        let (hello, rest) = try SessionResume.readHello(b)
+        XCTAssertEqual(hello, "Hello from computer session=7 udp=5000")
+        XCTAssertEqual(SessionResume.session(fromHello: hello), 7)
+        XCTAssertNil(SessionResume.resumed(fromHello: hello))
+        // Whatever arrived in the same read is kept, the rest is still queued.
+        var more = Data()
+        while rest.count + more.count < 3 {
+            _ = try b.read(into: &more)
+        }
+        XCTAssertEqual(rest + more, Data([1, 2, 3]))
+    }
+
+    func testRejectsClosedAndOverlongHello() throws {
+        let (a, b) = try socketPair()
+        _ = try a.write(from: Data("Hello from iPad".utf8))
+        a.close()
+        XCTAssertThrowsError(try SessionResume.readHello(b))
+        b.close()
+
+        let (c, d) = try socketPair()
+        defer { c.close(); d.close() }
+        _ = try c.write(from: Data(repeating: 0x41, count: 2 * SessionResume.kMaxHello))
+        XCTAssertThrowsError(try SessionResume.readHello(d))
+    }
+
+    func testParsesResumeRequest() {
+        let r = SessionResume.request(fromHello: "Hello from iPad codecs=3 resume=42:96000 udp=6000")
+        XCTAssertEqual(r?.id, 42)
+        XCTAssertEqual(r?.frames, 96000)
+        XCTAssertNil(SessionResume.request(fromHello: "Hello from iPad codecs=3 resume=42"))
+    }
+}
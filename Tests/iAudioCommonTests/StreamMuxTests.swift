@@ -0,0 +1,105 @@
+//
+//  StreamMuxTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+import Socket
+@testable import iAudioCommon
+
+/// A transceiver sends to a raw socket the test reads itself, so it sees
+/// exactly what went on the wire and in which order.
+final class StreamMuxTests : XCTestCase {
+
+    var trans : PCMTransceiver!
+    var peer : Socket!
+
+    override func setUpWithError() throws {
+        let listener = try Socket.create()
+        defer { listener.close() }
+        try listener.listen(on: 0, node: "127.0.0.1")
+        let sock = try Socket.create()
+        try sock.connect(to: "127.0.0.1", port: listener.listeningPort)
+        peer = try listener.acceptClientConnection()
+        try peer.setBlocking(mode: false)
+        trans = PCMTransceiver(sock, dataCallback: { _, _ in }, handshakeCallback: nil,
+                               terminatedCallback: {})
+        try trans.start()
+        // The peer never says anything.
+        trans.heartbeat.stop()
+    }
+
+    override func tearDown() {
+        trans.terminate()
+        peer.close()
+    }
+
+    /// Everything that arrived until the line went quiet, as
+    /// (signature, byte 3, payload size).
+    func received() -> [(UInt8, UInt8, Int)] {
+        // Pumps queued on the reactor have run.
+        Reactor.shared.queue.sync {}
+        let parser = FrameParser()
+        var buf = [UInt8](repeating: 0, count: 65536)
+        var quiet = 0
+        while quiet < 20 {
+            let n = buf.withUnsafeMutableBytes { Reactor.read(peer.socketfd, $0.baseAddress!, $0.count) }
+            if n > 0 {
+                parser.append(buf, n)
+                quiet = 0
+            } else {
+                usleep(2000)
+                quiet += 1
+            }
+        }
+        var frames = [(UInt8, UInt8, Int)]()
+        parser.drain { sig, byte3, payload in
+            frames.append((sig, byte3, payload.count))
+        }
+        return frames
+    }
+
+    /// With the peer not granting any credit, audio queued behind a flood of
+    /// telemetry waits for one credit window of messages at most, not for
+    /// the whole queue.
+    func testAudioWaitsForOneCreditWindowAtMost() {
+        let message = Data(repeating: 7, count: 1000)
+        for _ in 0..<100 {
+            trans.mux.send(message, on: .telemetry)
+        }
+        Reactor.shared.queue.sync {}
+        let audio = [UInt8](repeating: 1, count: 960)
+        audio.withUnsafeBytes {
+            trans.packetReady(UnsafeMutableRawPointer(mutating: $0.baseAddress!), $0.count)
+        }
+
+        let frames = received()
+        guard let at = frames.firstIndex(where: { $0.0 == 0x20 }) else {
+            return XCTFail("Audio never arrived")
+        }
+        XCTAssertEqual(frames[at].2, 960)
+        let ahead = frames[..<at].filter { $0.0 == 0x22 && $0.1 == MuxChannel.telemetry.rawValue }
+        XCTAssertLessThanOrEqual(ahead.count * message.count, StreamMux.kInitialCredit)
+        // Without new credit nothing else got out.
+        XCTAssertEqual(frames.filter { $0.1 == MuxChannel.telemetry.rawValue }.count, ahead.count)
+        XCTAssertGreaterThan(trans.mux.queuedBytes[.telemetry]!, 0)
+    }
+
+    /// A control message doesn't wait for telemetry queued before it,
+    /// which is stuck for lack of credit.
+    func testControlOvertakesTelemetry() {
+        let message = Data(repeating: 7, count: 1000)
+        for _ in 0..<40 {
+            trans.mux.send(message, on: .telemetry)
+        }
+        trans.sendControl(.heartbeat)
+        let frames = received().filter { $0.0 == 0x22 }
+        // Heartbeats are the only one byte control messages.
+        guard let control = frames.lastIndex(where: { $0.1 == MuxChannel.control.rawValue && $0.2 == 1 }) else {
+            return XCTFail("Control message never arrived")
+        }
+        let ahead = frames[..<control].filter { $0.1 == MuxChannel.telemetry.rawValue }
+        XCTAssertLessThanOrEqual(ahead.count * message.count, StreamMux.kInitialCredit)
+        XCTAssertGreaterThan(trans.mux.queuedBytes[.telemetry]!, 0)
+    }
+}
@@ -0,0 +1,103 @@
+//
+//  TelemetryTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+@testable import iAudioCommon
+
+final class TelemetryTests : XCTestCase {
+
+    func total(_ buckets : [(UInt16, UInt32)]) -> UInt64 {
+        return buckets.reduce(0) { $0 + UInt64($1.1) }
+    }
+
+    func testBucketsBoundValues() {
+        for v : UInt64 in [0, 1, 31, 32, 33, 47, 48, 1000, 123_456_789, 1 << 39] {
+            let i = Histogram.bucket(v)
+            XCTAssertLessThanOrEqual(Histogram.lowerBound(i), v)
+            if i + 1 < Histogram.kBuckets {
+                XCTAssertGreaterThan(Histogram.lowerBound(i + 1), v)
+            }
+        }
+        XCTAssertEqual(Histogram.bucket(UInt64.max), Histogram.kBuckets - 1)
+    }
+
+    func testDeltaOnlyHasNewCounts() {
+        let h = Histogram()
+        var last = [UInt32](repeating: 0, count: Histogram.kBuckets)
+        h.record(5)
+        h.record(5)
+        h.record(1000)
+        XCTAssertEqual(h.delta(since: &last).map { $0.1 }, [2, 1])
+        h.record(1000)
+        let d = h.delta(since: &last)
+        XCTAssertEqual(d.map { Int($0.0) }, [Histogram.bucket(1000)])
+        XCTAssertEqual(d.map { $0.1 }, [1])
+    }
+
+    /// A few far-apart buckets past kMaxBuckets must not be folded into
+    /// their low neighbours, which would drag the percentiles down.
+    func testCoarsenKeepsSparseBucketsApart() {
+        var buckets = (0..<37).map { (UInt16($0), UInt32(1)) }
+        buckets.append((300, 1000))
+        let c = Telemetry.coarsen(buckets)
+        XCTAssertLessThanOrEqual(c.count, Telemetry.kMaxBuckets)
+        XCTAssertEqual(total(c), total(buckets))
+        XCTAssertEqual(Histogram.percentile(c, 0.5), Histogram.lowerBound(300))
+        XCTAssertEqual(Histogram.percentile(c, 0.99), Histogram.percentile(buckets, 0.99))
+    }
+
+    /// Merged counts only ever move up, by less than the span merged.
+    func testCoarsenErrsHigh() {
+        var seed : UInt32 = 5
+        let buckets = (0..<Histogram.kBuckets).compactMap { i -> (UInt16, UInt32)? in
+            seed = seed &* 1664525 &+ 1013904223
+            return seed >> 30 == 0 ? (UInt16(i), seed >> 20) : nil
+        }
+        let c = Telemetry.coarsen(buckets)
+        XCTAssertLessThanOrEqual(c.count, Telemetry.kMaxBuckets)
+        XCTAssertEqual(total(c), total(buckets))
+        for p in [0.01, 0.1, 0.5, 0.9, 0.99, 1] {
+            let exact = Histogram.percentile(buckets, p)
+            let coarse = Histogram.percentile(c, p)
+            XCTAssertGreaterThanOrEqual(coarse, exact)
+            XCTAssertLessThan(Histogram.bucket(coarse) - Histogram.bucket(exact), 32)
+        }
+    }
+
+    func testCoarsenKeepsFewBuckets() {
+        let buckets : [(UInt16, UInt32)] = [(40, 1), (3, 2), (500, 3)]
+        let c = Telemetry.coarsen(buckets)
+        XCTAssertEqual(c.map { $0.0 }, [3, 40, 500])
+        XCTAssertEqual(c.map { $0.1 }, [2, 1, 3])
+    }
+
+    func testRoundTrips() throws {
+        var t = Telemetry()
+        t.underruns = 3
+        t.resyncs = 1
+        t.accelerated = 70
+        t.expanded = 12
+        t.concealed = 2
+        t.histograms[.playerCallbackNs] = [(40, 10), (90, 2)]
+        t.histograms[.playerOccupancyUs] = [(300, 12)]
+        let back = try XCTUnwrap(Telemetry.decode(t.encode()))
+        XCTAssertEqual([back.underruns, back.resyncs, back.accelerated, back.expanded, back.concealed],
+                       [3, 1, 70, 12, 2])
+        XCTAssertEqual(back.histograms[.playerCallbackNs]?.map { $0.0 }, [40, 90])
+        XCTAssertEqual(back.histograms[.playerCallbackNs]?.map { $0.1 }, [10, 2])
+        XCTAssertEqual(back.histograms[.playerOccupancyUs]?.map { $0.1 }, [12])
+        XCTAssertNil(Telemetry.decode(t.encode().dropLast()))
+    }
+
+    /// What the render callbacks pay per sample.
+    func testRecordBenchmark() {
+        let h = Histogram()
+        measure {
+            for i in 0..<1_000_000 {
+                h.record(UInt64(i &* 2654435761 & 0xFFFFF))
+            }
+        }
+    }
+}
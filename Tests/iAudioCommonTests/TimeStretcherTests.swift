@@ -0,0 +1,103 @@
+//
+//  TimeStretcherTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+@testable import iAudioCommon
+
+final class TimeStretcherTests : XCTestCase {
+
+    let rate = 48000.0
+    let frames = 512
+
+    /// Keeps ring topped up with a 220 Hz tone, mono.
+    final class Tone {
+        var n = 0
+        var written = 0
+
+        func fill(_ ring : SPSCRing, rate : Double) {
+            var sample : Int16 = 0
+            while ring.availableToWrite >= 2 {
+                sample = Int16(12000 * sin(Double(n) * 2 * .pi * 220 / rate))
+                ring.write(&sample, 2)
+                n += 1
+                written += 1
+            }
+        }
+    }
+
+    /// Plays renders renders at speed and returns frames consumed from the
+    /// ring, the stretcher and the output.
+    func play(speed : Double, renders : Int) -> (consumed : Int, stretcher : TimeStretcher, out : [Int16]) {
+        let ring = SPSCRing(minimumCapacity: 16384)
+        let tone = Tone()
+        let stretcher = TimeStretcher(channels: 1, sampleRate: rate)
+        stretcher.speed = speed
+        var out = [Int16](repeating: 0, count: renders * frames)
+        for r in 0..<renders {
+            tone.fill(ring, rate: rate)
+            let ok = out.withUnsafeMutableBufferPointer {
+                stretcher.render(from: ring, into: $0.baseAddress! + r * frames, frames: frames)
+            }
+            XCTAssertTrue(ok)
+        }
+        return (tone.written - ring.availableToRead / 2, stretcher, out)
+    }
+
+    /// Speeding up only ever drops periods, and tracks the wanted rate to
+    /// within a couple of periods.
+    func testSpeedsUpWithoutSwingingBack() {
+        let renders = 400
+        let (consumed, stretcher, _) = play(speed: 1.02, renders: renders)
+        let played = renders * frames
+        XCTAssertGreaterThan(stretcher.accelerated, 0)
+        XCTAssertEqual(stretcher.expanded, 0)
+        XCTAssertEqual(Double(consumed - played), Double(played) * 0.02,
+                       accuracy: Double(2 * stretcher.maxPeriod))
+        XCTAssertGreaterThanOrEqual(stretcher.budget, 0)
+    }
+
+    func testSlowsDownWithoutSwingingBack() {
+        let renders = 400
+        let (consumed, stretcher, _) = play(speed: 0.98, renders: renders)
+        let played = renders * frames
+        XCTAssertGreaterThan(stretcher.expanded, 0)
+        XCTAssertEqual(stretcher.accelerated, 0)
+        XCTAssertEqual(Double(played - consumed), Double(played) * 0.02,
+                       accuracy: Double(2 * stretcher.maxPeriod))
+        XCTAssertLessThanOrEqual(stretcher.budget, 0)
+    }
+
+    /// At real time the audio passes through untouched.
+    func testPassesThroughAtRealTime() {
+        let (consumed, stretcher, out) = play(speed: 1, renders: 20)
+        XCTAssertEqual(consumed, 20 * frames)
+        XCTAssertEqual(stretcher.accelerated + stretcher.expanded, 0)
+        for i in stride(from: 0, to: out.count, by: 97) {
+            XCTAssertEqual(out[i], Int16(12000 * sin(Double(i) * 2 * .pi * 220 / rate)))
+        }
+    }
+
+    /// A 512 frame render while speeding up, which searches for a period
+    /// every time.
+    func testRenderBenchmark() {
+        let ring = SPSCRing(minimumCapacity: 16384)
+        let tone = (0..<48000).map { Int16(12000 * sin(Double($0) * 2 * .pi * 220 / rate)) }
+        let stretcher = TimeStretcher(channels: 1, sampleRate: rate)
+        stretcher.speed = 1.02
+        var out = [Int16](repeating: 0, count: frames)
+        var at = 0
+        measure {
+            for _ in 0..<5_000 {
+                while ring.availableToWrite >= 2048 {
+                    _ = tone.withUnsafeBytes { ring.write($0.baseAddress! + 2 * at, 2048) }
+                    at = (at + 1024) % (tone.count - 1024)
+                }
+                _ = out.withUnsafeMutableBufferPointer {
+                    stretcher.render(from: ring, into: $0.baseAddress!, frames: frames)
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,49 @@
+//
+//  TraceTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+import Atomics
+@testable import iAudioCommon
+
+final class TraceTests : XCTestCase {
+
+    /// A ring the drain thread leaves alone, so the test can empty it
+    /// itself instead of printing every record.
+    func privateRing() -> TraceRing {
+        let ring = TraceRing()
+        Trace.unregister(ring)
+        return ring
+    }
+
+    /// Records that make it into the ring, emptied whenever it is full.
+    func testRecordBenchmark() {
+        let ring = privateRing()
+        let size = MemoryLayout<TraceRecord>.stride
+        measure {
+            for i in 0..<1_000_000 {
+                if ring.ring.availableToWrite < size {
+                    ring.ring.skip(ring.ring.availableToRead)
+                }
+                Trace.record(.log, ring, .playerRender, Int64(i), 0, 0)
+            }
+        }
+        ring.ring.skip(ring.ring.availableToRead)
+        XCTAssertEqual(ring.dropped.load(ordering: .relaxed), 0)
+    }
+
+    /// Records below Trace.level, which must cost next to nothing.
+    func testFilteredRecordBenchmark() {
+        let ring = privateRing()
+        measure {
+            for i in 0..<1_000_000 {
+                Trace.record(.verbose, ring, .playerRender, Int64(i), 0, 0)
+            }
+        }
+        // Unless built with IAUDIO_VERBOSE.
+        if Trace.level != .verbose {
+            XCTAssertEqual(ring.ring.availableToRead, 0)
+        }
+    }
+}
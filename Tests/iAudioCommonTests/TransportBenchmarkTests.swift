@@ -0,0 +1,338 @@
+//
+//  TransportBenchmarkTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+import Socket
+@testable import iAudioCommon
+@testable import iAudioServerCore
+
+/// What it costs to get audio across sockets: the server's send paths over
+/// loopback, and how long a device waits for sound when the server connects
+/// through the usbmuxd stand-in (fake-usbmuxd.py, needs python3).
+final class TransportBenchmarkTests : XCTestCase {
+
+    let format = StreamFormat.pcm16(sampleRate: 48000, channels: 2)
+
+    /// A transceiver, as the server has one per device, writing to a raw
+    /// socket the test reads.
+    func transceiver() throws -> (PCMTransceiver, Socket) {
+        let listener = try Socket.create()
+        defer { listener.close() }
+        try listener.listen(on: 0, node: "127.0.0.1")
+        let sock = try Socket.create()
+        try sock.connect(to: "127.0.0.1", port: listener.listeningPort)
+        let peer = try listener.acceptClientConnection()
+        try peer.setReadTimeout(value: 5000)
+        let trans = PCMTransceiver(sock, dataCallback: { _, _ in }, handshakeCallback: nil,
+                                   terminatedCallback: {})
+        try trans.start()
+        // The peer never says anything.
+        trans.heartbeat.stop()
+        return (trans, peer)
+    }
+
+    /// Reads peer on another thread until a control message comes, which
+    /// the sender queues behind its audio. Signals with the audio bytes
+    /// that arrived before it; frames the outbox dropped are missing.
+    func receive(_ peer : Socket, into audio : UnsafeMutablePointer<Int>, done : DispatchSemaphore) {
+        DispatchQueue.global(qos: .userInitiated).async {
+            let parser = FrameParser()
+            var buf = [UInt8](repeating: 0, count: 65536)
+            var ended = false
+            audio.pointee = 0
+            while !ended {
+                let n = buf.withUnsafeMutableBytes { Reactor.read(peer.socketfd, $0.baseAddress!, $0.count) }
+                if n <= 0 {
+                    break
+                }
+                parser.append(buf, n)
+                parser.drain { sig, byte3, payload in
+                    if sig == 0x20 {
+                        audio.pointee += payload.count
+                    } else if sig == 0x22 && byte3 == MuxChannel.control.rawValue {
+                        // Not a heartbeat from before it was stopped.
+                        ended = audio.pointee > 0
+                    }
+                }
+            }
+            done.signal()
+        }
+    }
+
+    /// 2000 capture buffers of 128 stereo frames into one device, sent the
+    /// moment they come.
+    func testUncoalescedStreamBenchmark() throws {
+        try stream(deadline: 0)
+    }
+
+    /// The same, batched under a 5 ms deadline. Fewer, larger frames.
+    func testCoalescedStreamBenchmark() throws {
+        try stream(deadline: 0.005)
+    }
+
+    func stream(deadline : Double) throws {
+        let (trans, peer) = try transceiver()
+        defer {
+            trans.terminate()
+            peer.close()
+        }
+        trans.coalescer.deadline = deadline
+        let buffer = [UInt8](repeating: 1, count: 128 * 4)
+        let audio = UnsafeMutablePointer<Int>.allocate(capacity: 1)
+        defer { audio.deallocate() }
+        measure {
+            let done = DispatchSemaphore(value: 0)
+            receive(peer, into: audio, done: done)
+            for _ in 0..<2000 {
+                buffer.withUnsafeBytes {
+                    trans.packetReady(UnsafeMutableRawPointer(mutating: $0.baseAddress!), $0.count)
+                }
+            }
+            trans.flushExpired()
+            trans.sendControl(.heartbeat)
+            XCTAssertEqual(done.wait(timeout: .now() + 10), .success)
+            XCTAssertGreaterThan(audio.pointee, 0)
+        }
+    }
+
+    /// 1000 batches of 10 ms of stereo to 8 devices on this machine, the way
+    /// FanOut sends them: encoded once, then written to every device from
+    /// its own serial queue. FanOut itself needs the capture unit.
+    func testFanOutBenchmark() throws {
+        var peers = [(PCMTransceiver, Socket, DispatchQueue)]()
+        defer {
+            for (trans, peer, _) in peers {
+                trans.terminate()
+                peer.close()
+            }
+        }
+        for _ in 0..<8 {
+            let (trans, peer) = try transceiver()
+            peers.append((trans, peer, DispatchQueue(label: "FanOut.Peer", qos: .userInteractive)))
+        }
+        let encoder = FrameEncoder()
+        var frame = Data(capacity: 8192)
+        let batch = Data(repeating: 1, count: 480 * 4)
+        let audio = UnsafeMutablePointer<Int>.allocate(capacity: peers.count)
+        defer { audio.deallocate() }
+        measure {
+            let done = DispatchSemaphore(value: 0)
+            for (i, (_, peer, _)) in peers.enumerated() {
+                receive(peer, into: audio + i, done: done)
+            }
+            for _ in 0..<1000 {
+                encoder.build(batch, codec: .pcm, channels: 2, channel: .speaker, into: &frame)
+                let f = frame
+                for (trans, _, queue) in peers {
+                    queue.async {
+                        _ = trans.sendFrame(f)
+                    }
+                }
+            }
+            for (trans, _, queue) in peers {
+                queue.async {
+                    trans.sendControl(.heartbeat)
+                }
+            }
+            for i in 0..<peers.count {
+                XCTAssertEqual(done.wait(timeout: .now() + 10), .success)
+                XCTAssertGreaterThan(audio[i], 0)
+            }
+        }
+    }
+
+    /// A frame as the server sends it: signature, length, payload.
+    func frame(_ sig : UInt8, _ payload : Data) -> Data {
+        var len = UInt32(payload.count)
+        var f = Data([0x69, 0x4, sig, 0])
+        f.append(Data(bytes: &len, count: 4))
+        f.append(payload)
+        return f
+    }
+
+    /// Reads exactly count bytes off a blocking socket.
+    func readExactly(_ sock : Socket, _ count : Int) throws -> Data {
+        var data = Data(count: count)
+        var got = 0
+        while got < count {
+            let n = data.withUnsafeMutableBytes { Reactor.read(sock.socketfd, $0.baseAddress! + got, count - got) }
+            if n <= 0 {
+                throw NSError(domain: "Error_Domain", code: 100,
+                              userInfo: [NSLocalizedDescriptionKey : "Mux closed"])
+            }
+            got += n
+        }
+        return data
+    }
+
+    /// fake-usbmuxd.py serving one device on a fresh unix socket, bridging
+    /// every Connect to port. nil if it doesn't come up (no python3).
+    func startMux(bridgingTo port : Int32) -> (Process, String)? {
+        let root = URL(fileURLWithPath: #file).deletingLastPathComponent()
+            .deletingLastPathComponent().deletingLastPathComponent()
+        let path = NSTemporaryDirectory() + "iaudio-usbmuxd-\(UUID().uuidString.prefix(8))"
+        let mux = Process()
+        mux.executableURL = URL(fileURLWithPath: "/usr/bin/env")
+        mux.arguments = ["python3", root.appendingPathComponent("fake-usbmuxd.py").path,
+                         "--socket", path, "--port", String(port)]
+        mux.standardError = FileHandle.nullDevice
+        do {
+            try mux.run()
+        } catch {
+            return nil
+        }
+        for _ in 0..<300 where mux.isRunning && !FileManager.default.fileExists(atPath: path) {
+            usleep(10_000)
+        }
+        if !mux.isRunning || !FileManager.default.fileExists(atPath: path) {
+            mux.terminate()
+            return nil
+        }
+        return (mux, path)
+    }
+
+    /// Has the mux connect device 1 like USBMuxHandler does, and returns
+    /// the socket once it is bridged to the device's port.
+    func muxConnect(_ path : String, port : Int32) throws -> Socket {
+        let sock = try Socket.create(family: .unix, type: .stream, proto: .unix)
+        try sock.connect(to: path)
+        let plist = try BinaryPlist.encode([
+            "MessageType" : "Connect",
+            "DeviceID"    : 1,
+            "PortNumber"  : Int(UInt16(port).byteSwapped),
+        ])
+        // Length, version, plist message, tag. Little endian.
+        var msg = Data()
+        for v in [UInt32(16 + plist.count), 1, 8, 1] {
+            var le = v.littleEndian
+            msg.append(Data(bytes: &le, count: 4))
+        }
+        msg.append(plist)
+        _ = try sock.write(from: msg)
+
+        let header = try readExactly(sock, 16)
+        let length = header.withUnsafeBytes { UInt32(littleEndian: $0.load(as: UInt32.self)) }
+        let reply = try readExactly(sock, Int(length) - 16)
+        let result = try PropertyListSerialization.propertyList(from: reply, format: nil) as? [String : Any]
+        guard (result?["Number"] as? NSNumber)?.intValue == 0 else {
+            sock.close()
+            throw NSError(domain: "Error_Domain", code: 101,
+                          userInfo: [NSLocalizedDescriptionKey : "Mux refused to connect"])
+        }
+        return sock
+    }
+
+    /// Polls until cond holds, 5 s at most.
+    func waitFor(_ cond : () -> Bool) {
+        for _ in 0..<5000 where !cond() {
+            usleep(1000)
+        }
+        XCTAssertTrue(cond())
+    }
+
+    /// From the server asking the mux to connect until the device plays
+    /// audio: the hellos, the handshake setting up the player and it
+    /// filling up to its target. The session ends after each round.
+    func testTimeToFirstAudioBenchmark() throws {
+        var backend : PulledAudioBackend?
+        let engine = ClientEngine {
+            let b = PulledAudioBackend()
+            backend = b
+            return b
+        }
+        let ended = DispatchSemaphore(value: 0)
+        engine.onSessionEnded = { ended.signal() }
+        try engine.startListening(port: 0)
+        defer { engine.stopListening() }
+        let port = engine.listener!.listeningPort
+        guard let (mux, path) = startMux(bridgingTo: port) else {
+            print("fake-usbmuxd.py didn't start, skipping")
+            return
+        }
+        defer { mux.terminate() }
+
+        let packet = frame(0x20, Data(count: 480 * 4))
+        measureMetrics(TransportBenchmarkTests.defaultPerformanceMetrics, automaticallyStartMeasuring: false) {
+            do {
+                // The last round's player played.
+                backend = nil
+                startMeasuring()
+                let server = try muxConnect(path, port: port)
+                try server.setReadTimeout(value: 3000)
+                _ = try SessionResume.readHello(server)
+                var start = SessionResume.framed("Hello from computer")
+                start.append(frame(0x19, format.data))
+                for _ in 0..<10 {
+                    start.append(packet)
+                }
+                _ = try server.write(from: start)
+                waitFor { backend?.auhalPlayer?.played == true }
+                stopMeasuring()
+
+                server.close()
+                XCTAssertEqual(ended.wait(timeout: .now() + 3), .success)
+            } catch {
+                XCTFail("\(error)")
+            }
+        }
+    }
+
+    /// From the server reconnecting through the mux after the connection
+    /// dropped until audio it sends reaches the device's player again. The
+    /// session and its player survive, so there is no handshake.
+    func testReconnectBenchmark() throws {
+        var backend : PulledAudioBackend?
+        let engine = ClientEngine {
+            let b = PulledAudioBackend()
+            backend = b
+            return b
+        }
+        let ended = DispatchSemaphore(value: 0)
+        engine.onSessionEnded = { ended.signal() }
+        try engine.startListening(port: 0)
+        defer { engine.stopListening() }
+        let port = engine.listener!.listeningPort
+        guard let (mux, path) = startMux(bridgingTo: port) else {
+            print("fake-usbmuxd.py didn't start, skipping")
+            return
+        }
+        defer { mux.terminate() }
+
+        let packet = frame(0x20, Data(count: 480 * 4))
+        var server = try muxConnect(path, port: port)
+        try server.setReadTimeout(value: 3000)
+        _ = try SessionResume.readHello(server)
+        var start = SessionResume.framed("Hello from computer session=7")
+        start.append(frame(0x19, format.data))
+        start.append(packet)
+        _ = try server.write(from: start)
+        waitFor { backend?.auhalPlayer?.framesEnqueued ?? 0 > 0 }
+
+        measureMetrics(TransportBenchmarkTests.defaultPerformanceMetrics, automaticallyStartMeasuring: false) {
+            do {
+                server.close()
+                waitFor { engine.suspended }
+                let before = backend?.auhalPlayer?.framesEnqueued ?? 0
+
+                startMeasuring()
+                server = try muxConnect(path, port: port)
+                try server.setReadTimeout(value: 3000)
+                let hello = try SessionResume.readHello(server)
+                XCTAssertEqual(SessionResume.request(fromHello: hello.hello)?.id, 7)
+                var resumed = SessionResume.framed("Hello from computer session=7 resumed=0")
+                resumed.append(packet)
+                _ = try server.write(from: resumed)
+                waitFor { backend?.auhalPlayer?.framesEnqueued ?? 0 > before }
+                stopMeasuring()
+            } catch {
+                XCTFail("\(error)")
+            }
+        }
+
+        // Let the grace period run out while the engine is still around.
+        server.close()
+        XCTAssertEqual(ended.wait(timeout: .now() + SessionResume.kGraceSeconds + 3), .success)
+    }
+}
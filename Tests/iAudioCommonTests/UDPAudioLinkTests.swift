@@ -0,0 +1,173 @@
+//
+//  UDPAudioLinkTests.swift
+//  iAudioCommonTests
+//
+
+import XCTest
+@testable import iAudioCommon
+
+/// Sends through real sockets on loopback, then hands the datagrams to the
+/// receiving link by hand, minus the ones "lost".
+final class UDPAudioLinkTests : XCTestCase {
+
+    var sender : UDPAudioLink!
+    var receiver : UDPAudioLink!
+    var delivered = [Data]()
+    var concealed = 0
+
+    override func setUpWithError() throws {
+        sender = try UDPAudioLink()
+        receiver = try UDPAudioLink()
+        try sender.connect(to: "127.0.0.1", port: receiver.localPort)
+        try receiver.connect(to: "127.0.0.1", port: sender.localPort)
+        try receiver.sock.setBlocking(mode: false)
+        delivered = []
+        concealed = 0
+        receiver.deliver = { [unowned self] in self.delivered.append($0) }
+        receiver.conceal = { [unowned self] in self.concealed += 1 }
+    }
+
+    override func tearDown() {
+        sender.close()
+        receiver.close()
+    }
+
+    /// Frames of different lengths, so the parity has to restore the length.
+    func frames(_ count : Int) -> [Data] {
+        return (0..<count).map { i in
+            Data((0..<(20 + 3 * i)).map { UInt8(truncatingIfNeeded: $0 * 7 + i) })
+        }
+    }
+
+    /// Everything waiting on the receiver's socket.
+    func datagrams() -> [Data] {
+        var out = [Data]()
+        var buf = [UInt8](repeating: 0, count: 65536)
+        while true {
+            let n = buf.withUnsafeMutableBytes {
+                Reactor.read(receiver.sock.socketfd, $0.baseAddress!, $0.count)
+            }
+            if n < 0 {
+                return out
+            }
+            out.append(Data(buf[..<n]))
+        }
+    }
+
+    func testDeliversInOrder() throws {
+        let sent = frames(8)
+        for f in sent {
+            try sender.send(f)
+        }
+        let d = datagrams()
+        // Every group of four frames is followed by its parity.
+        XCTAssertEqual(d.count, 10)
+        // Frames come reversed, even the first ones: the stream starts at
+        // the lowest of them, not at the first to arrive.
+        for i in [3, 2, 1, 0, 4, 8, 7, 6, 5, 9] {
+            receiver.received(d[i])
+        }
+        XCTAssertEqual(delivered, sent)
+        XCTAssertEqual(concealed, 0)
+    }
+
+    func testRepairsSingleLossPerGroup() throws {
+        let sent = frames(8)
+        for f in sent {
+            try sender.send(f)
+        }
+        let d = datagrams()
+        XCTAssertEqual(d.count, 10)
+        // The second frame of the first group and the last of the second.
+        for (i, datagram) in d.enumerated() where i != 1 && i != 8 {
+            receiver.received(datagram)
+        }
+        XCTAssertEqual(delivered, sent)
+        XCTAssertEqual(receiver.recovered, 2)
+        XCTAssertEqual(concealed, 0)
+    }
+
+    /// Two losses in a group can't be repaired: they are concealed once
+    /// enough later frames arrived.
+    func testConcealsDoubleLoss() throws {
+        let sent = frames(8)
+        for f in sent {
+            try sender.send(f)
+        }
+        let d = datagrams()
+        XCTAssertEqual(d.count, 10)
+        for (i, datagram) in d.enumerated() where i != 1 && i != 2 {
+            receiver.received(datagram)
+        }
+        XCTAssertEqual(delivered, [sent[0]] + Array(sent[3...]))
+        XCTAssertEqual(concealed, 2)
+        XCTAssertEqual(receiver.recovered, 0)
+    }
+
+    /// 30 s of 10 ms frames through impairment like netem's: 3% of the
+    /// datagrams lost at random and the rest delayed 5 to 25 ms each, so
+    /// frames often overtake the one before. Measures what is lost for
+    /// good despite FEC, and how long frames take from being sent to being
+    /// delivered.
+    func testImpairedLinkLossAndLatency() throws {
+        let count = 3000
+        var noise = PlayoutTargetTests.Noise(state: 2)
+        var arrivals = [(time : Double, datagram : Data)]()
+        // A batch at a time, so the socket buffer doesn't overflow.
+        for batch in stride(from: 0, to: count, by: 40) {
+            for i in batch..<batch + 40 {
+                var seq = UInt32(i)
+                try sender.send(Data(bytes: &seq, count: 4))
+            }
+            for d in datagrams() {
+                var last = d.withUnsafeBytes { $0.load(fromByteOffset: 4, as: UInt32.self) }
+                // Parity goes out right behind the last frame of its group.
+                if d[2] == UDPAudioLink.kParityKind {
+                    last += UInt32(UDPAudioLink.kGroupSize - 1)
+                }
+                if noise.next() < 0.03 { continue }
+                arrivals.append((Double(last) * 0.01 + 0.005 + 0.02 * noise.next(), d))
+            }
+        }
+        arrivals.sort { $0.time < $1.time }
+
+        var now = 0.0
+        var latency = [Double]()
+        receiver.deliver = { [unowned self] frame in
+            let seq = frame.withUnsafeBytes { $0.load(as: UInt32.self) }
+            latency.append(now - Double(seq) * 0.01)
+            self.delivered.append(frame)
+        }
+        for (time, d) in arrivals {
+            now = time
+            receiver.received(d)
+        }
+
+        let mean = latency.reduce(0, +) / Double(latency.count)
+        print("Impaired link: \(concealed) of \(count) frames concealed, \(receiver.recovered) repaired, " +
+              String(format: "latency %.1f ms mean, %.1f ms max", mean * 1000, latency.max()! * 1000))
+        // Frame 1 overtakes frame 0 here, which must not make 0 late.
+        XCTAssertEqual(delivered.first?.withUnsafeBytes { $0.load(as: UInt32.self) }, 0)
+        XCTAssertLessThan(Double(concealed) / Double(count), 0.01)
+        // The network's own delay is 15 ms on average. Gaps held open
+        // while waiting for a frame or its repair add little to that.
+        XCTAssertLessThan(mean, 0.02)
+    }
+
+    /// Links only take datagrams from the peer they are connected to.
+    func testIgnoresOtherSenders() throws {
+        let stranger = try UDPAudioLink()
+        defer { stranger.close() }
+        try stranger.connect(to: "127.0.0.1", port: receiver.localPort)
+        try stranger.send(frames(1)[0])
+        XCTAssertEqual(datagrams().count, 0)
+
+        try sender.send(frames(1)[0])
+        XCTAssertEqual(datagrams().count, 1)
+    }
+
+    func testParsesPortFromHello() {
+        XCTAssertEqual(UDPAudioLink.port(fromHello: "Hello from computer session=5 udp=50123"), 50123)
+        XCTAssertNil(UDPAudioLink.port(fromHello: "Hello from computer session=5"))
+    }
+}
@@ -0,0 +1,230 @@
+#!/usr/bin/env python3
+#
+# Stand-in for usbmuxd, so the transport can be exercised without an iPad.
+#
+# Speaks the usbmuxd plist protocol (ListDevices, Listen, Connect) on a unix
+# socket and bridges Connect to a TCP port on this machine, where a client
+# (iAudioClient or anything speaking its protocol) listens. Bridged traffic
+# can be delayed and rate limited per direction, stalled and cut.
+#
+# Point iAudioServer at it like libusbmuxd tools:
+#     ./fake-usbmuxd.py --socket /tmp/usbmuxd --delay-down 5 --rate-down 200000
+#     USBMUXD_SOCKET_ADDRESS=UNIX:/tmp/usbmuxd iAudioServer
+#
+# "down" is server -> device (speaker audio), "up" device -> server (mic).
+# Runs on macOS and Linux, needs python 3.7+ and nothing else.
+
+import argparse
+import asyncio
+import os
+import plistlib
+import random
+import struct
+import sys
+import time
+
+HEADER = struct.Struct("<IIII")  # length, version, message type, tag
+PLIST_MESSAGE = 8
+
+# usbmuxd result codes.
+RESULT_OK = 0
+RESULT_BADDEV = 2
+RESULT_CONNREFUSED = 3
+
+
+def log(*args):
+    print(time.strftime("%H:%M:%S"), *args, file=sys.stderr, flush=True)
+
+
+class Shaper:
+    """Fault injection for one direction of a bridged connection."""
+
+    def __init__(self, delay_ms, rate, stall_every, stall_ms):
+        self.delay = delay_ms / 1000.0
+        self.rate = rate
+        self.stall_every = stall_every
+        self.stall = stall_ms / 1000.0
+        self.start = time.monotonic()
+
+    async def pump(self, reader, writer):
+        """Copies reader to writer until EOF, shaped."""
+        queue = asyncio.Queue()
+
+        async def receive():
+            while True:
+                data = await reader.read(65536)
+                await queue.put((time.monotonic(), data))
+                if not data:
+                    return
+
+        recv = asyncio.ensure_future(receive())
+        try:
+            while True:
+                arrived, data = await queue.get()
+                if not data:
+                    break
+                # Latency: every chunk leaves delay after it arrived.
+                wait = arrived + self.delay - time.monotonic()
+                if wait > 0:
+                    await asyncio.sleep(wait)
+                # Stalls: nothing gets through for stall_ms every stall_every s.
+                if self.stall_every > 0:
+                    phase = (time.monotonic() - self.start) % self.stall_every
+                    if phase < self.stall:
+                        await asyncio.sleep(self.stall - phase)
+                # Bandwidth cap: a chunk takes len / rate to get through.
+                if self.rate > 0:
+                    await asyncio.sleep(len(data) / self.rate)
+                writer.write(data)
+                await writer.drain()
+        finally:
+            recv.cancel()
+            writer.close()
+
+
+class FakeMux:
+
+    def __init__(self, args):
+        self.args = args
+        self.devices = {}
+        self.listeners = []
+        self.next_id = 1
+        for _ in range(args.devices):
+            self.add_device()
+
+    def add_device(self):
+        dev_id = self.next_id
+        self.next_id += 1
+        self.devices[dev_id] = {
+            "DeviceID": dev_id,
+            "MessageType": "Attached",
+            "Properties": {
+                "ConnectionType": "USB",
+                "DeviceID": dev_id,
+                "LocationID": 0,
+                "ProductID": 0x12AB,
+                "SerialNumber": "fake%020d" % dev_id,
+            },
+        }
+        return dev_id
+
+    async def attach_later(self):
+        await asyncio.sleep(self.args.hotplug_after)
+        dev_id = self.add_device()
+        log("Attached device", dev_id)
+        for w in list(self.listeners):
+            self.send(w, self.devices[dev_id])
+
+    def send(self, writer, msg, tag=0):
+        payload = plistlib.dumps(msg, fmt=plistlib.FMT_XML)
+        writer.write(HEADER.pack(HEADER.size + len(payload), 1, PLIST_MESSAGE, tag) + payload)
+
+    def result(self, writer, number, tag):
+        self.send(writer, {"MessageType": "Result", "Number": number}, tag)
+
+    async def handle(self, reader, writer):
+        try:
+            while True:
+                header = await reader.readexactly(HEADER.size)
+                length, _, _, tag = HEADER.unpack(header)
+                payload = await reader.readexactly(length - HEADER.size)
+                # plistlib reads binary and XML plists alike.
+                msg = plistlib.loads(payload)
+                kind = msg.get("MessageType")
+                log("Request", kind, msg.get("DeviceID", ""))
+
+                if kind == "ListDevices":
+                    self.send(writer, {"DeviceList": list(self.devices.values())}, tag)
+                elif kind == "Listen":
+                    self.result(writer, RESULT_OK, tag)
+                    self.listeners.append(writer)
+                    for dev in self.devices.values():
+                        self.send(writer, dev)
+                elif kind == "Connect":
+                    await self.connect(msg, tag, reader, writer)
+                    return
+                else:
+                    self.result(writer, 1, tag)
+                await writer.drain()
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        finally:
+            if writer in self.listeners:
+                self.listeners.remove(writer)
+            writer.close()
+
+    async def connect(self, msg, tag, reader, writer):
+        dev_id = msg.get("DeviceID")
+        # usbmuxd wants the port in network byte order.
+        port = struct.unpack(">H", struct.pack("<H", msg.get("PortNumber", 0) & 0xFFFF))[0]
+        if dev_id not in self.devices:
+            self.result(writer, RESULT_BADDEV, tag)
+            await writer.drain()
+            return
+        if self.args.connect_delay > 0:
+            await asyncio.sleep(self.args.connect_delay / 1000.0)
+        try:
+            dev_reader, dev_writer = await asyncio.open_connection(
+                self.args.target, self.args.port or port)
+        except OSError:
+            log("Device", dev_id, "refused port", port)
+            self.result(writer, RESULT_CONNREFUSED, tag)
+            await writer.drain()
+            return
+        self.result(writer, RESULT_OK, tag)
+        await writer.drain()
+        log("Bridging device", dev_id, "port", port)
+
+        a = self.args
+        down = Shaper(a.delay_down, a.rate_down, a.stall_every, a.stall_ms)
+        up = Shaper(a.delay_up, a.rate_up, a.stall_every, a.stall_ms)
+        pumps = [asyncio.ensure_future(down.pump(reader, dev_writer)),
+                 asyncio.ensure_future(up.pump(dev_reader, writer))]
+        timeout = None
+        if a.disconnect_after > 0:
+            timeout = a.disconnect_after * random.uniform(0.5, 1.5)
+        done, pending = await asyncio.wait(pumps, timeout=timeout,
+                                           return_when=asyncio.FIRST_COMPLETED)
+        if not done:
+            log("Cutting device", dev_id, "after %.1f s" % timeout)
+        for p in pending:
+            p.cancel()
+        dev_writer.close()
+        log("Bridge to device", dev_id, "closed")
+
+
+async def main(args):
+    mux = FakeMux(args)
+    if os.path.exists(args.socket):
+        os.unlink(args.socket)
+    server = await asyncio.start_unix_server(mux.handle, path=args.socket)
+    log("Fake usbmuxd on", args.socket, "with", args.devices, "devices")
+    if args.hotplug_after > 0:
+        asyncio.ensure_future(mux.attach_later())
+    async with server:
+        await server.serve_forever()
+
+
+if __name__ == "__main__":
+    p = argparse.ArgumentParser(description="usbmuxd stand-in with fault injection")
+    p.add_argument("--socket", default="/tmp/usbmuxd", help="unix socket to serve on")
+    p.add_argument("--devices", type=int, default=1, help="devices attached at start")
+    p.add_argument("--hotplug-after", type=float, default=0,
+                   help="attach one more device after this many seconds")
+    p.add_argument("--target", default="127.0.0.1", help="host the devices' apps run on")
+    p.add_argument("--port", type=int, default=0,
+                   help="bridge every Connect here instead of the requested port")
+    p.add_argument("--connect-delay", type=float, default=0, help="ms before Connect answers")
+    p.add_argument("--delay-down", type=float, default=0, help="ms added server -> device")
+    p.add_argument("--delay-up", type=float, default=0, help="ms added device -> server")
+    p.add_argument("--rate-down", type=float, default=0, help="bytes/s cap server -> device")
+    p.add_argument("--rate-up", type=float, default=0, help="bytes/s cap device -> server")
+    p.add_argument("--stall-every", type=float, default=0,
+                   help="stall both directions every this many seconds")
+    p.add_argument("--stall-ms", type=float, default=0, help="length of a stall")
+    p.add_argument("--disconnect-after", type=float, default=0,
+                   help="cut bridged connections after about this many seconds")
+    try:
+        asyncio.run(main(p.parse_args()))
+    except KeyboardInterrupt:
+        pass
@@ -6,10 +6,19 @@
 //
 
 import Foundation
+import QuartzCore
 
 /// Class that modifies the state of the points array in ContentView.swift to
 /// enable visualization of time domain audio waveforms.
-class AudioViz {
+///
+/// The mic side (onNewBuffer) only reduces every kSamplesPerDot samples to
+/// their peak and writes it into a wait-free ring, so it never allocates,
+/// locks or touches the main thread. A display link drains the ring on the
+/// main thread and publishes to the UI at most once per screen refresh.
+class AudioViz : NSObject {
+    
+    /// Samples per dot. At 48 kHz the 1025 dots show about a second.
+    static let kSamplesPerDot = 48
     
     /// Determined by UI.
     var numDots : Int!
@@ -17,46 +26,93 @@ class AudioViz {
     /// Connection to UI.
     var appState : AppState!
     
-    /// Consider every sample.
-    var sampleRate = 1
+    /// Peaks (Float) from the mic side to the main thread. Dropped if the
+    /// main thread falls a whole screen behind.
+    let tap : SPSCRing
     
-    var sampleIndex = 0
-    var bufferIdx = 0
-    var firstPacket = true
+    /// The dot being reduced. Mic side.
+    var low = Int16.max
+    var high = Int16.min
+    var taken = 0
     
-    /// Temporary buffer to avoid memory leaks.
-    var buffer : [Double]!
-
+    /// Peaks shown, oldest at head. Main thread.
+    var envelope : [Double]
+    var head = 0
+    var link : CADisplayLink!
+    
+    /// Call on the main thread.
     init(_ appState : AppState, _ numDots : Int) {
         self.appState = appState
         self.numDots = numDots
-        buffer = Array(repeating: 0, count: self.numDots)
+        tap = SPSCRing(minimumCapacity: numDots * MemoryLayout<Float>.size)
+        envelope = Array(repeating: 0, count: numDots)
+        super.init()
+        link = CADisplayLink(target: self, selector: #selector(refresh(_:)))
+        link.add(to: .main, forMode: .common)
     }
     
+    /// Called with every mic buffer, on the thread that sends it.
     func onNewBuffer(ptr : UnsafeBufferPointer<Int16>) {
-        while sampleIndex < ptr.count {
-            // Swift is weird...
-            let val = Double(Int(ptr[sampleIndex])) / Double(Int(Int16.max))
-            buffer[bufferIdx] = val
-            bufferIdx += 1
-            if bufferIdx == buffer.count {
-                bufferIdx = 0
-                updateUI()
+        guard let base = ptr.baseAddress else { return }
+        var i = 0
+        while i < ptr.count {
+            let n = min(ptr.count - i, AudioViz.kSamplesPerDot - taken)
+            let (lo, hi) = AudioViz.extremes(base + i, n)
+            low = min(low, lo)
+            high = max(high, hi)
+            taken += n
+            i += n
+            if taken == AudioViz.kSamplesPerDot {
+                // Keep the sign of whichever side swung further.
+                let peak = Int(high) >= -Int(low) ? high : low
+                var v = max(-1, Float(peak) / Float(Int16.max))
+                tap.write(&v, MemoryLayout<Float>.size)
+                low = Int16.max
+                high = Int16.min
+                taken = 0
             }
-            sampleIndex += sampleRate
         }
-        sampleIndex -= ptr.count
     }
     
-    /// Creates array of points that will update UI on main thread. 
-    func updateUI() {
-        var arr = Array(repeating: Point(0), count: numDots)
-        for i in 0..<arr.count {
-            arr[i].value = buffer[i]
+    /// Smallest and largest of count samples, sixteen at a time.
+    static func extremes(_ p : UnsafePointer<Int16>, _ count : Int) -> (Int16, Int16) {
+        var lo = SIMD16<Int16>(repeating: Int16.max)
+        var hi = SIMD16<Int16>(repeating: Int16.min)
+        var i = 0
+        while i + 16 <= count {
+            let v = ChannelMapper.load16(p + i)
+            lo = pointwiseMin(lo, v)
+            hi = pointwiseMax(hi, v)
+            i += 16
+        }
+        var l = lo.min()
+        var h = hi.max()
+        while i < count {
+            l = min(l, p[i])
+            h = max(h, p[i])
+            i += 1
+        }
+        return (l, h)
+    }
+    
+    /// Moves new peaks into the envelope and updates the UI if there were
+    /// any. Runs on the main thread once per frame.
+    @objc func refresh(_ link : CADisplayLink) {
+        var peak : Float = 0
+        var fresh = false
+        while tap.read(into: &peak, MemoryLayout<Float>.size) > 0 {
+            envelope[head] = Double(peak)
+            head = (head + 1) % numDots
+            fresh = true
+        }
+        if !fresh {
+            return
         }
-        DispatchQueue.main.async {
-            self.appState.dots = arr
+        var dots = appState.dots
+        for i in 0..<min(dots.count, numDots) {
+            dots[i].value = envelope[(head + i) % numDots]
         }
+        appState.dots = dots
     }
 
 }
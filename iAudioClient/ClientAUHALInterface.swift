@@ -10,9 +10,9 @@ import AVFoundation
 
 
 /// Class in charge of interfacing with audio devices on iOS. Provides callbacks
-/// for microphone and speaker endpoints.
+/// for microphone and speaker endpoints. ClientEngine's RemoteIO backend.
 /// See http://atastypixel.com/blog/using-remoteio-audio-unit/ for an example.
-class ClientAUHALInterface {
+class ClientAUHALInterface : AudioBackend {
 
     /// Whether or not we are streaming audio
     var initted = false
@@ -28,10 +28,10 @@ class ClientAUHALInterface {
     var auhalRecorder: AUHALAudioRecorder!
     
     /// The audio format used on when piping audio into speaker.
-    var outAudioF: AudioStreamBasicDescription!
+    var outAudioF: StreamFormat!
     
     /// The audio format used when pulling audio out of microphone.
-    var inAudioF: AudioStreamBasicDescription!
+    var inAudioF: StreamFormat!
     
     /// Whether we stream use mic or not.
     var useMic = false
@@ -42,27 +42,52 @@ class ClientAUHALInterface {
     var internalIOBufferDuration : Double = 0.0
     let TAG = "ClientAUHALInterface"
 
+    /// Total mic frames handed to the transceiver. Mic format changes are
+    /// announced relative to this count.
+    var micFramesSent : UInt64 = 0
+    
+    var recorderCallbackNs : Histogram? {
+        return useMic ? auhalRecorder?.callbackNs : nil
+    }
+    
+    /// Serializes reconfigurations from the socket thread and route changes.
+    let reconfigLock = DispatchSemaphore(value: 1)
+    
+    /// Token of the AVAudioSession route change observer.
+    var routeObserver : NSObjectProtocol?
+
     /// Stops the audio unit for recording / pplaying audio
     func endSession() {
         let speed = (Double(bytesReceived) / (Date().timeIntervalSince1970 - timeStart))
         Logger.log(.log, TAG, "SPEED: \(speed)bytes/s");
         Logger.log(.log, TAG, "Disposing of remoteIO Audio unit...")
+        if routeObserver != nil {
+            NotificationCenter.default.removeObserver(routeObserver!)
+            routeObserver = nil
+        }
         AudioOutputUnitStop(remoteAudioUnit)
+        if useMic {
+            auhalRecorder?.stop()
+        }
         AudioComponentInstanceDispose(remoteAudioUnit)
         initted = false
     }
     
-    /// Initialize unit with known formats, registers callbacks.
-    func initUnit(outFormat: AudioStreamBasicDescription,
-                  inFormat: AudioStreamBasicDescription?,
+    /// Initialize unit with known formats, registers callbacks. If a session
+    /// is already running, reconfigures it in place instead.
+    func initUnit(outFormat: StreamFormat,
+                  inFormat: StreamFormat?,
                   _micPacketReady: ((_ ptr : UnsafeMutableRawPointer, _ len : Int) -> Void)?)
     throws {
         
         Logger.log(.log, TAG, "Initting mobile audio IO interface...")
         
-        outAudioF = outFormat
+        if initted {
+            try reconfigure(outFormat: outFormat, inFormat: inFormat)
+            return
+        }
         
-        if initted { return }
+        outAudioF = outFormat
         
         initted = true
         if inFormat != nil {
@@ -96,6 +121,81 @@ class ClientAUHALInterface {
                              &flag,
                              UInt32(MemoryLayout.size(ofValue: flag))))
         
+        if useMic {
+            // Enable mic IO.
+            Logger.log(.log, TAG, "Enabling IO on mic...")
+            try handle(AudioUnitSetProperty(remoteAudioUnit,
+                                 kAudioOutputUnitProperty_EnableIO,
+                                 kAudioUnitScope_Input,
+                                 kAudioSystemInputBus,
+                                 &flag,
+                                 UInt32(MemoryLayout.size(ofValue: flag))))
+        }
+        
+        try applyFormats()
+
+        do {
+            let ses = AVAudioSession.sharedInstance()
+            // NOTE: THIS PARAMETER IS SUPER IMPORTANT. Setting a low value
+            // will make IO buffers small, so less latency in audio playback.
+            // HOWEVER, making them too small, audio streaming won't be fast
+            // enough and we'll get not enough new data available to fill these
+            // buffers, so we'll get broken audio fragments.
+            try ses.setPreferredIOBufferDuration(TimeInterval(0.01))
+            self.internalIOBufferDuration = ses.ioBufferDuration
+        }
+        catch {
+            Logger.log(.log, TAG, "FAILED TO SET IO Duration")
+        }
+        
+        Logger.log(.log, TAG, "Configured for internalIOBufersize=\(internalIOBufferDuration)")
+        
+        // Create the audio player and add callbacks. Format changes announced
+        // by the server reconfigure the unit at the exact frame.
+        auhalPlayer = AUHALAudioPlayer()
+        auhalPlayer.initUnit(unit: remoteAudioUnit, outFormat: outAudioF)
+        auhalPlayer.onFormatSwitch = { [unowned self] format in
+            do {
+                try self.reconfigure(outFormat: format, inFormat: nil)
+            } catch {
+                Logger.log(.emergency, self.TAG, "Failed to switch speaker format")
+            }
+        }
+        auhalPlayer.addPlaybackCallback()
+        
+        if useMic {
+            /// Create the recorder and add callbacsk.
+            auhalRecorder = AUHALAudioRecorder()
+            auhalRecorder.initUnit(unit: remoteAudioUnit,
+                                   inFormat: inFormat!.asbd,
+                                   pcmPacketReady: { [unowned self] ptr, len in
+                                    self.micFramesSent += UInt64(len / Int(self.inAudioF.mBytesPerFrame))
+                                    _micPacketReady?(ptr, len)
+                                   })
+            auhalRecorder.addRecordingCallback()
+        }
+        
+        // A route change (e.g. headphones plugged in) may reset the formats
+        // on the hardware side. Re-apply ours without dropping the session.
+        routeObserver = NotificationCenter.default.addObserver(
+            forName: AVAudioSession.routeChangeNotification,
+            object: nil, queue: nil) { [unowned self] _ in
+            Logger.log(.log, self.TAG, "Audio route changed, reconfiguring...")
+            do {
+                try self.reconfigure(outFormat: self.outAudioF, inFormat: self.inAudioF)
+            } catch {
+                Logger.log(.emergency, self.TAG, "Failed to reconfigure after route change")
+            }
+        }
+        
+        // Start streaming.
+        AudioUnitInitialize(remoteAudioUnit)
+        AudioOutputUnitStart(remoteAudioUnit)
+    }
+    
+    /// Sets outAudioF / inAudioF on the app side of the RemoteIO unit. The
+    /// unit must be uninitialized.
+    func applyFormats() throws {
         // Set output format (the audio format that will be played by speaker).
         /*Logger.log(.log, TAG, "Setting speaker output format...")
         try handle(AudioUnitSetProperty(remoteAudioUnit,
@@ -106,24 +206,35 @@ class ClientAUHALInterface {
                              UInt32(MemoryLayout.size(ofValue: outAudioF))))*/
         
         // Set input format (the audio format that will be fed into the unit).
-        Logger.log(.log, TAG, "Setting speaker's input format...")
+        // Same as the stream, but with as many channels as the current
+        // route (e.g. 2 on headphones): the player maps channels itself, so
+        // mono plays on both sides.
+        var hwFormat = AudioStreamBasicDescription()
+        var hwSize = UInt32(MemoryLayout.size(ofValue: hwFormat))
+        try handle(AudioUnitGetProperty(remoteAudioUnit,
+                             kAudioUnitProperty_StreamFormat,
+                             kAudioUnitScope_Output,
+                             kAudioSystemOutputBus,
+                             &hwFormat,
+                             &hwSize))
+        var unitFormat = outAudioF.asbd
+        if hwFormat.mChannelsPerFrame > 0 &&
+            unitFormat.mFormatFlags & kAudioFormatFlagIsSignedInteger != 0 &&
+            unitFormat.mFormatFlags & kAudioFormatFlagIsNonInterleaved == 0 &&
+            unitFormat.mBitsPerChannel == 16 {
+            unitFormat.mChannelsPerFrame = hwFormat.mChannelsPerFrame
+            unitFormat.mBytesPerFrame = 2 * hwFormat.mChannelsPerFrame
+            unitFormat.mBytesPerPacket = unitFormat.mBytesPerFrame
+        }
+        Logger.log(.log, TAG, "Setting speaker's input format to \(unitFormat) for route \(hwFormat)...")
         try handle(AudioUnitSetProperty(remoteAudioUnit,
                              kAudioUnitProperty_StreamFormat,
                              kAudioUnitScope_Input,
                              kAudioSystemOutputBus,
-                             &outAudioF,
-                             UInt32(MemoryLayout.size(ofValue: outAudioF))))
+                             &unitFormat,
+                             UInt32(MemoryLayout.size(ofValue: unitFormat))))
         
         if useMic {
-            // Enable mic IO.
-            Logger.log(.log, TAG, "Enabling IO on mic...")
-            try handle(AudioUnitSetProperty(remoteAudioUnit,
-                                 kAudioOutputUnitProperty_EnableIO,
-                                 kAudioUnitScope_Input,
-                                 kAudioSystemInputBus,
-                                 &flag,
-                                 UInt32(MemoryLayout.size(ofValue: flag))))
-            
             // Check if sample rates match (that's important)
             var preferredFormat = AudioStreamBasicDescription()
             var size = UInt32(MemoryLayout.size(ofValue: preferredFormat))
@@ -152,12 +263,13 @@ class ClientAUHALInterface {
             
             // Set output format (the audio format we will receive).
             Logger.log(.log, TAG, "Setting microphone's output format")
+            var micFormat = inAudioF.asbd
             try handle(AudioUnitSetProperty(remoteAudioUnit,
                                  kAudioUnitProperty_StreamFormat,
                                  kAudioUnitScope_Output,
                                  kAudioSystemInputBus,
-                                 &inAudioF,
-                                 UInt32(MemoryLayout.size(ofValue: inAudioF))))
+                                 &micFormat,
+                                 UInt32(MemoryLayout.size(ofValue: micFormat))))
             
             try handle(AudioUnitGetProperty(remoteAudioUnit,
                                  kAudioUnitProperty_StreamFormat,
@@ -167,40 +279,41 @@ class ClientAUHALInterface {
                                  &size))
             Logger.log(.log, TAG, "Resultnig stream format for mic is: \(preferredFormat)")
         }
-
-        do {
-            let ses = AVAudioSession.sharedInstance()
-            // NOTE: THIS PARAMETER IS SUPER IMPORTANT. Setting a low value
-            // will make IO buffers small, so less latency in audio playback.
-            // HOWEVER, making them too small, audio streaming won't be fast
-            // enough and we'll get not enough new data available to fill these
-            // buffers, so we'll get broken audio fragments.
-            try ses.setPreferredIOBufferDuration(TimeInterval(0.01))
-            self.internalIOBufferDuration = ses.ioBufferDuration
-        }
-        catch {
-            Logger.log(.log, TAG, "FAILED TO SET IO Duration")
-        }
-        
-        Logger.log(.log, TAG, "Configured for internalIOBufersize=\(internalIOBufferDuration)")
+    }
+    
+    /// Switches the running session to new formats without disposing of the
+    /// RemoteIO unit or dropping the connection. Playback pauses for about a
+    /// buffer while the unit restarts.
+    /// - Parameters:
+    ///   - outFormat: New speaker format.
+    ///   - inFormat: New mic format, nil to keep the current one.
+    ///   - whileStopped: Run after the unit stopped and before it restarts,
+    ///     i.e. while no render callbacks fire.
+    func reconfigure(outFormat: StreamFormat,
+                     inFormat: StreamFormat?,
+                     whileStopped: (() throws -> Void)? = nil) throws {
+        reconfigLock.wait()
+        defer { reconfigLock.signal() }
+        if !initted { return }
         
-        // Create the audio player and add callbacks.
-        auhalPlayer = AUHALAudioPlayer()
-        auhalPlayer.initUnit(unit: remoteAudioUnit, outFormat: outAudioF)
-        auhalPlayer.addPlaybackCallback()
+        Logger.log(.log, TAG, "Reconfiguring remoteIO unit for \(outFormat) and \(inFormat)")
+        AudioOutputUnitStop(remoteAudioUnit)
+        AudioUnitUninitialize(remoteAudioUnit)
         
+        outAudioF = outFormat
+        if useMic && inFormat != nil {
+            inAudioF = inFormat
+        }
+        try applyFormats()
+        auhalPlayer.setFormat(outAudioF)
         if useMic {
-            /// Create the recorder and add callbacsk.
-            auhalRecorder = AUHALAudioRecorder()
-            auhalRecorder.initUnit(unit: remoteAudioUnit,
-                                   inFormat: inFormat!,
-                                   pcmPacketReady: _micPacketReady)
-            auhalRecorder.addRecordingCallback()
+            // Sends what the old format recorded, so micFramesSent is final.
+            auhalRecorder.setFormat(inAudioF.asbd)
         }
+        try whileStopped?()
         
-        // Start streaming.
-        AudioUnitInitialize(remoteAudioUnit)
-        AudioOutputUnitStart(remoteAudioUnit)
+        try handle(AudioUnitInitialize(remoteAudioUnit))
+        try handle(AudioOutputUnitStart(remoteAudioUnit))
     }
     
     /// Throws error if errorCode
@@ -6,7 +6,6 @@
 //
 
 import SwiftUI
-import Socket
 import AVFoundation
 
 /// Class that sets up UI for app and starts main client loop
@@ -17,15 +16,16 @@ struct iAudioClientApp: App {
     var contentView : ContentView = ContentView(appState: AppState())
     let TAG = "iAudioClientApp"
     
-    /// Main app loop. Always try open port to listen on.
+    /// Main app loop. Opens the port to listen on, trying again until it
+    /// works. Sessions then run on the reactor.
     func mainLoop() {
-        while (true) {
-            do {
-                try client.startListening()
-            } catch {
-                Logger.log(.emergency, TAG, "Error when tried listening")
+        do {
+            try client.startListening()
+        } catch {
+            Logger.log(.emergency, TAG, "Error when tried listening")
+            Reactor.shared.after(2) {
+                mainLoop()
             }
-            sleep(2)
         }
     }
     
@@ -59,17 +59,12 @@ struct iAudioClientApp: App {
     }
 }
     
-/// Class in charge of receiving and transmitting audio data.
+/// Class in charge of receiving and transmitting audio data. The session
+/// itself runs in ClientEngine; this wires it to RemoteIO and the UI.
 class ClientMain  {
     
-    /// The MuxHALAudioPlayer packets get piped into.
-    var auhalIF : ClientAUHALInterface!
-    
-    /// The class that handles packet sending and receiving.
-    var trans : PCMTransceiver!
-    
-    /// The usbmux socket.
-    var sock : Socket!
+    /// Runs the sessions.
+    let engine = ClientEngine(makeBackend: { ClientAUHALInterface() })
     
     /// Handle for UI updates.
     var appState : AppState!
@@ -87,62 +82,20 @@ class ClientMain  {
         self.appState = appState
         let numDots = self.appState.dots.count
         audioViz = AudioViz(appState, numDots)
-    }
-
-    /// Main event body. Blocks unitl an inbound connection comes in. Then
-    /// sets up audio streaming.
-    func startListening() throws {
-   
-        sock = try Socket.create(family: .inet, type: .stream, proto: .tcp)
-        try sock.setReadTimeout(value: 3)
-        try sock.setWriteTimeout(value: 3)
-        try sock.listen(on: 7000)
-        try sock.acceptConnection()
-        
-        // We got a new connection. Say hello.
-        try sock.write(from: "Hello from iPad".data(using: .ascii)!)
-        let buf = NSMutableData()
-        try sock.read(into: buf)
-        let s = String.init(data: buf as Data, encoding: .utf8)
-        Logger.log(.log, TAG, "Receifved: \(s)")
-        
-        /// Called when server sends a handshake consisting of audio format desc.
-        func onHandshake(outAF : AudioStreamBasicDescription,
-                         inAF  : AudioStreamBasicDescription?) {
-            auhalIF = ClientAUHALInterface()
-            do {
-                try auhalIF.initUnit(outFormat: outAF, inFormat: inAF, _micPacketReady: onSend)
-            } catch {
-                print("Fata l error")
+        if viz {
+            engine.onMicPCM = { [unowned self] pcm in
+                self.audioViz.onNewBuffer(ptr: pcm)
             }
         }
-        
-        /// Called when a new packet of microphone data becomes ready.
-        /// Do visualization and send it to the transceiver
-        func onSend(pcmPtr : UnsafeMutableRawPointer, pcmLen : Int) {
-            let ptr = pcmPtr.bindMemory(to: Int16.self, capacity: pcmLen)
-            audioViz.onNewBuffer(ptr: UnsafeBufferPointer<Int16>.init(start: ptr, count: pcmLen / 2))
-            trans.packetReady(pcmPtr, pcmLen)
-        }
-        
-        /// Called when a new audio packet came in from the mac system.
-        /// Play it on our speaker.
-        func onReceived(bytes : UnsafeMutablePointer<Int8>, len : Int) {
-            Logger.log(.verbose, TAG, "about to enqueue packet")
-            auhalIF.auhalPlayer.enqueuePCM(bytes, len)
+        engine.onSessionEnded = { [unowned self] in
+            self.showAlert()
         }
-        
-        /// Called when the socket breaks.
-        func onTerminated() {
-            auhalIF.endSession()
-            showAlert()
-        }
-        
-        /// Set up callbacks and start listening for incoming packets
-        trans = PCMTransceiver(sock, dataCallback:       onReceived,
-                                     handshakeCallback:  onHandshake,
-                                     terminatedCallback: onTerminated)
-        try trans.receiveLoop()
+    }
+
+    /// Opens the port the server connects to. Sessions then run on their
+    /// own. Returns right away.
+    func startListening() throws {
+        try engine.startListening()
     }
     
     func showAlert() {
@@ -151,5 +104,3 @@ class ClientMain  {
         }
     }
 }
-
-
@@ -0,0 +1,263 @@
+//
+//  BinaryPlist.swift
+//  iAudioServer
+//
+
+import Foundation
+
+/// Minimal binary property list ("bplist00") codec for the messages we
+/// exchange with usbmuxd. Much cheaper than going through
+/// PropertyListEncoder and XML for every command.
+///
+/// Supports what usbmuxd messages are made of: dictionaries with string
+/// keys, arrays, strings, integers, reals, booleans and data. Integers
+/// decode as NSNumber, so they cast to any integer type like the ones
+/// PropertyListSerialization returns.
+///
+/// Layout: "bplist00", the objects, a table of their offsets, then a 32
+/// byte trailer: 6 unused bytes, offset size, object reference size, object
+/// count, top object, offset table offset (big endian).
+enum BinaryPlist {
+
+    static let kMagic : [UInt8] = Array("bplist00".utf8)
+    static let kTrailerSize = 32
+
+    /// Whether data is a binary plist at all.
+    static func isBinary(_ data : Data) -> Bool {
+        return data.count >= kMagic.count + kTrailerSize && data.prefix(kMagic.count).elementsEqual(kMagic)
+    }
+
+    // MARK: Encoding
+
+    /// Encodes a plist made of the supported types.
+    /// - Throws: If obj contains anything else.
+    static func encode(_ obj : Any) throws -> Data {
+        // Flatten the tree: every object gets an index, containers refer to
+        // their children by index.
+        func count(_ o : Any) -> Int {
+            if let d = o as? [String : Any] {
+                return d.reduce(1) { $0 + 1 + count($1.value) }
+            }
+            if let a = o as? [Any] {
+                return a.reduce(1) { $0 + count($1) }
+            }
+            return 1
+        }
+        let refSize = count(obj) < 256 ? 1 : 2
+
+        var body = Data(kMagic)
+        var offsets = [Int]()
+
+        func appendInt(_ v : UInt64, _ size : Int) {
+            for i in (0..<size).reversed() {
+                body.append(UInt8(truncatingIfNeeded: v >> (8 * UInt64(i))))
+            }
+        }
+        func appendMarker(_ type : UInt8, _ n : Int) {
+            if n < 15 {
+                body.append(type | UInt8(n))
+            } else {
+                body.append(type | 0xF)
+                appendIntObject(Int64(n))
+            }
+        }
+        func appendIntObject(_ v : Int64) {
+            if v >= 0 && v <= 0xFF {
+                body.append(0x10); appendInt(UInt64(v), 1)
+            } else if v >= 0 && v <= 0xFFFF {
+                body.append(0x11); appendInt(UInt64(v), 2)
+            } else if v >= 0 && v <= 0xFFFF_FFFF {
+                body.append(0x12); appendInt(UInt64(v), 4)
+            } else {
+                body.append(0x13); appendInt(UInt64(bitPattern: v), 8)
+            }
+        }
+
+        // Writes o and its children, returns o's index. A container takes
+        // its index before its children but is written after them, once
+        // their indices are known.
+        func write(_ o : Any) throws -> Int {
+            let index = offsets.count
+            offsets.append(0)
+
+            if let d = o as? [String : Any] {
+                let keys = d.keys.sorted()
+                var refs = [Int]()
+                for k in keys {
+                    refs.append(try write(k))
+                }
+                for k in keys {
+                    refs.append(try write(d[k]!))
+                }
+                offsets[index] = body.count
+                appendMarker(0xD0, keys.count)
+                for r in refs {
+                    appendInt(UInt64(r), refSize)
+                }
+                return index
+            }
+            if let a = o as? [Any] {
+                var refs = [Int]()
+                for e in a {
+                    refs.append(try write(e))
+                }
+                offsets[index] = body.count
+                appendMarker(0xA0, a.count)
+                for r in refs {
+                    appendInt(UInt64(r), refSize)
+                }
+                return index
+            }
+
+            offsets[index] = body.count
+            if let s = o as? String {
+                if let ascii = s.data(using: .ascii) {
+                    appendMarker(0x50, ascii.count)
+                    body.append(ascii)
+                } else {
+                    let utf16 = Array(s.utf16)
+                    appendMarker(0x60, utf16.count)
+                    for c in utf16 {
+                        appendInt(UInt64(c), 2)
+                    }
+                }
+            } else if let b = o as? Bool, type(of: o) == Bool.self {
+                body.append(b ? 0x09 : 0x08)
+            } else if let d = o as? Data {
+                appendMarker(0x40, d.count)
+                body.append(d)
+            } else if let n = o as? Double, type(of: o) == Double.self {
+                body.append(0x23)
+                appendInt(n.bitPattern, 8)
+            } else if let n = o as? Int {
+                appendIntObject(Int64(n))
+            } else if let n = o as? NSNumber {
+                appendIntObject(n.int64Value)
+            } else {
+                throw NSError(domain: "Error_Domain", code: 110,
+                              userInfo: [NSLocalizedDescriptionKey : "Can't encode \(type(of: o))"])
+            }
+            return index
+        }
+
+        let top = try write(obj)
+        let tableOffset = body.count
+        let offsetSize = tableOffset < 256 ? 1 : tableOffset < 65536 ? 2 : 4
+        for o in offsets {
+            appendInt(UInt64(o), offsetSize)
+        }
+        body.append(contentsOf: [0, 0, 0, 0, 0, 0, UInt8(offsetSize), UInt8(refSize)])
+        appendInt(UInt64(offsets.count), 8)
+        appendInt(UInt64(top), 8)
+        appendInt(UInt64(tableOffset), 8)
+        return body
+    }
+
+    // MARK: Decoding
+
+    /// Decodes a binary plist.
+    /// - Throws: If data is malformed or uses unsupported types.
+    static func decode(_ data : Data) throws -> Any {
+        let b = [UInt8](data)
+        func fail() -> NSError {
+            return NSError(domain: "Error_Domain", code: 111,
+                           userInfo: [NSLocalizedDescriptionKey : "Malformed binary plist"])
+        }
+        func readInt(_ at : Int, _ size : Int) throws -> Int {
+            if size < 1 || size > 8 || at < 0 || at + size > b.count { throw fail() }
+            var v : UInt64 = 0
+            for i in 0..<size {
+                v = v << 8 | UInt64(b[at + i])
+            }
+            return Int(truncatingIfNeeded: v)
+        }
+        if !isBinary(data) { throw fail() }
+
+        let t = b.count - kTrailerSize
+        let offsetSize = Int(b[t + 6])
+        let refSize = Int(b[t + 7])
+        let numObjects = try readInt(t + 8, 8)
+        let top = try readInt(t + 16, 8)
+        let tableOffset = try readInt(t + 24, 8)
+        if numObjects < 1 || numObjects > b.count || top < 0 || top >= numObjects ||
+            tableOffset < 0 || tableOffset + numObjects * offsetSize > t {
+            throw fail()
+        }
+
+        // Length of an object with its marker at pos, and where its
+        // contents start.
+        func length(_ marker : UInt8, _ pos : Int) throws -> (Int, Int) {
+            let n = Int(marker & 0xF)
+            if n != 0xF {
+                return (n, pos + 1)
+            }
+            let intMarker = pos + 1 < b.count ? b[pos + 1] : 0
+            if intMarker & 0xF0 != 0x10 { throw fail() }
+            let size = 1 << Int(intMarker & 0xF)
+            let n2 = try readInt(pos + 2, size)
+            if n2 < 0 || n2 > b.count { throw fail() }
+            return (n2, pos + 2 + size)
+        }
+
+        // Usbmuxd messages are shallow; the depth limit only guards against
+        // reference cycles in a malformed plist.
+        func object(_ ref : Int, _ depth : Int) throws -> Any {
+            if ref < 0 || ref >= numObjects || depth > 32 { throw fail() }
+            let pos = try readInt(tableOffset + ref * offsetSize, offsetSize)
+            if pos < kMagic.count || pos >= t { throw fail() }
+            let marker = b[pos]
+            switch marker & 0xF0 {
+            case 0x00:
+                if marker == 0x08 { return false }
+                if marker == 0x09 { return true }
+                throw fail()
+            case 0x10:
+                let size = 1 << Int(marker & 0xF)
+                if size > 8 { throw fail() }
+                // Only 8 byte integers are signed, readInt handles both.
+                return NSNumber(value: try readInt(pos + 1, size))
+            case 0x20:
+                let size = 1 << Int(marker & 0xF)
+                let bits = UInt64(bitPattern: Int64(try readInt(pos + 1, size)))
+                if size == 4 { return NSNumber(value: Float(bitPattern: UInt32(bits))) }
+                if size == 8 { return NSNumber(value: Double(bitPattern: bits)) }
+                throw fail()
+            case 0x40, 0x50:
+                let (n, start) = try length(marker, pos)
+                if start + n > t { throw fail() }
+                let bytes = Data(b[start..<start + n])
+                if marker & 0xF0 == 0x40 { return bytes }
+                guard let s = String(data: bytes, encoding: .ascii) else { throw fail() }
+                return s
+            case 0x60:
+                let (n, start) = try length(marker, pos)
+                if start + 2 * n > t { throw fail() }
+                var units = [UInt16]()
+                units.reserveCapacity(n)
+                for i in 0..<n {
+                    units.append(UInt16(b[start + 2 * i]) << 8 | UInt16(b[start + 2 * i + 1]))
+                }
+                return String(decoding: units, as: UTF16.self)
+            case 0xA0:
+                let (n, start) = try length(marker, pos)
+                var arr = [Any]()
+                for i in 0..<n {
+                    arr.append(try object(try readInt(start + i * refSize, refSize), depth + 1))
+                }
+                return arr
+            case 0xD0:
+                let (n, start) = try length(marker, pos)
+                var dict = [String : Any]()
+                for i in 0..<n {
+                    guard let key = try object(try readInt(start + i * refSize, refSize),
+                                               depth + 1) as? String else { throw fail() }
+                    dict[key] = try object(try readInt(start + (n + i) * refSize, refSize), depth + 1)
+                }
+                return dict
+            default:
+                throw fail()
+            }
+        }
+        return try object(top, 0)
+    }
+}
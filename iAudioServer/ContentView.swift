@@ -19,6 +19,26 @@ class ServerState: ObservableObject {
     @Published var status = ServerStatus.connected_inactive;
     @Published var numDevices = 0;
     @Published var enableMicDistort = false;
+    
+    /// How long (ms) the sender may hold PCM buffers back to batch them into
+    /// one frame. 0 sends every buffer right away.
+    @Published var coalesceDeadlineMs = 0.0;
+    
+    /// Codecs the speaker and mic streams are sent with, if the device
+    /// supports them. Apply to new connections.
+    @Published var speakerCodec = AudioCodec.pcm;
+    @Published var micCodec = AudioCodec.pcm;
+    
+    /// Connect to the device over Wi-Fi instead of USB. Audio then goes over
+    /// UDP with FEC. Applies to new connections.
+    @Published var useWifi = false;
+    @Published var wifiHost = "";
+    
+    /// Current estimate of the device clock relative to ours.
+    @Published var clockInfo = "";
+    
+    /// How the device's audio callbacks fared over the last second.
+    @Published var telemetryInfo = "";
 }
 
 struct ContentView: View {
@@ -92,6 +112,33 @@ struct ContentView: View {
             Toggle(isOn: $serverState.enableMicDistort, label: {
                 Text("iOS Microphone FFT")
             })
+            
+            Picker("Speaker", selection: $serverState.speakerCodec) {
+                Text("PCM").tag(AudioCodec.pcm)
+                Text("Lossless").tag(AudioCodec.lossless)
+                Text("ADPCM").tag(AudioCodec.adpcm)
+            }
+            Picker("Mic", selection: $serverState.micCodec) {
+                Text("PCM").tag(AudioCodec.pcm)
+                Text("Lossless").tag(AudioCodec.lossless)
+                Text("ADPCM").tag(AudioCodec.adpcm)
+            }
+            
+            Toggle(isOn: $serverState.useWifi, label: {
+                Text("Wi-Fi (UDP)")
+            })
+            if serverState.useWifi {
+                TextField("iPad address", text: $serverState.wifiHost)
+            }
+            
+            Text("Packet coalescing: \(Int(serverState.coalesceDeadlineMs)) ms")
+                .opacity(0.4)
+            Slider(value: $serverState.coalesceDeadlineMs, in: 0...20, step: 1)
+            
+            if serverState.status == .connected_active {
+                Text(serverState.clockInfo).opacity(0.4)
+                Text(serverState.telemetryInfo).opacity(0.4)
+            }
 
         }
         .frame(width: 200.0).padding(15)
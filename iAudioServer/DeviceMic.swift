@@ -0,0 +1,162 @@
+//
+//  DeviceMic.swift
+//  iAudioServer
+//
+
+import Foundation
+import AVFoundation
+import CoreAudio
+import AudioUnit
+import AudioToolbox
+
+/// Mic uplink of one connected device. Plays the device's mic stream into
+/// iOSMicDevice through an AUHAL unit of its own. With several devices
+/// connected, each has one of these and the HAL mixes them on the virtual
+/// mic, so no device's stream has to wait for another's.
+class DeviceMic {
+
+    /// Shared helpers (AUHAL creation, error handling) and the mic device.
+    unowned let hal : ServerAUHALInterface
+
+    let micAuhal = AUHALAudioPlayer()
+
+    /// The AUHAL Audio Unit responseible for piping mic data from iOS.
+    var micAU: AudioComponentInstance!
+
+    /// Audio stream format we receive from this device.
+    var micAF: AudioStreamBasicDescription
+
+    /// Debugging.
+    let TAG = "DeviceMic"
+
+    init(_ hal : ServerAUHALInterface, format : AudioStreamBasicDescription, clock : ClockSync?) {
+        self.hal = hal
+        micAF = format
+        micAuhal.clock = clock
+    }
+
+    /// Creates and starts the unit.
+    /// - Throws: If the unit can't be set up.
+    func start() throws {
+        hal.instantiateAUHAL(au: &micAU)
+        try initIOSMicReceiving()
+        try hal.handle(AudioUnitInitialize(micAU!))
+        try hal.handle(AudioOutputUnitStart(micAU!))
+    }
+
+    /// Stops and disposes the unit.
+    func stop() {
+        AudioOutputUnitStop(micAU)
+        AudioComponentInstanceDispose(micAU)
+    }
+
+    /// Called with the device's mic PCM.
+    func enqueuePCM(_ bytes : UnsafeMutablePointer<Int8>, _ len : Int) {
+        micAuhal.enqueuePCM(bytes, len)
+    }
+    
+    /// Called for mic PCM lost on the way, see AUHALAudioPlayer.enqueueLoss.
+    func enqueueLoss(_ len : Int) {
+        micAuhal.enqueueLoss(len)
+    }
+
+    /// Handles control messages from the device.
+    func handleControl(_ msg : ControlMessage) {
+        switch msg {
+        case .formatChange(let stream, let applyAt, let format):
+            if stream == .mic {
+                micAuhal.scheduleFormat(format, at: applyAt)
+            }
+        default:
+            break
+        }
+    }
+
+    /// Restarts micAU with a new format. Called by micAuhal at the exact
+    /// frame the device switched formats.
+    func reconfigureMic(_ format : StreamFormat) {
+        do {
+            AudioOutputUnitStop(micAU)
+            AudioUnitUninitialize(micAU)
+            micAF = format.asbd
+            try hal.handle(AudioUnitSetProperty(micAU,
+                                 kAudioUnitProperty_StreamFormat,
+                                 kAudioUnitScope_Input,
+                                 kAudioOutputBus,
+                                 &micAF,
+                                 UInt32(MemoryLayout.size(ofValue: micAF))))
+            micAuhal.setFormat(format)
+            try hal.handle(AudioUnitInitialize(micAU))
+            try hal.handle(AudioOutputUnitStart(micAU))
+        } catch {
+            Logger.log(.emergency, TAG, "Failed to switch mic format: \(error)")
+        }
+    }
+
+    /// Prime micAU for sending audio to iOSMicDriver virtual audio device
+    /// which will then act as a system mic input.
+    func initIOSMicReceiving() throws {
+
+        // Enable IO on the virtual speaker's output bus.
+        var flag : UInt32 = 1;
+
+        Logger.log(.log, TAG, "Enabling IO for iOS mic playback...")
+        try hal.handle(AudioUnitSetProperty(micAU,
+                             kAudioOutputUnitProperty_EnableIO,
+                             kAudioUnitScope_Output,
+                             kAudioOutputBus, &flag,
+                             UInt32(MemoryLayout.size(ofValue: flag))))
+
+        // Disable IO for the input of the virtual speaker.
+        flag = 0
+        try hal.handle(AudioUnitSetProperty(micAU,
+                             kAudioOutputUnitProperty_EnableIO,
+                             kAudioUnitScope_Input,
+                             kAudioInputBus, &flag,
+                             UInt32(MemoryLayout.size(ofValue: flag))))
+
+        // Set iOSMicDriver device as input to HAL unit.
+        Logger.log(.log, TAG, "Setting iOSMicDeviceID as CurrentDevice...")
+        var deviceID = hal.micDriverDeviceID!
+        try hal.handle(AudioUnitSetProperty(micAU,
+                             kAudioOutputUnitProperty_CurrentDevice,
+                             kAudioUnitScope_Global,
+                             kAudioOutputBus, &deviceID,
+                             UInt32(MemoryLayout.size(ofValue: deviceID))))
+
+        Logger.log(.log, TAG, "Current Audio Format for iOS Mic: \(micAF)...")
+
+        // Set equal formats for input/output to avoid making AUHAL
+        // convert PCM formats. For a diagram, see
+        // https://developer.apple.com/library/archive/technotes/tn2091/_index.html
+
+        // Set input stream format. this is the data format of audio coming
+        // into the AUHAL unit's input scope. i.e. audio stream format from mic.
+        Logger.log(.log, TAG, "Setting IO Stream formats for iOS Mic playback equal...")
+        try hal.handle(AudioUnitSetProperty(micAU,
+                             kAudioUnitProperty_StreamFormat,
+                             kAudioUnitScope_Input,
+                             kAudioOutputBus,
+                             &micAF,
+                             UInt32(MemoryLayout.size(ofValue: micAF))))
+
+        // Request very small internal IO buffer sizes to increase frequency
+        // by which we send packets. This reduces latency but stresses CPU.
+        var internalIOBufferSize = 512
+        Logger.log(.log, TAG, "Setting internal buffer size for Mic playback (\(internalIOBufferSize))...")
+        try hal.handle(AudioUnitSetProperty(micAU,
+                             kAudioDevicePropertyBufferFrameSize,
+                             kAudioUnitScope_Global,
+                             kAudioOutputBus,
+                             &internalIOBufferSize,
+                             UInt32(MemoryLayout.size(ofValue: internalIOBufferSize))))
+
+        Logger.log(.log, TAG, "Initting playback unit and adding callback...")
+        micAuhal.initUnit(unit: micAU, outFormat: StreamFormat(micAF))
+        micAuhal.onFormatSwitch = { [unowned self] format in
+            self.reconfigureMic(format)
+        }
+        micAuhal.addPlaybackCallback()
+        Logger.log(.log, TAG, "Started iOS Mic unit")
+    }
+}
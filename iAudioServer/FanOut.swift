@@ -0,0 +1,356 @@
+//
+//  FanOut.swift
+//  iAudioServer
+//
+
+import Foundation
+import AVFoundation
+
+/// Feeds one system audio capture to every connected device. The capture is
+/// batched and encoded once per codec in use, no matter how many devices
+/// listen; each device then only costs a socket write. Every device has its
+/// own serial send queue with a bounded backlog, so a slow or stalled device
+/// drops its own frames instead of holding up the capture or the others.
+class FanOut {
+
+    /// One connected device.
+    class Peer {
+        /// Replaced when the session resumes on a new connection.
+        var trans : PCMTransceiver
+        let mic : DeviceMic?
+        
+        /// Identifies the session for resuming it, see SessionResume.
+        let sessionId : UInt32
+        
+        /// Set while the connection is gone but the session may still be
+        /// resumed. Frames sent meanwhile count as dropped.
+        var suspended = false
+        
+        /// Cleared if something happened while suspended that the device
+        /// can't catch up on (a speaker format change).
+        var resumable = true
+
+        /// Writes this device's frames, in order, off the audio thread.
+        let queue : DispatchQueue
+
+        /// Frames and messages queued but not written yet.
+        var backlog = 0
+
+        /// Capture frames sent before the device joined, and dropped for it
+        /// since. Speaker format changes are announced in its own frame count.
+        let baseFrame : UInt64
+        var droppedFrames : UInt64 = 0
+
+        init(_ trans : PCMTransceiver, _ mic : DeviceMic?, _ baseFrame : UInt64, _ sessionId : UInt32) {
+            self.trans = trans
+            self.mic = mic
+            self.baseFrame = baseFrame
+            self.sessionId = sessionId
+            queue = DispatchQueue(label: "FanOut.Peer", qos: .userInteractive)
+        }
+    }
+
+    /// Frames a device may have queued before new ones get dropped for it.
+    static let kMaxBacklog = 16
+
+    /// The shared capture (and the mic device).
+    let hal = ServerAUHALInterface()
+    var capturing = false
+    var useMic = true
+
+    var peers = [Peer]()
+
+    /// Guards peers and their backlogs. Held only briefly, also by the
+    /// capture thread.
+    let semaphore = DispatchSemaphore(value: 1)
+
+    /// Serializes devices joining and leaving, which may block on sockets
+    /// and audio units.
+    let membership = DispatchSemaphore(value: 1)
+
+    /// Batches capture buffers, same as PCMTransceiver does for one device.
+    let coalescer = PacketCoalescer()
+    var pcmBatch = Data(capacity: 8192)
+    
+    /// Guards the batch, coalescer and encoders: the capture thread adds to
+    /// the batch, the reactor flushes it once its deadline passed.
+    let batchLock = DispatchSemaphore(value: 1)
+
+    /// One encoder and frame buffer per codec, indexed by raw value.
+    let encoders = AudioCodec.allCases.map { _ in FrameEncoder() }
+    var frames = AudioCodec.allCases.map { _ in Data(capacity: 8192) }
+    var built = AudioCodec.allCases.map { _ in false }
+    var needed = AudioCodec.allCases.map { _ in false }
+
+    /// Layout of the captured audio.
+    var channels = 1
+    var bytesPerFrame = 0
+    var canEncode = true
+
+    /// Capture frames sent so far.
+    var framesSent : UInt64 = 0
+
+    /// Debugging.
+    let TAG = "FanOut"
+
+    init() {
+        hal.sendControl = { [unowned self] msg in
+            self.sendControl(msg)
+        }
+        hal.sendControlNow = { [unowned self] msg in
+            self.sendControlNow(msg)
+        }
+        coalescer.onDeadline = { [weak self] in
+            self?.flushExpired()
+        }
+    }
+
+    /// Devices streaming right now, not counting suspended ones.
+    var count : Int {
+        semaphore.wait()
+        defer { semaphore.signal() }
+        return peers.filter({ !$0.suspended }).count
+    }
+
+    /// Starts streaming to a newly connected device: sends it the handshake,
+    /// starts its mic and adds it to the receivers of the next frame. Starts
+    /// the capture if it is the first device.
+    /// - Throws: If the capture, handshake or mic setup fails.
+    func addPeer(_ trans : PCMTransceiver, sessionId : UInt32) throws -> Peer {
+        membership.wait()
+        defer { membership.signal() }
+
+        if !capturing {
+            try hal.makeSession(_packetReady: packetReady, _useMic: useMic)
+            setFormat(StreamFormat(hal.usbAF))
+            capturing = true
+        }
+        try trans.handshakePacketReady(absd: hal.handshakePayload(), useMic: hal.useMic)
+        let mic = try hal.makeMic(clock: trans.clock)
+        trans.controlCallback = { msg in
+            mic?.handleControl(msg)
+        }
+
+        semaphore.wait()
+        let peer = Peer(trans, mic, framesSent, sessionId)
+        peers.append(peer)
+        semaphore.signal()
+        Logger.log(.log, TAG, "Streaming to \(peers.count) devices")
+        return peer
+    }
+
+    /// Keeps a device whose connection died for SessionResume.kGraceSeconds,
+    /// its mic unit included, in case it comes back. Removes it after that.
+    /// - Parameter onExpired: Called if it didn't come back.
+    func suspendPeer(_ peer : Peer, onExpired : @escaping () -> Void) {
+        semaphore.wait()
+        peer.suspended = true
+        let trans = peer.trans
+        semaphore.signal()
+        Logger.log(.log, TAG, "Device lost, keeping session \(peer.sessionId) for resuming")
+        
+        Reactor.shared.after(SessionResume.kGraceSeconds) { [unowned self] in
+            self.semaphore.wait()
+            let expired = peer.suspended && peer.trans === trans
+            self.semaphore.signal()
+            if expired {
+                DispatchQueue.global(qos: .userInitiated).async {
+                    self.removePeer(peer)
+                    onExpired()
+                }
+            }
+        }
+    }
+    
+    /// Resumes a suspended session on a new connection, if it's still there.
+    /// - Parameters:
+    ///   - sessionId: The session the device asks to resume.
+    ///   - frames: Speaker frames the device played. Frames we sent beyond
+    ///     that were lost with the old connection.
+    ///   - trans: The new connection.
+    /// - Returns: The resumed device, nil if the session can't be resumed.
+    func resumePeer(_ sessionId : UInt32, frames : UInt64, _ trans : PCMTransceiver) -> Peer? {
+        semaphore.wait()
+        defer { semaphore.signal() }
+        guard let peer = peers.first(where: { $0.sessionId == sessionId }),
+              peer.suspended, peer.resumable else {
+            return nil
+        }
+        let delivered = framesSent - peer.baseFrame - peer.droppedFrames
+        if delivered > frames {
+            peer.droppedFrames += delivered - frames
+        }
+        peer.trans = trans
+        peer.suspended = false
+        trans.controlCallback = { [weak mic = peer.mic] msg in
+            mic?.handleControl(msg)
+        }
+        peer.mic?.micAuhal.clock = trans.clock
+        Logger.log(.log, TAG, "Resumed session \(sessionId), " +
+            "\(delivered > frames ? delivered - frames : 0) frames lost in flight")
+        return peer
+    }
+    
+    /// Stops streaming to a device. Stops the capture after the last one.
+    func removePeer(_ peer : Peer) {
+        membership.wait()
+        defer { membership.signal() }
+
+        semaphore.wait()
+        peer.suspended = false
+        peers.removeAll(where: { $0 === peer })
+        let left = peers.count
+        semaphore.signal()
+
+        peer.mic?.stop()
+        Logger.log(.log, TAG, "Device left after \(peer.droppedFrames) dropped frames, " +
+            "\(left) still connected")
+        if left == 0 && capturing {
+            hal.endSession()
+            capturing = false
+            batchLock.wait()
+            coalescer.reset()
+            batchLock.signal()
+        }
+    }
+
+    func setFormat(_ format : StreamFormat) {
+        channels = Int(format.mChannelsPerFrame)
+        bytesPerFrame = Int(format.mBytesPerFrame)
+        canEncode = AudioCodec.canEncode(format)
+        for e in encoders {
+            e.reset()
+        }
+    }
+
+    /// Called by the capture unit with every buffer.
+    func packetReady(_ pcmPtr : UnsafeMutableRawPointer, _ pcmLen : Int) {
+        batchLock.wait()
+        defer { batchLock.signal() }
+        if coalescer.batchedBytes == 0 {
+            pcmBatch.removeAll(keepingCapacity: true)
+        }
+        pcmBatch.append(pcmPtr.assumingMemoryBound(to: UInt8.self), count: pcmLen)
+        if coalescer.add(pcmLen) {
+            flush()
+        }
+    }
+
+    /// Called on the reactor when the batch's deadline passed before the
+    /// next capture buffer came.
+    func flushExpired() {
+        batchLock.wait()
+        defer { batchLock.signal() }
+        if coalescer.expired() {
+            flush()
+        }
+    }
+
+    /// Encodes the batch once per codec in use and queues it to every device.
+    /// Under batchLock. The encoding happens outside semaphore, so devices'
+    /// send queues never wait for it.
+    func flush() {
+        let n = bytesPerFrame > 0 ? UInt64(pcmBatch.count / bytesPerFrame) : 0
+        coalescer.didFlush()
+        for i in 0..<built.count {
+            built[i] = false
+            needed[i] = false
+        }
+
+        semaphore.wait()
+        for peer in peers where !peer.suspended {
+            needed[Int((canEncode ? peer.trans.txCodec : .pcm).rawValue)] = true
+        }
+        semaphore.signal()
+
+        for codec in AudioCodec.allCases where needed[Int(codec.rawValue)] {
+            let i = Int(codec.rawValue)
+            encoders[i].build(pcmBatch, codec: codec, channels: channels,
+                              channel: .speaker, into: &frames[i])
+            built[i] = true
+        }
+
+        semaphore.wait()
+        for peer in peers {
+            let codec = canEncode ? peer.trans.txCodec : .pcm
+            let i = Int(codec.rawValue)
+            // Not built: the device joined or resumed while encoding.
+            if peer.backlog >= FanOut.kMaxBacklog || peer.suspended || !built[i] {
+                peer.droppedFrames += n
+                continue
+            }
+            peer.backlog += 1
+            let frame = frames[i]
+            let trans = peer.trans
+            peer.queue.async { [unowned self] in
+                let sent = trans.sendFrame(frame)
+                self.semaphore.wait()
+                peer.backlog -= 1
+                // A resumed session already wrote off the old connection's.
+                if !sent && peer.trans === trans {
+                    peer.droppedFrames += n
+                }
+                self.semaphore.signal()
+            }
+        }
+        framesSent += n
+        semaphore.signal()
+    }
+
+    /// Queues a control message to every device.
+    func sendControl(_ msg : ControlMessage) {
+        semaphore.wait()
+        for peer in peers where !peer.suspended {
+            peer.trans.sendControl(msg)
+        }
+        semaphore.signal()
+    }
+
+    /// Sends a control message to every device in order with the audio
+    /// queued for it. A speaker format change is rewritten to each device's
+    /// own frame count, once the frames queued before it were sent or
+    /// dropped. Only call while the capture unit is stopped.
+    func sendControlNow(_ msg : ControlMessage) {
+        batchLock.wait()
+        if coalescer.batchedBytes > 0 {
+            flush()
+        }
+        var format : StreamFormat?
+        if case .formatChange(let stream, _, let f) = msg, stream == .speaker {
+            setFormat(f)
+            format = f
+        }
+        batchLock.signal()
+
+        semaphore.wait()
+        let sent = framesSent
+        for peer in peers {
+            if peer.suspended {
+                // It would miss the change. Make it start over instead.
+                peer.resumable = false
+                continue
+            }
+            peer.backlog += 1
+            let trans = peer.trans
+            peer.queue.async { [unowned self] in
+                var m = msg
+                if format != nil {
+                    self.semaphore.wait()
+                    m = .formatChange(stream: .speaker,
+                                      applyAt: sent - peer.baseFrame - peer.droppedFrames,
+                                      format: format!)
+                    self.semaphore.signal()
+                }
+                do {
+                    try trans.sendControlNow(m)
+                } catch {
+                    Logger.log(.emergency, self.TAG, "Failed to send \(m)")
+                }
+                self.semaphore.wait()
+                peer.backlog -= 1
+                self.semaphore.signal()
+            }
+        }
+        semaphore.signal()
+    }
+}
@@ -21,10 +21,10 @@ let kAudioOutputBus : UInt32 = 0;
 ///
 /// Uses AUHAL to communicate with the virtual device and issues resulting
 /// data to callbacks passed into [makeSession](x-source-tag://makeSession).
-/// Juggles two AUHAL units, one for recording, one for playback.
+/// Owns the one capture unit shared by all devices; every device plays its
+/// mic through a DeviceMic made by makeMic.
 class ServerAUHALInterface {
     
-    var micAuhal: AUHALAudioPlayer!
     var usbAuhal: AUHALAudioRecorder!
     
     /// Callback when new PCM Audio data packet has been rendered.
@@ -33,15 +33,12 @@ class ServerAUHALInterface {
     /// Audio stream format we will send over usb to the device.
     var usbAF: AudioStreamBasicDescription!
     
-    /// Audio stream format we will receive from the device.
+    /// Current format of iOSMicDevice. New devices are asked for it.
     var micAF: AudioStreamBasicDescription!
     
     /// The AUHAL Audio Unit responseible for polling system audio.
     var usbAU: AudioComponentInstance!
     
-    /// The AUHAL Audio Unit responseible for piping mic data from iOS.
-    var micAU: AudioComponentInstance!
-
     /// Debugging.
     let TAG = "MuxHALAudioStreamer"
     
@@ -51,15 +48,40 @@ class ServerAUHALInterface {
     /// AudioDeviceIDs of our virtual devices.
     var usbDriverDeviceID : AudioDeviceID!
     var micDriverDeviceID : AudioDeviceID? = nil
+    
+    /// Total speaker frames handed to packetReady. Speaker format changes are
+    /// announced relative to this count.
+    var speakerFramesSent : UInt64 = 0
+    
+    /// Sends a control message to all devices, queued or in order with audio.
+    var sendControl: ((ControlMessage) -> Void)?
+    var sendControlNow: ((ControlMessage) throws -> Void)?
+    
+    /// Sample rate listeners registered on the virtual devices.
+    var formatListener : AudioObjectPropertyListenerBlock?
+    var micFormatListener : AudioObjectPropertyListenerBlock?
+    
+    /// Address of the property we watch for format changes.
+    var sampleRateAddress = AudioObjectPropertyAddress(
+        mSelector: kAudioDevicePropertyNominalSampleRate,
+        mScope: kAudioObjectPropertyScopeGlobal,
+        mElement: kAudioObjectPropertyElementMaster)
 
     /// Stops and disposes current AUHAL unit.
     func endSession() {
+        if formatListener != nil {
+            AudioObjectRemovePropertyListenerBlock(usbDriverDeviceID, &sampleRateAddress,
+                                                   DispatchQueue.global(), formatListener!)
+            formatListener = nil
+        }
+        if micFormatListener != nil {
+            AudioObjectRemovePropertyListenerBlock(micDriverDeviceID!, &sampleRateAddress,
+                                                   DispatchQueue.global(), micFormatListener!)
+            micFormatListener = nil
+        }
         AudioOutputUnitStop(usbAU)
+        usbAuhal?.stop()
         AudioComponentInstanceDispose(usbAU)
-        if useMic {
-            AudioOutputUnitStop(micAU)
-            AudioComponentInstanceDispose(micAU)
-        }
     }
     
     /// Serializes AudioStreamBasicDescription to Data for socket transmission
@@ -93,125 +115,120 @@ class ServerAUHALInterface {
     
     /// Sets up our USBAudioDriver to poll for new audio input (which is the
     /// system's audio output). Then sends the resuliting PCM audio data to
-    /// the packet ready callback.
+    /// the packet ready callback. Devices get the formats from
+    /// handshakePayload.
     /// - Parameters:
     ///   - _packetReady: Called when a new buffer of audio data is available.
-    ///   - _handshakePacketReady: Called to give current audio format.
     /// - Throws: If cannot communicate to Virtual USBAudioDriver.
     func makeSession(
         _packetReady: @escaping (_ ptr : UnsafeMutableRawPointer, _ len : Int) -> Void,
-        _handshakePacketReady: @escaping (_ format : Data, _ useMic: Bool) throws -> Void,
         _useMic : Bool) throws {
         
         self.useMic = _useMic
         
-        micAuhal = AUHALAudioPlayer()
         usbAuhal = AUHALAudioRecorder()
         
         // Get AudioDeviceID for our USBDriver.
         usbDriverDeviceID = try GetAudioDeviceIDByUID(uid: "USBAudioDevice_UID")
         
-        // Register callbacks and send handshake packet describing audio format.
+        // Register callbacks and query the audio formats.
         packetReady = _packetReady
         usbAF = try GetAudioDescriptionFromDeviceID(id: usbDriverDeviceID)
-        var handshakePayload = asbdToData(asbd: usbAF)
         
         if useMic {
             micDriverDeviceID = try GetAudioDeviceIDByUID(uid: "iOSMicDevice_UID")
             micAF = try GetAudioDescriptionFromDeviceID(id: micDriverDeviceID!)
-            handshakePayload.append(asbdToData(asbd: micAF))
         }
-
-        try _handshakePacketReady(handshakePayload, useMic)
         
         instantiateAUHAL(au: &usbAU)
         try initSystemAudioTransmission()
         
-        if useMic {
-            instantiateAUHAL(au: &micAU)
-            try initIOSMicReceiving()
-        }
         // Start polling virtual audio device.
         AudioUnitInitialize(usbAU!)
-        if useMic { AudioUnitInitialize(micAU!) }
         AudioOutputUnitStart(usbAU!)
-        if useMic { AudioOutputUnitStart(micAU!) }
         Logger.log(.log, TAG, "Started output unit")
+        
+        // Renegotiate instead of tearing down when a device format changes.
+        formatListener = { [unowned self] _, _ in
+            self.renegotiateSpeaker()
+        }
+        AudioObjectAddPropertyListenerBlock(usbDriverDeviceID, &sampleRateAddress,
+                                            DispatchQueue.global(), formatListener!)
+        if useMic {
+            micFormatListener = { [unowned self] _, _ in
+                self.requestMicFormat()
+            }
+            AudioObjectAddPropertyListenerBlock(micDriverDeviceID!, &sampleRateAddress,
+                                                DispatchQueue.global(), micFormatListener!)
+        }
     }
     
-    /// Prime micAU for sending audio to iOSMicDriver virtual audio device
-    /// which will then act as a system mic input.
-    func initIOSMicReceiving() throws {
-
-        // Enable IO on the virtual speaker's output bus.
-        var flag : UInt32 = 1;
-        
-        Logger.log(.log, TAG, "Enabling IO for iOS mic playback...")
-        try handle(AudioUnitSetProperty(micAU,
-                             kAudioOutputUnitProperty_EnableIO,
-                             kAudioUnitScope_Output,
-                             kAudioOutputBus, &flag,
-                             UInt32(MemoryLayout.size(ofValue: flag))))
-        
-        // Disable IO for the input of the virtual speaker.
-        flag = 0
-        try handle(AudioUnitSetProperty(micAU,
-                             kAudioOutputUnitProperty_EnableIO,
-                             kAudioUnitScope_Input,
-                             kAudioInputBus, &flag,
-                             UInt32(MemoryLayout.size(ofValue: flag))))
-        
-        // Set iOSMicDriver device as input to HAL unit.
-        Logger.log(.log, TAG, "Setting iOSMicDeviceID as CurrentDevice...")
-        try handle(AudioUnitSetProperty(micAU,
-                             kAudioOutputUnitProperty_CurrentDevice,
-                             kAudioUnitScope_Global,
-                             kAudioOutputBus, &micDriverDeviceID,
-                             UInt32(MemoryLayout.size(ofValue: micDriverDeviceID))))
-
-        Logger.log(.log, TAG, "Current Audio Format for iOS Mic: \(micAF!)...")
-        
-        // Set equal formats for input/output to avoid making AUHAL
-        // convert PCM formats. For a diagram, see
-        // https://developer.apple.com/library/archive/technotes/tn2091/_index.html
-        
-        // Set input stream format. this is the data format of audio coming
-        // into the AUHAL unit's input scope. i.e. audio stream format from mic.
-        Logger.log(.log, TAG, "Setting IO Stream formats for iOS Mic playback equal...")
-        try handle(AudioUnitSetProperty(micAU,
-                             kAudioUnitProperty_StreamFormat,
-                             kAudioUnitScope_Input,
-                             kAudioOutputBus,
-                             &micAF,
-                             UInt32(MemoryLayout.size(ofValue: micAF))))
-        
-        // Set output stream format. This is the data format of audio coming
-        // out of AUHAL unit's input scope. i.e. audio stream format to transmit.
-        /*try handle(AudioUnitSetProperty(micAU,
-                             kAudioUnitProperty_StreamFormat,
-                             kAudioUnitScope_Output,
-                             kAudioOutputBus,
-                             &micAF,
-                             UInt32(MemoryLayout.size(ofValue: micAF))))*/
-        
-        // Request very small internal IO buffer sizes to increase frequency
-        // by which we send packets. This reduces latency but stresses CPU.
-        var internalIOBufferSize = 512
-        Logger.log(.log, TAG, "Setting internal buffer size for Mic playback (\(internalIOBufferSize))...")
-        try handle(AudioUnitSetProperty(micAU,
-                             kAudioDevicePropertyBufferFrameSize,
-                             kAudioUnitScope_Global,
-                             kAudioOutputBus,
-                             &internalIOBufferSize,
-                             UInt32(MemoryLayout.size(ofValue: internalIOBufferSize))))
-        
-        Logger.log(.log, TAG, "Initting playback unit and adding callback...")
-        micAuhal.initUnit(unit: micAU, outFormat: micAF)
-        micAuhal.addPlaybackCallback()
-
-        // Start polling virtual audio device.
-     
-        Logger.log(.log, TAG, "Started iOS Mic unit")
+    /// Handshake payload describing the current speaker (and mic) format.
+    func handshakePayload() -> Data {
+        var payload = asbdToData(asbd: usbAF)
+        if useMic {
+            payload.append(asbdToData(asbd: micAF))
+        }
+        return payload
+    }
+    
+    /// Creates and starts the mic playback of a newly connected device.
+    /// - Returns: nil if the mic is disabled.
+    /// - Throws: If the unit can't be set up.
+    func makeMic(clock : ClockSync?) throws -> DeviceMic? {
+        if !useMic { return nil }
+        let mic = DeviceMic(self, format: micAF, clock: clock)
+        try mic.start()
+        return mic
+    }
+    
+    /// Compares two stream formats byte by byte.
+    func asbdEqual(_ a : AudioStreamBasicDescription, _ b : AudioStreamBasicDescription) -> Bool {
+        return asbdToData(asbd: a) == asbdToData(asbd: b)
+    }
+    
+    /// Called when USBAudioDevice changed its format. Restarts usbAU with the
+    /// new format and tells the device at which frame it applies.
+    func renegotiateSpeaker() {
+        do {
+            let newAF = try GetAudioDescriptionFromDeviceID(id: usbDriverDeviceID)
+            if asbdEqual(newAF, usbAF) { return }
+            Logger.log(.log, TAG, "USBAudioDevice format changed to \(newAF)")
+            
+            // Once stopped, no more frames in the old format get captured.
+            AudioOutputUnitStop(usbAU)
+            AudioUnitUninitialize(usbAU)
+            usbAF = newAF
+            try handle(AudioUnitSetProperty(usbAU!,
+                                 kAudioUnitProperty_StreamFormat,
+                                 kAudioUnitScope_Output,
+                                 kAudioInputBus,
+                                 &usbAF,
+                                 UInt32(MemoryLayout.size(ofValue: usbAF))))
+            // Sends what the old format recorded, so speakerFramesSent is final.
+            usbAuhal.setFormat(usbAF)
+            try sendControlNow?(.formatChange(stream: .speaker,
+                                              applyAt: speakerFramesSent,
+                                              format: StreamFormat(usbAF)))
+            try handle(AudioUnitInitialize(usbAU))
+            try handle(AudioOutputUnitStart(usbAU))
+        } catch {
+            Logger.log(.emergency, TAG, "Failed to renegotiate speaker format: \(error)")
+        }
+    }
+    
+    /// Called when iOSMicDevice changed its format. The device produces the
+    /// mic stream, so it answers with the frame the change applies at.
+    func requestMicFormat() {
+        do {
+            let newAF = try GetAudioDescriptionFromDeviceID(id: micDriverDeviceID!)
+            if asbdEqual(newAF, micAF) { return }
+            Logger.log(.log, TAG, "iOSMicDevice format changed to \(newAF)")
+            micAF = newAF
+            sendControl?(.formatChange(stream: .mic, applyAt: 0, format: StreamFormat(newAF)))
+        } catch {
+            Logger.log(.emergency, TAG, "Failed to query mic format: \(error)")
+        }
     }
     
     /// Prime usbAU by preparing to record from USBAudioDevice and send that data.
@@ -281,7 +298,10 @@ class ServerAUHALInterface {
                              UInt32(MemoryLayout.size(ofValue: internalIOBufferSize))))
         
         Logger.log(.log, TAG, "Initting recording unit and adding callback...")
-        usbAuhal.initUnit(unit: usbAU, inFormat: usbAF, pcmPacketReady: packetReady)
+        usbAuhal.initUnit(unit: usbAU, inFormat: usbAF, pcmPacketReady: { [unowned self] ptr, len in
+            self.speakerFramesSent += UInt64(len / Int(self.usbAF.mBytesPerFrame))
+            self.packetReady(ptr, len)
+        })
         usbAuhal.addRecordingCallback()
     }
     
@@ -12,10 +12,10 @@ import Socket
 /// and try to connect to attached iOS devices over USB.
 class USBMuxHandler: NSObject {
     
-    /// Encodable template struct used to generate PLIST messages to send
+    /// Template struct used to generate PLIST messages to send
     /// to usbmuxd. See https://github.com/libimobiledevice
     /// for actual struct layout used by usbmuxd
-    struct MuxPacket : Codable {
+    struct MuxPacket {
         var ClientVersionString : String = "libusbmuxd 2.0.2"
         var ProgName            : String = "iUSBAudio"
         var MessageType         : String = "None"
@@ -36,10 +36,15 @@ class USBMuxHandler: NSObject {
         /// Given a ConnectionStruct, build valid usbmuxd comprehensible packet.
         /// - Returns: Data packet ready to be sent over socket
         func serialize() throws -> Data {
-            // encode plist as xml data
-            let enc = PropertyListEncoder()
-            enc.outputFormat = .xml
-            let xmlPlist = try enc.encode(self)
+            // encode plist as binary plist data
+            let plist = try BinaryPlist.encode([
+                "ClientVersionString" : ClientVersionString,
+                "ProgName"            : ProgName,
+                "MessageType"         : MessageType,
+                "kLibUSBMuxVersion"   : kLibUSBMuxVersion,
+                "PortNumber"          : Int(PortNumber),
+                "DeviceID"            : Int(DeviceID),
+            ] as [String : Any])
 
             // The remaining bytes of the usbmuxd header.
             // Here we specify protocol version 1 and message type  8 (PLIST).
@@ -47,11 +52,15 @@ class USBMuxHandler: NSObject {
 
             // Get size of packet to prepend to above header bytes and receive
             // valid header.
-            let size = Int32(xmlPlist.count) + Int32(headerBytes.count) + 4
+            let size = Int32(plist.count) + Int32(headerBytes.count) + 4
             let sizeBytes = withUnsafeBytes(of: size.littleEndian, Array.init)
 
-            return sizeBytes + headerBytes + xmlPlist
+            return sizeBytes + headerBytes + plist
         }
+        
+        /// Commands that never change, serialized once.
+        static let listDevices = try! MuxPacket("ListDevices").serialize()
+        static let listen      = try! MuxPacket("Listen").serialize()
     }
     
     /// Size of usbmux header.
@@ -60,18 +69,52 @@ class USBMuxHandler: NSObject {
     /// Connected to swift UI. Chaning this state updates UI.
     var serverState: ServerState!
     
-    /// Called when connection to a device is established
-    var connectedCallback: (Socket) throws -> Void
+    /// Called when connection to a device is established. Second arg is the
+    /// hello the device greeted us with, third is to be called once the
+    /// session ended. Answers the hello, starts the session and returns.
+    var connectedCallback: (Socket, String, @escaping () -> Void) throws -> Void
     
     let TAG = "USBMuxHandler"
     
+    /// Guards devices and the listen state.
+    let semaphore = DispatchSemaphore(value: 1)
+    
+    /// The usbmuxd socket in Listen mode and its reactor source. Only
+    /// touched on the reactor once listening.
+    var listenSock : Socket?
+    var listenSource : DispatchSourceRead?
+    var listenBuf = Data(capacity: 4096)
+    var readBuf = [UInt8](repeating: 0, count: 4096)
+    
+    /// Whether we should be listening for devices, and which start() the
+    /// current attempt belongs to. Guarded by semaphore.
+    var listening = false
+    var generation = 0
+    
     /// Register callbacks.
     init(_serverState: ServerState,
-         _connectedCallback: @escaping (_ dev : Socket) throws -> Void) {
+         _connectedCallback: @escaping (_ dev : Socket, _ hello : String,
+                                        _ onEnd : @escaping () -> Void) throws -> Void) {
         connectedCallback = _connectedCallback
         serverState = _serverState
     }
     
+    /// Parses a usbmuxd payload as a plist dictionary, binary or XML.
+    /// Binary is decoded without going through Foundation.
+    func parsePlist(_ payload : Data) throws -> [String : Any] {
+        var plist : Any
+        if BinaryPlist.isBinary(payload) {
+            plist = try BinaryPlist.decode(payload)
+        } else {
+            var fmt = PropertyListSerialization.PropertyListFormat.xml
+            plist = try PropertyListSerialization.propertyList(from: payload, format: &fmt)
+        }
+        guard let dict = plist as? [String : Any] else {
+            throw NSError(domain: "Error_Domain", code: 100, userInfo: nil)
+        }
+        return dict
+    }
+    
     /// Awaits a reponse from usbmux socket. Parses header and reads response
     /// into a plist which it returns as a dictionary. Function is blocking.
     func awaitResponsePlist(sock: Socket) throws -> [String : Any] {
@@ -92,57 +135,269 @@ class USBMuxHandler: NSObject {
         
         var rawPayload = [Int8](repeating: 0, count: payloadSize)
         try sock.read(into: &rawPayload, bufSize: payloadSize, truncate: true)
-        let payloadData = NSData(bytes: rawPayload, length: payloadSize)
         
         // parse payload as plist and cast to dict
-        var fmt = PropertyListSerialization.PropertyListFormat.xml
-        return try PropertyListSerialization.propertyList(
-            from: payloadData as Data, format: &fmt) as! [String : Any]
+        return try parsePlist(Data(bytes: rawPayload, count: payloadSize))
     }
     
     /// Sends command represented by MuxPacket to usbmuxd
     /// and returns response as a dictionary parsed from plist
     func sendCmd(_ sock: Socket, _ cmd: MuxPacket) throws -> [String : Any] {
+        return try sendCmd(sock, cmd.serialize())
+    }
+    
+    /// Sends an already serialized command, see MuxPacket.listDevices.
+    @discardableResult
+    func sendCmd(_ sock: Socket, _ cmd: Data) throws -> [String : Any] {
         // send command and await response
         try sock.setWriteTimeout(value: 2)
         try sock.setReadTimeout(value: 2)
-        try sock.write(from: cmd.serialize())
+        try sock.write(from: cmd)
         let resp = try awaitResponsePlist(sock: sock)
         try sock.setWriteTimeout(value: 1000000)
         try sock.setReadTimeout(value: 1000000)
         return resp
     }
     
-    /// Tries to connect to a device by given ID over sock. If succesfull,
-    /// will call connected callback. Return True of success, else false
-    func connectDeviceById(_ sock: Socket, _ devId : UInt8) throws -> Bool {
+    /// Path of the usbmuxd socket. Like libusbmuxd, honors
+    /// USBMUXD_SOCKET_ADDRESS=UNIX:<path>, e.g. to use fake-usbmuxd.py.
+    let muxSocketPath : String = {
+        let env = ProcessInfo.processInfo.environment["USBMUXD_SOCKET_ADDRESS"] ?? ""
+        if env.hasPrefix("UNIX:") {
+            return String(env.dropFirst(5))
+        }
+        return "/var/run/usbmuxd"
+    }()
+    
+    /// Opens a new connection to usbmuxd. Every device needs one of its own,
+    /// since a successful Connect turns it into the tunnel to the device.
+    func openMuxSocket() throws -> Socket {
+        let sock = try Socket.create(family: .unix,
+                                     type: .stream,
+                                     proto: .unix)
+        sock.readBufferSize = 32768
+        try sock.connect(to: muxSocketPath)
+        return sock
+    }
+    
+    /// Tries to connect to a device by given ID over a fresh usbmuxd socket.
+    /// If succesfull, starts the session through connectedCallback, which
+    /// calls sessionEnded once it's over. Blocks only for the connect and
+    /// the hellos, so call it off the reactor.
+    /// Return True of success, else false
+    func connectDeviceById(_ devId : UInt8) throws -> Bool {
+        
         // try to connect to device's running app
-        let resp = try sendCmd(sock, MuxPacket("Connect", 7000, devId))
+        let sock = try openMuxSocket()
+        var resp : [String : Any]
+        do {
+            resp = try sendCmd(sock, MuxPacket("Connect", 7000, devId))
+        } catch {
+            sock.close()
+            throw error
+        }
                                 
-        if (resp["Number"] as! Int == 0) {
+        if (resp["Number"] as? Int == 0) {
             // connection succesful. Exchange hellos.
-            updateStatus(status: .connected_active)
             Logger.log(.log, TAG, "connected success")
-            let data = NSMutableData()
-            try sock.read(into: data)
-            let s = String.init(data: data as Data, encoding: .utf8)
-            Logger.log(.log, TAG, "Received: \(s)")
-            try sock.write(from: "Hello from computer".data(using: .utf8)!)
             do {
-                try connectedCallback(sock)
+                try sock.setReadTimeout(value: 2000)
+                // The device waits for our answer, so nothing follows.
+                let s = try SessionResume.readHello(sock).hello
+                Logger.log(.log, TAG, "Received: \(s)")
+                setState(devId, .streaming)
+                updateStatus(status: .connected_active)
+                try connectedCallback(sock, s) { [unowned self] in
+                    Logger.log(.log, self.TAG, "Session with device #\(devId) ended")
+                    self.sessionEnded(devId)
+                }
             }
             catch {
                 Logger.log(.emergency, TAG, "Fatal: Connection callback failed with \(error)")
+                sock.close()
+                return false
             }
             return true;
         }
         else {
-            updateStatus(status: .connected_inactive)
-            Logger.log(.emergency, TAG, "Failed to connect")
+            // Usually the app isn't listening (yet).
+            sock.close()
+            Logger.log(.verbose, TAG, "Failed to connect to device #\(devId)")
             return false;
         }
     }
     
+    // MARK: Per device connect state machine
+    
+    /// Where we are with an attached device.
+    ///     connecting -> streaming             Connect and hellos worked.
+    ///     connecting -> backingOff            Failed, retry after a delay.
+    ///     backingOff -> connecting            Delay passed.
+    ///     streaming  -> backingOff            Session ended, device still
+    ///                                         attached: reconnect.
+    /// Detaching forgets the device, except while streaming; the session
+    /// notices on its own and then forgets it.
+    enum DeviceState {
+        case connecting
+        case backingOff
+        case streaming
+    }
+    
+    struct DeviceEntry {
+        var state = DeviceState.connecting
+        var attached = true
+        
+        /// Failed attempts in a row.
+        var failures = 0
+    }
+    
+    /// Devices usbmuxd reported attached, or that are still streaming.
+    /// Guarded by semaphore.
+    var devices = [UInt8 : DeviceEntry]()
+    
+    /// Connect retries start fast, the app usually comes up within a few
+    /// hundred ms of the device, and back off exponentially up to
+    /// kMaxBackoff for as long as the device stays attached.
+    let kInitialBackoff = 0.025
+    let kMaxBackoff = 2.0
+    
+    /// Failures in a row after which the device shows as inactive.
+    let kInactiveAfter = 6
+    
+    func setState(_ devId : UInt8, _ state : DeviceState) {
+        semaphore.wait()
+        devices[devId]?.state = state
+        semaphore.signal()
+    }
+    
+    /// usbmuxd reported a device, in the device list or as plugged in.
+    /// Connects right away unless we know it already.
+    func deviceAttached(_ devId : UInt8) {
+        semaphore.wait()
+        var connect = false
+        if devices[devId] == nil {
+            devices[devId] = DeviceEntry()
+            connect = true
+        } else {
+            devices[devId]!.attached = true
+        }
+        semaphore.signal()
+        if connect {
+            connectDeviceAsync(devId)
+        }
+    }
+    
+    /// usbmuxd reported a device unplugged. Pending retries die with it.
+    func deviceDetached(_ devId : UInt8) {
+        semaphore.wait()
+        if devices[devId]?.state == .streaming {
+            devices[devId]!.attached = false
+        } else {
+            devices.removeValue(forKey: devId)
+        }
+        semaphore.signal()
+    }
+    
+    /// Called when a device's session ended. Reconnects if it's still
+    /// attached; its app listens again right away.
+    func sessionEnded(_ devId : UInt8) {
+        semaphore.wait()
+        let attached = devices[devId]?.attached ?? false
+        if !attached {
+            devices.removeValue(forKey: devId)
+        }
+        semaphore.signal()
+        if attached {
+            scheduleRetry(devId)
+        } else if !hasSessions() {
+            updateStatus(status: .no_devs_found)
+        }
+    }
+    
+    /// Connects to a device off the reactor, and retries on failure.
+    func connectDeviceAsync(_ devId : UInt8) {
+        DispatchQueue.global(qos: .userInitiated).async { [unowned self] in
+            var connected = false
+            do {
+                connected = try self.connectDeviceById(devId)
+            }
+            catch {
+                Logger.log(.verbose, self.TAG, "Connect to device #\(devId) failed: \(error)")
+            }
+            if connected {
+                self.semaphore.wait()
+                self.devices[devId]?.failures = 0
+                self.semaphore.signal()
+            } else {
+                self.scheduleRetry(devId)
+            }
+        }
+    }
+    
+    /// Backs off and connects again, unless the device went away meanwhile.
+    func scheduleRetry(_ devId : UInt8) {
+        semaphore.wait()
+        guard devices[devId] != nil, listening else {
+            devices.removeValue(forKey: devId)
+            semaphore.signal()
+            return
+        }
+        let failures = devices[devId]!.failures
+        devices[devId]!.failures += 1
+        devices[devId]!.state = .backingOff
+        let streaming = devices.values.contains(where: { $0.state == .streaming })
+        semaphore.signal()
+        
+        if failures + 1 == kInactiveAfter && !streaming {
+            updateStatus(status: .connected_inactive)
+        }
+        let delay = min(kInitialBackoff * pow(2, Double(min(failures, 16))), kMaxBackoff)
+        Reactor.shared.after(delay) { [unowned self] in
+            self.semaphore.wait()
+            let retry = self.devices[devId]?.state == .backingOff
+            if retry {
+                self.devices[devId]!.state = .connecting
+            }
+            self.semaphore.signal()
+            if retry {
+                self.connectDeviceAsync(devId)
+            }
+        }
+    }
+    
+    func hasSessions() -> Bool {
+        semaphore.wait()
+        defer { semaphore.signal() }
+        return devices.values.contains(where: { $0.state == .streaming })
+    }
+    
+    /// Connects straight to the iOS app over the network, bypassing usbmuxd.
+    /// Blocks for the connect and the hellos, so call it off the reactor.
+    /// - Parameters:
+    ///   - host: Address of the iPad.
+    ///   - onEnd: Called once the session ended.
+    /// - Returns: True if a session was established.
+    func connectOverWifi(_ host : String, onEnd : @escaping () -> Void) -> Bool {
+        updateStatus(status: .trying_to_connect)
+        var sock : Socket?
+        do {
+            sock = try Socket.create(family: .inet, type: .stream, proto: .tcp)
+            try sock!.connect(to: host, port: 7000, timeout: 2000)
+            updateStatus(status: .connected_active)
+            Logger.log(.log, TAG, "Connected to \(host) over Wi-Fi")
+            try sock!.setReadTimeout(value: 2000)
+            let s = try SessionResume.readHello(sock!).hello
+            Logger.log(.log, TAG, "Received: \(s)")
+            try connectedCallback(sock!, s, onEnd)
+            return true
+        } catch {
+            Logger.log(.log, TAG, "Can't reach \(host): \(error)")
+            sock?.close()
+            updateStatus(status: .no_devs_found)
+            return false
+        }
+    }
+    
     /// Update the GUI status on main thread
     func updateStatus(status: ServerStatus) {
         DispatchQueue.main.async {
@@ -150,115 +405,188 @@ class USBMuxHandler: NSObject {
         }
     }
     
-    /// Tries to connect to an iOS device.
-    /// If a device is connected,
+    /// Connects to every iOS device running the app, each on its own
+    /// usbmuxd socket, then keeps listening for devices being plugged in on
+    /// the reactor. If a device is connected,
     ///     will check if it's active or not (app running).
     ///         If it is, start trasmission.
     ///         Else show error.
-    /// If no device is connected,
-    ///     will block until device connected, check if it's active or not.
-    ///     Try to connect.
-    func tryConnectToDevice() -> Bool {
-        var succ = false
-        Logger.log(.log, TAG, "Starting tryToConnectToDevice()")
+    /// Starts over by itself if the listen socket fails. Returns right away.
+    func start() {
+        semaphore.wait()
+        let running = listening
+        listening = true
+        generation += 1
+        let gen = generation
+        semaphore.signal()
+        if !running {
+            DispatchQueue.global(qos: .utility).async { [unowned self] in
+                self.listen(gen)
+            }
+        }
+    }
+    
+    /// Stops listening for devices. Sessions already running are unaffected.
+    func stop() {
+        semaphore.wait()
+        listening = false
+        devices = devices.filter { $0.value.state == .streaming }
+        semaphore.signal()
+        Reactor.shared.queue.async { [unowned self] in
+            self.closeListen()
+        }
+    }
+    
+    /// Whether the attempt of the given start() should still go on.
+    func isCurrent(_ gen : Int) -> Bool {
+        semaphore.wait()
+        defer { semaphore.signal() }
+        return listening && gen == generation
+    }
+    
+    /// Lists and connects the devices attached already, then hands the
+    /// socket to the reactor in Listen mode. Blocks for the initial
+    /// commands, so runs off the reactor.
+    func listen(_ gen : Int) {
+        Logger.log(.log, TAG, "Starting listen()")
         
         // Update UI to show we're trying to connect.
-        updateStatus(status: .trying_to_connect)
+        if !hasSessions() {
+            updateStatus(status: .trying_to_connect)
+        }
         
         do {
             // Create socket.
             Logger.log(.log, TAG, "Trying to connect to usbmuxd")
-            let sock = try Socket.create(family: .unix,
-                                         type: .stream,
-                                         proto: .unix)
-            sock.readBufferSize = 32768
-            try sock.connect(to: "/var/run/usbmuxd")
+            let sock = try openMuxSocket()
             
             Logger.log(.log, TAG, "Connected to unix socket")
 
             // List currently connected devices.
-            let plist = try sendCmd(sock, MuxPacket("ListDevices"))
-            let devices = plist["DeviceList"] as! NSArray
+            let plist = try sendCmd(sock, MuxPacket.listDevices)
+            let devices = plist["DeviceList"] as? NSArray ?? []
 
             // For each device in the list
             for case let dev as [String : Any] in devices {
-                
-                let devId = dev["DeviceID"] as! UInt8
-                
+                guard let devId = dev["DeviceID"] as? UInt8 else { continue }
                 Logger.log(.log, TAG, "Device found #\(devId)")
-                
-                do {
-                    let connected = try connectDeviceById(sock, devId)
-                    if connected {
-                        succ = true
-                    }
-                }
-                catch {
-                    updateStatus(status: .connected_inactive)
-                }
+                deviceAttached(devId)
             }
 
-            // No device were connected.
-            if serverState.status != .connected_active {
-                Logger.log(.log, TAG, "No device connected. start listening");
-                
-                try sendCmd(sock, MuxPacket("Listen"))
-                
-                // While we don't have a connected device,
-                while serverState.status != .connected_active {
-                    
-                    // block until we have new info from listening socket and
-                    // start listening for new plug-in events.
-
-                    // This plist is either connection or disconnection response
-                    let plist = try awaitResponsePlist(sock: sock)
-                    
-                    // something went wrong. abort.
-                    if !plist.keys.contains("DeviceID") {
-                        succ = false
-                        updateStatus(status: .no_devs_found)
-                        break;
-                    }
-                    
-                    let devId : UInt8 = plist["DeviceID"] as! UInt8
-
-                    if plist["MessageType"] as! String == "Attached" {
-                        updateStatus(status: .trying_to_connect)
-                        Logger.log(.log, TAG, "Attached device")
-                        
-                        // sets status to either connected_active
-                        // or connected_inactive
-                        sleep(2)
-                        let plist = try sendCmd(sock, MuxPacket("ListDevices"))
-                        let devices = plist["DeviceList"] as! NSArray
-                        Logger.log(.log, TAG, "\(devices)")
-
-                        let connected = try connectDeviceById(sock, devId)
-                        
-                        if !connected {
-                            sock.close()
-                            sleep(5)
-                        }
-                        else {
-                            succ = true
-                        }
-                    }
-                    else if plist["MessageType"] as! String == "Detached" {
-                        Logger.log(.log, TAG, "Device detached")
-                        updateStatus(status: .no_devs_found)
-                    }
+            // Keep listening for more devices, connected ones or not.
+            Logger.log(.log, TAG, "Start listening");
+            try sendCmd(sock, MuxPacket.listen)
+            try sock.setBlocking(mode: false)
+            
+            Reactor.shared.queue.async { [unowned self] in
+                if !self.isCurrent(gen) {
+                    sock.close()
+                    return
+                }
+                self.listenSock = sock
+                self.listenBuf.removeAll(keepingCapacity: true)
+                self.listenSource = Reactor.shared.watchRead(sock.socketfd) { [unowned self] in
+                    self.onListenReadable()
                 }
             }
         } catch {
             Logger.log(.emergency, TAG, "error: \(errno)")
             if errno == 61 || errno == 35 {
                 shellAsRoot("sudo launchctl stop com.apple.usbmuxd")
-                sleep(2)
             }
-            succ = false
+            restartListen()
+        }
+    }
+    
+    /// Starts listening over in a bit, unless stopped meanwhile.
+    func restartListen() {
+        if !hasSessions() {
+            updateStatus(status: .no_devs_found)
+        }
+        semaphore.wait()
+        let gen = generation
+        semaphore.signal()
+        Reactor.shared.after(2) { [unowned self] in
+            if self.isCurrent(gen) {
+                DispatchQueue.global(qos: .utility).async {
+                    self.listen(gen)
+                }
+            }
+        }
+    }
+    
+    /// Cancels the listen source. On the reactor.
+    func closeListen() {
+        if let src = listenSource, let sock = listenSock {
+            src.setCancelHandler {
+                sock.close()
+            }
+            src.cancel()
+        }
+        listenSource = nil
+        listenSock = nil
+    }
+    
+    /// Called by the reactor when usbmuxd sent something on the listen
+    /// socket. Handles every complete plug event received.
+    func onListenReadable() {
+        guard let sock = listenSock else { return }
+        while true {
+            let n = readBuf.withUnsafeMutableBytes {
+                Reactor.read(sock.socketfd, $0.baseAddress!, $0.count)
+            }
+            if n > 0 {
+                listenBuf.append(readBuf, count: n)
+                continue
+            }
+            if n < 0 && Reactor.wouldBlock() {
+                break
+            }
+            Logger.log(.emergency, TAG, "usbmuxd closed the listen socket: \(errno)")
+            closeListen()
+            restartListen()
+            return
+        }
+        
+        // Handle every complete packet, keep the rest for later.
+        while listenBuf.count >= kUSBMuxHeaderSize {
+            let packetSize = Int(listenBuf.withUnsafeBytes { $0.load(as: UInt32.self) })
+            if packetSize < kUSBMuxHeaderSize + 10 {
+                Logger.log(.emergency, TAG, "USBMuxd got corrupted! Received packet of size: \(packetSize)")
+                closeListen()
+                restartListen()
+                return
+            }
+            if listenBuf.count < packetSize { return }
+            let payload = listenBuf.subdata(in: kUSBMuxHeaderSize..<packetSize)
+            listenBuf.removeSubrange(0..<packetSize)
+            do {
+                handleListenEvent(try parsePlist(payload))
+            } catch {
+                Logger.log(.emergency, TAG, "Dropping unparsable usbmuxd event")
+            }
+        }
+    }
+    
+    /// Handles one Attached/Detached event from usbmuxd.
+    func handleListenEvent(_ plist : [String : Any]) {
+        guard let devId = plist["DeviceID"] as? UInt8,
+              let type = plist["MessageType"] as? String else { return }
+
+        if type == "Attached" {
+            Logger.log(.log, TAG, "Attached device #\(devId)")
+            
+            // Sets status to either connected_active or, after a few
+            // retries, connected_inactive.
+            deviceAttached(devId)
+        }
+        else if type == "Detached" {
+            Logger.log(.log, TAG, "Device detached")
+            deviceDetached(devId)
+            if !hasSessions() {
+                updateStatus(status: .no_devs_found)
+            }
         }
-        Logger.log(.log, TAG, "Finished tryConnectToDevice() with success: \(succ)")
-        return succ
     }
     
     @discardableResult
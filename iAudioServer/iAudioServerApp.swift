@@ -9,6 +9,7 @@ import Cocoa
 import SwiftUI
 import Socket
 import AVFoundation
+import Combine
 
 
 /// Desired behavior:
@@ -39,15 +40,45 @@ class AppDelegate: NSObject, NSApplicationDelegate {
     var statusBarItem: NSStatusItem!
     var contentView: ContentView!
     var muxHandler: USBMuxHandler!
-    var audioStreamer: ServerAUHALInterface!
+    var fanOut: FanOut!
     var useMic : Bool = true
+    var coalesceSub : AnyCancellable?
+    var wifiSub : AnyCancellable?
+    
+    /// Whether a Wi-Fi session is running or being attempted. Main thread.
+    var wifiActive = false
     let TAG = "ServerAppDelegate"
     
-    func tryConnectToDeviceLoop() {
-        DispatchQueue.global(qos: .utility).async {
-            var succ = false
-            while true {
-                succ = self.muxHandler.tryConnectToDevice()
+    /// Looks for devices the way the UI asks for: listens for USB devices,
+    /// or keeps a session to the iPad over Wi-Fi going. Main thread.
+    func startConnecting() {
+        let state = contentView.serverState
+        if !state.useWifi || state.wifiHost.isEmpty {
+            muxHandler.start()
+            return
+        }
+        muxHandler.stop()
+        if wifiActive {
+            return
+        }
+        wifiActive = true
+        let host = state.wifiHost
+        DispatchQueue.global(qos: .utility).async { [unowned self] in
+            let connected = self.muxHandler.connectOverWifi(host) {
+                self.retryConnecting(after: 0)
+            }
+            if !connected {
+                self.retryConnecting(after: 2)
+            }
+        }
+    }
+    
+    /// Called when a Wi-Fi attempt or session ended.
+    func retryConnecting(after seconds : Double) {
+        Reactor.shared.after(seconds) {
+            DispatchQueue.main.async {
+                self.wifiActive = false
+                self.startConnecting()
             }
         }
     }
@@ -57,12 +88,25 @@ class AppDelegate: NSObject, NSApplicationDelegate {
         // Get reference to SwiftUI view.
         contentView = ContentView();
         
+        // One capture feeds every device. Apply the coalescing deadline from
+        // the UI, now and on every change.
+        fanOut = FanOut()
+        fanOut.useMic = useMic
+        coalesceSub = contentView.serverState.$coalesceDeadlineMs.sink { [unowned self] ms in
+            self.fanOut.coalescer.deadline = ms / 1000
+        }
+        
         // Create class to interface with USB mutliplexer usbmuxd
         muxHandler = USBMuxHandler(_serverState: self.contentView.serverState,
                                    _connectedCallback: deviceConnected)
         
-        // Try to connect to devices always.
-        tryConnectToDeviceLoop()
+        // Try to connect to devices always, the way the UI asks for.
+        wifiSub = contentView.serverState.$useWifi.dropFirst().sink { [unowned self] _ in
+            DispatchQueue.main.async {
+                self.startConnecting()
+            }
+        }
+        startConnecting()
 
         // Create popover UI in menu bar
         popover = NSPopover();
@@ -96,11 +140,17 @@ class AppDelegate: NSObject, NSApplicationDelegate {
     }
     
     /// Called when a remote connection to an instance of iAudioClient App
-    /// has been established.
+    /// has been established. Answers the device's hello, resumes its
+    /// session if it asks to and it's still around, else starts a new one
+    /// on the reactor. Returns right away.
     /// - Parameter sock: The socket that directly connects to the device.
-    func deviceConnected(_ sock: Socket) throws -> Void{
+    /// - Parameter hello: The device's greeting, advertises its codecs.
+    /// - Parameter onEnd: Called once the session ended.
+    func deviceConnected(_ sock: Socket, _ hello: String,
+                         _ onEnd: @escaping () -> Void) throws -> Void{
         
-        try sock.setReadTimeout(value: 3)
+        // Bounds the handshake write, the only one before the session runs
+        // non-blocking on the reactor.
         try sock.setWriteTimeout(value: 3)
         
         func onReceived(bytes : UnsafeMutablePointer<Int8>, len : Int) {
@@ -118,37 +168,115 @@ class AppDelegate: NSObject, NSApplicationDelegate {
                         let j = max(min(Int(res[i]), Int(Int16.max)), Int(Int16.min))
                         bufptr[i] = Int16(j)
                     }
-                    audioStreamer.micAuhal.enqueuePCM(bytes, len)
+                    peer?.mic?.enqueuePCM(bytes, len)
                 }
             }
             else {
-                audioStreamer.micAuhal.enqueuePCM(bytes, len)
+                peer?.mic?.enqueuePCM(bytes, len)
             }
         }
         
+        var trans : PCMTransceiver!
+        var peer : FanOut.Peer?
+        
         func onTerminated() {
-            Logger.log(.log, TAG, "Terminating audio streamer...")
-            audioStreamer.endSession()
+            Logger.log(.log, TAG, "Terminating session...")
+            if peer != nil {
+                // Give the device a chance to come back (and reconnect it).
+                fanOut.suspendPeer(peer!) { [unowned self] in
+                    self.updateDeviceCount()
+                }
+            }
+            updateDeviceCount()
+            onEnd()
         }
         
         Logger.log(.log, TAG, "Creating PCM transceiver...")
-        let trans = PCMTransceiver(
+        trans = PCMTransceiver(
             sock,
             dataCallback: onReceived,
             handshakeCallback: nil,
             terminatedCallback: onTerminated)
+        trans.lossCallback = { len in
+            peer?.mic?.enqueueLoss(len)
+        }
+        
+        // Compress each stream as selected, if the device supports the codec.
+        let peerCodecs = AudioCodec.mask(fromHello: hello)
+        trans.txCodec = contentView.serverState.speakerCodec.negotiated(peerMask: peerCodecs)
+        trans.peerCodec = contentView.serverState.micCodec.negotiated(peerMask: peerCodecs)
+        Logger.log(.log, TAG, "Device codecs \(peerCodecs), speaker as \(trans.txCodec), " +
+            "mic as \(trans.peerCodec)")
+        
+        // Direct network sessions (Wi-Fi) carry audio over UDP if the device
+        // offered a port. usbmuxd only tunnels TCP, so USB sessions keep
+        // everything on the socket.
+        var udp = ""
+        if sock.signature?.protocolFamily == .inet,
+           let port = UDPAudioLink.port(fromHello: hello) {
+            let link = try UDPAudioLink()
+            do {
+                try link.connect(to: sock.remoteHostname, port: port)
+            } catch {
+                link.close()
+                throw error
+            }
+            trans.udp = link
+            udp = " udp=\(link.localPort)"
+        }
         
-        // Create class to interface with system audio output
-        Logger.log(.log, TAG, "Configuring audio devices...")
-        audioStreamer = ServerAUHALInterface()
+        trans.clock.onUpdate = { [weak self] clock in
+            let ms = clock.offset / 1e6
+            let ppm = clock.skew * 1e6
+            DispatchQueue.main.async {
+                self?.contentView.serverState.clockInfo =
+                    String(format: "Clock offset %.3f ms, skew %.1f ppm", ms, ppm)
+            }
+        }
+        trans.mux.setHandler(.telemetry) { [weak self] data in
+            guard let t = Telemetry.decode(data) else { return }
+            let summary = t.summary
+            DispatchQueue.main.async {
+                self?.contentView.serverState.telemetryInfo = summary
+            }
+        }
                 
-        /// Start audio streaming session
-        try audioStreamer.makeSession(
-            _packetReady: trans.packetReady,
-            _handshakePacketReady: trans.handshakePacketReady,
-            _useMic: useMic)
+        // Pick up where a lost connection left off, if the device asks to.
+        if let req = SessionResume.request(fromHello: hello),
+           let resumed = fanOut.resumePeer(req.id, frames: req.frames, trans) {
+            peer = resumed
+            let micFrames = resumed.mic?.micAuhal.framesEnqueued ?? 0
+            try sock.write(from: SessionResume.framed(
+                "Hello from computer session=\(req.id) resumed=\(micFrames)\(udp)"))
+        } else {
+            let id = SessionResume.newId()
+            try sock.write(from: SessionResume.framed("Hello from computer session=\(id)\(udp)"))
+            
+            /// Join the capture shared by all devices.
+            Logger.log(.log, TAG, "Configuring audio devices...")
+            peer = try fanOut.addPeer(trans, sessionId: id)
+        }
+        updateDeviceCount()
 
-        Logger.log(.log, TAG, "Entering receive loop...")
-        try trans.receiveLoop()
+        Logger.log(.log, TAG, "Starting session...")
+        do {
+            try trans.start()
+        } catch {
+            fanOut.removePeer(peer!)
+            updateDeviceCount()
+            throw error
+        }
+    }
+    
+    /// Shows how many devices are streaming. Goes back to looking for
+    /// devices once the last one left.
+    func updateDeviceCount() {
+        let n = fanOut.count
+        DispatchQueue.main.async {
+            self.contentView.serverState.numDevices = n
+        }
+        if n == 0 {
+            muxHandler.updateStatus(status: .trying_to_connect)
+        }
     }
 }